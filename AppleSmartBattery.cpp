@@ -27,6 +27,8 @@
 #include <IOKit/pwr_mgt/RootDomain.h>
 #include <IOKit/pwr_mgt/IOPMPrivate.h>
 #include <libkern/c++/OSObject.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
 
 #include "AppleSmartBatteryManager.h"
 #include "AppleSmartBattery.h"
@@ -37,15 +39,30 @@
 enum 
 {
     kExistingBatteryPath    = 1,
-    kNewBatteryPath         = 2
+    kNewBatteryPath         = 2,
+    kBatteryStatusPath      = 4,    // _BST only, for Notify(0x80)
+    kWakePath               = 8,    // _STA and _BST only, right after wake
+    kTripPointPath          = 16    // _BTP only, after a _BST moved the trip point
 };
 
+// How much of the battery a path reads. A request queued behind a poll in
+// flight is only replaced by one that reads more.
+static inline int pollPathRank(int path)
+{
+    switch (path)
+    {
+        case kExistingBatteryPath:  return 3;
+        case kWakePath:             return 2;
+        case kBatteryStatusPath:    return 1;
+        default:                    return 0;
+    }
+}
+
 // Retry attempts on command failure
 
 enum { 
     kRetryAttempts = 5,
-    kInitialPollCountdown = 5,
-    kIncompleteReadRetryMax = 10
+    kInitialPollCountdown = 5
 };
 
 enum 
@@ -55,29 +72,162 @@ enum
     kPostDischargeWaitSeconds   = 120
 };
 
+// Static battery information (_BIX/_BIF) is cached between polls and only
+// re-read on insertion, Notify(0x81), a model/serial change or once this
+// many seconds have passed (last full charge capacity drifts slowly).
+
+enum
+{
+    kStaticInfoRefreshSeconds   = 600
+};
+
 enum 
 {
     kDefaultPollInterval = 0,
-    kQuickPollInterval = 1
+    kQuickPollInterval = 1,
+    kNearThresholdPollInterval = 2,
+    kStablePollInterval = 3
 };
 
 #define kErrorRetryAttemptsExceeded         "Read Retry Attempts Exceeded"
 #define kErrorOverallTimeoutExpired         "Overall Read Timeout Expired"
+#define kErrorStageDeadlineExpired          "ACPI Method Deadline Expired"
 #define kErrorZeroCapacity                  "Capacity Read Zero"
 #define kErrorPermanentFailure              "Permanent Battery Failure"
 #define kErrorNonRecoverableStatus          "Non-recoverable status failure"
+#define kErrorShortPackage                  "ACPI Package Too Short"
 
 // Polling intervals
 // The battery kext switches between polling frequencies depending on
 // battery load
 
-static uint32_t milliSecPollingTable[2] =
+static uint32_t milliSecPollingTable[4] =
 { 
 	30000,    // 0 == Regular 30 second polling
-	1000      // 1 == Quick 1 second polling
+	1000,     // 1 == Quick 1 second polling
+	10000,    // 2 == Close to a warning/low capacity level or estimate is off
+	300000    // 3 == Longest back-off; fully charged on AC or very slow drain
+};
+
+// Reasons published with the chosen polling interval
+
+#define kPollReasonOverride         "Override"
+#define kPollReasonDefault          "Default"
+#define kPollReasonQuickPoll        "QuickPoll"
+#define kPollReasonNearThreshold    "NearThreshold"
+#define kPollReasonEstimateError    "EstimateError"
+#define kPollReasonStableOnAC       "StableOnAC"
+#define kPollReasonRateOfChange     "RateOfChange"
+#define kPollReasonTripPoint        "TripPoint"
+#define kPollReasonAfterWake        "AfterWake"
+#define kPollReasonBackoff          "Backoff"
+
+// Average rate estimation. The time constant is clamped to the averaging
+// interval range reported by _BIX; the measurement noise is that of a
+// single _BST rate reading.
+
+enum
+{
+	kRateTimeConstantMS		= 60000,
+	kRateMeasurementNoise	= 100 * 100		// mA^2
+};
+
+static const char *rateEstimatorNames[] = { "Pairwise", "EWMA", "Kalman" };
+
+// Notify(0x80) storms: notifications arriving within the coalescing window,
+// or while a poll is running, share one _BST refresh. Refreshes are further
+// limited by a token bucket of kNotifyBurst, refilled one per kNotifyRefillMS.
+
+enum
+{
+	kNotifyCoalesceMS	= 250,
+	kNotifyBurst		= 4,
+	kNotifyRefillMS		= 5000
+};
+
+// A poll that overran a stage deadline, or could not read _STA or _BST, is
+// retried after kBackoffBaseMS, doubling per consecutive failure up to
+// kBackoffMaxMS, with the upper half of each interval randomized so that
+// retries don't lock step with whatever is stalling the EC. BBIX is optional:
+// after kExtraFailureThreshold failures in a row it is left out of polls for
+// kExtraCircuitOpenMS, then tried once more.
+
+enum
+{
+	kBackoffBaseMS			= 2000,
+	kBackoffMaxMS			= 300000,
+	kExtraFailureThreshold	= 3,
+	kExtraCircuitOpenMS		= 600000
+};
+
+// Between polls the published capacity and time remaining are projected from
+// the last _BST using the average rate, so polls can be spaced further apart.
+
+enum
+{
+	kInterpolateIntervalMS		= 10000,	// at most this often
+	kInterpolatePercentPerPoll	= 2			// capacity moved between rate-of-change polls
+};
+
+/******************************************************************************
+ * getUptimeMS
+ * Monotonic time since boot in milliseconds
+ ******************************************************************************/
+
+static uint64_t getUptimeMS(void)
+{
+	uint64_t now;
+	uint64_t nsec;
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &nsec);
+
+	return nsec / kMillisecondScale;
+}
+
+// Every registered battery, in registration order; the first publishes the
+// aggregate. The lock also covers each battery's fContribution, the running
+// totals and the shared poll tick. It is created by the first manager to
+// start, see initBatteryList(), and kept for the life of the kext; the list
+// and the aggregate go with the last battery.
+
+static IOLock				*batteryListLock = NULL;
+static OSArray				*batteryList = NULL;
+static AppleSmartBattery	*aggregatePublisher = NULL;		// retained
+static BatteryAggregate		aggregateTotals;
+static BatteryAggregate		aggregatePublished;
+static UInt32				aggregateGeneration = 0;
+static bool					aggregatePublishing = false;
+static uint64_t				sharedPollDue = 0;
+
+// The published aggregate: one dictionary and its numbers, created with the
+// list and from then on updated in place under the lock
+
+enum
+{
+	kAggregateBatteryCount = 0,
+	kAggregatePresentCount,
+	kAggregateCurrentCapacity,
+	kAggregateMaxCapacity,
+	kAggregateDesignCapacity,
+	kAggregateAmperage,
+	kAggregateTimeRemaining,
+	kAggregateNumberCount
+};
+
+static const char *aggregateNumberKeys[kAggregateNumberCount] =
+{
+	"BatteryCount",
+	"BatteriesInstalled",
+	kIOPMPSCurrentCapacityKey,
+	kIOPMPSMaxCapacityKey,
+	kIOPMPSDesignCapacityKey,
+	kIOPMPSAmperageKey,
+	kIOPMPSTimeRemainingKey
 };
 
-static const uint32_t kBatteryReadAllTimeout = 10000;       // 10 seconds
+static OSDictionary			*aggregateState = NULL;
+static OSNumber				*aggregateNumbers[kAggregateNumberCount];	// held by aggregateState
 
 // Keys we use to publish battery state in our IOPMPowerSource::properties array
 static const OSSymbol *_MaxErrSym =				OSSymbol::withCString(kIOPMPSMaxErrKey);
@@ -91,12 +241,19 @@ static const OSSymbol *_InstantAmperageSym =	OSSymbol::withCString("InstantAmper
 static const OSSymbol *_ManufactureDateSym =	OSSymbol::withCString(kIOPMPSManufactureDateKey);
 static const OSSymbol *_DesignCapacitySym =		OSSymbol::withCString(kIOPMPSDesignCapacityKey);
 static const OSSymbol *_QuickPollSym =			OSSymbol::withCString("Quick Poll");
+static const OSSymbol *_ExtraCircuitOpenSym =	OSSymbol::withCString("ExtraInfoCircuitOpen");
 static const OSSymbol *_TemperatureSym =		OSSymbol::withCString(kIOPMPSBatteryTemperatureKey);
 static const OSSymbol *_CellVoltageSym =		OSSymbol::withCString("CellVoltage");
 static const OSSymbol *_ManufacturerDataSym =	OSSymbol::withCString("ManufacturerData");
 static const OSSymbol *_PFStatusSym =			OSSymbol::withCString("PermanentFailureStatus");
 static const OSSymbol *_TypeSym =				OSSymbol::withCString("BatteryType");
 static const OSSymbol *_ChargeStatusSym =		OSSymbol::withCString(kIOPMPSBatteryChargeStatusKey);
+static const OSSymbol *_PollingReasonSym =		OSSymbol::withCString("PollingReason");
+static const OSSymbol *_TripPointSym =			OSSymbol::withCString("BatteryTripPoint");
+static const OSSymbol *_StaleUntilSym =			OSSymbol::withCString("EstimatesStaleUntil");
+static const OSSymbol *_MaxCapacitySym =		OSSymbol::withCString(kIOPMPSMaxCapacityKey);
+static const OSSymbol *_CycleCountSym =			OSSymbol::withCString(kIOPMPSCycleCountKey);
+static const OSSymbol *_ManufacturerSym =		OSSymbol::withCString(kIOPMPSManufacturerKey);
 
 static const OSSymbol *_RunTimeToEmptySym =			OSSymbol::withCString("RunTimeToEmpty");
 static const OSSymbol *_RelativeStateOfChargeSym =	OSSymbol::withCString("RelativeStateOfCharge");
@@ -117,6 +274,105 @@ static const OSSymbol *_SerialNumberSym =		OSSymbol::withCString("FirmwareSerial
 static const OSSymbol *_HardwareSerialSym =		OSSymbol::withCString("BatterySerialNumber");
 static const OSSymbol *_DateOfManufacture =		OSSymbol::withCString("Date of Manufacture");
 
+// Polling reasons are published as shared symbols so a change of reason
+// does not allocate
+static const OSSymbol *_PollReasonOverrideSym =			OSSymbol::withCString(kPollReasonOverride);
+static const OSSymbol *_PollReasonDefaultSym =			OSSymbol::withCString(kPollReasonDefault);
+static const OSSymbol *_PollReasonQuickPollSym =		OSSymbol::withCString(kPollReasonQuickPoll);
+static const OSSymbol *_PollReasonNearThresholdSym =	OSSymbol::withCString(kPollReasonNearThreshold);
+static const OSSymbol *_PollReasonEstimateErrorSym =	OSSymbol::withCString(kPollReasonEstimateError);
+static const OSSymbol *_PollReasonStableOnACSym =		OSSymbol::withCString(kPollReasonStableOnAC);
+static const OSSymbol *_PollReasonRateOfChangeSym =		OSSymbol::withCString(kPollReasonRateOfChange);
+static const OSSymbol *_PollReasonTripPointSym =		OSSymbol::withCString(kPollReasonTripPoint);
+static const OSSymbol *_PollReasonAfterWakeSym =		OSSymbol::withCString(kPollReasonAfterWake);
+static const OSSymbol *_PollReasonBackoffSym =			OSSymbol::withCString(kPollReasonBackoff);
+
+// Names for the object accounting sites published in "DriverMemoryFootprint"
+
+static const char *objectSiteNames[kObjectSiteCount] =
+{
+	"StaticInfoSymbols",	// kObjectSiteStaticSymbol
+	"CellVoltages",			// kObjectSiteCellVoltages
+	"Counters",				// kObjectSiteCounters
+	"LegacyBatteryInfo",	// kObjectSiteLegacyInfo
+	"PowerSourceNumbers",	// kObjectSitePSNumber
+	"ManufacturerData",		// kObjectSiteManufacturerData
+	"ManufactureDate",		// kObjectSiteDateSymbol
+	"SerialNumber"			// kObjectSiteSerial
+};
+
+// ACPI package schemas. Each field is described once here; decoding,
+// unit conversion and publication are driven from these tables.
+
+static const ACPIPackageField acpiBIFFields[] =
+{
+	ACPI_INTEGER(BIF_POWER_UNIT,			ACPIBatteryInfo, powerUnit,			kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIF_DESIGN_CAPACITY,		ACPIBatteryInfo, designCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		&_DesignCapacitySym),
+	ACPI_INTEGER(BIF_LAST_FULL_CAPACITY,	ACPIBatteryInfo, lastFullCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		&_MaxCapacitySym),
+	ACPI_INTEGER(BIF_TECHNOLOGY,			ACPIBatteryInfo, technology,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIF_DESIGN_VOLTAGE,		ACPIBatteryInfo, designVoltage,		kACPIUnitMilliVolts,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIF_CAPACITY_WARNING,		ACPIBatteryInfo, capacityWarning,	kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIF_LOW_WARNING,			ACPIBatteryInfo, capacityLow,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIF_GRANULARITY_1,			ACPIBatteryInfo, granularity1,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIF_GRANULARITY_2,			ACPIBatteryInfo, granularity2,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_STRING (BIF_MODEL_NUMBER,			ACPIBatteryInfo, model,											&_DeviceNameSym),
+	ACPI_STRING (BIF_SERIAL_NUMBER,			ACPIBatteryInfo, serial,										NULL),
+	ACPI_STRING (BIF_BATTERY_TYPE,			ACPIBatteryInfo, type,											&_TypeSym),
+	ACPI_STRING (BIF_OEM,					ACPIBatteryInfo, oem,											&_ManufacturerSym)
+};
+
+static const ACPIPackageField acpiBIXFields[] =
+{
+	ACPI_INTEGER(BIX_REVISION,				ACPIBatteryInfo, revision,			kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_POWER_UNIT,			ACPIBatteryInfo, powerUnit,			kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_DESIGN_CAPACITY,		ACPIBatteryInfo, designCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		&_DesignCapacitySym),
+	ACPI_INTEGER(BIX_LAST_FULL_CAPACITY,	ACPIBatteryInfo, lastFullCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		&_MaxCapacitySym),
+	ACPI_INTEGER(BIX_TECHNOLOGY,			ACPIBatteryInfo, technology,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_DESIGN_VOLTAGE,		ACPIBatteryInfo, designVoltage,		kACPIUnitMilliVolts,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_CAPACITY_WARNING,		ACPIBatteryInfo, capacityWarning,	kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_LOW_WARNING,			ACPIBatteryInfo, capacityLow,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_CYCLE_COUNT,			ACPIBatteryInfo, cycleCount,		kACPIUnitNone,			ACPI_UNKNOWN,		&_CycleCountSym),
+	ACPI_INTEGER(BIX_ACCURACY,				ACPIBatteryInfo, accuracy,			kACPIUnitPercent,		ACPI_NO_SENTINEL,	&_MaxErrSym),
+	ACPI_INTEGER(BIX_MAX_SAMPLE_TIME,		ACPIBatteryInfo, maxSampleTime,		kACPIUnitMilliSeconds,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_MIN_SAMPLE_TIME,		ACPIBatteryInfo, minSampleTime,		kACPIUnitMilliSeconds,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_MAX_AVG_INTERVAL,		ACPIBatteryInfo, maxAverageInterval, kACPIUnitMilliSeconds,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_MIN_AVG_INTERVAL,		ACPIBatteryInfo, minAverageInterval, kACPIUnitMilliSeconds,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_GRANULARITY_1,			ACPIBatteryInfo, granularity1,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_GRANULARITY_2,			ACPIBatteryInfo, granularity2,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_STRING (BIX_MODEL_NUMBER,			ACPIBatteryInfo, model,											&_DeviceNameSym),
+	ACPI_STRING (BIX_SERIAL_NUMBER,			ACPIBatteryInfo, serial,										NULL),
+	ACPI_STRING (BIX_BATTERY_TYPE,			ACPIBatteryInfo, type,											&_TypeSym),
+	ACPI_STRING (BIX_OEM,					ACPIBatteryInfo, oem,											&_ManufacturerSym)
+};
+
+static const ACPIPackageField acpiBBIXFields[] =
+{
+	ACPI_INTEGER(BBIX_MANUF_ACCESS,			ACPIBatteryExtraInfo, manufacturerAccess,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_BATTERYMODE,			ACPIBatteryExtraInfo, batteryMode,				kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_ATRATETIMETOFULL,		ACPIBatteryExtraInfo, atRateTimeToFull,			kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_ATRATETIMETOEMPTY,	ACPIBatteryExtraInfo, atRateTimeToEmpty,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_TEMPERATURE,			ACPIBatteryExtraInfo, temperature,				kACPIUnitTenthKelvin,	ACPI_NO_SENTINEL,	&_TemperatureSym),
+	ACPI_INTEGER(BBIX_VOLTAGE,				ACPIBatteryExtraInfo, voltage,					kACPIUnitMilliVolts,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_CURRENT,				ACPIBatteryExtraInfo, current,					kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	&_CurrentSym),
+	ACPI_INTEGER(BBIX_AVG_CURRENT,			ACPIBatteryExtraInfo, averageCurrent,			kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	&_AverageCurrentSym),
+	ACPI_INTEGER(BBIX_REL_STATE_CHARGE,		ACPIBatteryExtraInfo, relativeStateOfCharge,	kACPIUnitPercent,		ACPI_NO_SENTINEL,	&_RelativeStateOfChargeSym),
+	ACPI_INTEGER(BBIX_ABS_STATE_CHARGE,		ACPIBatteryExtraInfo, absoluteStateOfCharge,	kACPIUnitPercent,		ACPI_NO_SENTINEL,	&_AbsoluteStateOfChargeSym),
+	ACPI_INTEGER(BBIX_REMAIN_CAPACITY,		ACPIBatteryExtraInfo, remainingCapacity,		kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	&_RemainingCapacitySym),
+	ACPI_INTEGER(BBIX_RUNTIME_TO_EMPTY,		ACPIBatteryExtraInfo, runTimeToEmpty,			kACPIUnitMinutes,		ACPI_UNKNOWN,		&_RunTimeToEmptySym),
+	ACPI_INTEGER(BBIX_AVG_TIME_TO_EMPTY,	ACPIBatteryExtraInfo, averageTimeToEmpty,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_AVG_TIME_TO_FULL,		ACPIBatteryExtraInfo, averageTimeToFull,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_MANUF_DATE,			ACPIBatteryExtraInfo, manufactureDate,			kACPIUnitPackedDate,	ACPI_NO_SENTINEL,	&_ManufactureDateSym),
+	ACPI_BUFFER (BBIX_MANUF_DATA,			ACPIBatteryExtraInfo, manufacturerData)
+};
+
+static const ACPIPackageField acpiBSTFields[] =
+{
+	ACPI_INTEGER(BST_STATUS,				ACPIBatteryStatus, state,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BST_RATE,					ACPIBatteryStatus, rate,		kACPIUnitRate,			ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BST_CAPACITY,				ACPIBatteryStatus, capacity,	kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BST_VOLTAGE,				ACPIBatteryStatus, voltage,		kACPIUnitMilliVolts,	ACPI_NO_SENTINEL,	NULL)
+};
+
 #define super IOPMPowerSource
 
 OSDefineMetaClassAndStructors(AppleSmartBattery, IOPMPowerSource)
@@ -154,10 +410,410 @@ bool AppleSmartBattery::init(void)
     fProvider = NULL;
     fWorkLoop = NULL;
     fPollTimer = NULL;
+    fCellVoltages = NULL;
+    fLegacyBatteryInfo[0] = NULL;
+    fLegacyBatteryInfo[1] = NULL;
+    fPublishedUpdatesNum = NULL;
+    fSuppressedUpdatesNum = NULL;
+    fNextPollIntervalNum = NULL;
+    fNotifyTimer = NULL;
+    fPollThread = NULL;
+    fStopping = false;
+    fPollQueued = 0;
+    fPollPath = 0;
+    fEstimatesStaleUntil = 0;
+    bzero(&fPoll, sizeof(fPoll));
+    fStageDeadlineTimer = NULL;
+    fPollTimedOut = false;
+    fPollFailures = 0;
+    fJitterSeed = 0;
+    fExtraFailures = 0;
+    fExtraDisabledUntil = 0;
+    fNotifyReceivedNum = NULL;
+    fNotifyRefreshesNum = NULL;
+    fNotifyRateLimitedNum = NULL;
+    fSleepAckLatencyNum = NULL;
+    fSharedMemory = NULL;
+    fSharedPage = NULL;
+    fHistory = NULL;
+    fHistoryCurrent = 0;
+    fHistoryHead = 0;
+    fHistoryInterval = 0;
+    fInterpolateTimer = NULL;
+    fInterpolateAnchor = 0;
+    fInterpolating = false;
+    bzero(&fContribution, sizeof(fContribution));
+    fAggregated = false;
+    
+    bzero(fLiveObjects, sizeof(fLiveObjects));
+    bzero(fCreatedObjects, sizeof(fCreatedObjects));
+    fMemoryFootprint = NULL;
+    bzero(fLiveObjectsNum, sizeof(fLiveObjectsNum));
+    bzero(fCreatedObjectsNum, sizeof(fCreatedObjectsNum));
+    fTotalLiveObjectsNum = NULL;
 	
     return true;
 }
 
+/******************************************************************************
+ * applyContribution
+ *
+ * Add (sign 1) or remove (sign -1) one battery's share of the totals.
+ ******************************************************************************/
+
+static void applyContribution(BatteryAggregate *totals, const BatteryContribution *c, int sign)
+{
+	totals->presentCount	+= sign * (c->present ? 1 : 0);
+	totals->chargingCount	+= sign * (c->charging ? 1 : 0);
+	totals->externalCount	+= sign * (c->externalConnected ? 1 : 0);
+	totals->currentCapacity	+= sign * c->currentCapacity;
+	totals->maxCapacity		+= sign * c->maxCapacity;
+	totals->designCapacity	+= sign * c->designCapacity;
+	totals->amperage		+= sign * c->amperage;
+}
+
+/******************************************************************************
+ * createAggregateState
+ *
+ * The aggregate dictionary with zeroed numbers, for updateAggregateState()
+ * to fill in. Called under the battery list lock.
+ ******************************************************************************/
+
+static OSDictionary *createAggregateState(void)
+{
+	OSDictionary *dict = OSDictionary::withCapacity(kAggregateNumberCount + 2);
+	
+	if (!dict)
+		return NULL;
+	
+	for (int i = 0; i < kAggregateNumberCount; i++)
+	{
+		OSNumber *n = OSNumber::withNumber((unsigned long long) 0, NUM_BITS);
+		
+		if (!n || !dict->setObject(aggregateNumberKeys[i], n)) {
+			if (n) n->release();
+			dict->release();
+			bzero(aggregateNumbers, sizeof(aggregateNumbers));
+			return NULL;
+		}
+		
+		aggregateNumbers[i] = n;
+		n->release();
+	}
+	
+	dict->setObject(kIOPMPSIsChargingKey,			kOSBooleanFalse);
+	dict->setObject(kIOPMPSExternalConnectedKey,	kOSBooleanFalse);
+	
+	return dict;
+}
+
+/******************************************************************************
+ * updateAggregateState
+ *
+ * Writes totals into the published dictionary without allocating. Called
+ * under the battery list lock.
+ ******************************************************************************/
+
+static void updateAggregateState(const BatteryAggregate *totals)
+{
+	aggregateNumbers[kAggregateBatteryCount]->setValue(totals->batteryCount);
+	aggregateNumbers[kAggregatePresentCount]->setValue(totals->presentCount);
+	aggregateNumbers[kAggregateCurrentCapacity]->setValue(totals->currentCapacity);
+	aggregateNumbers[kAggregateMaxCapacity]->setValue(totals->maxCapacity);
+	aggregateNumbers[kAggregateDesignCapacity]->setValue(totals->designCapacity);
+	aggregateNumbers[kAggregateAmperage]->setValue((unsigned long long) (SInt64) totals->amperage);
+	aggregateNumbers[kAggregateTimeRemaining]->setValue(totals->timeRemaining);
+	
+	aggregateState->setObject(kIOPMPSIsChargingKey,			totals->chargingCount ? kOSBooleanTrue : kOSBooleanFalse);
+	aggregateState->setObject(kIOPMPSExternalConnectedKey,	totals->externalCount ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::initBatteryList
+ *
+ * Creates the battery list lock, once. Called by each manager before its
+ * battery starts; managers of different bays may start concurrently, and
+ * only one lock is kept.
+ ******************************************************************************/
+
+bool AppleSmartBattery::initBatteryList(void)
+{
+	IOLock *lock;
+	
+	if (batteryListLock)
+		return true;
+	
+	lock = IOLockAlloc();
+	if (!lock)
+		return false;
+	
+	if (!OSCompareAndSwapPtr(NULL, lock, (void * volatile *) &batteryListLock))
+		IOLockFree(lock);
+	
+	return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::registerBattery
+ *
+ * Called by the manager once the battery has started.
+ ******************************************************************************/
+
+void AppleSmartBattery::registerBattery(AppleSmartBattery *battery)
+{
+	if (!batteryListLock)
+		return;
+	
+	IOLockLock(batteryListLock);
+	
+	if (!batteryList)
+		batteryList = OSArray::withCapacity(2);
+	if (!aggregateState)
+		aggregateState = createAggregateState();
+	
+	if (batteryList && aggregateState && !battery->fAggregated && batteryList->setObject(battery))
+	{
+		battery->fAggregated = true;
+		aggregateTotals.batteryCount++;
+		applyContribution(&aggregateTotals, &battery->fContribution, 1);
+	}
+	
+	IOLockUnlock(batteryListLock);
+	
+	publishAggregate();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::unregisterBattery
+ *
+ * Called by the manager before the battery is stopped. The last battery
+ * out frees the list and the aggregate.
+ ******************************************************************************/
+
+void AppleSmartBattery::unregisterBattery(AppleSmartBattery *battery)
+{
+	OSArray			*list = NULL;
+	OSDictionary	*state = NULL;
+	
+	if (!batteryListLock)
+		return;
+	
+	IOLockLock(batteryListLock);
+	
+	if (battery->fAggregated)
+	{
+		battery->fAggregated = false;
+		aggregateTotals.batteryCount--;
+		applyContribution(&aggregateTotals, &battery->fContribution, -1);
+		
+		for (unsigned int i = 0; i < batteryList->getCount(); i++)
+		{
+			if (batteryList->getObject(i) == battery) {
+				batteryList->removeObject(i);
+				break;
+			}
+		}
+		
+		if (!batteryList->getCount())
+		{
+			list			= batteryList;
+			state			= aggregateState;
+			batteryList		= NULL;
+			aggregateState	= NULL;
+			bzero(aggregateNumbers, sizeof(aggregateNumbers));
+		}
+	}
+	
+	IOLockUnlock(batteryListLock);
+	
+	publishAggregate();
+	
+	if (list)
+		list->release();
+	if (state)
+		state->release();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::updateAggregate
+ *
+ * Swap this battery's last contribution for its current state. Called
+ * after every poll on the battery's own work loop.
+ ******************************************************************************/
+
+void AppleSmartBattery::updateAggregate(void)
+{
+	BatteryContribution c;
+	bool				aggregated;
+	
+	bzero(&c, sizeof(c));
+	
+	c.present			= fBatteryPresent;
+	c.externalConnected	= externalConnected();
+	
+	if (fBatteryPresent)
+	{
+		c.charging			= isCharging();
+		c.currentCapacity	= currentCapacity();
+		c.maxCapacity		= maxCapacity();
+		c.designCapacity	= designCapacity();
+		c.amperage			= amperage();
+	}
+	
+	// Not started by a manager
+	if (!batteryListLock) {
+		fContribution = c;
+		return;
+	}
+	
+	IOLockLock(batteryListLock);
+	
+	if (fAggregated)
+	{
+		applyContribution(&aggregateTotals, &fContribution, -1);
+		applyContribution(&aggregateTotals, &c, 1);
+	}
+	
+	fContribution	= c;
+	aggregated		= fAggregated;
+	
+	IOLockUnlock(batteryListLock);
+	
+	if (aggregated)
+		publishAggregate();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishAggregate
+ *
+ * Publishes the running totals on the first registered battery, with the
+ * combined time remaining: everything left over the net discharge rate, or
+ * everything missing over the net charge rate. Nothing is allocated: the
+ * numbers are updated in place under the lock, and the dictionary only goes
+ * to the registry when the publishing battery changes.
+ *
+ * That hand-over happens after dropping the lock. One caller publishes at a
+ * time; a caller that finds a publication under way bumps
+ * aggregateGeneration instead, and the publisher goes round again until it
+ * has published the latest generation, so batteries on different work loops
+ * can't hand the dictionary over out of order.
+ ******************************************************************************/
+
+void AppleSmartBattery::publishAggregate(void)
+{
+	BatteryAggregate	totals;
+	AppleSmartBattery	*publisher;
+	AppleSmartBattery	*previous;
+	OSDictionary		*dict;
+	UInt32				generation;
+	
+	IOLockLock(batteryListLock);
+	
+	aggregateGeneration++;
+	
+	if (aggregatePublishing)
+	{
+		IOLockUnlock(batteryListLock);
+		return;
+	}
+	
+	aggregatePublishing = true;
+	
+	do {
+		generation = aggregateGeneration;
+		
+		totals = aggregateTotals;
+		totals.timeRemaining = 0;
+		
+		if (totals.amperage < 0)
+			totals.timeRemaining = (UInt32) (((UInt64) totals.currentCapacity * 60) / -totals.amperage);
+		else if ((totals.amperage > 0) && (totals.maxCapacity > totals.currentCapacity))
+			totals.timeRemaining = (UInt32) (((UInt64) (totals.maxCapacity - totals.currentCapacity) * 60) / totals.amperage);
+		
+		publisher = NULL;
+		if (batteryList && batteryList->getCount())
+			publisher = (AppleSmartBattery *) batteryList->getObject(0);
+		
+		if ((publisher == aggregatePublisher) && !memcmp(&totals, &aggregatePublished, sizeof(totals)))
+			continue;
+		
+		// Both stay retained until published, whatever their managers do
+		previous	= NULL;
+		dict		= NULL;
+		if (aggregatePublisher != publisher)
+		{
+			previous = aggregatePublisher;
+			aggregatePublisher = publisher;
+			
+			if (publisher) {
+				publisher->retain();
+				dict = aggregateState;
+				dict->retain();
+			}
+		}
+		if (publisher)
+			publisher->retain();
+		
+		aggregatePublished = totals;
+		
+		if (publisher)
+			updateAggregateState(&totals);
+		
+		IOLockUnlock(batteryListLock);
+		
+		if (previous) {
+			previous->removeProperty(kAggregateBatteryStateKey);
+			previous->release();
+		}
+		
+		if (dict) {
+			publisher->setProperty(kAggregateBatteryStateKey, dict);
+			dict->release();
+		}
+		if (publisher)
+			publisher->release();
+		
+		IOLockLock(batteryListLock);
+	} while (generation != aggregateGeneration);
+	
+	aggregatePublishing = false;
+	
+	IOLockUnlock(batteryListLock);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::alignSharedPoll
+ *
+ * With more than one battery, lets this battery's next poll share a tick
+ * with the others so the EC is woken once for all of them: an existing tick
+ * due in the second half of the interval is taken as is, otherwise this
+ * poll becomes the tick the others can join.
+ ******************************************************************************/
+
+uint32_t AppleSmartBattery::alignSharedPoll(uint32_t interval)
+{
+	uint64_t now = getUptimeMS();
+	uint64_t due = now + interval;
+	
+	// No lock, no other battery to share with
+	if (!batteryListLock)
+		return interval;
+	
+	IOLockLock(batteryListLock);
+	
+	if (fAggregated && (aggregateTotals.batteryCount > 1))
+	{
+		if ((sharedPollDue > now) && (sharedPollDue <= due) && (sharedPollDue >= (now + interval / 2)))
+			due = sharedPollDue;
+		else if ((sharedPollDue <= now) || (sharedPollDue > due))
+			sharedPollDue = due;
+	}
+	
+	IOLockUnlock(batteryListLock);
+	
+	return (uint32_t) (due - now);
+}
+
 /******************************************************************************
  * AppleSmartBattery::free
  *
@@ -165,12 +821,76 @@ bool AppleSmartBattery::init(void)
 
 void AppleSmartBattery::free(void) 
 {
-    fPollTimer->cancelTimeout();
-    fBatteryReadAllTimer->cancelTimeout();
-    fWorkLoop->disableAllEventSources();
+    if (fPollTimer) fPollTimer->cancelTimeout();
+    if (fStageDeadlineTimer) fStageDeadlineTimer->cancelTimeout();
+    if (fInterpolateTimer) fInterpolateTimer->cancelTimeout();
+    if (fNotifyTimer) fNotifyTimer->cancelTimeout();
+    if (fWorkLoop) fWorkLoop->disableAllEventSources();
+    
+    // Normally gone already, see stop(). A queued or running poll holds a
+    // reference, so there is none left to wait for by now.
+    if (fPollThread) {
+        thread_call_free(fPollThread);
+        fPollThread = NULL;
+    }
     
     clearBatteryState(true);
     
+    if (fCellVoltages) fCellVoltages->release();
+    
+    for (int i = 0; i < 2; i++)
+    {
+        if (fLegacyBatteryInfo[i]) {
+            if (fLegacyBatteryInfo[i]->getObject(kIOBatteryFlagsKey))
+                trackObjects(kObjectSiteLegacyInfo, -1);
+            fLegacyBatteryInfo[i]->release();
+            trackObjects(kObjectSiteLegacyInfo, -1);
+        }
+    }
+    
+    for (int i = 0; i < kObjectSiteCount; i++)
+    {
+        if (fLiveObjectsNum[i]) fLiveObjectsNum[i]->release();
+        if (fCreatedObjectsNum[i]) fCreatedObjectsNum[i]->release();
+    }
+    if (fTotalLiveObjectsNum) fTotalLiveObjectsNum->release();
+    if (fMemoryFootprint) fMemoryFootprint->release();
+    
+    if (fPublishedUpdatesNum) fPublishedUpdatesNum->release();
+    if (fSuppressedUpdatesNum) fSuppressedUpdatesNum->release();
+    if (fNextPollIntervalNum) fNextPollIntervalNum->release();
+    if (fNotifyReceivedNum) fNotifyReceivedNum->release();
+    if (fNotifyRefreshesNum) fNotifyRefreshesNum->release();
+    if (fNotifyRateLimitedNum) fNotifyRateLimitedNum->release();
+    if (fSleepAckLatencyNum) fSleepAckLatencyNum->release();
+    if (fSharedMemory) fSharedMemory->release();
+    if (fHistory) IOFree(fHistory, kHistoryBlocks * sizeof(BatteryHistoryBlock));
+    
+    if (fPollTimer) {
+        fWorkLoop->removeEventSource(fPollTimer);
+        fPollTimer->release();
+    }
+    
+    if (fStageDeadlineTimer) {
+        fWorkLoop->removeEventSource(fStageDeadlineTimer);
+        fStageDeadlineTimer->release();
+    }
+    
+    if (fInterpolateTimer) {
+        fWorkLoop->removeEventSource(fInterpolateTimer);
+        fInterpolateTimer->release();
+    }
+    
+    if (fNotifyTimer) {
+        fWorkLoop->removeEventSource(fNotifyTimer);
+        fNotifyTimer->release();
+    }
+    
+    releaseStaticSymbol(fDeviceName);
+    releaseStaticSymbol(fSerialNumber);
+    releaseStaticSymbol(fType);
+    releaseStaticSymbol(fManufacturer);
+    
     super::free();
 }
 
@@ -184,6 +904,8 @@ bool AppleSmartBattery::start(IOService *provider)
     OSNumber        *debugPollingSetting;
 	OSBoolean		*useExtendedInformation;
 	OSBoolean		*useExtraInformation;
+	OSString		*rateEstimator;
+	UInt32			capabilities;
 	
     fProvider = OSDynamicCast(AppleSmartBatteryManager, provider);
 	
@@ -208,18 +930,19 @@ bool AppleSmartBattery::start(IOService *provider)
         fPollingOverridden = false;
     }
 	
-	// Check if we should use extended information in _BIX (ACPI 4.0) or older _BIF
+	// The methods the firmware implements decide between _BIX (ACPI 4.0)
+	// and the older _BIF, and whether to read BBIX. The Info.plist keys,
+	// when present, override the probe.
+	
+	capabilities = fProvider->getCapabilities();
 	
-	useExtendedInformation = (OSBoolean *)fProvider->getProperty(kUseBatteryExtendedInfoKey);
-	if (useExtendedInformation && OSDynamicCast(OSBoolean, useExtendedInformation) )
+	fUseBatteryExtendedInformation = (capabilities & kBatteryCapabilityBIX) ? true : false;
+	
+	useExtendedInformation = OSDynamicCast(OSBoolean, fProvider->getProperty(kUseBatteryExtendedInfoKey));
+	if (useExtendedInformation)
 	{
-		
 		fUseBatteryExtendedInformation = useExtendedInformation->isTrue();
 	}
-	else 
-	{
-		fUseBatteryExtendedInformation = false;
-	}
 	
 	if(fUseBatteryExtendedInformation)
 	{
@@ -230,177 +953,1854 @@ bool AppleSmartBattery::start(IOService *provider)
 		IOLog("AppleSmartBattery: Using ACPI regular battery information method _BIF\n");
 	}
 
-	// Check if we should use extra information in BBIX
+	fUseBatteryExtraInformation = (capabilities & kBatteryCapabilityBBIX) ? true : false;
 	
-	useExtraInformation = (OSBoolean *)fProvider->getProperty(kUseBatteryExtraInfoKey);
-	if (useExtraInformation && OSDynamicCast(OSBoolean, useExtraInformation) )
+	useExtraInformation = OSDynamicCast(OSBoolean, fProvider->getProperty(kUseBatteryExtraInfoKey));
+	if (useExtraInformation)
 	{
-		
 		fUseBatteryExtraInformation = useExtraInformation->isTrue();
 	}
-	else 
+	
+	if(fUseBatteryExtraInformation)
+	{
+		IOLog("AppleSmartBattery: Using ACPI extra battery information method BBIX\n");
+	}
+	
+	// Pick the average rate estimator
+	
+	fRateEstimator = kRateEstimatorEWMA;
+	
+	rateEstimator = OSDynamicCast(OSString, fProvider->getProperty(kRateEstimatorKey));
+	if (rateEstimator)
 	{
-		fUseBatteryExtraInformation = false;
+		for (UInt32 i = 0; i < sizeof(rateEstimatorNames) / sizeof(rateEstimatorNames[0]); i++)
+		{
+			if (rateEstimator->isEqualTo(rateEstimatorNames[i]))
+				fRateEstimator = i;
+		}
 	}
 	
-	if(fUseBatteryExtraInformation)
+	setProperty(kRateEstimatorKey, rateEstimatorNames[fRateEstimator]);
+	
+    fBatteryPresent		= false;
+    fACConnected		= false;
+    fACChargeCapable	= false;
+	fSystemSleeping     = false;
+    fPowerServiceToAck  = NULL;
+	fSleepAckStart      = 0;
+	fPollingNow         = false;
+	fStaticInfoValid    = false;
+	fStaticInfoTimestamp = 0;
+	fNextPollInterval   = 0;
+	fPollReason         = NULL;
+	fCapacityWarning    = 0;
+	fCapacityLow        = 0;
+	fCapacitySlope      = 0;
+	fEstimateError      = 0;
+	fTrendCapacity      = 0;
+	fTrendStatus        = 0;
+	fTrendTimestamp     = 0;
+	fPublishedUpdates   = 0;
+	fSuppressedUpdates  = 0;
+	fLegacyIndex        = 0;
+	fSnapshotGeneration = 0;
+	fMinAverageInterval = 0;
+	fMaxAverageInterval = 0;
+	resetRateEstimator();
+	fTripPointSupported = (capabilities & kBatteryCapabilityBTP) ? true : false;
+	fTripPointArmed     = false;
+	fTripPointFalling   = false;
+	fTripPoint          = 0;
+	fTripPointPending   = false;
+	fTripPointTarget    = 0;
+	fCapacityScale      = 1;
+	fTimerPoll          = false;
+	fNotifyPending      = false;
+	fNotifyTokens       = kNotifyBurst;
+	fNotifyRefillTime   = 0;
+	fNotifyReceived     = 0;
+	fNotifyRefreshes    = 0;
+	fNotifyRateLimited  = 0;
+	
+	// Read-only page shared with AppleSmartBatteryUserClient clients
+	fSharedMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionOutIn | kIOMemoryKernelUserShared,
+														  page_size, page_size);
+	if (!fSharedMemory)
+		return false;
+	
+	fSharedPage = (BatterySharedPage *) fSharedMemory->getBytesNoCopy();
+	bzero(fSharedPage, page_size);
+	
+	fSharedPage->magic				= kBatterySharedPageMagic;
+	fSharedPage->version			= kBatterySnapshotVersion;
+	fSharedPage->size				= sizeof(BatterySharedPage);
+	fSharedPage->ringSize			= kBatterySharedRingSize;
+	fSharedPage->snapshot.version	= kBatterySnapshotVersion;
+	
+	fHistory = (BatteryHistoryBlock *) IOMalloc(kHistoryBlocks * sizeof(BatteryHistoryBlock));
+	if (!fHistory)
+		return false;
+	
+	bzero(fHistory, kHistoryBlocks * sizeof(BatteryHistoryBlock));
+	
+	setProperty("IOUserClientClass", "AppleSmartBatteryUserClient");
+	
+	// Containers reused by every poll
+	fCellVoltages			= OSArray::withCapacity(4);
+	fPublishedUpdatesNum	= OSNumber::withNumber(0ULL, NUM_BITS);
+	fSuppressedUpdatesNum	= OSNumber::withNumber(0ULL, NUM_BITS);
+	fNextPollIntervalNum	= OSNumber::withNumber(0ULL, NUM_BITS);
+	fNotifyReceivedNum		= OSNumber::withNumber(0ULL, NUM_BITS);
+	fNotifyRefreshesNum		= OSNumber::withNumber(0ULL, NUM_BITS);
+	fNotifyRateLimitedNum	= OSNumber::withNumber(0ULL, NUM_BITS);
+	fSleepAckLatencyNum		= OSNumber::withNumber(0ULL, NUM_BITS);
+	
+	if (!fCellVoltages || !fPublishedUpdatesNum || !fSuppressedUpdatesNum || !fNextPollIntervalNum
+		|| !fNotifyReceivedNum || !fNotifyRefreshesNum || !fNotifyRateLimitedNum || !fSleepAckLatencyNum)
+		return false;
+	
+	for (int i = 0; i < 4; i++)
+	{
+		OSNumber *num = OSNumber::withNumber(0ULL, NUM_BITS);
+		if (!num)
+			return false;
+		fCellVoltages->setObject(num);
+		num->release();
+	}
+	
+	fCellVoltage1 = fCellVoltage2 = fCellVoltage3 = fCellVoltage4 = 0;
+	
+	// These live until free(), so they are never untracked
+	trackObjects(kObjectSiteCellVoltages, 5);
+	trackObjects(kObjectSiteCounters, 7);
+	
+	if (!createMemoryFootprint())
+		return false;
+	
+	setProperty("StatusUpdatesPublished", fPublishedUpdatesNum);
+	setProperty("StatusUpdatesSuppressed", fSuppressedUpdatesNum);
+	setProperty("NextPollInterval_msec", fNextPollIntervalNum);
+	setProperty("StatusNotificationsReceived", fNotifyReceivedNum);
+	setProperty("StatusNotificationRefreshes", fNotifyRefreshesNum);
+	setProperty("StatusNotificationsRateLimited", fNotifyRateLimitedNum);
+	setProperty("SleepAckLatency_msec", fSleepAckLatencyNum);
+	
+	// Make sure that we read battery state at least 5 times at 30 second intervals
+    // after system boot.
+    fInitialPollCountdown = kInitialPollCountdown;
+	
+    fWorkLoop = getWorkLoop();
+	
+    fPollTimer = IOTimerEventSource::timerEventSource( this, 
+													  OSMemberFunctionCast( IOTimerEventSource::Action, 
+																		   this, &AppleSmartBattery::pollingTimeOut) );
+	
+    fStageDeadlineTimer = IOTimerEventSource::timerEventSource( this,
+															   OSMemberFunctionCast( IOTimerEventSource::Action,
+																					this, &AppleSmartBattery::stageDeadlineTimeOut) );
+	
+    fInterpolateTimer = IOTimerEventSource::timerEventSource( this,
+															 OSMemberFunctionCast( IOTimerEventSource::Action,
+																				  this, &AppleSmartBattery::interpolateTimeOut) );
+	
+    if( !fWorkLoop || !fPollTimer
+	   || (kIOReturnSuccess != fWorkLoop->addEventSource(fPollTimer)) )
+    {
+        return false;
+    }
+	
+    if( !fInterpolateTimer
+	   || (kIOReturnSuccess != fWorkLoop->addEventSource(fInterpolateTimer)) )
+    {
+        return false;
+    }
+	
+    if( !fStageDeadlineTimer
+	   || (kIOReturnSuccess != fWorkLoop->addEventSource(fStageDeadlineTimer)) )
+    {
+        return false;
+    }
+	
+    fNotifyTimer = IOTimerEventSource::timerEventSource( this,
+														OSMemberFunctionCast( IOTimerEventSource::Action,
+																			 this, &AppleSmartBattery::notifyTimeOut) );
+	
+    if( !fNotifyTimer
+	   || (kIOReturnSuccess != fWorkLoop->addEventSource(fNotifyTimer)) )
+    {
+        return false;
+    }
+	
+    // Seeds the backoff jitter, see nextJitter(). Batteries started in the
+    // same instant must not retry in lock step, so each mixes in its address.
+    uint64_t seed;
+    clock_get_uptime(&seed);
+    fJitterSeed = (UInt32) seed ^ (UInt32) ((uintptr_t) this >> 4);
+	
+    // ACPI methods are evaluated here, off the work loop
+    fPollThread = thread_call_allocate(&AppleSmartBattery::pollThreadEntry, (thread_call_param_t) this);
+    if (!fPollThread)
+        return false;
+	
+    // Publish the intended period in seconds that our "time remaining"
+    // estimate is wildly inaccurate after wake from sleep.
+    setProperty( kIOPMPSInvalidWakeSecondsKey,		kSecondsUntilValidOnWake, NUM_BITS);
+	
+    // Publish the necessary time period (in seconds) that a battery
+    // calibrating tool must wait to allow the battery to settle after
+    // charge and after discharge.
+    setProperty( kIOPMPSPostChargeWaitSecondsKey,	kPostChargeWaitSeconds, NUM_BITS);
+    setProperty( kIOPMPSPostDishargeWaitSecondsKey, kPostDischargeWaitSeconds, NUM_BITS);
+	
+    // zero out battery state with argument (do_set == true)
+    clearBatteryState(false);
+	
+    // Kick off the 30 second timer and do an initial poll
+    pollBatteryState( kNewBatteryPath );
+	
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::stop
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::stop(IOService *provider)
+{
+    // No new polls, and the one in flight (if any) stops at its next stage
+    if (fWorkLoop)
+        fWorkLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &AppleSmartBattery::stopPolling), this);
+    
+    // Not under the gate: a running poll needs it for completePoll(). A poll
+    // cancelled before it ran still holds the reference taken for it.
+    if (fPollThread)
+    {
+        if (thread_call_cancel_wait(fPollThread))
+            release();
+        
+        thread_call_free(fPollThread);
+        fPollThread = NULL;
+    }
+    
+    super::stop(provider);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::stopPolling
+ *
+ * Called from stop() under the gate.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::stopPolling(void)
+{
+    fStopping = true;
+    fPollQueued = 0;
+    fNotifyPending = false;
+    
+    cancelPoll();
+    
+    if (fPollTimer) fPollTimer->cancelTimeout();
+    if (fStageDeadlineTimer) fStageDeadlineTimer->cancelTimeout();
+    if (fInterpolateTimer) fInterpolateTimer->cancelTimeout();
+    if (fNotifyTimer) fNotifyTimer->cancelTimeout();
+    
+    // Nothing is left to complete a poll power management may be waiting on
+    acknowledgeSystemSleepWake();
+    
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::logReadError
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::logReadError(
+										  const char *error_type, 
+										  uint16_t additional_error,
+										  void *t)
+{
+    if(!error_type) return;
+	
+    setProperty((const char *)"LatestErrorType", error_type);
+	
+    IOLog("AppleSmartBattery: Error: %s (%d)\n", error_type, additional_error);  
+	
+    return;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::setPollingInterval
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::setPollingInterval(
+												int milliSeconds)
+{
+    DEBUG_LOG("AppleSmartBattery::setPollingInterval: New interval = %d ms\n", milliSeconds);
+    
+    if (!fPollingOverridden) {
+        milliSecPollingTable[kDefaultPollInterval] = milliSeconds;
+        fPollingInterval = kDefaultPollInterval;
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollBatteryState
+ *
+ * Asynchronously kicks off the register poll. The methods to evaluate are
+ * chosen here, evaluated on fPollThread and applied by completePoll(); the
+ * work loop is free in between. One poll runs at a time; a request made
+ * while one is in flight runs when it completes.
+ ******************************************************************************/
+
+bool AppleSmartBattery::pollBatteryState(int path)
+{
+    DEBUG_LOG("AppleSmartBattery::pollBatteryState: path = 0x%x\n", path);
+    
+    // This must be called under workloop synchronization
+    if (fStopping)
+        return false;
+    
+    if (kNewBatteryPath == path) 
+	{
+		/* Cancel polling timer in case this round of reads was initiated
+		 by an alarm. We re-set the 30 second poll later. */
+		fPollTimer->cancelTimeout();
+		
+		/* A new battery always gets its static information re-read */
+		invalidateStaticInfo();
+		
+		pollBatteryState( kExistingBatteryPath );
+	} 
+	else if (fPollingNow)
+	{
+		// A full read covers a wake read, which covers a status-only one
+		int queued = ((kBatteryStatusPath == path) || (kWakePath == path)) ? path : kExistingBatteryPath;
+		
+		if (pollPathRank(queued) > pollPathRank(fPollQueued))
+			fPollQueued = queued;
+	}
+	else 
+	{
+		// A status change only needs _BST, as long as we already know the
+		// battery and its static information
+		bool statusOnly = (kBatteryStatusPath == path) && fBatteryPresent && fStaticInfoValid;
+		
+		// On wake only presence and status are read before power management
+		// is acknowledged; the rest follows once estimates have settled
+		bool wake = (kWakePath == path) && fStaticInfoValid;
+		
+		// Only writes the trip point the last _BST planned
+		bool tripOnly = (kTripPointPath == path);
+		
+		// Any other poll reads _BST, so it answers a coalesced notification too
+		if (fNotifyPending && !tripOnly) {
+			fNotifyPending = false;
+			fNotifyTimer->cancelTimeout();
+		}
+		
+		bzero(&fPoll, sizeof(fPoll));
+		
+		if (tripOnly)
+		{
+			fPollPath = kTripPointPath;
+		}
+		else if (wake)
+		{
+			fPoll.methods |= kPollMethodSTA;
+			fPollPath = kWakePath;
+		}
+		else if (statusOnly)
+		{
+			fPollPath = kBatteryStatusPath;
+		}
+		else
+		{
+			fPollPath = kExistingBatteryPath;
+			fPoll.methods |= kPollMethodSTA;
+			
+			// Static information is re-read once it has aged out; a
+			// new battery was invalidated above
+			if (staticInfoNeedsRefresh())
+				fPoll.methods |= fUseBatteryExtendedInformation ? kPollMethodBIX : kPollMethodBIF;
+			
+			if (fUseBatteryExtraInformation && !extraCircuitOpen())
+				fPoll.methods |= kPollMethodBBIX;
+		}
+		
+		if (!tripOnly)
+			fPoll.methods |= kPollMethodBST;
+		
+		// A trip point waiting to be written rides along with any poll
+		if (fTripPointPending)
+		{
+			fPoll.methods	|= kPollMethodBTP;
+			fPoll.tripPoint	 = fTripPointTarget * fCapacityScale;
+		}
+		
+		fPollingNow		= true;
+		fCancelPolling	= false;
+		fPollTimedOut	= false;
+		
+		armStageDeadlines();
+		
+		// Dropped by pollThreadEntry once the results are applied
+		retain();
+		thread_call_enter(fPollThread);
+	}
+	
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollThreadEntry
+ *
+ * fPollThread body. Evaluates the planned methods without holding the
+ * gate, then posts the results back to the work loop.
+ ******************************************************************************/
+
+void AppleSmartBattery::pollThreadEntry(thread_call_param_t param0, thread_call_param_t param1)
+{
+	AppleSmartBattery *me = (AppleSmartBattery *) param0;
+	
+	me->fProvider->evaluateBatteryPoll(&me->fPoll);
+	
+	me->fWorkLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, me, &AppleSmartBattery::completePoll), me);
+	
+	me->release();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::cancelPoll
+ *
+ * Stops the poll in flight at its next stage boundary; completePoll() then
+ * drops whatever it had read. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::cancelPoll(void)
+{
+	if (!fPollingNow)
+		return;
+	
+	DEBUG_LOG("AppleSmartBattery::cancelPoll: cancelling at stage %u\n", (unsigned int) fPoll.stage);
+	
+	fCancelPolling	= true;
+	fPoll.cancelled	= true;
+	OSMemoryBarrier();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::armStageDeadlines
+ *
+ * Gives each requested stage of fPoll its own deadline, from the latency the
+ * provider has observed for its method, and starts the deadline timer.
+ ******************************************************************************/
+
+void AppleSmartBattery::armStageDeadlines(void)
+{
+	UInt32 first = 0;
+	
+	if (fPoll.methods & kPollMethodSTA)
+		fPoll.deadline[kPollStageSTA] = fProvider->methodDeadline("_STA");
+	
+	if (fPoll.methods & kPollMethodBIX)
+		fPoll.deadline[kPollStageInfo] = fProvider->methodDeadline("_BIX");
+	else if (fPoll.methods & kPollMethodBIF)
+		fPoll.deadline[kPollStageInfo] = fProvider->methodDeadline("_BIF");
+	
+	if (fPoll.methods & kPollMethodBBIX)
+		fPoll.deadline[kPollStageExtra] = fProvider->methodDeadline("BBIX");
+	
+	if (fPoll.methods & kPollMethodBST)
+		fPoll.deadline[kPollStageStatus] = fProvider->methodDeadline("_BST");
+	
+	if (fPoll.methods & kPollMethodBTP)
+		fPoll.deadline[kPollStageTrip] = fProvider->methodDeadline("_BTP");
+	
+	for (UInt32 stage = kPollStageSTA; !first && (stage < kPollStageDone); stage++)
+		first = fPoll.deadline[stage];
+	
+	fStageDeadlineTimer->cancelTimeout();
+	fStageDeadlineTimer->setTimeoutMS(first ? first : (UInt32) kDeadlineMaxMS);
+}
+
+/******************************************************************************
+ * stageElapsedMS
+ * Time since a stage started, from fPoll.stageStart.
+ ******************************************************************************/
+
+static UInt32 stageElapsedMS(uint64_t start)
+{
+	uint64_t	now;
+	uint64_t	nsec;
+	
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - start, &nsec);
+	
+	return (nsec / kMillisecondScale > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (UInt32) (nsec / kMillisecondScale);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollTimeRemaining
+ *
+ * The longest the poll in flight can still take before its stage deadlines
+ * give up on it, in ms: what is left of the current stage, plus the stages
+ * after it unless currentStageOnly (a cancelled poll stops after the stage it
+ * is on). Power management is asked to wait this long and no longer.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::pollTimeRemaining(bool currentStageOnly)
+{
+	UInt32		stage;
+	uint64_t	start;
+	UInt32		deadline;
+	UInt32		elapsed;
+	UInt32		remaining = 0;
+	
+	stage = fPoll.stage;
+	OSMemoryBarrier();
+	start = fPoll.stageStart;
+	
+	for (UInt32 next = stage; next < kPollStageDone; next++)
+	{
+		deadline = fPoll.deadline[next];
+		
+		// Not requested
+		if (!deadline)
+			continue;
+		
+		if ((next == stage) && start) {
+			elapsed		= stageElapsedMS(start);
+			deadline	= (elapsed < deadline) ? (deadline - elapsed) : 0;
+		}
+		
+		remaining += deadline;
+		
+		if (currentStageOnly)
+			break;
+	}
+	
+	// Time for completePoll() to get through the gate
+	return remaining + kDeadlineMinMS;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::stageDeadlineTimeOut
+ *
+ * Checks the stage fPollThread is evaluating against its deadline. An ACPI
+ * evaluation can't be interrupted, so an overrun cancels the poll: it stops
+ * at the next stage boundary, its results are dropped and the next attempt
+ * is backed off. Power management is not kept waiting on it.
+ ******************************************************************************/
+
+void AppleSmartBattery::stageDeadlineTimeOut(void)
+{
+	UInt32		stage;
+	uint64_t	start;
+	UInt32		elapsed;
+	UInt32		deadline;
+	
+	if (!fPollingNow || fCancelPolling)
+		return;
+	
+	// evaluateBatteryPoll() writes stageStart before stage
+	stage = fPoll.stage;
+	OSMemoryBarrier();
+	start = fPoll.stageStart;
+	
+	// Evaluation finished; completePoll() is on its way
+	if (stage >= kPollStageDone)
+		return;
+	
+	deadline = fPoll.deadline[stage];
+	
+	// Not started yet, or passing through a stage with nothing to evaluate
+	if (!start || !deadline) {
+		fStageDeadlineTimer->setTimeoutMS(deadline ? deadline : (UInt32) kDeadlineMinMS);
+		return;
+	}
+	
+	elapsed = stageElapsedMS(start);
+	
+	if (elapsed < deadline) {
+		fStageDeadlineTimer->setTimeoutMS(deadline - elapsed);
+		return;
+	}
+	
+	DEBUG_LOG("AppleSmartBattery::stageDeadlineTimeOut: stage %u took %u ms, deadline %u ms\n",
+			  (unsigned int) stage, (unsigned int) elapsed, (unsigned int) deadline);
+	
+	logReadError(kErrorStageDeadlineExpired, stage, NULL);
+	
+	fPollTimedOut = true;
+	cancelPoll();
+	
+	acknowledgeSystemSleepWake();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::extraCircuitOpen
+ *
+ * True while BBIX is left out of polls after repeated failures. Once the
+ * period expires the next poll tries it again; see recordExtraResult().
+ ******************************************************************************/
+
+bool AppleSmartBattery::extraCircuitOpen(void)
+{
+	if (!fExtraDisabledUntil)
+		return false;
+	
+	if (getUptimeMS() < fExtraDisabledUntil)
+		return true;
+	
+	fExtraDisabledUntil = 0;
+	setPropertyIfChanged(_ExtraCircuitOpenSym, kOSBooleanFalse);
+	
+	return false;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::recordExtraResult
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::recordExtraResult(bool failed)
+{
+	if (!failed) {
+		fExtraFailures = 0;
+		return;
+	}
+	
+	if (++fExtraFailures < kExtraFailureThreshold)
+		return;
+	
+	IOLog("AppleSmartBattery: BBIX failed %u times, disabled for %u s\n",
+		  (unsigned int) fExtraFailures, (unsigned int) (kExtraCircuitOpenMS / 1000));
+	
+	// One more failure after the trial poll re-opens it
+	fExtraFailures		= kExtraFailureThreshold - 1;
+	fExtraDisabledUntil	= getUptimeMS() + kExtraCircuitOpenMS;
+	setPropertyIfChanged(_ExtraCircuitOpenSym, kOSBooleanTrue);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::nextJitter
+ *
+ * Uniform-ish value in [0, range). A plain LCG is plenty to spread retries.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::nextJitter(UInt32 range)
+{
+	fJitterSeed = fJitterSeed * 1103515245 + 12345;
+	
+	return range ? ((fJitterSeed >> 8) % range) : 0;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::completePoll
+ *
+ * Applies a finished poll on the work loop, unless it was cancelled while
+ * the methods were being evaluated.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::completePoll(void)
+{
+	int		queued = fPollQueued;
+	bool	failed;
+	
+	fPollQueued = 0;
+	fStageDeadlineTimer->cancelTimeout();
+	
+	if (fPoll.methods & kPollMethodBTP)
+		completeTripPoint();
+	
+	// Only a poll that ran every stage can be judged on what it read; one
+	// cut short by sleep or removal is neither a success nor a failure. A
+	// slow _BTP costs the trip point, not the reads before it.
+	failed = (fPollTimedOut && (kPollStageTrip != fPoll.stage))
+		|| (!fCancelPolling && (kPollStageDone == fPoll.stage)
+			&& (fPoll.methods & (kPollMethodSTA | kPollMethodBST) & ~fPoll.evaluated));
+	
+	if (fPoll.methods & kPollMethodBBIX)
+	{
+		if (fPollTimedOut && (kPollStageExtra == fPoll.stage))
+			recordExtraResult(true);
+		else if (fPoll.stage > kPollStageExtra)
+			recordExtraResult(!(fPoll.evaluated & kPollMethodBBIX));
+	}
+	
+	if (failed)
+	{
+		fPollFailures++;
+		
+		// A retry is scheduled with backoff instead
+		queued = 0;
+	}
+	else if (!fCancelPolling)
+	{
+		fPollFailures = 0;
+	}
+	
+	if (fCancelPolling)
+	{
+		DEBUG_LOG("AppleSmartBattery::completePoll: poll cancelled, results dropped\n");
+		fCancelPolling = false;
+	}
+	else if (kTripPointPath != fPollPath)
+	{
+		fProvider->applyBatteryPoll(&fPoll);
+		
+		if (kWakePath == fPollPath)
+		{
+			fEstimatesStaleUntil = getUptimeMS() + (kSecondsUntilValidOnWake * 1000ULL);
+			setPSNumber(_StaleUntilSym, (UInt32) (fEstimatesStaleUntil / 1000));
+		}
+		else if (fEstimatesStaleUntil && (kExistingBatteryPath == fPollPath) && (getUptimeMS() >= fEstimatesStaleUntil))
+		{
+			// The deferred full read
+			fEstimatesStaleUntil = 0;
+			removeTrackedPSProperty(kObjectSitePSNumber, _StaleUntilSym);
+			settingsChangedSinceUpdate = true;
+		}
+		
+        if (fBatteryPresent) 
+		{
+			publishBatteryState();
+        }
+		else
+		{
+            setFullyCharged(false);
+            clearBatteryState(true);
+        }
+		
+		updateAggregate();
+	}
+	
+	if (fPoll.info)		fPoll.info->release();
+	if (fPoll.extra)	fPoll.extra->release();
+	if (fPoll.status)	fPoll.status->release();
+	bzero(&fPoll, sizeof(fPoll));
+	
+	fPollingNow		= false;
+	fPollTimedOut	= false;
+	fTimerPoll		= false;
+	fPollPath		= 0;
+	
+	if (fSystemSleeping || fStopping)
+	{
+		// Power management may be waiting on this poll
+		acknowledgeSystemSleepWake();
+		return kIOReturnSuccess;
+	}
+	
+	// A wake that arrived while this poll was in flight queued its read
+	// behind it; power management is acknowledged once that one completes.
+	// A status-only read doesn't cover it.
+	if (!queued || (kBatteryStatusPath == queued))
+		acknowledgeSystemSleepWake();
+	
+	// The next poll writes a pending trip point too; with none queued, a
+	// poll of its own does
+	if (queued)
+		pollBatteryState(queued);
+	else if (fTripPointPending)
+		pollBatteryState(kTripPointPath);
+	else
+		scheduleNextPoll();
+	
+	return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pushBatteryState
+ *
+ * The updateStatus() half of publishBatteryState(), without its per-poll
+ * accounting. Returns whether anything was pushed.
+ ******************************************************************************/
+
+bool AppleSmartBattery::pushBatteryState(void)
+{
+	if (!settingsChangedSinceUpdate)
+		return false;
+	
+	rebuildLegacyIOBatteryInfo(true);
+	updateStatus();
+	updateBatterySnapshot();
+	settingsChangedSinceUpdate = false;
+	
+	return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishBatteryState
+ *
+ * Pushes one poll's worth of changes out with a single updateStatus().
+ * setPSProperty() only marks the power source dirty when a value actually
+ * differs from what is in the properties dictionary, so an unchanged poll
+ * skips the legacy dictionary rebuild, updateStatus() and the
+ * kIOPMMessageBatteryStatusHasChanged fan-out entirely.
+ ******************************************************************************/
+
+void AppleSmartBattery::publishBatteryState(void)
+{
+	if (pushBatteryState()) 
+	{
+		fPublishedUpdates++;
+	}
+	else 
+	{
+		fSuppressedUpdates++;
+	}
+	
+	fPublishedUpdatesNum->setValue(fPublishedUpdates);
+	fSuppressedUpdatesNum->setValue(fSuppressedUpdates);
+	
+	publishMemoryFootprint();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::updateBatterySnapshot
+ *
+ * Called from publishBatteryState() on the work loop, the snapshot's only
+ * writer. Values are taken from the power source dictionary so readers see
+ * exactly what was just published. Every update also appends a sample to the
+ * shared page's ring.
+ ******************************************************************************/
+
+void AppleSmartBattery::updateBatterySnapshot(void)
+{
+	BatterySnapshot snapshot;
+	BatterySample	sample;
+	
+	if (!fSharedPage)
+		return;
+	
+	bzero(&snapshot, sizeof(snapshot));
+	
+	snapshot.timestamp			= getUptimeMS();
+	snapshot.generation			= ++fSnapshotGeneration;
+	
+	if (batteryInstalled())			snapshot.flags |= kBatterySnapshotPresent;
+	if (isCharging())				snapshot.flags |= kBatterySnapshotCharging;
+	if (externalConnected())		snapshot.flags |= kBatterySnapshotExternalConnected;
+	if (externalChargeCapable())	snapshot.flags |= kBatterySnapshotExternalChargeCapable;
+	if (fullyCharged())				snapshot.flags |= kBatterySnapshotFullyCharged;
+	if (fStatus & BATTERY_CRITICAL)	snapshot.flags |= kBatterySnapshotCritical;
+	if (fInterpolating)				snapshot.flags |= kBatterySnapshotInterpolated;
+	if (fEstimatesStaleUntil)		snapshot.flags |= kBatterySnapshotStale;
+	
+	snapshot.currentCapacity	= currentCapacity();
+	snapshot.maxCapacity		= maxCapacity();
+	snapshot.designCapacity		= designCapacity();
+	snapshot.amperage			= amperage();
+	snapshot.voltage			= voltage();
+	snapshot.timeRemaining		= timeRemaining();
+	snapshot.averageTimeToEmpty	= averageTimeToEmpty();
+	snapshot.averageTimeToFull	= averageTimeToFull();
+	snapshot.temperature		= temperature();
+	snapshot.cycleCount			= cycleCount();
+	
+	BatterySnapshotWrite(&fSharedPage->snapshot, &snapshot);
+	
+	sample.timestamp		= snapshot.timestamp;
+	sample.flags			= snapshot.flags;
+	sample.currentCapacity	= snapshot.currentCapacity;
+	sample.amperage			= snapshot.amperage;
+	sample.voltage			= snapshot.voltage;
+	sample.temperature		= snapshot.temperature;
+	sample.reserved			= 0;
+	
+	BatterySharedPageAppend(fSharedPage, &sample);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copyBatterySnapshot
+ *
+ * Lock-free; may be called from any thread without the command gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::copyBatterySnapshot(BatterySnapshot *snapshot)
+{
+	if (!fSharedPage) {
+		bzero(snapshot, sizeof(BatterySnapshot));
+		return;
+	}
+	
+	BatterySnapshotRead(&fSharedPage->snapshot, snapshot);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::recordHistorySample
+ *
+ * Called once per _BST read, on the work loop, after the values have been
+ * converted to mA/mAh. Appends to the newest history block, starting a new
+ * block with a whole key sample once the delta no longer fits.
+ ******************************************************************************/
+
+void AppleSmartBattery::recordHistorySample(UInt32 status)
+{
+	BatteryHistoryBlock		*block = &fHistory[fHistoryCurrent];
+	BatteryHistorySample	sample;
+	UInt8					encoded[kHistoryMaxEncodedSample];
+	UInt32					length = 0;
+	
+	sample.timestamp	= getUptimeMS();
+	sample.status		= status;
+	sample.rate			= fCurrentRate;
+	sample.capacity		= fCurrentCapacity;
+	sample.voltage		= fCurrentVoltage;
+	sample.temperature	= fExtraInfo.temperature;
+	
+	if (fUseBatteryExtraInformation)
+		sample.current	= (SInt32) fExtraInfo.current;
+	else if (status & BATTERY_DISCHARGING)
+		sample.current	= -(SInt32) fCurrentRate;
+	else if (status & BATTERY_CHARGING)
+		sample.current	= (SInt32) fCurrentRate;
+	else
+		sample.current	= 0;
+	
+	if (block->count)
+		length = EncodeHistorySample(&fHistoryLast, fHistoryInterval, &sample, encoded);
+	
+	if (!block->count || (length > sizeof(block->data) - block->used))
+	{
+		if (block->count) {
+			fHistoryCurrent = (fHistoryCurrent + 1) % kHistoryBlocks;
+			block = &fHistory[fHistoryCurrent];
+		}
+		
+		block->firstSequence	= fHistoryHead;
+		block->count			= 1;
+		block->used				= 0;
+		block->key				= sample;
+		
+		fHistoryInterval = 0;
+	}
+	else
+	{
+		bcopy(encoded, &block->data[block->used], length);
+		block->used += length;
+		block->count++;
+		
+		fHistoryInterval = (SInt64) (sample.timestamp - fHistoryLast.timestamp);
+	}
+	
+	fHistoryLast = sample;
+	fHistoryHead++;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copySampleHistory
+ *
+ * Entry point for AppleSmartBatteryUserClient; serialises against
+ * recordHistorySample() on the work loop.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::copySampleHistory(BatteryHistoryRequest *request)
+{
+	if (!fWorkLoop || !request)
+		return kIOReturnBadArgument;
+	
+	return fWorkLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action,
+									this, &AppleSmartBattery::copySampleHistoryGated),
+								this, (void *) request);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copySampleHistoryGated
+ *
+ * Decodes blocks oldest first, from the block holding the cursor, and writes
+ * the samples out in small batches.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::copySampleHistoryGated(BatteryHistoryRequest *request)
+{
+	BatteryHistorySample	batch[16];
+	UInt32					batched = 0;
+	UInt32					done	= 0;
+	UInt64					first	= fHistoryHead;
+	bool					found	= false;
+	
+	for (UInt32 i = 1; (i <= kHistoryBlocks) && (done + batched < request->maxCount); i++)
+	{
+		const BatteryHistoryBlock	*block = &fHistory[(fHistoryCurrent + i) % kHistoryBlocks];
+		BatteryHistoryCursor		cursor;
+		
+		if (!block->count || (block->firstSequence + block->count <= request->cursor))
+			continue;
+		
+		InitHistoryCursor(&cursor, block);
+		
+		do {
+			UInt64 sequence = block->firstSequence + cursor.index;
+			
+			if (sequence < request->cursor)
+				continue;
+			
+			if (!found) {
+				first = sequence;
+				found = true;
+			}
+			
+			batch[batched++] = cursor.sample;
+			
+			if (batched == (sizeof(batch) / sizeof(batch[0]))) {
+				copyHistoryBatch(request, done, batch, batched);
+				done	+= batched;
+				batched	= 0;
+			}
+		} while ((done + batched < request->maxCount) && NextHistorySample(&cursor));
+	}
+	
+	if (batched) {
+		copyHistoryBatch(request, done, batch, batched);
+		done += batched;
+	}
+	
+	request->first = first;
+	request->count = done;
+	
+	return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copyHistoryBatch
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::copyHistoryBatch(BatteryHistoryRequest *request, UInt32 offset,
+										 const BatteryHistorySample *samples, UInt32 count)
+{
+	if (request->descriptor)
+		request->descriptor->writeBytes(offset * sizeof(BatteryHistorySample),
+										samples, count * sizeof(BatteryHistorySample));
+	else
+		bcopy(samples, (BatteryHistorySample *) request->buffer + offset,
+			  count * sizeof(BatteryHistorySample));
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copySharedMemory
+ *
+ ******************************************************************************/
+
+IOMemoryDescriptor *AppleSmartBattery::copySharedMemory(void)
+{
+	if (fSharedMemory)
+		fSharedMemory->retain();
+	
+	return fSharedMemory;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::setPropertyIfChanged
+ *
+ * Registry (non power source) property that is only rewritten on change.
+ ******************************************************************************/
+
+void AppleSmartBattery::setPropertyIfChanged(const OSSymbol *key, OSObject *val)
+{
+	OSObject *lastVal = getProperty(key);
+	
+	if (lastVal && val && lastVal->isEqualTo(val))
+		return;
+	
+	setProperty(key, val);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::trackObjects
+ *
+ * Object accounting. Every OSObject the driver creates is counted against
+ * its call site when created, and again when the last reference the driver
+ * controls goes: when it is released, or replaced in or removed from the
+ * container it was handed to. A site whose live count keeps climbing is
+ * leaking.
+ ******************************************************************************/
+
+void AppleSmartBattery::trackObjects(UInt32 site, SInt32 count)
+{
+	if (site >= kObjectSiteCount)
+		return;
+	
+	fLiveObjects[site] += count;
+	
+	if (count > 0)
+		fCreatedObjects[site] += count;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::releaseStaticSymbol
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::releaseStaticSymbol(OSSymbol *sym)
+{
+	if (sym) {
+		sym->release();
+		trackObjects(kObjectSiteStaticSymbol, -1);
+	}
+}
+
+/******************************************************************************
+ * AppleSmartBattery::setTrackedPSProperty
+ *
+ * setPSProperty() for an object the driver just created for site. The power
+ * source dictionary then holds the only reference, so the object stays live
+ * until it is replaced under key or removed. Keys written through here are
+ * only ever written through here, so what is replaced was counted too.
+ ******************************************************************************/
+
+void AppleSmartBattery::setTrackedPSProperty(UInt32 site, const OSSymbol *key, OSObject *val)
+{
+	if (properties->getObject(key))
+		trackObjects(site, -1);
+	
+	setPSProperty(key, val);
+	trackObjects(site, 1);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::removeTrackedPSProperty
+ *
+ * Removes a key written by setTrackedPSProperty() from the power source
+ * dictionary. The registry copy is the caller's to remove.
+ ******************************************************************************/
+
+void AppleSmartBattery::removeTrackedPSProperty(UInt32 site, const OSSymbol *key)
+{
+	if (!properties->getObject(key))
+		return;
+	
+	properties->removeObject(key);
+	trackObjects(site, -1);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::createMemoryFootprint
+ *
+ * Builds "DriverMemoryFootprint" once: per call site, the objects the driver
+ * currently holds and how many it has created. publishMemoryFootprint()
+ * only updates the numbers in place.
+ ******************************************************************************/
+
+bool AppleSmartBattery::createMemoryFootprint(void)
+{
+	fMemoryFootprint		= OSDictionary::withCapacity(kObjectSiteCount + 1);
+	fTotalLiveObjectsNum	= OSNumber::withNumber(0ULL, NUM_BITS);
+	
+	if (!fMemoryFootprint || !fTotalLiveObjectsNum)
+		return false;
+	
+	for (UInt32 site = 0; site < kObjectSiteCount; site++)
+	{
+		OSDictionary *siteDict = OSDictionary::withCapacity(2);
+		
+		fLiveObjectsNum[site]		= OSNumber::withNumber(0ULL, NUM_BITS);
+		fCreatedObjectsNum[site]	= OSNumber::withNumber(0ULL, NUM_BITS);
+		
+		if (!siteDict || !fLiveObjectsNum[site] || !fCreatedObjectsNum[site]) {
+			if (siteDict) siteDict->release();
+			return false;
+		}
+		
+		siteDict->setObject("Live", fLiveObjectsNum[site]);
+		siteDict->setObject("Created", fCreatedObjectsNum[site]);
+		fMemoryFootprint->setObject(objectSiteNames[site], siteDict);
+		siteDict->release();
+	}
+	
+	fMemoryFootprint->setObject("LiveObjects", fTotalLiveObjectsNum);
+	
+	// The footprint, a dictionary and two numbers per site and the total
+	trackObjects(kObjectSiteCounters, (3 * kObjectSiteCount) + 2);
+	
+	publishMemoryFootprint();
+	setProperty("DriverMemoryFootprint", fMemoryFootprint);
+	
+	return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishMemoryFootprint
+ *
+ * Refreshes the numbers in "DriverMemoryFootprint". Nothing is allocated,
+ * so every publishBatteryState() can afford it.
+ ******************************************************************************/
+
+void AppleSmartBattery::publishMemoryFootprint(void)
+{
+	SInt32 totalLive = 0;
+	
+	if (!fMemoryFootprint)
+		return;
+	
+	for (UInt32 site = 0; site < kObjectSiteCount; site++)
+	{
+		fLiveObjectsNum[site]->setValue((unsigned long long) fLiveObjects[site]);
+		fCreatedObjectsNum[site]->setValue((unsigned long long) fCreatedObjects[site]);
+		totalLive += fLiveObjects[site];
+	}
+	
+	fTotalLiveObjectsNum->setValue((unsigned long long) totalLive);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::scheduleNextPoll
+ *
+ * Picks the next polling interval from the charge state, the observed rate
+ * of change, the distance to the _BIX/_BIF warning and low capacities and
+ * how well the last trend predicted the latest sample, then restarts the
+ * poll timer.
+ ******************************************************************************/
+
+void AppleSmartBattery::scheduleNextPoll(void)
+{
+	uint32_t		interval;
+	const OSSymbol	*reason;
+	
+	if (fPollingOverridden) 
+	{
+		/* restart timer with debug value */
+		interval = 1000 * fPollingInterval;
+		reason = _PollReasonOverrideSym;
+	}
+	else if (fPollFailures) 
+	{
+		UInt32 shift = fPollFailures - 1;
+		
+		interval = kBackoffMaxMS;
+		if ((shift < 32) && (((UInt64) kBackoffBaseMS << shift) < kBackoffMaxMS))
+			interval = kBackoffBaseMS << shift;
+		
+		interval = (interval / 2) + nextJitter(interval / 2 + 1);
+		reason = _PollReasonBackoffSym;
+	}
+	else if (!fBatteryPresent || !fMaxCapacity) 
+	{
+		interval = milliSecPollingTable[kDefaultPollInterval];
+		reason = _PollReasonDefaultSym;
+	}
+	else if (fEstimatesStaleUntil) 
+	{
+		// Full read deferred from wake, once the EC's averages have settled
+		uint64_t now = getUptimeMS();
+		
+		interval = (fEstimatesStaleUntil > now) ? (uint32_t)(fEstimatesStaleUntil - now) : 0;
+		if (interval < milliSecPollingTable[kQuickPollInterval])
+			interval = milliSecPollingTable[kQuickPollInterval];
+		reason = _PollReasonAfterWakeSym;
+	}
+	else if (fTripPointArmed) 
+	{
+		// The EC notifies us at the next boundary; poll only to refresh
+		// the rate and catch anything the trip point can't see
+		interval = milliSecPollingTable[kStablePollInterval];
+		reason = _PollReasonTripPointSym;
+	}
+	else if (fPollingInterval == kQuickPollInterval) 
+	{
+		interval = milliSecPollingTable[kQuickPollInterval];
+		reason = _PollReasonQuickPollSym;
+	}
+	else if (nearCapacityThreshold()) 
+	{
+		interval = milliSecPollingTable[kNearThresholdPollInterval];
+		reason = _PollReasonNearThresholdSym;
+	}
+	else if (fEstimateError > (fMaxCapacity / 50)) 
+	{
+		// Last trend missed by more than 2% of capacity; look again soon
+		interval = milliSecPollingTable[kNearThresholdPollInterval];
+		reason = _PollReasonEstimateErrorSym;
+	}
+	else if (!(fStatus & (BATTERY_DISCHARGING | BATTERY_CHARGING))) 
+	{
+		if (fACConnected) {
+			interval = milliSecPollingTable[kStablePollInterval];
+			reason = _PollReasonStableOnACSym;
+		} else {
+			interval = milliSecPollingTable[kDefaultPollInterval];
+			reason = _PollReasonDefaultSym;
+		}
+	}
+	else 
+	{
+		// Aim for about one poll per kInterpolatePercentPerPoll of capacity
+		// moved; interpolateTimeOut() keeps the published capacity moving in
+		// between. The _BST rate and the observed slope are both in mA(h)/h.
+		
+		uint32_t rate = (fCapacitySlope < 0) ? -fCapacitySlope : fCapacitySlope;
+		
+		if ((fCurrentRate != ACPI_UNKNOWN) && (fCurrentRate > rate))
+			rate = fCurrentRate;
+		
+		if (rate)
+			interval = (uint32_t)(((uint64_t)fMaxCapacity * 36000 * kInterpolatePercentPerPoll) / rate);
+		else
+			interval = milliSecPollingTable[kStablePollInterval];
+		
+		if (interval < milliSecPollingTable[kNearThresholdPollInterval])
+			interval = milliSecPollingTable[kNearThresholdPollInterval];
+		
+		if (interval > milliSecPollingTable[kStablePollInterval])
+			interval = milliSecPollingTable[kStablePollInterval];
+		
+		reason = _PollReasonRateOfChangeSym;
+	}
+	
+	// Backoff keeps its own timing; an override is meant to be exact
+	if ((reason != _PollReasonOverrideSym) && (reason != _PollReasonBackoffSym))
+		interval = alignSharedPoll(interval);
+	
+	if (interval != fNextPollInterval) {
+		fNextPollInterval = interval;
+		fNextPollIntervalNum->setValue(interval);
+	}
+	
+	if (reason != fPollReason) {
+		fPollReason = reason;
+		setProperty(_PollingReasonSym, (OSObject *) reason);
+	}
+	
+	DEBUG_LOG("AppleSmartBattery::scheduleNextPoll: %u ms (%s)\n", (unsigned int) interval, reason->getCStringNoCopy());
+	
+	fPollTimer->setTimeoutMS( interval );
+}
+
+/******************************************************************************
+ * AppleSmartBattery::nearCapacityThreshold
+ *
+ * True when discharging within 2% of the design warning capacity (or below).
+ ******************************************************************************/
+
+bool AppleSmartBattery::nearCapacityThreshold(void)
+{
+	UInt32 threshold = fCapacityWarning ? fCapacityWarning : fCapacityLow;
+	
+	if (!threshold || !(fStatus & BATTERY_DISCHARGING))
+		return false;
+	
+	return fCurrentCapacity <= (threshold + (fMaxCapacity / 50));
+}
+
+/******************************************************************************
+ * AppleSmartBattery::updateCapacityTrend
+ *
+ * Tracks dCapacity/dt (mAh per hour) between successive _BST samples and how
+ * far the previous trend was from predicting the new capacity.
+ ******************************************************************************/
+
+void AppleSmartBattery::updateCapacityTrend(UInt32 status)
+{
+	uint64_t now = getUptimeMS();
+	
+	if (fTrendTimestamp && (status == fTrendStatus) && (now > fTrendTimestamp)) 
+	{
+		SInt64 elapsed		= (SInt64)(now - fTrendTimestamp);
+		SInt64 delta		= (SInt64)fCurrentCapacity - (SInt64)fTrendCapacity;
+		SInt64 predicted	= (SInt64)fTrendCapacity + ((SInt64)fCapacitySlope * elapsed) / 3600000;
+		SInt64 error		= (SInt64)fCurrentCapacity - predicted;
+		
+		fEstimateError	= (UInt32)((error < 0) ? -error : error);
+		fCapacitySlope	= (SInt32)((delta * 3600000) / elapsed);
+	}
+	else 
+	{
+		fEstimateError	= 0;
+		fCapacitySlope	= 0;
+	}
+	
+	fTrendStatus	= status;
+	fTrendCapacity	= fCurrentCapacity;
+	fTrendTimestamp	= now;
+	
+	DEBUG_LOG("AppleSmartBattery::updateCapacityTrend: slope = %d mAh/h, error = %u mAh\n",
+			  (int) fCapacitySlope, (unsigned int) fEstimateError);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::resetRateEstimator
+ *
+ * Forget the rate history; the next _BST sample seeds a new estimate.
+ ******************************************************************************/
+
+void AppleSmartBattery::resetRateEstimator(void)
+{
+	fRateEstimate	= 0;
+	fRateVariance	= 0;
+	fRateCapacity	= 0;
+	fRateTimestamp	= 0;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::rateTimeConstant
+ *
+ * Averaging time constant in ms, kept within the battery's own averaging
+ * interval range when _BIX reports one.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::rateTimeConstant(void)
+{
+	UInt32 tau = kRateTimeConstantMS;
+	
+	if (fMinAverageInterval && (tau < fMinAverageInterval))
+		tau = fMinAverageInterval;
+	
+	if (fMaxAverageInterval && (fMaxAverageInterval >= fMinAverageInterval) && (tau > fMaxAverageInterval))
+		tau = fMaxAverageInterval;
+	
+	return tau;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::fuseRateMeasurement
+ *
+ * Scalar Kalman update of fRateEstimate (24.8) with a measurement (24.8)
+ * of the given variance (mA^2).
+ ******************************************************************************/
+
+void AppleSmartBattery::fuseRateMeasurement(SInt64 measurement, UInt64 variance)
+{
+	SInt64 gain;	// 0.16
+	
+	if (!(fRateVariance + variance))
+		return;
+	
+	gain = (SInt64)((fRateVariance << 16) / (fRateVariance + variance));
+	
+	fRateEstimate	+= ((measurement - fRateEstimate) * gain) / 65536;
+	fRateVariance	-= (fRateVariance * gain) / 65536;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::estimateRate
+ *
+ * Folds the latest _BST rate into the running estimate and returns the
+ * average rate in mA. All arithmetic is integer; the estimate is kept in
+ * 24.8 fixed point so slow drains don't round away.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::estimateRate(void)
+{
+	uint64_t	now			= getUptimeMS();
+	SInt64		sample		= (SInt64)fCurrentRate << 8;
+	SInt64		tau			= rateTimeConstant();
+	SInt64		elapsed;
+	
+	if (!fRateTimestamp || (now <= fRateTimestamp))
+	{
+		// First sample since a reset
+		
+		fRateEstimate	= sample;
+		fRateVariance	= kRateMeasurementNoise;
+		fRateCapacity	= fCurrentCapacity;
+		fRateTimestamp	= now;
+		
+		return fCurrentRate;
+	}
+	
+	elapsed = (SInt64)(now - fRateTimestamp);
+	
+	switch (fRateEstimator)
+	{
+		case kRateEstimatorPairwise:
+			fRateEstimate = (fRateEstimate + sample) / 2;
+			break;
+			
+		case kRateEstimatorKalman:
+		{
+			SInt64 delta = (SInt64)fCurrentCapacity - (SInt64)fRateCapacity;
+			
+			// Let the rate wander by about one reading's noise per time constant
+			
+			fRateVariance += (UInt64)((kRateMeasurementNoise * elapsed * elapsed) / (tau * tau));
+			
+			fuseRateMeasurement(sample, kRateMeasurementNoise);
+			
+			// Capacity only moves in whole units, so dC/dt is worth little over
+			// short intervals and a lot over long ones
+			
+			if (delta)
+			{
+				SInt64 quantum = 3600000 / elapsed + 1;		// mA per unit of capacity
+				
+				if (delta < 0)
+					delta = -delta;
+				
+				fuseRateMeasurement(((delta * 3600000) << 8) / elapsed, (UInt64)(quantum * quantum));
+			}
+			break;
+		}
+			
+		case kRateEstimatorEWMA:
+		default:
+		{
+			SInt64 alpha = (elapsed << 16) / (tau + elapsed);	// 0.16
+			
+			fRateEstimate += ((sample - fRateEstimate) * alpha) / 65536;
+			break;
+		}
+	}
+	
+	fRateCapacity	= fCurrentCapacity;
+	fRateTimestamp	= now;
+	
+	if (fRateEstimate < (1 << 8))
+		return 1;
+	
+	return (UInt32)((fRateEstimate + (1 << 7)) >> 8);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::anchorInterpolation
+ *
+ * A fresh _BST replaces any projected values; start projecting again from
+ * it if the battery is charging or discharging.
+ ******************************************************************************/
+
+void AppleSmartBattery::anchorInterpolation(void)
+{
+	fInterpolating		= false;
+	fInterpolateAnchor	= getUptimeMS();
+	
+	fInterpolateTimer->cancelTimeout();
+	
+	if (fPollingOverridden || !fMaxCapacity || !fAverageRate)
+		return;
+	
+	if (fStatus & (BATTERY_DISCHARGING | BATTERY_CHARGING))
+		fInterpolateTimer->setTimeoutMS(kInterpolateIntervalMS);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::interpolateTimeOut
+ *
+ * Coulomb counts from the last _BST: projects capacity and time remaining
+ * with the average rate over the time elapsed since. No ACPI methods are
+ * evaluated; only values that change are republished.
+ ******************************************************************************/
+
+void AppleSmartBattery::interpolateTimeOut(void)
+{
+	SInt64	elapsed;
+	SInt64	delta;
+	SInt64	capacity;
+	UInt32	remaining;
+	
+	if (fPollingNow || !fBatteryPresent || !fInterpolateAnchor || !fAverageRate)
+		return;
+	
+	elapsed	= (SInt64)(getUptimeMS() - fInterpolateAnchor);
+	delta	= ((SInt64)fAverageRate * elapsed) / 3600000;
+	
+	if (fStatus & BATTERY_DISCHARGING)
+	{
+		capacity = (SInt64)fCurrentCapacity - delta;
+		if (capacity < 0)
+			capacity = 0;
+		
+		remaining = (UInt32)((60 * capacity) / fAverageRate);
+		setAverageTimeToEmpty(remaining);
+	}
+	else if (fStatus & BATTERY_CHARGING)
+	{
+		capacity = (SInt64)fCurrentCapacity + delta;
+		if (capacity > fMaxCapacity)
+			capacity = fMaxCapacity;
+		
+		remaining = (UInt32)((60 * (fMaxCapacity - capacity)) / fAverageRate);
+		setAverageTimeToFull(remaining);
+	}
+	else
+	{
+		return;
+	}
+	
+	DEBUG_LOG("AppleSmartBattery::interpolateTimeOut: %u mAh after %u ms\n",
+			  (unsigned int) capacity, (unsigned int) elapsed);
+	
+	fInterpolating = true;
+	
+	setCurrentCapacity((unsigned int) capacity);
+	setTimeRemaining(remaining);
+	
+	// Not a poll; leave the published/suppressed counters alone
+	if (pushBatteryState())
+		updateAggregate();
+	
+	fInterpolateTimer->setTimeoutMS(kInterpolateIntervalMS);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::nextTripPoint
+ *
+ * The next capacity worth hearing about in the direction the battery is
+ * moving: the next whole percent, or the _BIX/_BIF warning or low level if
+ * that comes first. 0 when there is nothing to wait for.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::nextTripPoint(void)
+{
+	UInt32 percent = (UInt32)(((UInt64)fCurrentCapacity * 100) / fMaxCapacity);
+	UInt32 trip;
+	
+	if (fStatus & BATTERY_DISCHARGING)
+	{
+		trip = (UInt32)(((UInt64)percent * fMaxCapacity) / 100);
+		if (trip >= fCurrentCapacity)
+			trip = percent ? (UInt32)(((UInt64)(percent - 1) * fMaxCapacity) / 100) : 0;
+		
+		if ((fCapacityWarning < fCurrentCapacity) && (fCapacityWarning > trip))
+			trip = fCapacityWarning;
+		
+		if ((fCapacityLow < fCurrentCapacity) && (fCapacityLow > trip))
+			trip = fCapacityLow;
+		
+		return trip;
+	}
+	
+	if ((fStatus & BATTERY_CHARGING) && (percent < 100))
+	{
+		trip = (UInt32)(((UInt64)(percent + 1) * fMaxCapacity + 99) / 100);
+		
+		return (trip < fMaxCapacity) ? trip : 0;
+	}
+	
+	return 0;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::programTripPoint
+ *
+ * Called after each _BST. Plans moving the _BTP trip point to the next
+ * boundary so the EC's Notify(0x80) replaces polling near thresholds; the
+ * poll thread writes it as the trip stage of the next poll, and
+ * completeTripPoint() takes the result. Firmware without _BTP, or that
+ * takes the trip point but never notifies, drops us back to timer polling
+ * for good.
+ ******************************************************************************/
+
+void AppleSmartBattery::programTripPoint(void)
+{
+	UInt32 trip = 0;
+	
+	if (!fTripPointSupported)
+		return;
+	
+	// A timer poll that finds the trip point well behind us means the
+	// notification never came
+	
+	if (fTripPointArmed && fTimerPoll &&
+		(fTripPointFalling ? ((fCurrentCapacity + fMaxCapacity / 100) < fTripPoint)
+						   : (fCurrentCapacity > (fTripPoint + fMaxCapacity / 100))))
 	{
-		IOLog("AppleSmartBattery: Using ACPI extra battery information method BBIX\n");
+		IOLog("AppleSmartBattery: No notification at _BTP trip point, using timer polling\n");
+		
+		fTripPointSupported	= false;
+		fTripPointArmed		= false;
+		fTripPoint			= 0;
+		removeProperty(_TripPointSym);
+		
+		// Still cleared in the EC, once
+		fTripPointPending	= true;
+		fTripPointTarget	= 0;
+		return;
 	}
 	
-    fBatteryPresent		= false;
-    fACConnected		= false;
-    fACChargeCapable	= false;
-	fSystemSleeping     = false;
-    fPowerServiceToAck  = NULL;
-	fPollingNow         = false;
+	if (fMaxCapacity && !fPollingOverridden)
+		trip = nextTripPoint();
 	
-	// Make sure that we read battery state at least 5 times at 30 second intervals
-    // after system boot.
-    fInitialPollCountdown = kInitialPollCountdown;
+	// Already there, or on its way
+	if (trip == (fTripPointPending ? fTripPointTarget : fTripPoint))
+		return;
 	
-    fWorkLoop = getWorkLoop();
+	DEBUG_LOG("AppleSmartBattery::programTripPoint: %u -> %u\n", (unsigned int) fTripPoint, (unsigned int) trip);
 	
-    fPollTimer = IOTimerEventSource::timerEventSource( this, 
-													  OSMemberFunctionCast( IOTimerEventSource::Action, 
-																		   this, &AppleSmartBattery::pollingTimeOut) );
+	fTripPointPending	= (trip != fTripPoint);
+	fTripPointTarget	= trip;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::completeTripPoint
+ *
+ * The trip stage of a finished poll. A poll cut short before the stage
+ * leaves the trip point pending for the next one.
+ ******************************************************************************/
+
+void AppleSmartBattery::completeTripPoint(void)
+{
+	UInt32	trip = fTripPointTarget;
+	bool	written = (fPoll.evaluated & kPollMethodBTP) ? true : false;
 	
-    fBatteryReadAllTimer = IOTimerEventSource::timerEventSource( this,
-																OSMemberFunctionCast( IOTimerEventSource::Action,
-																					 this, &AppleSmartBattery::incompleteReadTimeOut) );
+	// Dropped with the battery while the poll was in flight
+	if (!fTripPointPending)
+		return;
 	
-    if( !fWorkLoop || !fPollTimer
-	   || (kIOReturnSuccess != fWorkLoop->addEventSource(fPollTimer)) )
-    {
-        return false;
-    }
+	// Never got to it
+	if (!written && (kPollStageDone != fPoll.stage) && !(fPollTimedOut && (kPollStageTrip == fPoll.stage)))
+		return;
 	
-    // Publish the intended period in seconds that our "time remaining"
-    // estimate is wildly inaccurate after wake from sleep.
-    setProperty( kIOPMPSInvalidWakeSecondsKey,		kSecondsUntilValidOnWake, NUM_BITS);
+	fTripPointPending = false;
 	
-    // Publish the necessary time period (in seconds) that a battery
-    // calibrating tool must wait to allow the battery to settle after
-    // charge and after discharge.
-    setProperty( kIOPMPSPostChargeWaitSecondsKey,	kPostChargeWaitSeconds, NUM_BITS);
-    setProperty( kIOPMPSPostDishargeWaitSecondsKey, kPostDischargeWaitSeconds, NUM_BITS);
+	// That was clearing it on the way out
+	if (!fTripPointSupported)
+		return;
 	
-    // zero out battery state with argument (do_set == true)
-    clearBatteryState(false);
+	if (!written)
+	{
+		IOLog("AppleSmartBattery: _BTP unavailable, using timer polling\n");
+		
+		fTripPointSupported	= false;
+		fTripPointArmed		= false;
+		fTripPoint			= 0;
+		removeProperty(_TripPointSym);
+		return;
+	}
 	
-    // Kick off the 30 second timer and do an initial poll
-    pollBatteryState( kNewBatteryPath );
+	fTripPoint			= trip;
+	fTripPointArmed		= (trip != 0);
+	fTripPointFalling	= (fStatus & BATTERY_DISCHARGING) ? true : false;
 	
-    return true;
+	if (fTripPointArmed)
+		setProperty(_TripPointSym->getCStringNoCopy(), (unsigned long long) trip, NUM_BITS);
+	else
+		removeProperty(_TripPointSym);
 }
 
 /******************************************************************************
- * AppleSmartBattery::stop
+ * AppleSmartBattery::invalidateStaticInfo
  *
+ * Forces _BIX/_BIF to be re-read on the next poll.
  ******************************************************************************/
 
-void AppleSmartBattery::stop(IOService *provider)
+void AppleSmartBattery::invalidateStaticInfo(void)
 {
-    super::stop(provider);
+	DEBUG_LOG("AppleSmartBattery::invalidateStaticInfo called\n");
+	
+	fStaticInfoValid = false;
 }
 
 /******************************************************************************
- * AppleSmartBattery::logReadError
+ * AppleSmartBattery::staticInfoNeedsRefresh
  *
  ******************************************************************************/
 
-void AppleSmartBattery::logReadError(
-										  const char *error_type, 
-										  uint16_t additional_error,
-										  void *t)
+bool AppleSmartBattery::staticInfoNeedsRefresh(void)
 {
-    if(!error_type) return;
+	if (!fStaticInfoValid)
+		return true;
 	
-    setProperty((const char *)"LatestErrorType", error_type);
+	return (getUptimeMS() - fStaticInfoTimestamp) >= (kStaticInfoRefreshSeconds * 1000ULL);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::staticInfoRefreshed
+ *
+ * Called once _BIX/_BIF has been decoded. A different model or serial number
+ * means a different pack, so running averages from the old one are dropped.
+ ******************************************************************************/
+
+void AppleSmartBattery::staticInfoRefreshed(OSSymbol *lastDeviceName, OSSymbol *lastSerialNumber)
+{
+	if ((lastDeviceName && fDeviceName && !lastDeviceName->isEqualTo(fDeviceName)) ||
+		(lastSerialNumber && fSerialNumber && !lastSerialNumber->isEqualTo(fSerialNumber)))
+	{
+		IOLog("AppleSmartBattery: Battery model or serial number changed\n");
+		fAverageRate = 0;
+		resetRateEstimator();
+	}
 	
-    IOLog("AppleSmartBattery: Error: %s (%d)\n", error_type, additional_error);  
+	/* construct and publish our battery serial number here */
+	constructAppleSerialNumber();
 	
-    return;
+	fStaticInfoValid		= true;
+	fStaticInfoTimestamp	= getUptimeMS();
 }
 
 /******************************************************************************
- * AppleSmartBattery::setPollingInterval
+ * AppleSmartBattery::handleBatteryStatusChanged
  *
+ * Notify(0x80) - charge state, rate or remaining capacity changed.
+ * Caller must hold the gate.
  ******************************************************************************/
 
-void AppleSmartBattery::setPollingInterval(
-												int milliSeconds)
+void AppleSmartBattery::handleBatteryStatusChanged(void)
 {
-    DEBUG_LOG("AppleSmartBattery::setPollingInterval: New interval = %d ms\n", milliSeconds);
-    
-    if (!fPollingOverridden) {
-        milliSecPollingTable[kDefaultPollInterval] = milliSeconds;
-        fPollingInterval = kDefaultPollInterval;
-    }
+    DEBUG_LOG("AppleSmartBattery::handleBatteryStatusChanged called\n");
+	
+	fNotifyReceivedNum->setValue(++fNotifyReceived);
+	
+	// Already waiting; this one rides along
+	if (fNotifyPending)
+		return;
+	
+	fNotifyPending = true;
+	fNotifyTimer->setTimeoutMS(kNotifyCoalesceMS);
 }
 
 /******************************************************************************
- * AppleSmartBattery::pollBatteryState
+ * AppleSmartBattery::notifyTimeOut
  *
- * Asynchronously kicks off the register poll.
+ * End of the coalescing window: run one _BST refresh for every notification
+ * received since it opened, if the token bucket allows.
  ******************************************************************************/
 
-bool AppleSmartBattery::pollBatteryState(int path)
+void AppleSmartBattery::notifyTimeOut(void)
 {
-    DEBUG_LOG("AppleSmartBattery::pollBatteryState: path = 0x%x\n", path);
-    
-    // This must be called under workloop synchronization
-    if (kNewBatteryPath == path) 
+	uint64_t	now = getUptimeMS();
+	uint64_t	earned;
+	
+	if (!fNotifyPending)
+		return;
+	
+	if (fPollingNow) {
+		fNotifyTimer->setTimeoutMS(kNotifyCoalesceMS);
+		return;
+	}
+	
+	// Refill
+	
+	earned = (now - fNotifyRefillTime) / kNotifyRefillMS;
+	if (earned) 
 	{
-		/* Cancel polling timer in case this round of reads was initiated
-		 by an alarm. We re-set the 30 second poll later. */
-		fPollTimer->cancelTimeout();
-		
-		/* Initialize battery read timeout to catch any longstanding stalls. */           
-		fBatteryReadAllTimer->cancelTimeout();
-		fBatteryReadAllTimer->setTimeoutMS( kBatteryReadAllTimeout );
-		
-		pollBatteryState( kExistingBatteryPath );
-	} 
-	else 
+		fNotifyTokens		 = ((fNotifyTokens + earned) > kNotifyBurst) ? (UInt32) kNotifyBurst : (UInt32)(fNotifyTokens + earned);
+		fNotifyRefillTime	+= earned * kNotifyRefillMS;
+	}
+	
+	if (fNotifyTokens == kNotifyBurst)
+		fNotifyRefillTime = now;
+	
+	if (!fNotifyTokens) 
 	{
-		fPollingNow = true;
-		
-        fProvider->getBatterySTA();
-		
-        if (fBatteryPresent) 
-		{
-			if(fUseBatteryExtendedInformation)
-				fProvider->getBatteryBIX();
-			else
-				fProvider->getBatteryBIF();
-			
-			if(fUseBatteryExtraInformation)
-				fProvider->getBatteryBBIX();
-			
-			fProvider->getBatteryBST();
-        }
-		else
-		{
-            setFullyCharged(false);
-            clearBatteryState(true);
-        }
-		
-		fPollingNow = false;
-		
-		if (!fPollingOverridden) 
-		{
-			/* Restart timer with standard polling interval */
-			fPollTimer->setTimeoutMS( milliSecPollingTable[fPollingInterval] );
-		}
-		else
-		{
-			/* restart timer with debug value */
-			fPollTimer->setTimeoutMS( 1000 * fPollingInterval );
-		}
+		// Try again when the next token is due
+		fNotifyRateLimitedNum->setValue(++fNotifyRateLimited);
+		fNotifyTimer->setTimeoutMS((UInt32)(fNotifyRefillTime + kNotifyRefillMS - now));
+		return;
 	}
 	
-    return true;
+	fNotifyTokens--;
+	fNotifyRefreshesNum->setValue(++fNotifyRefreshes);
+	
+	pollBatteryState( kBatteryStatusPath );
+}
+
+/******************************************************************************
+ * AppleSmartBattery::handleBatteryInfoChanged
+ *
+ * Notify(0x81) - static battery information has changed.
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::handleBatteryInfoChanged(void)
+{
+    DEBUG_LOG("AppleSmartBattery::handleBatteryInfoChanged called\n");
+	
+	invalidateStaticInfo();
+	pollBatteryState( kExistingBatteryPath );
 }
 
 void AppleSmartBattery::handleBatteryInserted(void)
@@ -420,13 +2820,14 @@ void AppleSmartBattery::handleBatteryRemoved(void)
 	// Removed battery means cancel any ongoing polling session */
 	if(fPollingNow)
 	{
-		fCancelPolling = true;
+		cancelPoll();
 		fPollTimer->cancelTimeout();
-		fBatteryReadAllTimer->cancelTimeout();
+		fStageDeadlineTimer->cancelTimeout();
 	}
 	
     // This must be called under workloop synchronization
     clearBatteryState(true);
+	updateAggregate();
 	acknowledgeSystemSleepWake();
 	
     return;
@@ -453,31 +2854,48 @@ IOReturn AppleSmartBattery::handleSystemSleepWake(
         fPowerServiceToAck->release();
         fPowerServiceToAck = 0;
     }
+    fSleepAckStart = 0;
 	
     fSystemSleeping = isSystemSleep;
 	
     if (fSystemSleeping) // System Sleep
     {
-        // Stall PM until battery poll in progress is cancelled.
+        // Stall PM until battery poll in progress is cancelled. It stops
+        // after the ACPI method it is evaluating; completePoll() acks.
         if (fPollingNow)
         {
             fPowerServiceToAck = powerService;
             fPowerServiceToAck->retain();
+            fSleepAckStart = getUptimeMS();
+            cancelPoll();
             fPollTimer->cancelTimeout();    
-            fBatteryReadAllTimer->cancelTimeout();
-            ret = (kBatteryReadAllTimeout * 1000);
+            fStageDeadlineTimer->cancelTimeout();
+            ret = pollTimeRemaining(true) * 1000;
         }
+		
+        // Re-anchored by the first poll after wake
+        fInterpolateTimer->cancelTimeout();
+		
+        // The poll after wake reads _BST anyway
+        fNotifyPending = false;
+        fNotifyTimer->cancelTimeout();
     }
     else // System Wake
     {
         fPowerServiceToAck = powerService;
         fPowerServiceToAck->retain();
-        pollBatteryState(kExistingBatteryPath);
+		
+        // Time stood still across sleep while the charge did not
+        resetRateEstimator();
+        fTrendTimestamp = 0;
+		
+        pollBatteryState(kWakePath);
 		
         if (fPollingNow)
         {
             // Transaction started, wait for completion.
-            ret = (kBatteryReadAllTimeout * 1000);
+            fSleepAckStart = getUptimeMS();
+            ret = pollTimeRemaining(false) * 1000;
         }
         else if (fPowerServiceToAck)
         {
@@ -501,6 +2919,13 @@ void AppleSmartBattery::acknowledgeSystemSleepWake( void )
 {
 	DEBUG_LOG("AppleSmartBattery::acknowledgeSystemSleepWake called\n");
 	
+    if (fPowerServiceToAck && fSleepAckStart)
+    {
+        // How long sleep waited on an in-flight poll, or wake on its read
+        fSleepAckLatencyNum->setValue(getUptimeMS() - fSleepAckStart);
+        fSleepAckStart = 0;
+    }
+	
     if (fPowerServiceToAck)
     {
         fPowerServiceToAck->acknowledgeSetPowerState();
@@ -528,32 +2953,15 @@ void AppleSmartBattery::pollingTimeOut(void)
     if (fInitialPollCountdown > 0) 
     {
         // At boot time we make sure to re-read everything kInitialPoltoCountdown times
+        fInitialPollCountdown--;
+        fTimerPoll = true;
         pollBatteryState( kNewBatteryPath ); 
     } else {
+        fTimerPoll = true;
 		pollBatteryState( kExistingBatteryPath );
 	}
 }
 
-/******************************************************************************
- * incompleteReadTimeOut
- * 
- * The complete battery read has not completed in the allowed timeframe.
- * We assume this is for several reasons:
- *    - The EC has dropped an SMBus packet (probably recoverable)
- *    - The EC has stalled an SMBus request; IOSMBusController is hung (probably not recoverable)
- *
- * Start the battery read over from scratch.
- *****************************************************************************/
-
-void AppleSmartBattery::incompleteReadTimeOut(void)
-{
-    DEBUG_LOG("AppleSmartBattery::incompleteReadTimeOut called\n");
-    
-    logReadError(kErrorOverallTimeoutExpired, 0, NULL);
-	
-	pollBatteryState( kExistingBatteryPath );
-}
-
 /******************************************************************************
  * AppleSmartBattery::clearBatteryState
  *
@@ -569,6 +2977,19 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
     fBatteryPresent = false;
     fACConnected = false;
     fACChargeCapable = false;
+	fStaticInfoValid = false;
+	fTrendTimestamp = 0;
+	resetRateEstimator();
+	
+	fInterpolating = false;
+	fInterpolateAnchor = 0;
+	if (fInterpolateTimer) fInterpolateTimer->cancelTimeout();
+	fEstimatesStaleUntil = 0;
+	
+	// A battery that is gone can't trip; the next one is programmed afresh
+	fTripPointArmed = false;
+	fTripPoint = 0;
+	fTripPointPending = false;
 	
     setBatteryInstalled(false);
     setIsCharging(false);
@@ -592,58 +3013,63 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
     removeProperty(errorConditionKey);
 	
 	// setBatteryBIF/setBatteryBIX
-	properties->removeObject(_DesignCapacitySym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _DesignCapacitySym);
     removeProperty(_DesignCapacitySym);
 	properties->removeObject(_DeviceNameSym);
     removeProperty(_DeviceNameSym);
 	properties->removeObject(_TypeSym);
     removeProperty(_TypeSym);
-	properties->removeObject(_MaxErrSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _MaxErrSym);
     removeProperty(_MaxErrSym);
-	properties->removeObject(_ManufactureDateSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _ManufactureDateSym);
     removeProperty(_ManufactureDateSym);
-	properties->removeObject(_SerialNumberSym);
+	removeTrackedPSProperty(kObjectSiteSerial, _SerialNumberSym);
     removeProperty(_SerialNumberSym);
-	properties->removeObject(_ManufacturerDataSym);
+	removeTrackedPSProperty(kObjectSiteManufacturerData, _ManufacturerDataSym);
     removeProperty(_ManufacturerDataSym);
-	properties->removeObject(_PFStatusSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _PFStatusSym);
 	removeProperty(_PFStatusSym);
-	properties->removeObject(_AbsoluteStateOfChargeSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _AbsoluteStateOfChargeSym);
 	removeProperty(_AbsoluteStateOfChargeSym);
-	properties->removeObject(_DateOfManufacture);
+	removeTrackedPSProperty(kObjectSiteDateSymbol, _DateOfManufacture);
 	removeProperty(_DateOfManufacture);
-	properties->removeObject(_RelativeStateOfChargeSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _RelativeStateOfChargeSym);
 	removeProperty(_RelativeStateOfChargeSym);
-	properties->removeObject(_RemainingCapacitySym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _RemainingCapacitySym);
 	removeProperty(_RemainingCapacitySym);
-	properties->removeObject(_RunTimeToEmptySym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _RunTimeToEmptySym);
 	removeProperty(_RunTimeToEmptySym);
 
 	// setBatteryBST
-	properties->removeObject(_AvgTimeToEmptySym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _AvgTimeToEmptySym);
     removeProperty(_AvgTimeToEmptySym);
-	properties->removeObject(_AvgTimeToFullSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _AvgTimeToFullSym);
     removeProperty(_AvgTimeToFullSym);
-	properties->removeObject(_InstantTimeToEmptySym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _InstantTimeToEmptySym);
     removeProperty(_InstantTimeToEmptySym);
-	properties->removeObject(_InstantTimeToFullSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _InstantTimeToFullSym);
     removeProperty(_InstantTimeToFullSym);
-	properties->removeObject(_InstantAmperageSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _InstantAmperageSym);
     removeProperty(_InstantAmperageSym);
 	properties->removeObject(_QuickPollSym);
     removeProperty(_QuickPollSym);
+    removeProperty(_TripPointSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _StaleUntilSym);
 	properties->removeObject(_CellVoltageSym);
     removeProperty(_CellVoltageSym);
-	properties->removeObject(_TemperatureSym);
+	removeTrackedPSProperty(kObjectSitePSNumber, _TemperatureSym);
     removeProperty(_TemperatureSym);
-	properties->removeObject(_HardwareSerialSym);
+	removeTrackedPSProperty(kObjectSiteSerial, _HardwareSerialSym);
     removeProperty(_HardwareSerialSym);
 	
     rebuildLegacyIOBatteryInfo(do_update);
 	
     if(do_update) {
         updateStatus();
+        updateBatterySnapshot();
     }
+	
+	publishMemoryFootprint();
 }
 
 /******************************************************************************
@@ -653,7 +3079,7 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
 
 void AppleSmartBattery::rebuildLegacyIOBatteryInfo(bool do_update)
 {
-    OSDictionary        *legacyDict = OSDictionary::withCapacity(5);
+    OSDictionary        *legacyDict;
     uint32_t            flags = 0;
     OSNumber            *flags_num = NULL;
 	
@@ -665,30 +3091,66 @@ void AppleSmartBattery::rebuildLegacyIOBatteryInfo(bool do_update)
 	
     if(do_update)
     {
-        flags_num = OSNumber::withNumber((unsigned long long)flags, NUM_BITS);
-        legacyDict->setObject(kIOBatteryFlagsKey, flags_num);
-        flags_num->release();
+        // Alternate between two dictionaries. The one not currently published
+        // is refilled in place once nothing else holds a reference to it.
+        fLegacyIndex ^= 1;
+        legacyDict = fLegacyBatteryInfo[fLegacyIndex];
+        
+        if (!legacyDict || (legacyDict->getRetainCount() > 1))
+        {
+            if (legacyDict) {
+                // The flags number goes with it, as far as we are concerned
+                if (legacyDict->getObject(kIOBatteryFlagsKey))
+                    trackObjects(kObjectSiteLegacyInfo, -1);
+                legacyDict->release();
+                trackObjects(kObjectSiteLegacyInfo, -1);
+            }
+            legacyDict = fLegacyBatteryInfo[fLegacyIndex] = OSDictionary::withCapacity(6);
+            if (!legacyDict) return;
+            trackObjects(kObjectSiteLegacyInfo, 1);
+        }
+        
+        flags_num = OSDynamicCast(OSNumber, legacyDict->getObject(kIOBatteryFlagsKey));
+        if (!flags_num || (flags_num->unsigned32BitValue() != flags))
+        {
+            bool replacing = (legacyDict->getObject(kIOBatteryFlagsKey) != NULL);
+            
+            flags_num = OSNumber::withNumber((unsigned long long)flags, NUM_BITS);
+            if (flags_num) {
+                legacyDict->setObject(kIOBatteryFlagsKey, flags_num);
+                flags_num->release();
+                trackObjects(kObjectSiteLegacyInfo, 1);
+                if (replacing)
+                    trackObjects(kObjectSiteLegacyInfo, -1);
+            }
+        }
 	
-        legacyDict->setObject(kIOBatteryCurrentChargeKey, properties->getObject(kIOPMPSCurrentCapacityKey));
-        legacyDict->setObject(kIOBatteryCapacityKey, properties->getObject(kIOPMPSMaxCapacityKey));
-        legacyDict->setObject(kIOBatteryVoltageKey, properties->getObject(kIOPMPSVoltageKey));
-        legacyDict->setObject(kIOBatteryAmperageKey, properties->getObject(kIOPMPSAmperageKey));
-        legacyDict->setObject(kIOBatteryCycleCountKey, properties->getObject(kIOPMPSCycleCountKey));
+        setLegacyObject(legacyDict, kIOBatteryCurrentChargeKey, properties->getObject(currentCapacityKey));
+        setLegacyObject(legacyDict, kIOBatteryCapacityKey, properties->getObject(maxCapacityKey));
+        setLegacyObject(legacyDict, kIOBatteryVoltageKey, properties->getObject(voltageKey));
+        setLegacyObject(legacyDict, kIOBatteryAmperageKey, properties->getObject(amperageKey));
+        setLegacyObject(legacyDict, kIOBatteryCycleCountKey, properties->getObject(cycleCountKey));
 	
         setLegacyIOBatteryInfo(legacyDict);
-	
-        legacyDict->release();
     }
     else
     {
-        properties->removeObject(kIOPMPSCurrentCapacityKey);
-        properties->removeObject(kIOPMPSMaxCapacityKey);
-        properties->removeObject(kIOPMPSVoltageKey);
-        properties->removeObject(kIOPMPSAmperageKey);
-        properties->removeObject(kIOPMPSCycleCountKey);
+        removeTrackedPSProperty(kObjectSitePSNumber, currentCapacityKey);
+        removeTrackedPSProperty(kObjectSitePSNumber, maxCapacityKey);
+        removeTrackedPSProperty(kObjectSitePSNumber, voltageKey);
+        removeTrackedPSProperty(kObjectSitePSNumber, amperageKey);
+        removeTrackedPSProperty(kObjectSitePSNumber, cycleCountKey);
     }
 }
 
+void AppleSmartBattery::setLegacyObject(OSDictionary *legacyDict, const char *key, OSObject *val)
+{
+    if (val)
+        legacyDict->setObject(key, val);
+    else
+        legacyDict->removeObject(key);
+}
+
 /******************************************************************************
  *  Fabricate a serial number from our battery controller model and serial
  *  number.
@@ -725,66 +3187,173 @@ void AppleSmartBattery::constructAppleSerialNumber(void)
 	
     printableSerial = OSSymbol::withCString(serialBuf);
     if (printableSerial) {
-		setPSProperty(_HardwareSerialSym, (OSObject *) printableSerial);
+		setTrackedPSProperty(kObjectSiteSerial, _HardwareSerialSym, (OSObject *) printableSerial);
         printableSerial->release();
     }
 	
     return;
 }
 
-/******************************************************************************
- * Given a packed date from SBS, decode into a human readable date and return
- * an OSSymbol
- ******************************************************************************/
-
-#define kMaxDateSize	12
+/******************************************************************************
+ * Given a packed date from SBS, decode into a human readable date and return
+ * an OSSymbol
+ ******************************************************************************/
+
+#define kMaxDateSize	12
+
+const OSSymbol * AppleSmartBattery::unpackDate(UInt32 packedDate)
+{
+    DEBUG_LOG("AppleSmartBattery::unpackDate: packedDate = 0x%x\n", (unsigned int) packedDate);
+    
+	/* The date is packed in the following fashion: (year-1980) * 512 + month * 32 + day.
+	 *
+	 * Field	Bits Used	Format				Allowable Values
+	 * Day		0...4		5 bit binary value	1 - 31 (corresponds to date)
+	 * Month	5...8		4 bit binary value	1 - 12 (corresponds to month number)
+	 * Year		9...15		7 bit binary value	0 - 127 (corresponds to year biased by 1980
+	 */
+
+	UInt32	yearBits	= (packedDate >> 9) & 0x7F;
+	UInt32	monthBits	= (packedDate >> 5) & 0xF;
+	UInt32	dayBits		= packedDate & 0x1F;
+
+	char dateBuf[kMaxDateSize];
+    bzero(dateBuf, kMaxDateSize);
+	
+	// TODO: Determine date format from OS and format according to that, but for now use YYYY-MM-DD
+	
+    snprintf(dateBuf, kMaxDateSize, "%4d-%02d-%02d%c", (unsigned int) yearBits + 1980, (unsigned int) monthBits, (unsigned int) dayBits, (char)0);
+	
+    const OSSymbol *printableDate = OSSymbol::withCString(dateBuf);
+    if (printableDate) {
+		return printableDate;
+	}
+	else {
+		return NULL;
+	}
+
+}
+
+/******************************************************************************
+ *  Power Source value accessors
+ *  These supplement the built-in accessors in IOPMPowerSource.h, and should 
+ *  arguably be added back into the superclass IOPMPowerSource
+ ******************************************************************************/
+
+/******************************************************************************
+ * AppleSmartBattery::setPSNumber
+ *
+ * Compares against the stored value first, so re-publishing an unchanged
+ * number costs nothing. A changed value is written into the OSNumber already
+ * in the power source dictionary (and the registry, which shares it); only
+ * the first value for a key allocates. setPSProperty() would only see the
+ * same object again, so the power source is marked dirty here.
+ ******************************************************************************/
+
+void AppleSmartBattery::setPSNumber(const OSSymbol *key, UInt32 val)
+{
+    OSNumber *n = OSDynamicCast(OSNumber, properties->getObject(key));
+    
+    if (n) 
+	{
+        if (n->unsigned32BitValue() != val) {
+            n->setValue((unsigned long long) val);
+            settingsChangedSinceUpdate = true;
+        }
+        return;
+    }
+    
+    n = OSNumber::withNumber((unsigned long long) val, NUM_BITS);
+    if (n) {
+        setTrackedPSProperty(kObjectSitePSNumber, key, n);
+        n->release();
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishACPIPackage
+ *
+ * Publishes every keyed field of a decoded package. Integer fields holding
+ * their "not reported" sentinel leave the previous value in place.
+ ******************************************************************************/
+
+void AppleSmartBattery::publishACPIPackage(const ACPIPackageField *fields, UInt32 fieldCount, const void *decoded)
+{
+	for (UInt32 i = 0; i < fieldCount; i++)
+	{
+		const ACPIPackageField	*field	= &fields[i];
+		const void				*member	= (const UInt8 *) decoded + field->offset;
+		
+		if (!field->key)
+			continue;
+		
+		if (field->type == kACPIFieldInteger)
+		{
+			UInt32 value = *(const UInt32 *) member;
+			
+			if ((field->sentinel != ACPI_NO_SENTINEL) && (value == field->sentinel))
+				continue;
+			
+			setPSNumber(*field->key, value);
+		}
+		else if (field->type == kACPIFieldString)
+		{
+			OSSymbol *sym = *(OSSymbol * const *) member;
+			
+			if (sym)
+				setPSProperty(*field->key, (OSObject *) sym);
+		}
+	}
+}
+
+/******************************************************************************
+ *  Change-only versions of the numeric IOPMPowerSource setters. These hide
+ *  the superclass versions, which allocate a new OSNumber on every call.
+ ******************************************************************************/
+
+void AppleSmartBattery::setCurrentCapacity(unsigned int val)
+{
+    setPSNumber(currentCapacityKey, val);
+}
+
+void AppleSmartBattery::setMaxCapacity(unsigned int val)
+{
+    setPSNumber(maxCapacityKey, val);
+}
+
+void AppleSmartBattery::setTimeRemaining(int val)
+{
+    setPSNumber(timeRemainingKey, val);
+}
 
-const OSSymbol * AppleSmartBattery::unpackDate(UInt32 packedDate)
+void AppleSmartBattery::setAmperage(int val)
 {
-    DEBUG_LOG("AppleSmartBattery::unpackDate: packedDate = 0x%x\n", (unsigned int) packedDate);
-    
-	/* The date is packed in the following fashion: (year-1980) * 512 + month * 32 + day.
-	 *
-	 * Field	Bits Used	Format				Allowable Values
-	 * Day		0...4		5 bit binary value	1 - 31 (corresponds to date)
-	 * Month	5...8		4 bit binary value	1 - 12 (corresponds to month number)
-	 * Year		9...15		7 bit binary value	0 - 127 (corresponds to year biased by 1980
-	 */
+    setPSNumber(amperageKey, val);
+}
 
-	UInt32	yearBits	= packedDate >> 9;
-	UInt32	monthBits	= (packedDate >> 5) & 0xF;
-	UInt32	dayBits		= packedDate & 0x1F;
+void AppleSmartBattery::setVoltage(unsigned int val)
+{
+    setPSNumber(voltageKey, val);
+}
 
-	char dateBuf[kMaxDateSize];
-    bzero(dateBuf, kMaxDateSize);
-	
-	// TODO: Determine date format from OS and format according to that, but for now use YYYY-MM-DD
-	
-    snprintf(dateBuf, kMaxDateSize, "%4d-%02d-%02d%c", (unsigned int) yearBits + 1980, (unsigned int) monthBits, (unsigned int) dayBits, (char)0);
-	
-    const OSSymbol *printableDate = OSSymbol::withCString(dateBuf);
-    if (printableDate) {
-		return printableDate;
-	}
-	else {
-		return NULL;
-	}
+void AppleSmartBattery::setCycleCount(unsigned int val)
+{
+    setPSNumber(cycleCountKey, val);
+}
 
+void AppleSmartBattery::setAdapterInfo(int val)
+{
+    setPSNumber(adapterInfoKey, val);
 }
 
-/******************************************************************************
- *  Power Source value accessors
- *  These supplement the built-in accessors in IOPMPowerSource.h, and should 
- *  arguably be added back into the superclass IOPMPowerSource
- ******************************************************************************/
+void AppleSmartBattery::setLocation(int val)
+{
+    setPSNumber(locationKey, val);
+}
 
 void AppleSmartBattery::setMaxErr(int error)
 {
-    OSNumber *n = OSNumber::withNumber(error, NUM_BITS);
-    if (n) {
-		setPSProperty(_MaxErrSym, n);
-        n->release();
-    }
+    setPSNumber(_MaxErrSym, error);
 }
 
 int AppleSmartBattery::maxErr(void)
@@ -821,39 +3390,22 @@ bool AppleSmartBattery::fullyCharged(void)
 
 void AppleSmartBattery::setInstantaneousTimeToEmpty(int seconds)
 {
-    OSNumber *n = OSNumber::withNumber(seconds, NUM_BITS);
-    if (n) {
-        setPSProperty(_InstantTimeToEmptySym, n);
-		n->release();
-    }
+    setPSNumber(_InstantTimeToEmptySym, seconds);
 }
 
 void AppleSmartBattery::setInstantaneousTimeToFull(int seconds)
 {
-    OSNumber *n = OSNumber::withNumber(seconds, NUM_BITS);
-    if (n) {
-        setPSProperty(_InstantTimeToFullSym, n);
-		n->release();
-    }
+    setPSNumber(_InstantTimeToFullSym, seconds);
 }
 
 void AppleSmartBattery::setInstantAmperage(int mA)
 {
-    OSNumber *n = OSNumber::withNumber(mA, NUM_BITS);
-    if (n) {
-        setPSProperty(_InstantAmperageSym, n);
-		n->release();
-    }
+    setPSNumber(_InstantAmperageSym, mA);
 }
 
 void AppleSmartBattery::setAverageTimeToEmpty(int seconds)
 {
-	
-    OSNumber *n = OSNumber::withNumber(seconds, NUM_BITS);
-	if (n) {
-		setPSProperty(_AvgTimeToEmptySym, n);
-        n->release();
-    }
+    setPSNumber(_AvgTimeToEmptySym, seconds);
 }
 
 int AppleSmartBattery::averageTimeToEmpty(void)
@@ -868,11 +3420,7 @@ int AppleSmartBattery::averageTimeToEmpty(void)
 
 void AppleSmartBattery::setAverageTimeToFull(int seconds)
 {
-    OSNumber *n = OSNumber::withNumber(seconds, NUM_BITS);
-    if (n) {
-        setPSProperty(_AvgTimeToFullSym, n);
-		n->release();
-    }
+    setPSNumber(_AvgTimeToFullSym, seconds);
 }
 
 int AppleSmartBattery::averageTimeToFull(void)
@@ -887,11 +3435,7 @@ int AppleSmartBattery::averageTimeToFull(void)
 
 void AppleSmartBattery::setRunTimeToEmpty(int seconds)
 {
-    OSNumber *n = OSNumber::withNumber(seconds, NUM_BITS);
-    if (n) {
-        setPSProperty(_RunTimeToEmptySym, n);
-		n->release();
-    }
+    setPSNumber(_RunTimeToEmptySym, seconds);
 }
 
 int AppleSmartBattery::runTimeToEmpty(void)
@@ -906,11 +3450,7 @@ int AppleSmartBattery::runTimeToEmpty(void)
 
 void AppleSmartBattery::setRelativeStateOfCharge(int percent)
 {
-    OSNumber *n = OSNumber::withNumber(percent, NUM_BITS);
-    if (n) {
-        setPSProperty(_RelativeStateOfChargeSym, n);
-		n->release();
-    }
+    setPSNumber(_RelativeStateOfChargeSym, percent);
 }
 
 int AppleSmartBattery::relativeStateOfCharge(void)
@@ -925,11 +3465,7 @@ int AppleSmartBattery::relativeStateOfCharge(void)
 
 void AppleSmartBattery::setAbsoluteStateOfCharge(int percent)
 {
-    OSNumber *n = OSNumber::withNumber(percent, NUM_BITS);
-    if (n) {
-        setPSProperty(_AbsoluteStateOfChargeSym, n);
-		n->release();
-    }
+    setPSNumber(_AbsoluteStateOfChargeSym, percent);
 }
 
 int AppleSmartBattery::absoluteStateOfCharge(void)
@@ -944,11 +3480,7 @@ int AppleSmartBattery::absoluteStateOfCharge(void)
 
 void AppleSmartBattery::setRemainingCapacity(int mah)
 {
-    OSNumber *n = OSNumber::withNumber(mah, NUM_BITS);
-    if (n) {
-        setPSProperty(_RemainingCapacitySym, n);
-		n->release();
-    }
+    setPSNumber(_RemainingCapacitySym, mah);
 }
 
 int AppleSmartBattery::remainingCapacity(void)
@@ -963,11 +3495,7 @@ int AppleSmartBattery::remainingCapacity(void)
 
 void AppleSmartBattery::setAverageCurrent(int ma)
 {
-    OSNumber *n = OSNumber::withNumber(ma, NUM_BITS);
-    if (n) {
-        setPSProperty(_AverageCurrentSym, n);
-		n->release();
-    }
+    setPSNumber(_AverageCurrentSym, ma);
 }
 
 int AppleSmartBattery::averageCurrent(void)
@@ -982,11 +3510,7 @@ int AppleSmartBattery::averageCurrent(void)
 
 void AppleSmartBattery::setCurrent(int ma)
 {
-    OSNumber *n = OSNumber::withNumber(ma, NUM_BITS);
-    if (n) {
-        setPSProperty(_CurrentSym, n);
-		n->release();
-    }
+    setPSNumber(_CurrentSym, ma);
 }
 
 int AppleSmartBattery::current(void)
@@ -1001,11 +3525,7 @@ int AppleSmartBattery::current(void)
 
 void AppleSmartBattery::setTemperature(int temperature)
 {
-    OSNumber *n = OSNumber::withNumber(temperature, NUM_BITS);
-    if (n) {
-        setPSProperty(_TemperatureSym, n);
-		n->release();
-    }
+    setPSNumber(_TemperatureSym, temperature);
 }
 
 int AppleSmartBattery::temperature(void)
@@ -1020,11 +3540,7 @@ int AppleSmartBattery::temperature(void)
 
 void AppleSmartBattery::setManufactureDate(int date)
 {
-    OSNumber *n = OSNumber::withNumber(date, NUM_BITS);
-    if (n) {
-		setPSProperty(_ManufactureDateSym, n);
-        n->release();
-    }
+    setPSNumber(_ManufactureDateSym, date);
 }
 
 int AppleSmartBattery::manufactureDate(void)
@@ -1039,21 +3555,25 @@ int AppleSmartBattery::manufactureDate(void)
 
 void AppleSmartBattery::setSerialNumber(OSSymbol *sym)
 {
-	// BatterySerialNumber
+	// BatterySerialNumber is published by constructAppleSerialNumber(), from
+	// the model and this serial number
 	
     if (sym) 
 	{
-		setPSProperty(_HardwareSerialSym, (OSObject *) sym);
-	
 		// FirmwareSerialNumber - This is a number so we have to convert it from the zero padded
 		//                        string returned by ACPI.
 	
         long lSerialNumber = strtol(sym->getCStringNoCopy(), (char **)NULL, 16);
-											 
-		OSNumber *n = OSNumber::withNumber((unsigned long long) lSerialNumber, NUM_BITS);
+		
+		OSNumber *n = OSDynamicCast(OSNumber, properties->getObject(_SerialNumberSym));
+		
+		if (n && (n->unsigned32BitValue() == (UInt32) lSerialNumber))
+			return;
+		
+		n = OSNumber::withNumber((unsigned long long) lSerialNumber, NUM_BITS);
 
 		if(n) {
-			setPSProperty(_SerialNumberSym, n);
+			setTrackedPSProperty(kObjectSiteSerial, _SerialNumberSym, n);
 			n->release();
 		}
 	}
@@ -1066,9 +3586,14 @@ OSSymbol *AppleSmartBattery::serialNumber(void)
 
 void AppleSmartBattery::setManufacturerData(uint8_t *buffer, uint32_t bufferSize)
 {
+    OSData *lastData = OSDynamicCast(OSData, properties->getObject(_ManufacturerDataSym));
+    
+    if (lastData && lastData->isEqualTo(buffer, bufferSize))
+        return;
+    
     OSData *newData = OSData::withBytes( buffer, bufferSize );
     if (newData) {
-        setPSProperty(_ManufacturerDataSym, newData);
+		setTrackedPSProperty(kObjectSiteManufacturerData, _ManufacturerDataSym, newData);
 		newData->release();
     }
 }
@@ -1090,12 +3615,7 @@ const OSSymbol *AppleSmartBattery::chargeStatus(void)
 
 void AppleSmartBattery::setDesignCapacity(unsigned int val)
 {
-    OSNumber *n = OSNumber::withNumber(val, NUM_BITS);
-	if(n)
-	{
-		setPSProperty(_DesignCapacitySym, n);
-		n->release();
-	}
+    setPSNumber(_DesignCapacitySym, val);
 }
 
 unsigned int AppleSmartBattery::designCapacity(void) 
@@ -1122,13 +3642,7 @@ OSSymbol * AppleSmartBattery::batteryType(void)
 
 void AppleSmartBattery::setPermanentFailureStatus(unsigned int val)
 {
-	OSNumber *n = OSNumber::withNumber(val, NUM_BITS);
-	
-    if (n)
-	{
-		setPSProperty(_PFStatusSym, n);
-		n->release();
-	}
+    setPSNumber(_PFStatusSym, val);
 }
 
 unsigned int AppleSmartBattery::permanentFailureStatus(void)
@@ -1195,41 +3709,87 @@ IOReturn AppleSmartBattery::setBatteryBIF(OSArray *acpibat_bif)
 {
     DEBUG_LOG("AppleSmartBattery::setBatteryBIF: acpibat_bif size = %d\n", acpibat_bif->getCapacity());
     
-	fPowerUnit			= GetValueFromArray (acpibat_bif, BIF_POWER_UNIT);
-	fDesignCapacity		= GetValueFromArray (acpibat_bif, BIF_DESIGN_CAPACITY);
-	fMaxCapacity		= GetValueFromArray (acpibat_bif, BIF_LAST_FULL_CAPACITY);
-	fBatteryTechnology	= GetValueFromArray (acpibat_bif, BIF_TECHNOLOGY);
-	fDesignVoltage		= GetValueFromArray (acpibat_bif, BIF_DESIGN_VOLTAGE);
-	fDeviceName			= GetSymbolFromArray(acpibat_bif, BIF_MODEL_NUMBER);
-	fSerialNumber		= GetSymbolFromArray(acpibat_bif, BIF_SERIAL_NUMBER);					 
-	fType				= GetSymbolFromArray(acpibat_bif, BIF_BATTERY_TYPE);
-	fManufacturer		= GetSymbolFromArray(acpibat_bif, BIF_OEM);
+	ACPIBatteryInfo info;
+	
+	bzero(&info, sizeof(info));
+	
+	// Let the decoder reuse the symbols from the last read when unchanged
+	
+	info.model	= fDeviceName;
+	info.serial	= fSerialNumber;
+	info.type	= fType;
+	info.oem	= fManufacturer;
+	
+	if (DecodeACPIPackage(acpibat_bif, acpiBIFFields, ACPI_FIELD_COUNT(acpiBIFFields), &info) != kIOReturnSuccess)
+		logReadError(kErrorShortPackage, acpibat_bif->getCount(), NULL);
+	
+	if (info.powerUnit == WATTS)
+		ConvertACPICapacities(acpiBIFFields, ACPI_FIELD_COUNT(acpiBIFFields), &info, info.designVoltage);
+	
+	publishACPIPackage(acpiBIFFields, ACPI_FIELD_COUNT(acpiBIFFields), &info);
+	
+	return setBatteryInfo(&info, false);
+}
 
-	if(fPowerUnit == WATTS) {
-		fDesignCapacity /= fDesignVoltage;
-		fMaxCapacity /= fDesignVoltage;
-	}
+/******************************************************************************
+ * AppleSmartBattery::setBatteryInfo
+ *
+ * Common tail of _BIF and _BIX once the package has been decoded, converted
+ * and its keyed fields published. Takes over the four symbol references.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::setBatteryInfo(ACPIBatteryInfo *info, bool extended)
+{
+	OSSymbol *lastDeviceName	= fDeviceName;
+	OSSymbol *lastSerialNumber	= fSerialNumber;
+	OSSymbol *lastType			= fType;
+	OSSymbol *lastManufacturer	= fManufacturer;
+	
+	fPowerUnit			= info->powerUnit;
+	fDesignCapacity		= (info->designCapacity == ACPI_UNKNOWN) ? 0 : info->designCapacity;
+	fMaxCapacity		= (info->lastFullCapacity == ACPI_UNKNOWN) ? 0 : info->lastFullCapacity;
+	fBatteryTechnology	= info->technology;
+	fDesignVoltage		= info->designVoltage;
+	fCapacityWarning	= info->capacityWarning;
+	fCapacityLow		= info->capacityLow;
+	fCycleCount			= info->cycleCount;
+	fMaxErr				= info->accuracy;
+	fMinAverageInterval	= (info->minAverageInterval == ACPI_UNKNOWN) ? 0 : info->minAverageInterval;
+	fMaxAverageInterval	= (info->maxAverageInterval == ACPI_UNKNOWN) ? 0 : info->maxAverageInterval;
+	fDeviceName			= info->model;
+	fSerialNumber		= info->serial;
+	fType				= info->type;
+	fManufacturer		= info->oem;
+	
+	// DecodeACPIPackage always hands back references we own
+	trackObjects(kObjectSiteStaticSymbol, 4);
 	
 	if ((fDesignCapacity == 0) || (fMaxCapacity == 0))  {
 		logReadError(kErrorZeroCapacity, 0, NULL);
 	}
 	
-	setDesignCapacity(fDesignCapacity);
-	setMaxCapacity(fMaxCapacity);
-	setDeviceName(fDeviceName);
 	setSerialNumber(fSerialNumber);
-	setBatteryType(fType);
-	setManufacturer(fManufacturer);
 	
 	// ACPI _BIF doesn't provide these
 	
-	setCycleCount(0);
-	setMaxErr(0);
+	if (!extended) {
+		setCycleCount(0);
+		setMaxErr(0);
+	}
+	
+	// ...and neither _BIF nor _BIX provide these
+	
 	setManufactureDate(0);
-	fManufacturerData = OSData::withCapacity(10);
-	setManufacturerData((uint8_t *)fManufacturerData, fManufacturerData->getLength());
+	setManufacturerData(NULL, 0);
 	setPermanentFailureStatus(0);
 	
+	staticInfoRefreshed(lastDeviceName, lastSerialNumber);
+	
+	releaseStaticSymbol(lastDeviceName);
+	releaseStaticSymbol(lastSerialNumber);
+	releaseStaticSymbol(lastType);
+	releaseStaticSymbol(lastManufacturer);
+	
 	return kIOReturnSuccess;
 }
 
@@ -1270,44 +3830,26 @@ IOReturn AppleSmartBattery::setBatteryBIX(OSArray *acpibat_bix)
 {
     DEBUG_LOG("AppleSmartBattery::setBatteryBIX: acpibat_bix size = %d\n", acpibat_bix->getCapacity());
     
-	fPowerUnit			= GetValueFromArray (acpibat_bix, BIX_POWER_UNIT);
-	fDesignCapacity		= GetValueFromArray (acpibat_bix, BIX_DESIGN_CAPACITY);
-	fMaxCapacity		= GetValueFromArray (acpibat_bix, BIX_LAST_FULL_CAPACITY);
-	fBatteryTechnology	= GetValueFromArray (acpibat_bix, BIX_TECHNOLOGY);
-	fDesignVoltage		= GetValueFromArray (acpibat_bix, BIX_DESIGN_VOLTAGE);
-	fCycleCount			= GetValueFromArray (acpibat_bix, BIX_CYCLE_COUNT);
-	fMaxErr				= GetValueFromArray (acpibat_bix, BIX_ACCURACY);
-	fDeviceName			= GetSymbolFromArray(acpibat_bix, BIX_MODEL_NUMBER);
-	fSerialNumber		= GetSymbolFromArray(acpibat_bix, BIX_SERIAL_NUMBER);					 
-	fType				= GetSymbolFromArray(acpibat_bix, BIX_BATTERY_TYPE);
-	fManufacturer		= GetSymbolFromArray(acpibat_bix, BIX_OEM);
-	
-	if(fPowerUnit == WATTS) {
-		fDesignCapacity /= fDesignVoltage;
-		fMaxCapacity /= fDesignVoltage;
-	}
+	ACPIBatteryInfo info;
 	
-	if ((fDesignCapacity == 0) || (fMaxCapacity == 0))  {
-		logReadError(kErrorZeroCapacity, 0, NULL);
-	}
+	bzero(&info, sizeof(info));
 	
-	setDesignCapacity(fDesignCapacity);
-	setMaxCapacity(fMaxCapacity);
-	setDeviceName(fDeviceName);
-	setSerialNumber(fSerialNumber);
-	setBatteryType(fType);
-	setManufacturer(fManufacturer);
-	setCycleCount(fCycleCount);
-	setMaxErr(fMaxErr);
+	// Let the decoder reuse the symbols from the last read when unchanged
 	
-	// ACPI _BIX doesn't provide these...
+	info.model	= fDeviceName;
+	info.serial	= fSerialNumber;
+	info.type	= fType;
+	info.oem	= fManufacturer;
 	
-	setManufactureDate(0);
-	fManufacturerData = OSData::withCapacity(10);
-	setManufacturerData((uint8_t *)fManufacturerData, fManufacturerData->getLength());
-	setPermanentFailureStatus(0);
+	if (DecodeACPIPackage(acpibat_bix, acpiBIXFields, ACPI_FIELD_COUNT(acpiBIXFields), &info) != kIOReturnSuccess)
+		logReadError(kErrorShortPackage, acpibat_bix->getCount(), NULL);
 	
-	return kIOReturnSuccess;
+	if (info.powerUnit == WATTS)
+		ConvertACPICapacities(acpiBIXFields, ACPI_FIELD_COUNT(acpiBIXFields), &info, info.designVoltage);
+	
+	publishACPIPackage(acpiBIXFields, ACPI_FIELD_COUNT(acpiBIXFields), &info);
+	
+	return setBatteryInfo(&info, true);
 }
 
 /******************************************************************************
@@ -1343,56 +3885,34 @@ IOReturn AppleSmartBattery::setBatteryBBIX(OSArray *acpibat_bbix)
 {
     DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: acpibat_bbix size = %d\n", acpibat_bbix->getCapacity());
     
-	fManufacturerAccess		= GetValueFromArray (acpibat_bbix, BBIX_MANUF_ACCESS);
-	fBatteryMode			= GetValueFromArray (acpibat_bbix, BBIX_BATTERYMODE);
-	fAtRateTimeToFull		= GetValueFromArray (acpibat_bbix, BBIX_ATRATETIMETOFULL);
-	fAtRateTimeToEmpty		= GetValueFromArray (acpibat_bbix, BBIX_ATRATETIMETOEMPTY);
-	fTemperature			= GetValueFromArray (acpibat_bbix, BBIX_TEMPERATURE);
-	fVoltage				= GetValueFromArray (acpibat_bbix, BBIX_VOLTAGE);
-	fCurrent				= GetValueFromArray (acpibat_bbix, BBIX_CURRENT);
-	fAverageCurrent			= GetValueFromArray (acpibat_bbix, BBIX_AVG_CURRENT);
-	fRelativeStateOfCharge	= GetValueFromArray (acpibat_bbix, BBIX_REL_STATE_CHARGE);					 
-	fAbsoluteStateOfCharge	= GetValueFromArray (acpibat_bbix, BBIX_ABS_STATE_CHARGE);
-	fRemainingCapacity		= GetValueFromArray (acpibat_bbix, BBIX_REMAIN_CAPACITY);
-	fRunTimeToEmpty			= GetValueFromArray (acpibat_bbix, BBIX_RUNTIME_TO_EMPTY);
-	fAverageTimeToEmpty		= GetValueFromArray (acpibat_bbix, BBIX_AVG_TIME_TO_EMPTY);
-	fAverageTimeToFull		= GetValueFromArray (acpibat_bbix, BBIX_AVG_TIME_TO_FULL);
-	fManufactureDate		= GetValueFromArray (acpibat_bbix, BBIX_MANUF_DATE);
-	fManufacturerData		= GetDataFromArray  (acpibat_bbix, BBIX_MANUF_DATA);
-	
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fManufacturerAccess    = 0x%x\n", (unsigned int) fManufacturerAccess);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fBatteryMode           = 0x%x\n", (unsigned int) fBatteryMode);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAtRateTimeToFull      = 0x%x (min)\n", (unsigned int) fAtRateTimeToFull);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAtRateTimeToEmpty     = 0x%x (min)\n", (unsigned int) fAtRateTimeToEmpty);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fTemperature           = 0x%x (0.1K)\n", (unsigned int) fTemperature);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fVoltage               = 0x%x (mV)\n", (unsigned int) fVoltage);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fCurrent               = 0x%x (mA)\n", (unsigned int) fCurrent);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAverageCurrent        = 0x%x (mA)\n", (unsigned int) fAverageCurrent);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fRelativeStateOfCharge = 0x%x (%%)\n", (unsigned int) fRelativeStateOfCharge);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAbsoluteStateOfCharge = 0x%x (%%)\n", (unsigned int) fAbsoluteStateOfCharge);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fRemainingCapacity     = 0x%x (mAh)\n", (unsigned int) fRemainingCapacity);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fRunTimeToEmpty        = 0x%x (min)\n", (unsigned int) fRunTimeToEmpty);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAverageTimeToEmpty    = 0x%x (min)\n", (unsigned int) fAverageTimeToEmpty);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fAverageTimeToFull     = 0x%x (min)\n", (unsigned int) fAverageTimeToFull);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fManufactureDate       = 0x%x\n", (unsigned int) fManufactureDate);
-	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: fManufacturerData size = 0x%x\n", (unsigned int) fManufacturerData->getLength());
-	
-	setTemperature(fTemperature);
-	setManufactureDate(fManufactureDate);
-	
-	const OSSymbol *manuDate = this->unpackDate(fManufactureDate);
-	if (manuDate) {
-		setPSProperty(_DateOfManufacture, (OSObject *) manuDate);
-		manuDate->release();
-	}
-	
-	setRunTimeToEmpty(fRunTimeToEmpty);
-	setRelativeStateOfCharge(fRelativeStateOfCharge);
-	setAbsoluteStateOfCharge(fAbsoluteStateOfCharge);
-	setRemainingCapacity(fRemainingCapacity);
-	setAverageCurrent(fAverageCurrent);
-	setCurrent(fCurrent);
-	setManufacturerData((uint8_t *)fManufacturerData, fManufacturerData->getLength());
+	if (DecodeACPIPackage(acpibat_bbix, acpiBBIXFields, ACPI_FIELD_COUNT(acpiBBIXFields), &fExtraInfo) != kIOReturnSuccess)
+		logReadError(kErrorShortPackage, acpibat_bbix->getCount(), NULL);
+	
+	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: manufacturerAccess    = 0x%x\n", (unsigned int) fExtraInfo.manufacturerAccess);
+	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: batteryMode           = 0x%x\n", (unsigned int) fExtraInfo.batteryMode);
+	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: temperature           = 0x%x (0.1K)\n", (unsigned int) fExtraInfo.temperature);
+	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: manufactureDate       = 0x%x\n", (unsigned int) fExtraInfo.manufactureDate);
+	DEBUG_LOG("AppleSmartBattery::setBatteryBBIX: manufacturerData size = 0x%x\n", (unsigned int) fExtraInfo.manufacturerData.length);
+	
+	// The date string is derived from the packed date, so compare before the
+	// table publishes the new packed value
+	
+	if (!properties->getObject(_DateOfManufacture) || (manufactureDate() != (int) fExtraInfo.manufactureDate))
+	{
+		const OSSymbol *manuDate = this->unpackDate(fExtraInfo.manufactureDate);
+		if (manuDate) {
+			setTrackedPSProperty(kObjectSiteDateSymbol, _DateOfManufacture, (OSObject *) manuDate);
+			manuDate->release();
+		}
+	}
+	
+	publishACPIPackage(acpiBBIXFields, ACPI_FIELD_COUNT(acpiBBIXFields), &fExtraInfo);
+	
+	setManufacturerData((uint8_t *) fExtraInfo.manufacturerData.bytes, fExtraInfo.manufacturerData.length);
+	
+	// Borrowed from the package, which the caller is about to release
+	fExtraInfo.manufacturerData.bytes	= NULL;
+	fExtraInfo.manufacturerData.length	= 0;
 	
 	return kIOReturnSuccess;
 }
@@ -1458,10 +3978,15 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
     
 	// Get the values from the ACPI array
 	
-	UInt32 currentStatus = GetValueFromArray (acpibat_bst, BST_STATUS);
-	fCurrentRate		 = GetValueFromArray (acpibat_bst, BST_RATE);
-	fCurrentCapacity	 = GetValueFromArray (acpibat_bst, BST_CAPACITY);
-	fCurrentVoltage		 = GetValueFromArray (acpibat_bst, BST_VOLTAGE);	
+	ACPIBatteryStatus batteryStatus;
+	
+	if (DecodeACPIPackage(acpibat_bst, acpiBSTFields, ACPI_FIELD_COUNT(acpiBSTFields), &batteryStatus) != kIOReturnSuccess)
+		logReadError(kErrorShortPackage, acpibat_bst->getCount(), NULL);
+	
+	UInt32 currentStatus = batteryStatus.state;
+	fCurrentRate		 = batteryStatus.rate;
+	fCurrentCapacity	 = batteryStatus.capacity;
+	fCurrentVoltage		 = batteryStatus.voltage;
 	
 	DEBUG_LOG("AppleSmartBattery::setBatteryBST: fPowerUnit       = 0x%x\n",	(unsigned int) fPowerUnit);
 	DEBUG_LOG("AppleSmartBattery::setBatteryBST: currentStatus    = 0x%x\n",	(unsigned int) currentStatus);
@@ -1483,9 +4008,12 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
 	
 	// Watts = Amps X Volts
 	
-	if(fPowerUnit == WATTS)	{
+	fCapacityScale = 1;
+	
+	if((fPowerUnit == WATTS) && fCurrentVoltage)	{
 		DEBUG_LOG("AppleSmartBattery::setBatteryBST: Calculating for WATTS\n");
 		
+		fCapacityScale = fCurrentVoltage;
 		if(fCurrentRate > fCurrentVoltage)
 			fCurrentRate = (fCurrentRate * 1000) / fCurrentVoltage;
 		fCurrentCapacity /= fCurrentVoltage;
@@ -1498,20 +4026,17 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
 		DEBUG_LOG("AppleSmartBattery::setBatteryBST: adjusted fCurrentRate = 0x%x\n",		(unsigned int) fCurrentRate);
 	}
 	
-	if (fAverageRate)	
-		fAverageRate = (fAverageRate + fCurrentRate) / 2;
-	else
-		fAverageRate = fCurrentRate;
-	
-	DEBUG_LOG("AppleSmartBattery::setBatteryBST: fAverageRate = 0x%x\n",		(unsigned int) fAverageRate);
-	
 	if (currentStatus ^ fStatus) 
 	{
 		// The battery has changed states
 		fStatus = currentStatus;
-		fAverageRate = 0;
+		resetRateEstimator();
 	}
 	
+	fAverageRate = estimateRate();
+	
+	DEBUG_LOG("AppleSmartBattery::setBatteryBST: fAverageRate = 0x%x\n",		(unsigned int) fAverageRate);
+	
 	if ((currentStatus & BATTERY_DISCHARGING) && (currentStatus & BATTERY_CHARGING)) 
 	{		
 		// This should NEVER happen but...
@@ -1628,56 +4153,52 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
 		DEBUG_LOG("AppleSmartBattery: Battery is charged.\n");
 	}
 	
+	programTripPoint();
+	
 	if (!fPollingOverridden && fMaxCapacity) {
 		/*
 		 * Conditionally set polling interval to 1 second if we're
 		 *     discharging && below 5% && on AC power
 		 * i.e. we're doing an Inflow Disabled discharge
+		 * unless a trip point will tell us about each percent anyway
 		 */
-		if ((((100*fCurrentCapacity) / fMaxCapacity) < 5) && fACConnected) {
-			setProperty("Quick Poll", true);
+		if ((((100*fCurrentCapacity) / fMaxCapacity) < 5) && fACConnected && !fTripPointArmed) {
+			setPropertyIfChanged(_QuickPollSym, kOSBooleanTrue);
 			fPollingInterval = kQuickPollInterval;
 		} else {
-			setProperty("Quick Poll", false);
+			setPropertyIfChanged(_QuickPollSym, kOSBooleanFalse);
 			fPollingInterval = kDefaultPollInterval;
 		}
 	}
-    OSNumber *num;
+	
+	updateCapacityTrend(currentStatus);
 	
 	// Assumes 4 cells but Smart Battery standard does not provide count to do this dynamically. 
 	// Smart Battery can expose manufacturer specific functions, but they will be specific to the embedded battery controller
 	
-	fCellVoltages = OSArray::withCapacity(4); 
-	
-	fCellVoltage1 = fCurrentVoltage / 4;
-    num = OSNumber::withNumber((unsigned long long)fCellVoltage1 , NUM_BITS);
-    fCellVoltages->setObject(num);
-	
-	fCellVoltage2 = fCurrentVoltage / 4;
-    num = OSNumber::withNumber((unsigned long long)fCellVoltage2 , NUM_BITS);
-    fCellVoltages->setObject(num);
-	
-	fCellVoltage3 = fCurrentVoltage / 4;
-    num = OSNumber::withNumber((unsigned long long)fCellVoltage3 , NUM_BITS);
-    fCellVoltages->setObject(num);
-	
-	fCellVoltage4 = fCurrentVoltage - fCellVoltage1 - fCellVoltage2 - fCellVoltage3;
-    num = OSNumber::withNumber((unsigned long long)fCellVoltage4 , NUM_BITS);
-    fCellVoltages->setObject(num);
-	
-	setProperty("CellVoltage", fCellVoltages);
-	
-	setProperty("Temperature", (long long unsigned int)fTemperature, NUM_BITS);
+	if (fCurrentVoltage != (fCellVoltage1 + fCellVoltage2 + fCellVoltage3 + fCellVoltage4))
+	{
+		fCellVoltage1 = fCurrentVoltage / 4;
+		fCellVoltage2 = fCurrentVoltage / 4;
+		fCellVoltage3 = fCurrentVoltage / 4;
+		fCellVoltage4 = fCurrentVoltage - fCellVoltage1 - fCellVoltage2 - fCellVoltage3;
+		
+		// The array and its numbers are allocated once in start() and
+		// updated in place
+		((OSNumber *) fCellVoltages->getObject(0))->setValue(fCellVoltage1);
+		((OSNumber *) fCellVoltages->getObject(1))->setValue(fCellVoltage2);
+		((OSNumber *) fCellVoltages->getObject(2))->setValue(fCellVoltage3);
+		((OSNumber *) fCellVoltages->getObject(3))->setValue(fCellVoltage4);
+	}
 	
-	/* construct and publish our battery serial number here */
-	constructAppleSerialNumber();
+	if (getProperty(_CellVoltageSym) != fCellVoltages)
+		setProperty(_CellVoltageSym, fCellVoltages);
 	
-	/* Cancel read-completion timeout; Successfully read battery state */
-	fBatteryReadAllTimer->cancelTimeout();
+	setTemperature(fExtraInfo.temperature);
 	
-	rebuildLegacyIOBatteryInfo(true);
+	recordHistorySample(currentStatus);
 	
-	updateStatus();
+	anchorInterpolation();
 	
 	return kIOReturnSuccess;
 }
@@ -1690,66 +4211,291 @@ IOReturn AppleSmartBattery::setPowerState(unsigned long which, IOService *whom)
 	return IOPMAckImplied;
 } 
 
-UInt32 GetValueFromArray(OSArray * array, UInt8 index) 
+/*
+ * Classify every element of a package once. OSTypeIDInst gives the exact
+ * class, so the element can be used directly without OSDynamicCast.
+ */
+void InitACPIPackageView(ACPIPackageView *view, OSArray *package)
 {
-	OSObject *object = array->getObject(index);
+	UInt32 count = package->getCount();
 	
-	if (object && (OSTypeIDInst(object) == OSTypeID(OSNumber))) 
+	if (count > kACPIPackageViewMax)
+		count = kACPIPackageViewMax;
+	
+	view->count = count;
+	
+	for (UInt32 i = 0; i < count; i++)
 	{
-		OSNumber * number = OSDynamicCast(OSNumber, object);
-		if (number) 
-			return number->unsigned32BitValue();
+		ACPIPackageElement	*element	= &view->elements[i];
+		OSObject			*object		= package->getObject(i);
+		const OSMetaClass	*typeID		= object ? OSTypeIDInst(object) : NULL;
+		
+		element->kind	= kACPIElementNone;
+		element->value	= 0;
+		element->bytes	= NULL;
+		element->length	= 0;
+		
+		if (typeID == OSTypeID(OSNumber))
+		{
+			element->kind	= kACPIElementInteger;
+			element->value	= ((OSNumber *) object)->unsigned32BitValue();
+		}
+		else if ((typeID == OSTypeID(OSString)) || (typeID == OSTypeID(OSSymbol)))
+		{
+			element->kind	= kACPIElementString;
+			element->bytes	= ((OSString *) object)->getCStringNoCopy();
+			element->length	= ((OSString *) object)->getLength();
+		}
+		else if (typeID == OSTypeID(OSData))
+		{
+			element->kind	= kACPIElementBuffer;
+			element->bytes	= (const char *) ((OSData *) object)->getBytesNoCopy();
+			element->length	= ((OSData *) object)->getLength();
+		}
 	}
-	return 0;
 }
 
-OSData *GetDataFromArray(OSArray *array, UInt8 index)
+/*
+ * Return a retained symbol for a string or buffer element. If the element
+ * matches the candidate (normally the symbol cached from the last read) the
+ * candidate is reused and nothing is looked up or allocated.
+ */
+OSSymbol *CopyACPIPackageSymbol(const ACPIPackageView *view, UInt32 index, const OSSymbol *candidate)
 {
-	OSObject *object = array->getObject(index);
+	const ACPIPackageElement	*element;
+	const char					*nul;
+	UInt32						length;
+	bool						terminated;
+	char						stringBuf[kACPIStringMax];
 	
-	if(object && (OSTypeIDInst(object) == OSTypeID(OSString)))
+	if ((index >= view->count) || (view->elements[index].kind == kACPIElementNone) ||
+		(view->elements[index].kind == kACPIElementInteger))
 	{
-		OSString *oString = OSDynamicCast(OSString, object);
-		if(oString)
-		{
-			OSData *osData = OSData::withBytes(oString->getCStringNoCopy(), oString->getLength());
-			if(osData)
-				return osData;
+		unknownObjectKey->retain();
+		return (OSSymbol *)unknownObjectKey;
+	}
+	
+	element		= &view->elements[index];
+	length		= element->length;
+	terminated	= (element->kind == kACPIElementString);
+	
+	// Buffers are not necessarily terminated; stop at the first NUL
+	
+	if (!terminated) {
+		nul = (const char *) memchr(element->bytes, 0, length);
+		if (nul) {
+			length		= (UInt32) (nul - element->bytes);
+			terminated	= true;
+		} else if (length > (kACPIStringMax - 1)) {
+			length		= kACPIStringMax - 1;
 		}
 	}
 	
-	if(object && (OSTypeIDInst(object) == OSTypeID(OSData)))
+	if (candidate && (candidate->getLength() == length) &&
+		!memcmp(candidate->getCStringNoCopy(), element->bytes, length))
 	{
-		OSData *osData = OSDynamicCast(OSData, object);
-		if(osData)
-			return osData;
+		candidate->retain();
+		return (OSSymbol *) candidate;
 	}
 	
-	return (OSData *) NULL;
+	if (terminated)
+		return (OSSymbol *)OSSymbol::withCString(element->bytes);
+	
+	memcpy(stringBuf, element->bytes, length);
+	stringBuf[length] = 0;
+	
+	return (OSSymbol *)OSSymbol::withCString(stringBuf);
 }
 
-OSSymbol *GetSymbolFromArray(OSArray *array, UInt8 index) 
+/*
+ * Decode an ACPI package against its schema in a single pass over a typed
+ * view. Elements that are missing or of the wrong type decode to the field's
+ * sentinel (integers), the "Unknown" symbol (strings) or an empty buffer.
+ * String members may hold a borrowed candidate symbol on entry and always
+ * hold a retained symbol on return; buffers borrow from the package.
+ */
+IOReturn DecodeACPIPackage(OSArray *package, const ACPIPackageField *fields, UInt32 fieldCount, void *decoded)
 {
-	const OSMetaClass *typeID;
-    char stringBuf[255];
+	IOReturn		ret = kIOReturnSuccess;
+	ACPIPackageView	view;
 	
-    typeID = OSTypeIDInst(array->getObject(index));
-    
-	if (typeID == OSTypeID(OSString)) 
+	InitACPIPackageView(&view, package);
+	
+	for (UInt32 i = 0; i < fieldCount; i++)
 	{
-        OSString *osString = OSDynamicCast(OSString, array->getObject(index));
-        
-		return (OSSymbol *)OSSymbol::withString(osString);
-	} 
-	else if (typeID == OSTypeID(OSData)) 
+		const ACPIPackageField		*field		= &fields[i];
+		void						*member		= (UInt8 *) decoded + field->offset;
+		const ACPIPackageElement	*element	= NULL;
+		
+		if (field->index < view.count)
+			element = &view.elements[field->index];
+		else
+			ret = kIOReturnUnderrun;
+		
+		switch (field->type)
+		{
+			case kACPIFieldInteger:
+				if (element && (element->kind == kACPIElementInteger))
+					*(UInt32 *) member = element->value;
+				else
+					*(UInt32 *) member = field->sentinel;
+				break;
+				
+			case kACPIFieldString:
+				*(OSSymbol **) member = CopyACPIPackageSymbol(&view, field->index, *(OSSymbol **) member);
+				break;
+				
+			case kACPIFieldBuffer:
+			{
+				ACPIBytes *buffer = (ACPIBytes *) member;
+				
+				if (element && ((element->kind == kACPIElementString) || (element->kind == kACPIElementBuffer))) {
+					buffer->bytes	= element->bytes;
+					buffer->length	= element->length;
+				} else {
+					buffer->bytes	= NULL;
+					buffer->length	= 0;
+				}
+				break;
+			}
+		}
+	}
+	
+	return ret;
+}
+
+/*
+ * Power unit 0 (mW/mWh) packages are brought into the same scale as
+ * power unit 1 (mA/mAh) ones by dividing by the design voltage.
+ */
+void ConvertACPICapacities(const ACPIPackageField *fields, UInt32 fieldCount, void *decoded, UInt32 voltage)
+{
+	if ((voltage == 0) || (voltage == ACPI_UNKNOWN))
+		return;
+	
+	for (UInt32 i = 0; i < fieldCount; i++)
 	{
-        OSData *osData = OSDynamicCast(OSData, array->getObject(index));
+		const ACPIPackageField	*field = &fields[i];
+		UInt32					*value = (UInt32 *) ((UInt8 *) decoded + field->offset);
+		
+		if ((field->type != kACPIFieldInteger) || (field->unit != kACPIUnitCapacity))
+			continue;
+		
+		if ((field->sentinel != ACPI_NO_SENTINEL) && (*value == field->sentinel))
+			continue;
+		
+		*value /= voltage;
+	}
+}
 
-        bzero(stringBuf, sizeof(stringBuf));
-		snprintf(stringBuf, sizeof(stringBuf), "%s", (char *)osData->getBytesNoCopy(0,osData->getLength()));
-        
-		return (OSSymbol *)OSSymbol::withCString(stringBuf);
+/*
+ * Sample history codec. Signed differences are zigzag mapped so small
+ * negative values stay small, then written as little-endian base-128
+ * varints.
+ */
+static inline UInt64 ZigZagEncode(SInt64 value)
+{
+	return ((UInt64) value << 1) ^ (UInt64) (value >> 63);
+}
+
+static inline SInt64 ZigZagDecode(UInt64 value)
+{
+	return (SInt64) (value >> 1) ^ -(SInt64) (value & 1);
+}
+
+static UInt32 PutVarint(UInt8 *out, UInt64 value)
+{
+	UInt32 length = 0;
+	
+	while (value >= 0x80) {
+		out[length++] = (UInt8) (value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = (UInt8) value;
+	
+	return length;
+}
+
+static bool GetVarint(const UInt8 **in, const UInt8 *end, UInt64 *value)
+{
+	const UInt8	*p		= *in;
+	UInt64		result	= 0;
+	
+	for (UInt32 shift = 0; (p < end) && (shift < 64); shift += 7)
+	{
+		UInt8 byte = *p++;
+		
+		result |= (UInt64) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			*in		= p;
+			*value	= result;
+			return true;
+		}
 	}
+	
+	return false;
+}
+
+#define HISTORY_DELTA(field)	ZigZagEncode((SInt64) sample->field - (SInt64) previous->field)
+
+UInt32 EncodeHistorySample(const BatteryHistorySample *previous, SInt64 previousInterval,
+						   const BatteryHistorySample *sample, UInt8 *out)
+{
+	SInt64	interval	= (SInt64) (sample->timestamp - previous->timestamp);
+	UInt32	length		= 0;
+	
+	length += PutVarint(&out[length], ZigZagEncode(interval - previousInterval));
+	length += PutVarint(&out[length], HISTORY_DELTA(status));
+	length += PutVarint(&out[length], HISTORY_DELTA(rate));
+	length += PutVarint(&out[length], HISTORY_DELTA(capacity));
+	length += PutVarint(&out[length], HISTORY_DELTA(voltage));
+	length += PutVarint(&out[length], HISTORY_DELTA(temperature));
+	length += PutVarint(&out[length], HISTORY_DELTA(current));
+	
+	return length;
+}
 
-	return (OSSymbol *)unknownObjectKey;
+void InitHistoryCursor(BatteryHistoryCursor *cursor, const BatteryHistoryBlock *block)
+{
+	cursor->block		= block;
+	cursor->sample		= block->key;
+	cursor->interval	= 0;
+	cursor->offset		= 0;
+	cursor->index		= 0;
+}
+
+/*
+ * Step to the next sample of the block. Returns false at the end of the
+ * block or if the encoded data is truncated.
+ */
+bool NextHistorySample(BatteryHistoryCursor *cursor)
+{
+	const BatteryHistoryBlock	*block	= cursor->block;
+	const UInt8					*p		= &block->data[cursor->offset];
+	const UInt8					*end	= &block->data[block->used];
+	BatteryHistorySample		*sample	= &cursor->sample;
+	UInt64						deltas[7];
+	
+	if (cursor->index + 1 >= block->count)
+		return false;
+	
+	for (UInt32 i = 0; i < 7; i++) {
+		if (!GetVarint(&p, end, &deltas[i]))
+			return false;
+	}
+	
+	cursor->interval	+= ZigZagDecode(deltas[0]);
+	sample->timestamp	+= cursor->interval;
+	sample->status		+= (UInt32) ZigZagDecode(deltas[1]);
+	sample->rate		+= (UInt32) ZigZagDecode(deltas[2]);
+	sample->capacity	+= (UInt32) ZigZagDecode(deltas[3]);
+	sample->voltage		+= (UInt32) ZigZagDecode(deltas[4]);
+	sample->temperature	+= (UInt32) ZigZagDecode(deltas[5]);
+	// Wraps like the unsigned fields, rather than overflowing
+	sample->current		= (SInt32) ((UInt32) sample->current + (UInt32) ZigZagDecode(deltas[6]));
+	
+	cursor->offset		= (UInt32) (p - block->data);
+	cursor->index++;
+	
+	return true;
 }
@@ -25,8 +25,14 @@
 #define __AppleSmartBattery__
 
 
+#include <stddef.h>
+
 #include <IOKit/IOService.h>
 #include <IOKit/pwr_mgt/IOPMPowerSource.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <kern/thread_call.h>
+
+#include "AppleSmartBatterySnapshot.h"
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
 #include "AppleSmartBatteryManager.h"
@@ -43,6 +49,12 @@
 
 #define BATTERY_PRESENT		0x10	// Bit 4 - _STA Method return
 
+// Notify() values sent to the battery device
+
+#define BATTERY_STATUS_CHANGED	0x80	// Dynamic status (_BST) changed
+#define BATTERY_INFO_CHANGED	0x81	// Static information (_BIX/_BIF) changed
+#define BATTERY_MAINTENANCE		0x82	// Maintenance data (_BMD) changed
+
 // Return package from _BIF
 
 #define BIF_POWER_UNIT			0	
@@ -114,18 +126,332 @@
 
 #define kBatteryPollingDebugKey     "BatteryPollingPeriodOverride"
 
-// Define this in Info.plist to use extended battery information (ACPI 4.0 _BIX method)
+// Define this in Info.plist to force the extended battery information method
+// (ACPI 4.0 _BIX) on or off; by default it is used when the firmware has it
 
 #define kUseBatteryExtendedInfoKey	"UseExtendedBatteryInformationMethod"
 
-// Define this in Info.plist to use extra battery information in non-standard BBIX method
+// Define this in Info.plist to force the non-standard extra battery information
+// method BBIX on or off; by default it is used when the firmware has it
 
 #define kUseBatteryExtraInfoKey		"UseExtraBatteryInformationMethod"
 
+// Define this in Info.plist to choose how the average rate is estimated:
+// "Pairwise", "EWMA" (default) or "Kalman"
+
+#define kRateEstimatorKey			"RateEstimator"
+
+enum
+{
+	kRateEstimatorPairwise		= 0,	// (average + sample) / 2, the original behaviour
+	kRateEstimatorEWMA			= 1,	// exponentially weighted, time constant aware
+	kRateEstimatorKalman		= 2		// fuses the _BST rate with dCapacity/dt
+};
+
+// ACPI package schema
+//
+// Each battery package is described once by a table of ACPIPackageField
+// (see AppleSmartBattery.cpp) and decoded in a single bounds-checked pass by
+// DecodeACPIPackage() into one of the structures below.
+
+enum
+{
+	kACPIFieldInteger = 0,
+	kACPIFieldString,
+	kACPIFieldBuffer
+};
+
+enum
+{
+	kACPIUnitNone = 0,
+	kACPIUnitCapacity,			// mWh or mAh, depending on the power unit
+	kACPIUnitRate,				// mW or mA, depending on the power unit
+	kACPIUnitMilliVolts,
+	kACPIUnitMilliAmps,
+	kACPIUnitMinutes,
+	kACPIUnitMilliSeconds,
+	kACPIUnitTenthKelvin,
+	kACPIUnitPercent,
+	kACPIUnitPackedDate
+};
+
+#define ACPI_NO_SENTINEL	0
+
+typedef struct ACPIPackageField
+{
+	UInt8			index;		// element index in the package
+	UInt8			type;		// kACPIField*
+	UInt8			unit;		// kACPIUnit*
+	UInt32			sentinel;	// "not reported" value, also used when the package is short
+	UInt16			offset;		// offset of the decoded member
+	const OSSymbol	**key;		// power source key published from the table, or NULL
+} ACPIPackageField;
+
+typedef struct ACPIBytes
+{
+	const void		*bytes;		// borrowed from the package
+	UInt32			length;
+} ACPIBytes;
+
+// _BIF and _BIX decode into the same structure; _BIF leaves the _BIX-only
+// members at zero.
+
+typedef struct ACPIBatteryInfo
+{
+	UInt32			revision;
+	UInt32			powerUnit;
+	UInt32			designCapacity;
+	UInt32			lastFullCapacity;
+	UInt32			technology;
+	UInt32			designVoltage;
+	UInt32			capacityWarning;
+	UInt32			capacityLow;
+	UInt32			cycleCount;
+	UInt32			accuracy;
+	UInt32			maxSampleTime;
+	UInt32			minSampleTime;
+	UInt32			maxAverageInterval;
+	UInt32			minAverageInterval;
+	UInt32			granularity1;
+	UInt32			granularity2;
+	OSSymbol		*model;
+	OSSymbol		*serial;
+	OSSymbol		*type;
+	OSSymbol		*oem;
+} ACPIBatteryInfo;
+
+typedef struct ACPIBatteryExtraInfo
+{
+	UInt32			manufacturerAccess;
+	UInt32			batteryMode;
+	UInt32			atRateTimeToFull;
+	UInt32			atRateTimeToEmpty;
+	UInt32			temperature;
+	UInt32			voltage;
+	UInt32			current;
+	UInt32			averageCurrent;
+	UInt32			relativeStateOfCharge;
+	UInt32			absoluteStateOfCharge;
+	UInt32			remainingCapacity;
+	UInt32			runTimeToEmpty;
+	UInt32			averageTimeToEmpty;
+	UInt32			averageTimeToFull;
+	UInt32			manufactureDate;
+	ACPIBytes		manufacturerData;
+} ACPIBatteryExtraInfo;
+
+typedef struct ACPIBatteryStatus
+{
+	UInt32			state;
+	UInt32			rate;
+	UInt32			capacity;
+	UInt32			voltage;
+} ACPIBatteryStatus;
+
+// Table entry builders. The size check fails to compile if a field is
+// described with the wrong kind of member.
+
+#define ACPI_FIELD_CHECK(strct, member, ctype) \
+	(0 * sizeof(char[(sizeof(((strct *) 0)->member) == sizeof(ctype)) ? 1 : -1]))
+
+#define ACPI_INTEGER(idx, strct, member, unit, sentinel, key) \
+	{ idx, kACPIFieldInteger, unit, sentinel, \
+	  (UInt16) (offsetof(strct, member) + ACPI_FIELD_CHECK(strct, member, UInt32)), key }
+
+#define ACPI_STRING(idx, strct, member, key) \
+	{ idx, kACPIFieldString, kACPIUnitNone, ACPI_NO_SENTINEL, \
+	  (UInt16) (offsetof(strct, member) + ACPI_FIELD_CHECK(strct, member, OSSymbol *)), key }
+
+#define ACPI_BUFFER(idx, strct, member) \
+	{ idx, kACPIFieldBuffer, kACPIUnitNone, ACPI_NO_SENTINEL, \
+	  (UInt16) (offsetof(strct, member) + ACPI_FIELD_CHECK(strct, member, ACPIBytes)), NULL }
+
+#define ACPI_FIELD_COUNT(table)	(sizeof(table) / sizeof((table)[0]))
+
+// Typed view of a returned package. Every element is classified once when
+// the view is built; integers are read out and strings/buffers are borrowed
+// from the package, so the view is only valid while the package is retained.
+
+enum
+{
+	kACPIElementNone = 0,
+	kACPIElementInteger,
+	kACPIElementString,
+	kACPIElementBuffer
+};
+
+enum
+{
+	kACPIPackageViewMax		= 20,		// largest package we decode (_BIX)
+	kACPIStringMax			= 255
+};
+
+typedef struct ACPIPackageElement
+{
+	UInt32			kind;		// kACPIElement*
+	UInt32			value;		// integers
+	const char		*bytes;		// strings and buffers
+	UInt32			length;
+} ACPIPackageElement;
+
+typedef struct ACPIPackageView
+{
+	UInt32				count;
+	ACPIPackageElement	elements[kACPIPackageViewMax];
+} ACPIPackageView;
+
+void	 InitACPIPackageView(ACPIPackageView *view, OSArray *package);
+OSSymbol *CopyACPIPackageSymbol(const ACPIPackageView *view, UInt32 index, const OSSymbol *candidate);
+
+IOReturn DecodeACPIPackage(OSArray *package, const ACPIPackageField *fields, UInt32 fieldCount, void *decoded);
+void	ConvertACPICapacities(const ACPIPackageField *fields, UInt32 fieldCount, void *decoded, UInt32 voltage);
+
 static const OSSymbol * unknownObjectKey		= OSSymbol::withCString("Unknown");
-UInt32 GetValueFromArray(OSArray * array, UInt8 index);
-OSSymbol *GetSymbolFromArray(OSArray * array, UInt8 index);
-OSData	*GetDataFromArray(OSArray *array, UInt8 index);
+
+// Call sites counted by the driver's object accounting
+
+enum
+{
+	kObjectSiteStaticSymbol = 0,
+	kObjectSiteCellVoltages,
+	kObjectSiteCounters,
+	kObjectSiteLegacyInfo,
+	kObjectSitePSNumber,
+	kObjectSiteManufacturerData,
+	kObjectSiteDateSymbol,
+	kObjectSiteSerial,
+	kObjectSiteCount
+};
+
+// Sample history store
+//
+// Samples are kept in fixed-size blocks. The first sample of a block is
+// stored whole; every later one as zigzag varints of the difference from
+// the previous sample (timestamps as a difference of intervals), which is
+// typically 7-10 bytes instead of 32. When the newest block is full the
+// oldest one is recycled.
+
+enum
+{
+	kHistoryBlockBytes			= 512,
+	kHistoryBlocks				= 128,		// 64KB, a few days at 30 seconds
+	kHistoryMaxEncodedSample	= 7 * 10	// seven fields, at most 10 bytes each
+};
+
+typedef struct BatteryHistoryBlock
+{
+	UInt64					firstSequence;
+	UInt32					count;			// samples, including key
+	UInt32					used;			// bytes of data in use
+	BatteryHistorySample	key;
+	UInt8					data[kHistoryBlockBytes - 16 - sizeof(BatteryHistorySample)];
+} BatteryHistoryBlock;
+
+// Walks the samples of one block in order
+
+typedef struct BatteryHistoryCursor
+{
+	const BatteryHistoryBlock	*block;
+	BatteryHistorySample		sample;		// current sample
+	SInt64						interval;
+	UInt32						offset;		// into block->data
+	UInt32						index;		// of sample within the block
+} BatteryHistoryCursor;
+
+UInt32	EncodeHistorySample(const BatteryHistorySample *previous, SInt64 previousInterval,
+							const BatteryHistorySample *sample, UInt8 *out);
+void	InitHistoryCursor(BatteryHistoryCursor *cursor, const BatteryHistoryBlock *block);
+bool	NextHistorySample(BatteryHistoryCursor *cursor);
+
+// Bulk history export, see AppleSmartBattery::copySampleHistory()
+
+typedef struct BatteryHistoryRequest
+{
+	UInt64					cursor;			// in
+	void					*buffer;		// in: destination, or
+	IOMemoryDescriptor		*descriptor;	// in: prepared destination descriptor
+	UInt32					maxCount;		// in
+	UInt64					first;			// out
+	UInt32					count;			// out
+} BatteryHistoryRequest;
+
+// With several batteries, each one's share of the combined power source.
+// Written by its own battery, read by whichever battery aggregates; both
+// under the battery list lock, see AppleSmartBattery::updateAggregate()
+
+typedef struct BatteryContribution
+{
+	bool		present;
+	bool		charging;
+	bool		externalConnected;
+	UInt32		currentCapacity;	// mAh
+	UInt32		maxCapacity;		// mAh
+	UInt32		designCapacity;		// mAh
+	SInt32		amperage;			// mA, negative while discharging
+} BatteryContribution;
+
+// The combined state of all batteries, kept as running totals so an update
+// costs the same however many batteries there are. Published on the first
+// battery under "AggregateBatteryState"; deliberately not an IOPMPowerSource
+// of its own, which power management would count as one more battery.
+
+typedef struct BatteryAggregate
+{
+	UInt32		batteryCount;
+	UInt32		presentCount;
+	UInt32		chargingCount;
+	UInt32		externalCount;
+	UInt32		currentCapacity;	// mAh
+	UInt32		maxCapacity;		// mAh
+	UInt32		designCapacity;		// mAh
+	SInt32		amperage;			// mA
+	UInt32		timeRemaining;		// minutes
+} BatteryAggregate;
+
+#define kAggregateBatteryStateKey	"AggregateBatteryState"
+
+// ACPI methods evaluated by one poll
+
+enum
+{
+	kPollMethodSTA		= 0x01,
+	kPollMethodBIX		= 0x02,
+	kPollMethodBIF		= 0x04,
+	kPollMethodBBIX		= 0x08,
+	kPollMethodBST		= 0x10,
+	kPollMethodBTP		= 0x20
+};
+
+// Poll stages, evaluated in this order. Cancellation is checked before
+// each, so a cancelled poll finishes within one ACPI evaluation.
+
+enum
+{
+	kPollStageSTA		= 0,	// _STA
+	kPollStageInfo,				// _BIX or _BIF
+	kPollStageExtra,			// BBIX
+	kPollStageStatus,			// _BST
+	kPollStageTrip,				// _BTP, planned from the last _BST
+	kPollStageDone
+};
+
+// One poll in flight. Planned on the work loop, evaluated on the poll
+// thread without holding the gate, then applied back on the work loop.
+
+typedef struct BatteryPollTransaction
+{
+	UInt32		methods;		// kPollMethod* to evaluate
+	UInt32		evaluated;		// kPollMethod* that returned a result
+	volatile UInt32	stage;		// kPollStage* being evaluated
+	volatile uint64_t	stageStart;	// when it started, absolute time
+	UInt32		deadline[kPollStageDone];	// ms per stage, 0 if not requested
+	volatile bool	cancelled;	// set from the work loop, see cancelPoll()
+	UInt32		sta;
+	OSArray		*info;			// _BIX or _BIF
+	OSArray		*extra;			// BBIX
+	OSArray		*status;		// _BST
+	UInt32		tripPoint;		// _BTP argument, in _BST capacity units
+} BatteryPollTransaction;
 
 class AppleSmartBatteryManager;
 
@@ -142,7 +468,13 @@ protected:
 	IOTimerEventSource      *fPollTimer;
 	bool					fPollingNow;
 	bool					fCancelPolling;
-    IOTimerEventSource      *fBatteryReadAllTimer;
+	int						fPollQueued;		// path requested while fPollingNow
+	int						fPollPath;			// path of the poll in flight
+	uint64_t				fEstimatesStaleUntil;	// ms; 0 unless just woken
+	thread_call_t			fPollThread;
+	bool					fStopping;			// stop() has begun; no new polls
+	BatteryPollTransaction	fPoll;
+    IOTimerEventSource      *fStageDeadlineTimer;
     uint16_t                fMachinePath;
     uint32_t                fPollingInterval;
     bool                    fPollingOverridden;
@@ -154,11 +486,120 @@ protected:
 	
 	bool					fSystemSleeping;
 	IOService				*fPowerServiceToAck;
+	uint64_t				fSleepAckStart;		// sleep or wake held for a poll since
+	OSNumber				*fSleepAckLatencyNum;
 	
     OSArray                 *fCellVoltages;
 
 	uint8_t                 fInitialPollCountdown;;
 	
+	// _BIX/_BIF cache state
+	bool					fStaticInfoValid;
+	uint64_t				fStaticInfoTimestamp;
+	
+	// Adaptive polling state
+	uint32_t				fNextPollInterval;
+	OSNumber				*fNextPollIntervalNum;
+	const OSSymbol			*fPollReason;
+	SInt32					fCapacitySlope;
+	UInt32					fEstimateError;
+	UInt32					fTrendCapacity;
+	UInt32					fTrendStatus;
+	uint64_t				fTrendTimestamp;
+	
+	// Differential publication counters
+	UInt32					fPublishedUpdates;
+	UInt32					fSuppressedUpdates;
+	OSNumber				*fPublishedUpdatesNum;
+	OSNumber				*fSuppressedUpdatesNum;
+	
+	// Legacy battery info dictionaries, alternated between polls
+	OSDictionary			*fLegacyBatteryInfo[2];
+	int						fLegacyIndex;
+	
+	// Object accounting, see trackObjects()
+	SInt32					fLiveObjects[kObjectSiteCount];
+	UInt32					fCreatedObjects[kObjectSiteCount];
+	
+	// "DriverMemoryFootprint", built once and updated in place
+	OSDictionary			*fMemoryFootprint;
+	OSNumber				*fLiveObjectsNum[kObjectSiteCount];
+	OSNumber				*fCreatedObjectsNum[kObjectSiteCount];
+	OSNumber				*fTotalLiveObjectsNum;
+	
+	// Lock-free copy of the published state, see copyBatterySnapshot().
+	// Lives in a page that AppleSmartBatteryUserClient maps into user space.
+	IOBufferMemoryDescriptor	*fSharedMemory;
+	BatterySharedPage		*fSharedPage;
+	uint32_t				fSnapshotGeneration;
+	
+	// History of every _BST read, see recordHistorySample()
+	BatteryHistoryBlock		*fHistory;
+	UInt32					fHistoryCurrent;	// block being filled
+	UInt64					fHistoryHead;		// samples ever recorded
+	BatteryHistorySample	fHistoryLast;
+	SInt64					fHistoryInterval;	// last timestamp difference
+	
+	// Average rate estimator state, see estimateRate()
+	UInt32					fRateEstimator;		// kRateEstimator*
+	SInt64					fRateEstimate;		// mA, 24.8 fixed point
+	UInt64					fRateVariance;		// mA^2, Kalman only
+	UInt32					fRateCapacity;		// capacity at fRateTimestamp
+	uint64_t				fRateTimestamp;
+	UInt32					fMinAverageInterval;	// ms, from _BIX; 0 if unknown
+	UInt32					fMaxAverageInterval;
+	
+	// Capacity interpolation between polls, see interpolateTimeOut()
+	IOTimerEventSource		*fInterpolateTimer;
+	uint64_t				fInterpolateAnchor;	// time of the last _BST
+	bool					fInterpolating;		// published values are projected
+	
+	// _BTP trip point, see programTripPoint()
+	bool					fTripPointSupported;
+	bool					fTripPointArmed;
+	bool					fTripPointFalling;	// set while discharging
+	UInt32					fTripPoint;			// capacity, in published units
+	bool					fTripPointPending;	// fTripPointTarget not yet written
+	UInt32					fTripPointTarget;	// next _BTP, in published units
+	UInt32					fCapacityScale;		// published to _BST capacity units
+	bool					fTimerPoll;			// poll in flight started by fPollTimer
+	
+	// Multiple batteries, see updateAggregate()
+	BatteryContribution		fContribution;
+	bool					fAggregated;		// counted in the aggregate
+	
+	// Notify(0x80) coalescing and rate limiting, see handleBatteryStatusChanged()
+	IOTimerEventSource		*fNotifyTimer;
+	bool					fNotifyPending;
+	UInt32					fNotifyTokens;
+	uint64_t				fNotifyRefillTime;
+	UInt32					fNotifyReceived;
+	UInt32					fNotifyRefreshes;
+	UInt32					fNotifyRateLimited;
+	OSNumber				*fNotifyReceivedNum;
+	OSNumber				*fNotifyRefreshesNum;
+	OSNumber				*fNotifyRateLimitedNum;
+	
+	// Poll failure handling, see completePoll() and scheduleNextPoll()
+	bool					fPollTimedOut;		// a stage overran its deadline
+	UInt32					fPollFailures;		// consecutive failed polls
+	UInt32					fJitterSeed;
+	UInt32					fExtraFailures;		// consecutive BBIX failures
+	uint64_t				fExtraDisabledUntil;	// BBIX circuit open until
+	
+    // Change-only numeric publication into the power source dictionary
+    void    setPSNumber(const OSSymbol *key, UInt32 val);
+
+    // Hide the allocating IOPMPowerSource numeric setters
+    void    setCurrentCapacity(unsigned int val);
+    void    setMaxCapacity(unsigned int val);
+    void    setTimeRemaining(int val);
+    void    setAmperage(int val);
+    void    setVoltage(unsigned int val);
+    void    setCycleCount(unsigned int val);
+    void    setAdapterInfo(int val);
+    void    setLocation(int val);
+
     // Accessor for MaxError reading
     // Percent error in MaxCapacity reading
     void    setMaxErr(int error);
@@ -238,10 +679,68 @@ protected:
 
 	const OSSymbol	*unpackDate(UInt32 packedDate);
 
+	void	invalidateStaticInfo(void);
+	bool	staticInfoNeedsRefresh(void);
+	void	staticInfoRefreshed(OSSymbol *lastDeviceName, OSSymbol *lastSerialNumber);
+
+	void	publishBatteryState(void);
+	bool	pushBatteryState(void);
+	void	updateBatterySnapshot(void);
+	void	recordHistorySample(UInt32 status);
+	IOReturn	copySampleHistoryGated(BatteryHistoryRequest *request);
+	void	copyHistoryBatch(BatteryHistoryRequest *request, UInt32 offset,
+							 const BatteryHistorySample *samples, UInt32 count);
+	void	setPropertyIfChanged(const OSSymbol *key, OSObject *val);
+
+	void	trackObjects(UInt32 site, SInt32 count);
+	void	releaseStaticSymbol(OSSymbol *sym);
+	void	setTrackedPSProperty(UInt32 site, const OSSymbol *key, OSObject *val);
+	void	removeTrackedPSProperty(UInt32 site, const OSSymbol *key);
+	bool	createMemoryFootprint(void);
+	void	publishMemoryFootprint(void);
+
+	void	scheduleNextPoll(void);
+	bool	nearCapacityThreshold(void);
+	void	updateCapacityTrend(UInt32 status);
+
+	void	resetRateEstimator(void);
+	UInt32	rateTimeConstant(void);
+	void	fuseRateMeasurement(SInt64 measurement, UInt64 variance);
+	UInt32	estimateRate(void);
+
+	void	anchorInterpolation(void);
+	void	interpolateTimeOut(void);
+
+	UInt32	nextTripPoint(void);
+	void	programTripPoint(void);
+	void	completeTripPoint(void);
+
+	void	notifyTimeOut(void);
+
+	static void	pollThreadEntry(thread_call_param_t param0, thread_call_param_t param1);
+	IOReturn	completePoll(void);
+	void		cancelPoll(void);
+	IOReturn	stopPolling(void);
+	void		armStageDeadlines(void);
+	UInt32		pollTimeRemaining(bool currentStageOnly);
+
+	static void	publishAggregate(void);
+	void		updateAggregate(void);
+	uint32_t	alignSharedPoll(uint32_t interval);
+	bool		extraCircuitOpen(void);
+	void		recordExtraResult(bool failed);
+	UInt32		nextJitter(UInt32 range);
+
 public:
 
 	static AppleSmartBattery *smartBattery(void);
 
+	// Add to or remove from the combined power source and shared schedule.
+	// initBatteryList() must have succeeded first.
+	static bool initBatteryList(void);
+	static void registerBattery(AppleSmartBattery *battery);
+	static void unregisterBattery(AppleSmartBattery *battery);
+
     virtual bool init(void);
     virtual void free(void);
 	virtual bool start(IOService *provider);
@@ -255,10 +754,23 @@ public:
 
     void    handleBatteryInserted(void);
     
+    void    handleBatteryInfoChanged(void);
+    
+    void    handleBatteryStatusChanged(void);
+    
     void    handleBatteryRemoved(void);
 	
 	IOReturn handleSystemSleepWake(IOService *powerSource, bool isSystemSleep);
 	
+	// Consistent copy of the last published state; safe without the gate
+	void	copyBatterySnapshot(BatterySnapshot *snapshot);
+	
+	// Retained descriptor for the shared page, for AppleSmartBatteryUserClient
+	IOMemoryDescriptor	*copySharedMemory(void);
+	
+	// Bulk copy of recorded samples; takes the work loop gate
+	IOReturn	copySampleHistory(BatteryHistoryRequest *request);
+	
 protected:
     
 	void    logReadError( const char *error_type, 
@@ -269,11 +781,17 @@ protected:
 
     void    pollingTimeOut(void);
     
-    void    incompleteReadTimeOut(void);
+    void    stageDeadlineTimeOut(void);
 
     void    rebuildLegacyIOBatteryInfo(bool do_update);
 
+    void    setLegacyObject(OSDictionary *legacyDict, const char *key, OSObject *val);
+
 	void	acknowledgeSystemSleepWake(void);
+
+	IOReturn setBatteryInfo(ACPIBatteryInfo *info, bool extended);
+
+	void	publishACPIPackage(const ACPIPackageField *fields, UInt32 fieldCount, const void *decoded);
 	
 private:
 	
@@ -284,6 +802,8 @@ private:
 	UInt32   fCurrentCapacity;
 	UInt32	 fBatteryTechnology;
 	UInt32   fMaxCapacity;
+	UInt32   fCapacityWarning;
+	UInt32   fCapacityLow;
 	UInt32   fCurrentRate;
 	UInt32   fAverageRate;
 	UInt32   fStatus;
@@ -300,22 +820,8 @@ private:
 	UInt32   fCellVoltage3;
 	UInt32   fCellVoltage4;
 
-	UInt32	fManufacturerAccess;
-	UInt32	fBatteryMode;
-	UInt32	fAtRateTimeToFull;
-	UInt32	fAtRateTimeToEmpty;
-	UInt32  fTemperature;
-	UInt32	fVoltage;
-	SInt32	fCurrent;
-	SInt32	fAverageCurrent;
-	UInt32	fRelativeStateOfCharge;
-	UInt32	fAbsoluteStateOfCharge;
-	UInt32	fRemainingCapacity;
-	UInt32	fRunTimeToEmpty;
-	UInt32	fAverageTimeToEmpty;
-	UInt32	fAverageTimeToFull;
-	UInt32  fManufactureDate;
-	OSData   *fManufacturerData;
+	// Last decoded BBIX package; manufacturerData is only valid during setBatteryBBIX
+	ACPIBatteryExtraInfo	fExtraInfo;
 
 public:
 
@@ -23,6 +23,9 @@
 
 #include <IOKit/pwr_mgt/RootDomain.h>
 #include <IOKit/IOCommandGate.h>
+#include <IOKit/IOUserClient.h>
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
 
 #include "AppleSmartBatteryManager.h"
 #include "AppleSmartBattery.h"
@@ -36,6 +39,50 @@ static IOPMPowerState myTwoStates[2] = {
     {kIOPMPowerStateVersion1, kIOPMPowerOn, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
 };
 
+// Record keys for fMethodLatency, in kBatteryMethod* order
+
+static const char *batteryMethodNames[kBatteryMethodCount] =
+{
+	"_STA",		// kBatteryMethodSTA
+	"_BST",		// kBatteryMethodBST
+	"_BIX",		// kBatteryMethodBIX
+	"_BIF",		// kBatteryMethodBIF
+	"BBIX",		// kBatteryMethodBBIX
+	"_BTP",		// kBatteryMethodBTP
+	"Other"		// kBatteryMethodOther
+};
+
+// Methods checked by probeCapabilities()
+
+static const struct
+{
+	const char	*name;
+	UInt32		capability;
+} batteryCapabilityMethods[] =
+{
+	{ "_BIX",	kBatteryCapabilityBIX },
+	{ "_BIF",	kBatteryCapabilityBIF },
+	{ "BBIX",	kBatteryCapabilityBBIX },
+	{ "_BTP",	kBatteryCapabilityBTP },
+	{ "_BMD",	kBatteryCapabilityBMD },
+	{ "_BPS",	kBatteryCapabilityBPS }
+};
+
+/******************************************************************************
+ * batteryMethodIndex
+ * Map an ACPI method name onto its fMethodLatency slot
+ ******************************************************************************/
+
+static int batteryMethodIndex(const char *method)
+{
+	for (int i = 0; i < kBatteryMethodOther; i++) {
+		if (!strncmp(method, batteryMethodNames[i], 4))
+			return i;
+	}
+
+	return kBatteryMethodOther;
+}
+
 #define super IOService
 
 OSDefineMetaClassAndStructors(AppleSmartBatteryManager, IOService)
@@ -60,6 +107,17 @@ bool AppleSmartBatteryManager::init(OSDictionary *dict)
 void AppleSmartBatteryManager::free(void)
 {
     DEBUG_LOG("AppleSmartBatteryManager::free: Freeing\n");
+
+    if (fMethodLatencyState) {
+        fMethodLatencyState->release();
+        fMethodLatencyState = NULL;
+    }
+
+    if (fMethodLatencyLock) {
+        IOLockFree(fMethodLatencyLock);
+        fMethodLatencyLock = NULL;
+    }
+
     super::free();
 }
 
@@ -106,23 +164,37 @@ bool AppleSmartBatteryManager::start(IOService *provider)
 
 	IOLog("AppleSmartBatteryManager: Version 2011.0802 starting\n");
 
-	int value = getPlatform()->numBatteriesSupported();
-	DEBUG_LOG("AppleSmartBatteryManager: Battery Supported Count(s) %d.\n", value);
+    // Samples are recorded from the poll thread and from message(); the
+    // lock keeps each record whole for the periodic publish
+    fMethodLatencyLock = IOLockAlloc();
+    if (!fMethodLatencyLock) {
+        return false;
+    }
 
-    // TODO: Create battery array to hold battery objects if more than one battery in the system
-    
-	if (value > 1) 
-    { 
-		if (kIOReturnSuccess == fProvider->evaluateInteger("_STA", &fBatterySTA)) {
-			if (fBatterySTA & BATTERY_PRESENT) {
-				goto populateBattery;
-			} else {
-				goto skipBattery;
-			}
-		}
-	}
+    fLatencyTimer = IOTimerEventSource::timerEventSource(this,
+                                                         OSMemberFunctionCast(IOTimerEventSource::Action,
+                                                                              this, &AppleSmartBatteryManager::latencyTimeOut));
+    if (!fLatencyTimer
+        || (kIOReturnSuccess != wl->addEventSource(fLatencyTimer))) {
+        return false;
+    }
+
+	resetMethodLatency();
+	publishMethodLatency();
+
+	// Before the battery starts, it plans its polls from the result
+	probeCapabilities();
+
+	DEBUG_LOG("AppleSmartBatteryManager: Battery Supported Count(s) %d.\n", getPlatform()->numBatteriesSupported());
 
-populateBattery:
+    // Each ACPI battery (PNP0C0A) gets a manager of its own, so with several
+    // bays there is one manager and one AppleSmartBattery per bay. An empty
+    // bay still gets its battery, so a pack inserted later is picked up;
+    // the batteries share a poll schedule and a combined state, see
+    // AppleSmartBattery::registerBattery().
+
+	if (!AppleSmartBattery::initBatteryList())
+		return false;
 
 	fBattery = AppleSmartBattery::smartBattery();
 
@@ -149,7 +221,7 @@ populateBattery:
 
 	fBattery->registerService(0);
 
-skipBattery:
+	AppleSmartBattery::registerBattery(fBattery);
 
 	this->registerService(0);
 
@@ -164,21 +236,37 @@ void AppleSmartBatteryManager::stop(IOService *provider)
 {
 	DEBUG_LOG("AppleSmartBatteryManager::stop: called\n");
 	
-    fBattery->detach(this);
+    AppleSmartBattery::unregisterBattery(fBattery);
     
-    fBattery->free();
+    // Returns once the battery's poll thread is done with us
     fBattery->stop(this);
-    fBattery->terminate();
+    fBattery->detach(this);
+    fBattery->release();
     fBattery = NULL;
     
     IOWorkLoop *wl = getWorkLoop();
     if (wl) {
         wl->removeEventSource(fBatteryGate);
+        wl->removeEventSource(fManagerGate);
     }
 
-    fBatteryGate->free();
+    fBatteryGate->release();
     fBatteryGate = NULL;
-    
+    fManagerGate->release();
+    fManagerGate = NULL;
+
+    // No evaluation arms the timer after this
+    IOLockLock(fMethodLatencyLock);
+    IOTimerEventSource *latencyTimer = fLatencyTimer;
+    fLatencyTimer = NULL;
+    IOLockUnlock(fMethodLatencyLock);
+
+    latencyTimer->cancelTimeout();
+    if (wl) {
+        wl->removeEventSource(latencyTimer);
+    }
+    latencyTimer->release();
+
 	PMstop();
     
     super::stop(provider);
@@ -235,10 +323,29 @@ IOReturn AppleSmartBatteryManager::setPowerState(unsigned long which, IOService
 IOReturn AppleSmartBatteryManager::message(UInt32 type, IOService *provider, void *argument)
 {
     UInt32 batterySTA;
+    UInt32 notifyCode = (UInt32)(uintptr_t) argument;
+
+    if ((kIOACPIMessageDeviceNotification != type) || !fBatteryGate)
+        return kIOReturnSuccess;
 
-	if( (kIOACPIMessageDeviceNotification == type)
-        && (kIOReturnSuccess == fProvider->evaluateInteger("_STA", &batterySTA))
-		&& fBatteryGate )
+    if ((BATTERY_STATUS_CHANGED == notifyCode) && (fBatterySTA & BATTERY_PRESENT))
+    {
+        // Only _BST can have changed; skip _STA and the static packages
+        DEBUG_LOG("AppleSmartBatteryManager: battery status changed\n");
+        fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action,
+                           fBattery, &AppleSmartBattery::handleBatteryStatusChanged),
+                           NULL, NULL, NULL, NULL);
+        return kIOReturnSuccess;
+    }
+
+    if (BATTERY_MAINTENANCE == notifyCode)
+    {
+        // Nothing we read depends on the maintenance data
+        DEBUG_LOG("AppleSmartBatteryManager: battery maintenance data changed\n");
+        return kIOReturnSuccess;
+    }
+
+	if (kIOReturnSuccess == evaluateBatteryInteger("_STA", &batterySTA))
 	{
 		if (batterySTA ^ fBatterySTA) 
 		{
@@ -259,6 +366,14 @@ IOReturn AppleSmartBatteryManager::message(UInt32 type, IOService *provider, voi
                                NULL, NULL, NULL, NULL);
 			}
 		}
+		else if (BATTERY_INFO_CHANGED == notifyCode)
+		{
+			// Static information changed; drop the cached _BIX/_BIF and re-read.
+			DEBUG_LOG("AppleSmartBatteryManager: battery information changed\n");
+            fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action,
+                               fBattery, &AppleSmartBattery::handleBatteryInfoChanged),
+                               NULL, NULL, NULL, NULL);
+		}
 		else 
 		{
             // Just an alarm; re-read battery state.
@@ -273,145 +388,479 @@ IOReturn AppleSmartBatteryManager::message(UInt32 type, IOService *provider, voi
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatterySTA
- * Call DSDT _STA method to return battery device status
+ * AppleSmartBatteryManager::setProperties
+ * Userspace hook to clear the ACPI latency statistics
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatterySTA(void)
+IOReturn AppleSmartBatteryManager::setProperties(OSObject *properties)
 {
-    DEBUG_LOG("AppleSmartBatteryManager::getBatterySTA called\n");
-    
-    IOReturn evaluateStatus;
-    
-    evaluateStatus = fProvider->evaluateInteger("_STA", &fBatterySTA);
-    
-	if (evaluateStatus == kIOReturnSuccess) 
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+
+    if (!dict || !dict->getObject(kResetACPIMethodLatencyKey))
+        return kIOReturnUnsupported;
+
+    if (kIOReturnSuccess != IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator))
+        return kIOReturnNotPrivileged;
+
+    resetMethodLatency();
+    publishMethodLatency();
+
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::probeCapabilities
+ * Find out once which optional methods the DSDT implements, so polls never
+ * evaluate one that isn't there.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::probeCapabilities(void)
+{
+    OSDictionary    *methods;
+    UInt32          count = sizeof(batteryCapabilityMethods) / sizeof(batteryCapabilityMethods[0]);
+
+    fCapabilities = 0;
+
+    methods = OSDictionary::withCapacity(count);
+
+    for (UInt32 i = 0; i < count; i++)
     {
-		return fBattery->setBatterySTA(fBatterySTA);
-	}
-    else 
+        bool present = (kIOReturnSuccess == fProvider->validateObject(batteryCapabilityMethods[i].name));
+
+        if (present)
+            fCapabilities |= batteryCapabilityMethods[i].capability;
+
+        if (methods)
+            methods->setObject(batteryCapabilityMethods[i].name, present ? kOSBooleanTrue : kOSBooleanFalse);
+    }
+
+    DEBUG_LOG("AppleSmartBatteryManager::probeCapabilities: 0x%x\n", (unsigned int) fCapabilities);
+
+    if (methods) {
+        setProperty(kBatteryCapabilitiesKey, methods);
+        methods->release();
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::publishMethodLatency
+ * Publishes a snapshot of the per-method records. Recording a sample
+ * touches no registry state; the first sample after a publish arms
+ * fLatencyTimer, which publishes again kLatencyPublishMS later. The
+ * registry may hold the snapshot past our lifetime, so it owns its bytes.
+ * The records are created on the first call and overwritten in place after.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::publishMethodLatency(void)
+{
+    if (!fMethodLatencyState)
     {
-        DEBUG_LOG("AppleSmartBatteryManager::getBatterySTA: evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        OSDictionary *latency = OSDictionary::withCapacity(kBatteryMethodCount);
+        if (!latency)
+            return;
+
+        for (int i = 0; i < kBatteryMethodCount; i++)
+        {
+            OSData *record = OSData::withBytes(&fMethodLatency[i], sizeof(ACPIMethodLatency));
+            if (!record) {
+                latency->release();
+                return;
+            }
+            latency->setObject(batteryMethodNames[i], record);
+            fMethodLatencyRecords[i] = record;
+            record->release();
+        }
+
+        setProperty("ACPIMethodLatency", latency);
+        fMethodLatencyState = latency;
+    }
+
+    IOLockLock(fMethodLatencyLock);
+
+    for (int i = 0; i < kBatteryMethodCount; i++)
+        bcopy(&fMethodLatency[i], (void *) fMethodLatencyRecords[i]->getBytesNoCopy(), sizeof(ACPIMethodLatency));
+
+    IOLockUnlock(fMethodLatencyLock);
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBIF
- * Call DSDT _BIF method to return ACPI 3.x battery info
+ * AppleSmartBatteryManager::latencyTimeOut
+ * On the work loop, kLatencyPublishMS after the first sample since the
+ * last publish
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBIF(void)
+void AppleSmartBatteryManager::latencyTimeOut(void)
 {
-    DEBUG_LOG("AppleSmartBatteryManager::getBatteryBIF called\n");
-    
-    IOReturn evaluateStatus;
-    OSObject *fBatteryBIF;
-    
-    evaluateStatus = fProvider->validateObject("_BIF");
-    DEBUG_LOG("AppleSmartBatteryManager::getBatteryBIF: validateObject return 0x%x\n", evaluateStatus);
-    
-    evaluateStatus = fProvider->evaluateObject("_BIF", &fBatteryBIF);
+    IOLockLock(fMethodLatencyLock);
+    fLatencyPublishPending = false;
+    IOLockUnlock(fMethodLatencyLock);
 
-	if (evaluateStatus == kIOReturnSuccess) 
-    {
-		OSArray * acpibat_bif = OSDynamicCast(OSArray, fBatteryBIF);
-		setProperty("Battery Information", acpibat_bif);
-		IOReturn value = fBattery->setBatteryBIF(acpibat_bif);
-		acpibat_bif->release();
-		return value;
-	} 
-    else 
+    publishMethodLatency();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::resetMethodLatency
+ *
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::resetMethodLatency(void)
+{
+    IOLockLock(fMethodLatencyLock);
+
+    bzero(fMethodLatency, sizeof(fMethodLatency));
+
+    for (int i = 0; i < kBatteryMethodCount; i++)
+        fMethodLatency[i].version = kLatencyHistogramVersion;
+
+    IOLockUnlock(fMethodLatencyLock);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::recordMethodLatency
+ * _STA is also evaluated from message() outside the work loop, so the
+ * record is updated under fMethodLatencyLock.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::recordMethodLatency(const char *method, uint64_t startTime, IOReturn status)
+{
+    ACPIMethodLatency   *record = &fMethodLatency[batteryMethodIndex(method)];
+    uint64_t            now;
+    uint64_t            nsec;
+    UInt32              usec;
+    int                 bucket = 0;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - startTime, &nsec);
+
+    usec = (nsec / 1000 > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (UInt32) (nsec / 1000);
+
+    while ((bucket < (kLatencyBucketCount - 1)) && (usec >> (bucket + 1)))
+        bucket++;
+
+    IOLockLock(fMethodLatencyLock);
+
+    record->calls++;
+    record->buckets[bucket]++;
+    record->totalMicroseconds += usec;
+
+    if (status != kIOReturnSuccess)
+        record->errors++;
+
+    if (usec > record->maxMicroseconds)
+        record->maxMicroseconds = usec;
+
+    if (!fLatencyPublishPending && fLatencyTimer) {
+        fLatencyPublishPending = true;
+        fLatencyTimer->setTimeoutMS(kLatencyPublishMS);
+    }
+
+    IOLockUnlock(fMethodLatencyLock);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::methodDeadline
+ * How long one evaluation of method may take before the poll gives up on
+ * it, in ms. Derived from the p99 of its latency histogram.
+ ******************************************************************************/
+
+UInt32 AppleSmartBatteryManager::methodDeadline(const char *method)
+{
+    ACPIMethodLatency   record;
+    UInt32              calls;
+    UInt32              target;
+    UInt32              seen = 0;
+    UInt32              deadline;
+    int                 bucket;
+
+    IOLockLock(fMethodLatencyLock);
+    record = fMethodLatency[batteryMethodIndex(method)];
+    IOLockUnlock(fMethodLatencyLock);
+
+    calls = record.calls;
+
+    if (calls < kDeadlineMinSamples)
+        return kDeadlineMaxMS;
+
+    // Evaluations at or below the p99
+    target = calls - (calls / 100);
+
+    for (bucket = 0; bucket < (kLatencyBucketCount - 1); bucket++)
     {
-        DEBUG_LOG("AppleSmartBatteryManager::getBatteryBIF: evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        seen += record.buckets[bucket];
+        if (seen >= target)
+            break;
+    }
+
+    if (bucket == (kLatencyBucketCount - 1))
+        return kDeadlineMaxMS;
+
+    // Upper edge of the bucket, in ms
+    deadline = (UInt32) (((2ULL << bucket) * kDeadlineMultiplier + 999) / 1000);
+
+    if (deadline < kDeadlineMinMS)
+        deadline = kDeadlineMinMS;
+
+    if (deadline > kDeadlineMaxMS)
+        deadline = kDeadlineMaxMS;
+
+    return deadline;
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBIX
- * Call DSDT _BIX method to return ACPI 4.x battery info
+ * AppleSmartBatteryManager::evaluateBatteryObject
+ * All ACPI object evaluation for the battery goes through here so the
+ * provider can be swapped out or instrumented in a single place.
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBIX(void)
+IOReturn AppleSmartBatteryManager::evaluateBatteryObject(const char *method, OSObject **result,
+                                                         OSObject **params, IOItemCount paramCount)
 {
-    DEBUG_LOG("AppleSmartBatteryManager::getBatteryBIX called\n");
-    
+    if (!fProvider || !method || !result) 
+        return kIOReturnBadArgument;
+
+    *result = NULL;
+
+    uint64_t startTime;
+    clock_get_uptime(&startTime);
+
+    IOReturn status = fProvider->evaluateObject(method, result, params, paramCount);
+
+    recordMethodLatency(method, startTime, status);
+
+    return status;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::evaluateBatteryInteger
+ * Integer counterpart of evaluateBatteryObject (_STA)
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::evaluateBatteryInteger(const char *method, UInt32 *result)
+{
+    if (!fProvider || !method || !result) 
+        return kIOReturnBadArgument;
+
+    uint64_t startTime;
+    clock_get_uptime(&startTime);
+
+    IOReturn status = fProvider->evaluateInteger(method, result);
+
+    recordMethodLatency(method, startTime, status);
+
+    return status;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setPackageProperty
+ * Republish a raw ACPI package only when its contents changed
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::setPackageProperty(const char *key, OSArray *package)
+{
+    OSObject *lastPackage = getProperty(key);
+
+    if (lastPackage && lastPackage->isEqualTo(package))
+        return;
+
+    setProperty(key, package);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::copyBatteryPackage
+ * Evaluate a battery method that returns a package; the caller releases it
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::copyBatteryPackage(const char *method, OSArray **package)
+{
+    DEBUG_LOG("AppleSmartBatteryManager::copyBatteryPackage: %s\n", method);
+
     IOReturn evaluateStatus;
-    OSObject *fBatteryBIX;
-    
-    evaluateStatus = fProvider->evaluateObject("_BIX", &fBatteryBIX);
-    
-	if (evaluateStatus == kIOReturnSuccess) 
+    OSObject *result;
+
+    *package = NULL;
+
+    evaluateStatus = evaluateBatteryObject(method, &result);
+
+    if (evaluateStatus != kIOReturnSuccess)
     {
-		OSArray *acpibat_bix = OSDynamicCast(OSArray, fBatteryBIX);
-		setProperty("Battery Extended Information", acpibat_bix);
-		IOReturn value = fBattery->setBatteryBIX(acpibat_bix);
-		acpibat_bix->release();
-		return value;
-	}
-    else 
+        DEBUG_LOG("AppleSmartBatteryManager::copyBatteryPackage: %s evaluateObject error 0x%x\n", method, evaluateStatus);
+        return kIOReturnError;
+    }
+
+    *package = OSDynamicCast(OSArray, result);
+    if (!*package)
     {
-        DEBUG_LOG("AppleSmartBatteryManager::getBatteryBIX: evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        DEBUG_LOG("AppleSmartBatteryManager::copyBatteryPackage: %s did not return a package\n", method);
+        if (result) result->release();
+        return kIOReturnError;
+    }
+
+    return kIOReturnSuccess;
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBBIX
- * Call DSDT BBIX method to return all battery info (non-standard)
+ * AppleSmartBatteryManager::evaluateBatteryPoll
+ * Runs on the battery's poll thread, outside the work loop. Evaluates the
+ * methods the poll asked for, stage by stage, and keeps the results for
+ * applyBatteryPoll(). Stops early if the poll is cancelled.
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBBIX(void)
+void AppleSmartBatteryManager::evaluateBatteryPoll(BatteryPollTransaction *poll)
 {
-    DEBUG_LOG("AppleSmartBatteryManager::getBatteryBBIX called\n");
+    DEBUG_LOG("AppleSmartBatteryManager::evaluateBatteryPoll: methods = 0x%x\n", (unsigned int) poll->methods);
 
-    IOReturn evaluateStatus;
-	OSObject * fBatteryBBIX;
-    
-    evaluateStatus = fProvider->evaluateObject("BBIX", &fBatteryBBIX);
-	
-	if (evaluateStatus == kIOReturnSuccess) 
+    uint64_t    start;
+    UInt32      stage;
+
+    poll->evaluated = 0;
+
+    for (stage = kPollStageSTA; stage < kPollStageDone; stage++)
     {
-		OSArray *acpibat_bbix = OSDynamicCast(OSArray, fBatteryBBIX);
-		setProperty("Battery Extra Information", acpibat_bbix);
-		IOReturn value = fBattery->setBatteryBBIX(acpibat_bbix);
-		acpibat_bbix->release();
-		return value;
-	} 
-    else 
+        if (poll->cancelled)
+        {
+            DEBUG_LOG("AppleSmartBatteryManager::evaluateBatteryPoll: cancelled at stage %u\n", (unsigned int) poll->stage);
+            break;
+        }
+
+        // The battery's deadline timer reads stage, then stageStart; publish
+        // them in the opposite order so it never pairs a stage with an
+        // earlier stage's start time
+        clock_get_uptime(&start);
+        poll->stageStart = start;
+        OSMemoryBarrier();
+        poll->stage = stage;
+
+        if (!evaluatePollStage(poll))
+            break;
+    }
+
+    if (kPollStageDone == stage)
+        poll->stage = kPollStageDone;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::evaluatePollStage
+ * Evaluate the current stage's method if the poll wants it. Returns false
+ * when there is nothing more to read.
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::evaluatePollStage(BatteryPollTransaction *poll)
+{
+    switch (poll->stage)
     {
-        DEBUG_LOG("AppleSmartBatteryManager::getBatteryBBIX: evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        case kPollStageSTA:
+            if (!(poll->methods & kPollMethodSTA))
+                break;
+
+            if (kIOReturnSuccess != evaluateBatteryInteger("_STA", &poll->sta))
+            {
+                DEBUG_LOG("AppleSmartBatteryManager::evaluatePollStage: _STA evaluateInteger error\n");
+                break;
+            }
+
+            poll->evaluated |= kPollMethodSTA;
+
+            // Nothing more to read from an empty bay
+            return (poll->sta & BATTERY_PRESENT) ? true : false;
+
+        case kPollStageInfo:
+            if ((poll->methods & kPollMethodBIX)
+                && (kIOReturnSuccess == copyBatteryPackage("_BIX", &poll->info)))
+                poll->evaluated |= kPollMethodBIX;
+
+            if ((poll->methods & kPollMethodBIF)
+                && (kIOReturnSuccess == copyBatteryPackage("_BIF", &poll->info)))
+                poll->evaluated |= kPollMethodBIF;
+            break;
+
+        case kPollStageExtra:
+            if ((poll->methods & kPollMethodBBIX)
+                && (kIOReturnSuccess == copyBatteryPackage("BBIX", &poll->extra)))
+                poll->evaluated |= kPollMethodBBIX;
+            break;
+
+        case kPollStageStatus:
+            if ((poll->methods & kPollMethodBST)
+                && (kIOReturnSuccess == copyBatteryPackage("_BST", &poll->status)))
+                poll->evaluated |= kPollMethodBST;
+            break;
+
+        case kPollStageTrip:
+            if ((poll->methods & kPollMethodBTP)
+                && (kIOReturnSuccess == setBatteryBTP(poll->tripPoint)))
+                poll->evaluated |= kPollMethodBTP;
+            break;
+    }
+
+    return true;
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBST
- * Call DSDT _BST method to return the battery state
+ * AppleSmartBatteryManager::applyBatteryPoll
+ * Back on the work loop: publishes the raw packages and hands them to the
+ * battery in _STA, _BIX/_BIF, BBIX, _BST order
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBST(void)
+void AppleSmartBatteryManager::applyBatteryPoll(BatteryPollTransaction *poll)
 {
-    DEBUG_LOG("AppleSmartBatteryManager::getBatteryBST called\n");
+    if (poll->evaluated & kPollMethodSTA)
+    {
+        fBatterySTA = poll->sta;
+        fBattery->setBatterySTA(fBatterySTA);
+    }
 
+    if (poll->evaluated & kPollMethodBIX)
+    {
+        setPackageProperty("Battery Extended Information", poll->info);
+        fBattery->setBatteryBIX(poll->info);
+    }
+
+    if (poll->evaluated & kPollMethodBIF)
+    {
+        setPackageProperty("Battery Information", poll->info);
+        fBattery->setBatteryBIF(poll->info);
+    }
+
+    if (poll->evaluated & kPollMethodBBIX)
+    {
+        setPackageProperty("Battery Extra Information", poll->extra);
+        fBattery->setBatteryBBIX(poll->extra);
+    }
+
+    if (poll->evaluated & kPollMethodBST)
+    {
+        setPackageProperty("Battery Status", poll->status);
+        fBattery->setBatteryBST(poll->status);
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setBatteryBTP
+ * Call DSDT _BTP method to set the battery trip point; the EC sends
+ * Notify(0x80) when remaining capacity crosses it. Only the poll thread
+ * calls this, as a poll's trip stage, so a slow EC never holds the gate.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::setBatteryBTP(UInt32 tripPoint)
+{
+    DEBUG_LOG("AppleSmartBatteryManager::setBatteryBTP: tripPoint = %u\n", (unsigned int) tripPoint);
+    
     IOReturn evaluateStatus;
-	OSObject *fBatteryBST;
+    OSObject *param;
+    OSObject *result = NULL;
     
-    evaluateStatus = fProvider->evaluateObject("_BST", &fBatteryBST);
-	
-	if (evaluateStatus == kIOReturnSuccess)  
-	{
-		OSArray * acpibat_bst = OSDynamicCast(OSArray,fBatteryBST);
-		setProperty("Battery Status", acpibat_bst);
-		IOReturn value = fBattery->setBatteryBST(acpibat_bst);
-		acpibat_bst->release();
-	
-		return value;
-	}
-	else
-	{
-        DEBUG_LOG("AppleSmartBatteryManager::getBatteryBST: evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+    param = OSNumber::withNumber(tripPoint, 32);
+    if (!param)
+        return kIOReturnNoMemory;
+    
+    evaluateStatus = evaluateBatteryObject("_BTP", &result, &param, 1);
+    
+    param->release();
+    if (result) result->release();
+    
+    if (evaluateStatus != kIOReturnSuccess) {
+        DEBUG_LOG("AppleSmartBatteryManager::setBatteryBTP: evaluateObject error 0x%x\n", evaluateStatus);
+    }
+    
+    return evaluateStatus;
 }
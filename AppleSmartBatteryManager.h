@@ -25,6 +25,7 @@
 #define __AppleSmartBatteryManager__
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
 #include "AppleSmartBattery.h"
@@ -36,6 +37,82 @@
 #endif
 
 class AppleSmartBattery;
+struct BatteryPollTransaction;
+
+// ACPI methods we keep evaluation statistics for
+
+enum
+{
+	kBatteryMethodSTA = 0,
+	kBatteryMethodBST,
+	kBatteryMethodBIX,
+	kBatteryMethodBIF,
+	kBatteryMethodBBIX,
+	kBatteryMethodBTP,
+	kBatteryMethodOther,
+	kBatteryMethodCount
+};
+
+// Optional battery methods, probed once at start. The result is published
+// under "BatteryCapabilities" = { "_BIX" = Yes, ... }
+
+enum
+{
+	kBatteryCapabilityBIX		= 0x01,
+	kBatteryCapabilityBIF		= 0x02,
+	kBatteryCapabilityBBIX		= 0x04,
+	kBatteryCapabilityBTP		= 0x08,
+	kBatteryCapabilityBMD		= 0x10,
+	kBatteryCapabilityBPS		= 0x20
+};
+
+#define kBatteryCapabilitiesKey		"BatteryCapabilities"
+
+// Latency histogram: bucket n counts evaluations that took [2^n, 2^(n+1))
+// microseconds; bucket 0 also takes anything under 1us and the last bucket
+// everything from ~0.5s up.
+
+enum
+{
+	kLatencyHistogramVersion	= 1,
+	kLatencyBucketCount			= 20
+};
+
+// Per-stage poll deadlines: kDeadlineMultiplier times the method's observed
+// p99 latency, clamped. Until enough samples have been seen, or when the p99
+// falls in the open-ended last bucket, the maximum applies.
+
+enum
+{
+	kDeadlineMultiplier			= 4,
+	kDeadlineMinSamples			= 20,
+	kDeadlineMinMS				= 250,
+	kDeadlineMaxMS				= 10000
+};
+
+// Published as raw bytes, one record per method, under
+// "ACPIMethodLatency" = { "_STA" = <record>, ... }. The published records
+// trail the samples by up to kLatencyPublishMS; a reset publishes at once.
+
+enum
+{
+	kLatencyPublishMS			= 5000
+};
+
+typedef struct ACPIMethodLatency
+{
+	UInt32		version;
+	UInt32		calls;
+	UInt32		errors;
+	UInt32		maxMicroseconds;
+	UInt64		totalMicroseconds;
+	UInt32		buckets[kLatencyBucketCount];
+} ACPIMethodLatency;
+
+// Writing this key (any value) through IORegistryEntrySetCFProperties
+// clears the statistics. Requires administrator privilege.
+
+#define kResetACPIMethodLatencyKey	"ResetACPIMethodLatency"
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -53,6 +130,7 @@ public:
 
     IOReturn setPowerState(unsigned long which, IOService *whom);
     IOReturn message(UInt32 type, IOService *provider, void *argument);
+    IOReturn setProperties(OSObject *properties);
 
 private:
 	
@@ -61,7 +139,22 @@ private:
 	IOACPIPlatformDevice    *fProvider;
 	AppleSmartBattery       *fBattery;
 
+	UInt32					fCapabilities;		// kBatteryCapability*
+
+	ACPIMethodLatency		fMethodLatency[kBatteryMethodCount];		// under fMethodLatencyLock
+	IOLock					*fMethodLatencyLock;
+	IOTimerEventSource		*fLatencyTimer;
+	bool					fLatencyPublishPending;		// fLatencyTimer armed, under fMethodLatencyLock
+	OSDictionary			*fMethodLatencyState;		// as published
+	OSData					*fMethodLatencyRecords[kBatteryMethodCount];	// held by fMethodLatencyState
+
 	IOReturn setPollingInterval(int milliSeconds);
+	void     setPackageProperty(const char *key, OSArray *package);
+	void     probeCapabilities(void);
+	void     publishMethodLatency(void);
+	void     latencyTimeOut(void);
+	void     resetMethodLatency(void);
+	void     recordMethodLatency(const char *method, uint64_t startTime, IOReturn status);
 
 public:
 	
@@ -69,13 +162,28 @@ public:
     
     UInt32 fBatterySTA;
 
-    // Methods that return ACPI data into above structures
-    
-	IOReturn getBatterySTA(void);
-	IOReturn getBatteryBIF(void);
-	IOReturn getBatteryBIX(void);
-	IOReturn getBatteryBBIX(void);
-	IOReturn getBatteryBST(void);
+	UInt32   getCapabilities(void) { return fCapabilities; }
+
+    // Single entry points for ACPI evaluation against the battery device
+
+	IOReturn evaluateBatteryObject(const char *method, OSObject **result,
+								   OSObject **params = NULL, IOItemCount paramCount = 0);
+	IOReturn evaluateBatteryInteger(const char *method, UInt32 *result);
+
+	IOReturn copyBatteryPackage(const char *method, OSArray **package);
+
+	UInt32   methodDeadline(const char *method);
+
+    // A poll's ACPI evaluation, off the work loop, and its publication, on it
+
+	void     evaluateBatteryPoll(BatteryPollTransaction *poll);
+	bool     evaluatePollStage(BatteryPollTransaction *poll);
+	void     applyBatteryPoll(BatteryPollTransaction *poll);
+
+    // Program the _BTP trip point, in _BST remaining capacity units; 0 clears
+    // it. Evaluated by the poll thread, as a poll's trip stage.
+
+	IOReturn setBatteryBTP(UInt32 tripPoint);
 
 };
 
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "AppleSmartBatteryReader.h"
+
+enum
+{
+	kBatterySharedFileSize	= 4096		// what the driver shares
+};
+
+/******************************************************************************
+ * validPage
+ * The layout is only trusted once the header matches this build's.
+ ******************************************************************************/
+
+static int validPage(const BatterySharedPage *page, size_t length)
+{
+	if ((length < sizeof(BatterySharedPage))
+		|| (page->magic != kBatterySharedPageMagic)
+		|| (page->version != kBatterySnapshotVersion)
+		|| (page->size < sizeof(BatterySharedPage))
+		|| (page->ringSize != kBatterySharedRingSize))
+	{
+		errno = EPROTO;
+		return 0;
+	}
+
+	return 1;
+}
+
+/******************************************************************************
+ * BatteryReaderOpenFile
+ *
+ ******************************************************************************/
+
+int BatteryReaderOpenFile(BatteryReader *reader, const char *path)
+{
+	struct stat	info;
+	void		*address;
+	int			fd;
+
+	memset(reader, 0, sizeof(*reader));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &info) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t) info.st_size < sizeof(BatterySharedPage)) {
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+
+	address = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == address)
+		return -1;
+
+	if (!validPage((const BatterySharedPage *) address, (size_t) info.st_size)) {
+		munmap(address, (size_t) info.st_size);
+		return -1;
+	}
+
+	reader->page	= (const BatterySharedPage *) address;
+	reader->length	= (size_t) info.st_size;
+
+	return 0;
+}
+
+/******************************************************************************
+ * BatteryReaderOpen
+ *
+ ******************************************************************************/
+
+#ifdef __APPLE__
+
+int BatteryReaderOpen(BatteryReader *reader)
+{
+	io_service_t	service;
+	kern_return_t	kr;
+
+	memset(reader, 0, sizeof(*reader));
+
+	service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("AppleSmartBattery"));
+	if (!service) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	kr = IOServiceOpen(service, mach_task_self(), 0, &reader->connect);
+	IOObjectRelease(service);
+
+	if (kr != KERN_SUCCESS) {
+		errno = EACCES;
+		return -1;
+	}
+
+	kr = IOConnectMapMemory64(reader->connect, kBatterySharedMemoryType, mach_task_self(),
+							  &reader->address, &reader->size, kIOMapAnywhere | kIOMapReadOnly);
+
+	if ((kr != KERN_SUCCESS)
+		|| !validPage((const BatterySharedPage *) (uintptr_t) reader->address, (size_t) reader->size))
+	{
+		if (kr == KERN_SUCCESS)
+			IOConnectUnmapMemory64(reader->connect, kBatterySharedMemoryType, mach_task_self(), reader->address);
+		else
+			errno = ENOMEM;
+
+		IOServiceClose(reader->connect);
+		memset(reader, 0, sizeof(*reader));
+		return -1;
+	}
+
+	reader->page	= (const BatterySharedPage *) (uintptr_t) reader->address;
+	reader->length	= (size_t) reader->size;
+
+	return 0;
+}
+
+#else
+
+int BatteryReaderOpen(BatteryReader *reader)
+{
+	const char *path = getenv(kBatterySharedPageEnvironment);
+
+	return BatteryReaderOpenFile(reader, path ? path : kBatterySharedPageDefaultPath);
+}
+
+#endif
+
+/******************************************************************************
+ * BatteryReaderClose
+ *
+ ******************************************************************************/
+
+void BatteryReaderClose(BatteryReader *reader)
+{
+	if (!reader->page)
+		return;
+
+#ifdef __APPLE__
+	if (reader->connect) {
+		IOConnectUnmapMemory64(reader->connect, kBatterySharedMemoryType, mach_task_self(), reader->address);
+		IOServiceClose(reader->connect);
+	}
+	else
+#endif
+	munmap((void *) reader->page, reader->length);
+
+	memset(reader, 0, sizeof(*reader));
+}
+
+/******************************************************************************
+ * BatteryReaderCopySnapshot
+ *
+ ******************************************************************************/
+
+int BatteryReaderCopySnapshot(const BatteryReader *reader, BatterySnapshot *snapshot)
+{
+	if (!reader->page) {
+		errno = EBADF;
+		return -1;
+	}
+
+	BatterySnapshotRead(&reader->page->snapshot, snapshot);
+
+	return 0;
+}
+
+/******************************************************************************
+ * BatteryReaderCopySamples
+ *
+ ******************************************************************************/
+
+uint32_t BatteryReaderCopySamples(const BatteryReader *reader, BatterySample *samples, uint32_t maxCount)
+{
+	if (!reader->page)
+		return 0;
+
+	return BatterySharedPageReadSamples(reader->page, samples, maxCount);
+}
+
+/******************************************************************************
+ * BatteryReaderSamplesWritten
+ *
+ ******************************************************************************/
+
+uint64_t BatteryReaderSamplesWritten(const BatteryReader *reader)
+{
+	if (!reader->page)
+		return 0;
+
+	return __atomic_load_n(&reader->page->ringHead, __ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * BatteryReaderCopyHistory
+ *
+ ******************************************************************************/
+
+#ifdef __APPLE__
+
+int BatteryReaderCopyHistory(const BatteryReader *reader, uint64_t cursor,
+							 BatteryHistorySample *samples, uint32_t maxCount,
+							 uint64_t *first, uint32_t *count, uint64_t *nextCursor)
+{
+	uint64_t	output[3];
+	uint32_t	outputCount = 3;
+	size_t		size = (size_t) maxCount * sizeof(BatteryHistorySample);
+
+	if (!reader->connect) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (KERN_SUCCESS != IOConnectCallMethod(reader->connect, kBatteryUserClientCopyHistory,
+											&cursor, 1, NULL, 0,
+											output, &outputCount, samples, &size))
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	*first		= output[0];
+	*count		= (uint32_t) output[1];
+	*nextCursor	= output[2];
+
+	return 0;
+}
+
+#else
+
+int BatteryReaderCopyHistory(const BatteryReader *reader, uint64_t cursor,
+							 BatteryHistorySample *samples, uint32_t maxCount,
+							 uint64_t *first, uint32_t *count, uint64_t *nextCursor)
+{
+	(void) reader; (void) cursor; (void) samples; (void) maxCount;
+	(void) first; (void) count; (void) nextCursor;
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
+
+/******************************************************************************
+ * BatterySharedFileCreate
+ *
+ ******************************************************************************/
+
+BatterySharedPage *BatterySharedFileCreate(const char *path)
+{
+	BatterySharedPage	*page;
+	int					fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, kBatterySharedFileSize) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	page = (BatterySharedPage *) mmap(NULL, kBatterySharedFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ((void *) page == MAP_FAILED)
+		return NULL;
+
+	// As AppleSmartBattery::start() sets up its page
+	page->version			= kBatterySnapshotVersion;
+	page->size				= sizeof(BatterySharedPage);
+	page->ringSize			= kBatterySharedRingSize;
+	page->snapshot.version	= kBatterySnapshotVersion;
+
+	// Readers check the magic last
+	__atomic_store_n(&page->magic, kBatterySharedPageMagic, __ATOMIC_RELEASE);
+
+	return page;
+}
+
+/******************************************************************************
+ * BatterySharedFileClose
+ *
+ ******************************************************************************/
+
+void BatterySharedFileClose(BatterySharedPage *page)
+{
+	if (page)
+		munmap(page, kBatterySharedFileSize);
+}
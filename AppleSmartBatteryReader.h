@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __AppleSmartBatteryReader__
+#define __AppleSmartBatteryReader__
+
+// User space reader for the page AppleSmartBatteryUserClient shares, see
+// AppleSmartBatterySnapshot.h. Not part of the kext.
+//
+// On Mac OS X BatteryReaderOpen() maps the page of the first
+// AppleSmartBattery. Elsewhere the page is stood in for by a file with the
+// same layout, which a simulator creates with BatterySharedFileCreate() and
+// fills with BatterySnapshotWrite() and BatterySharedPageAppend(). Readers
+// map it with BatteryReaderOpen() or BatteryReaderOpenFile().
+//
+// Functions returning int return 0, or -1 with errno set.
+
+#include <stddef.h>
+
+#include "AppleSmartBatterySnapshot.h"
+
+#ifdef __APPLE__
+#include <IOKit/IOKitLib.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Where BatteryReaderOpen() looks for the stand-in file when
+// $BATTERY_SHARED_PAGE is not set
+
+#define kBatterySharedPageEnvironment	"BATTERY_SHARED_PAGE"
+#define kBatterySharedPageDefaultPath	"/run/battery-shared-page"
+
+typedef struct BatteryReader
+{
+	const BatterySharedPage	*page;
+	size_t					length;
+#ifdef __APPLE__
+	io_connect_t			connect;		// IO_OBJECT_NULL for a file
+	mach_vm_address_t		address;
+	mach_vm_size_t			size;
+#endif
+} BatteryReader;
+
+int		BatteryReaderOpen(BatteryReader *reader);
+int		BatteryReaderOpenFile(BatteryReader *reader, const char *path);
+void	BatteryReaderClose(BatteryReader *reader);
+
+// The current state, never torn
+int		BatteryReaderCopySnapshot(const BatteryReader *reader, BatterySnapshot *snapshot);
+
+// Up to maxCount of the most recent ring samples, oldest first. Returns how
+// many were copied.
+uint32_t	BatteryReaderCopySamples(const BatteryReader *reader, BatterySample *samples, uint32_t maxCount);
+
+// Samples appended to the ring since it was created; the difference between
+// two calls tells how many a reader missed if it exceeds kBatterySharedRingSize
+uint64_t	BatteryReaderSamplesWritten(const BatteryReader *reader);
+
+// The driver's _BST history, see kBatteryUserClientCopyHistory. Only the
+// driver keeps one; on a stand-in file this fails with ENOTSUP.
+int		BatteryReaderCopyHistory(const BatteryReader *reader, uint64_t cursor,
+								 BatteryHistorySample *samples, uint32_t maxCount,
+								 uint64_t *first, uint32_t *count, uint64_t *nextCursor);
+
+// Stand-in writer: creates (or truncates) path as an initialised, empty
+// page and maps it writable. Single writer only, as in the driver.
+BatterySharedPage	*BatterySharedFileCreate(const char *path);
+void	BatterySharedFileClose(BatterySharedPage *page);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __AppleSmartBatterySnapshot__
+#define __AppleSmartBatterySnapshot__
+
+// Fixed layout battery state, shared between the driver and its readers.
+// Only plain C types so the header can be used from user space as well.
+
+#include <stdint.h>
+
+enum
+{
+	kBatterySnapshotVersion		= 1
+};
+
+// AppleSmartBatteryUserClient memory type for IOConnectMapMemory; maps
+// a read-only BatterySharedPage
+
+enum
+{
+	kBatterySharedMemoryType	= 0
+};
+
+// AppleSmartBatteryUserClient external methods (IOConnectCallMethod)
+//
+// kBatteryUserClientCopyHistory
+//   scalar in  [0]  cursor: sequence number of the first sample wanted
+//   struct out      BatteryHistorySample[], oldest first
+//   scalar out [0]  sequence number of the first sample returned
+//              [1]  number of samples returned
+//              [2]  cursor to pass on the next call
+// If the cursor has already been overwritten the copy starts at the oldest
+// sample still held; a gap between cursor and [0] means samples were lost.
+
+enum
+{
+	kBatteryUserClientCopyHistory	= 0,
+	kBatteryUserClientMethodCount
+};
+
+#define kBatterySharedPageMagic		0x42415454		// 'BATT'
+
+enum
+{
+	kBatterySharedRingSize		= 64			// samples, power of two
+};
+
+// BatterySnapshot.flags
+
+enum
+{
+	kBatterySnapshotPresent					= 0x01,
+	kBatterySnapshotCharging				= 0x02,
+	kBatterySnapshotExternalConnected		= 0x04,
+	kBatterySnapshotExternalChargeCapable	= 0x08,
+	kBatterySnapshotFullyCharged			= 0x10,
+	kBatterySnapshotCritical				= 0x20,
+	kBatterySnapshotInterpolated			= 0x40,		// capacity and times projected since the last _BST
+	kBatterySnapshotStale					= 0x80		// estimates unreliable shortly after wake
+};
+
+typedef struct BatterySnapshot
+{
+	uint64_t	timestamp;				// uptime in ms when published
+	uint32_t	generation;				// bumped on every publication
+	uint32_t	flags;					// kBatterySnapshot*
+	uint32_t	currentCapacity;		// mAh
+	uint32_t	maxCapacity;			// mAh
+	uint32_t	designCapacity;			// mAh
+	int32_t		amperage;				// mA, negative while discharging
+	uint32_t	voltage;				// mV
+	uint32_t	timeRemaining;			// minutes
+	uint32_t	averageTimeToEmpty;		// minutes
+	uint32_t	averageTimeToFull;		// minutes
+	uint32_t	temperature;			// 0.1K
+	uint32_t	cycleCount;
+} BatterySnapshot;
+
+// Two copies behind a sequence counter (a "latch"). The writer moves readers
+// onto one copy while it rewrites the other, so readers never wait on the
+// writer; they only retry if a whole publication overlapped their copy.
+
+typedef struct BatterySnapshotLatch
+{
+	volatile uint32_t	sequence;
+	uint32_t			version;
+	BatterySnapshot		slot[2];
+} BatterySnapshotLatch;
+
+// One ring entry per published change of battery state
+
+typedef struct BatterySample
+{
+	uint64_t	timestamp;				// uptime in ms
+	uint32_t	flags;					// kBatterySnapshot*
+	uint32_t	currentCapacity;		// mAh
+	int32_t		amperage;				// mA
+	uint32_t	voltage;				// mV
+	uint32_t	temperature;			// 0.1K
+	uint32_t	reserved;
+} BatterySample;
+
+// One entry per _BST read, kept in the driver's history
+
+typedef struct BatteryHistorySample
+{
+	uint64_t	timestamp;				// uptime in ms
+	uint32_t	status;					// _BST battery state
+	uint32_t	rate;					// mA
+	uint32_t	capacity;				// mAh
+	uint32_t	voltage;				// mV
+	uint32_t	temperature;			// 0.1K
+	int32_t		current;				// mA, negative while discharging
+} BatteryHistorySample;
+
+// Layout of the page mapped by AppleSmartBatteryUserClient. The driver is
+// the only writer; user space maps it read-only.
+
+typedef struct BatterySharedPage
+{
+	uint32_t				magic;			// kBatterySharedPageMagic
+	uint32_t				version;		// kBatterySnapshotVersion
+	uint32_t				size;			// sizeof(BatterySharedPage)
+	uint32_t				ringSize;		// kBatterySharedRingSize
+	BatterySnapshotLatch	snapshot;
+	volatile uint64_t		ringHead;		// samples ever written
+	BatterySample			ring[kBatterySharedRingSize];
+} BatterySharedPage;
+
+// The driver shares exactly one 4K page
+typedef char BatterySharedPageFits[(sizeof(BatterySharedPage) <= 4096) ? 1 : -1];
+
+/*
+ * Single writer only (the driver, on its work loop).
+ */
+static inline void BatterySnapshotWrite(BatterySnapshotLatch *latch, const BatterySnapshot *snapshot)
+{
+	uint32_t sequence = latch->sequence;
+
+	__atomic_store_n(&latch->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	latch->slot[0] = *snapshot;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&latch->sequence, sequence + 2, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	latch->slot[1] = *snapshot;
+}
+
+/*
+ * Any number of concurrent readers, no locks taken.
+ */
+static inline void BatterySnapshotRead(const BatterySnapshotLatch *latch, BatterySnapshot *snapshot)
+{
+	uint32_t sequence;
+
+	do {
+		sequence = __atomic_load_n(&latch->sequence, __ATOMIC_ACQUIRE);
+		*snapshot = latch->slot[sequence & 1];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&latch->sequence, __ATOMIC_RELAXED) != sequence);
+}
+
+/*
+ * Append a sample to the ring. Single writer only.
+ */
+static inline void BatterySharedPageAppend(BatterySharedPage *page, const BatterySample *sample)
+{
+	uint64_t head = page->ringHead;
+
+	page->ring[head & (kBatterySharedRingSize - 1)] = *sample;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&page->ringHead, head + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy out up to maxCount of the most recent samples, oldest first, and
+ * return how many were copied. Samples the writer may have overwritten
+ * while they were being copied are dropped from the front.
+ */
+static inline uint32_t BatterySharedPageReadSamples(const BatterySharedPage *page, BatterySample *samples, uint32_t maxCount)
+{
+	uint64_t	head, first, last, valid;
+	uint32_t	count = 0;
+
+	if (maxCount > kBatterySharedRingSize)
+		maxCount = kBatterySharedRingSize;
+
+	head	= __atomic_load_n(&page->ringHead, __ATOMIC_ACQUIRE);
+	first	= (head > maxCount) ? head - maxCount : 0;
+
+	for (last = first; last < head; last++)
+		samples[count++] = page->ring[last & (kBatterySharedRingSize - 1)];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	// The writer may be filling slot (newHead % size), i.e. index newHead - size
+
+	valid = __atomic_load_n(&page->ringHead, __ATOMIC_RELAXED);
+	valid = (valid >= kBatterySharedRingSize) ? valid - kBatterySharedRingSize + 1 : 0;
+
+	if (valid > first) {
+		uint64_t drop = valid - first;
+
+		if (drop >= count)
+			return 0;
+
+		for (uint32_t i = 0; i < count - drop; i++)
+			samples[i] = samples[i + drop];
+
+		count -= (uint32_t) drop;
+	}
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "AppleSmartBatteryUserClient.h"
+#include "AppleSmartBatteryManager.h"
+
+#define super IOUserClient
+
+OSDefineMetaClassAndStructors(AppleSmartBatteryUserClient, IOUserClient)
+
+// Indexed by kBatteryUserClient* selector
+
+const IOExternalMethodDispatch AppleSmartBatteryUserClient::sMethods[kBatteryUserClientMethodCount] =
+{
+	{	// kBatteryUserClientCopyHistory
+		(IOExternalMethodAction) &AppleSmartBatteryUserClient::sCopyHistory,
+		1,								// cursor
+		0,
+		3,								// first, count, next cursor
+		kIOUCVariableStructureSize		// BatteryHistorySample[]
+	}
+};
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::initWithTask
+ *
+ ******************************************************************************/
+
+bool AppleSmartBatteryUserClient::initWithTask(task_t owningTask, void *securityID,
+											   UInt32 type, OSDictionary *properties)
+{
+	if (!super::initWithTask(owningTask, securityID, type, properties))
+		return false;
+
+	fTask		= owningTask;
+	fBattery	= NULL;
+
+	return true;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::free
+ *
+ ******************************************************************************/
+
+void AppleSmartBatteryUserClient::free(void)
+{
+	if (fBattery) {
+		fBattery->release();
+		fBattery = NULL;
+	}
+
+	super::free();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::start
+ *
+ ******************************************************************************/
+
+bool AppleSmartBatteryUserClient::start(IOService *provider)
+{
+	DEBUG_LOG("AppleSmartBatteryUserClient::start: called\n");
+
+	AppleSmartBattery *battery = OSDynamicCast(AppleSmartBattery, provider);
+
+	if (!battery || !super::start(provider))
+		return false;
+
+	battery->retain();
+	fBattery = battery;
+
+	return true;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::clientClose
+ * An external method may still be running on another thread, so fBattery
+ * stays valid until free(); once terminated, new calls are refused.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryUserClient::clientClose(void)
+{
+	DEBUG_LOG("AppleSmartBatteryUserClient::clientClose: called\n");
+
+	terminate();
+
+	return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::clientMemoryForType
+ * The shared page is always mapped read-only; the driver is its only writer.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options,
+														  IOMemoryDescriptor **memory)
+{
+	if (!fBattery || isInactive())
+		return kIOReturnNotReady;
+
+	if (type != kBatterySharedMemoryType)
+		return kIOReturnBadArgument;
+
+	*memory = fBattery->copySharedMemory();
+	if (!*memory)
+		return kIOReturnNoMemory;
+
+	*options = kIOMapReadOnly;
+
+	return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::externalMethod
+ *
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+													 IOExternalMethodDispatch *dispatch, OSObject *target,
+													 void *reference)
+{
+	if (selector >= kBatteryUserClientMethodCount)
+		return kIOReturnBadArgument;
+
+	if (!fBattery || isInactive())
+		return kIOReturnNotReady;
+
+	dispatch	= (IOExternalMethodDispatch *) &sMethods[selector];
+	target		= this;
+
+	return super::externalMethod(selector, arguments, dispatch, target, reference);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::sCopyHistory
+ *
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryUserClient::sCopyHistory(AppleSmartBatteryUserClient *target, void *reference,
+												   IOExternalMethodArguments *arguments)
+{
+	return target->copyHistory(arguments);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryUserClient::copyHistory
+ * Large requests arrive as a descriptor rather than an in-band buffer;
+ * either way the samples are copied straight from the driver's ring.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryUserClient::copyHistory(IOExternalMethodArguments *arguments)
+{
+	BatteryHistoryRequest	request;
+	IOReturn				ret;
+
+	if (!fBattery)
+		return kIOReturnNotReady;
+
+	bzero(&request, sizeof(request));
+	request.cursor = arguments->scalarInput[0];
+
+	if (arguments->structureOutputDescriptor)
+	{
+		request.descriptor	= arguments->structureOutputDescriptor;
+		request.maxCount	= (UInt32) (request.descriptor->getLength() / sizeof(BatteryHistorySample));
+
+		ret = request.descriptor->prepare();
+		if (ret != kIOReturnSuccess)
+			return ret;
+
+		ret = fBattery->copySampleHistory(&request);
+		request.descriptor->complete();
+
+		arguments->structureOutputDescriptorSize = request.count * sizeof(BatteryHistorySample);
+	}
+	else
+	{
+		request.buffer		= arguments->structureOutput;
+		request.maxCount	= arguments->structureOutputSize / sizeof(BatteryHistorySample);
+
+		ret = fBattery->copySampleHistory(&request);
+		arguments->structureOutputSize = request.count * sizeof(BatteryHistorySample);
+	}
+
+	if (ret != kIOReturnSuccess)
+		return ret;
+
+	arguments->scalarOutput[0] = request.first;
+	arguments->scalarOutput[1] = request.count;
+	arguments->scalarOutput[2] = request.first + request.count;
+
+	return kIOReturnSuccess;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __AppleSmartBatteryUserClient__
+#define __AppleSmartBatteryUserClient__
+
+#include <IOKit/IOUserClient.h>
+
+#include "AppleSmartBattery.h"
+
+class AppleSmartBattery;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Hands out a read-only mapping of the battery's BatterySharedPage
+// (see AppleSmartBatterySnapshot.h) via IOConnectMapMemory with
+// kBatterySharedMemoryType, and bulk history through IOConnectCallMethod.
+
+class AppleSmartBatteryUserClient : public IOUserClient
+{
+	OSDeclareDefaultStructors(AppleSmartBatteryUserClient)
+
+public:
+
+	virtual bool initWithTask(task_t owningTask, void *securityID, UInt32 type, OSDictionary *properties);
+	virtual void free(void);
+	virtual bool start(IOService *provider);
+	virtual IOReturn clientClose(void);
+	virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+	virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+									IOExternalMethodDispatch *dispatch, OSObject *target, void *reference);
+
+private:
+
+	static const IOExternalMethodDispatch sMethods[kBatteryUserClientMethodCount];
+
+	static IOReturn sCopyHistory(AppleSmartBatteryUserClient *target, void *reference,
+								 IOExternalMethodArguments *arguments);
+
+	IOReturn copyHistory(IOExternalMethodArguments *arguments);
+
+	AppleSmartBattery		*fBattery;		// retained until free()
+	task_t					fTask;
+};
+
+#endif
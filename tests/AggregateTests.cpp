@@ -0,0 +1,183 @@
+/*
+ * Several batteries at once: the combined power source the first of them
+ * publishes, the poll tick they share, and what each battery costs the
+ * aggregate as their number grows.
+ */
+
+#include <vector>
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+enum
+{
+	kAggregateTestBatteries	= 4,
+	kAggregateStaggerMS		= 7000,
+	kAggregateSettleMS		= 1800000,
+	kAggregateRunMS			= 3600000,
+	kAggregateBenchMax		= 64,
+	kAggregateBenchUpdates	= 200000
+};
+
+static SInt64 aggregateNumber(BatteryFixture &fixture, const char *key)
+{
+	OSDictionary	*aggregate = OSDynamicCast(OSDictionary, fixture.battery->getProperty(kAggregateBatteryStateKey));
+	OSNumber		*number = aggregate ? OSDynamicCast(OSNumber, aggregate->getObject(key)) : NULL;
+
+	return number ? (SInt32) number->unsigned32BitValue() : -1;
+}
+
+// Battery i discharges from 4000 - 500i mAh at 1000 + 500i mA
+static FakeACPIDevice *numberedBattery(UInt32 i)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	OSArray			*status = CreateBSTPackage(BATTERY_DISCHARGING, 1000 + 500 * i, 4000 - 500 * i, 11500);
+
+	device->setObject("_BST", status);
+	status->release();
+
+	return device;
+}
+
+// When each _BST was read, host clock ms
+static void recordPoll(FakeACPIDevice *device, const char *method, void *context)
+{
+	((std::vector<uint64_t> *) context)->push_back(HostClockMS());
+	device->setHook(method, recordPoll, context);
+}
+
+TEST(AggregateSumsBatteries)
+{
+	BatteryFixture	*fixtures[kAggregateTestBatteries];
+	SInt64			current = 0, max = 0, amperage = 0;
+
+	for (UInt32 i = 0; i < kAggregateTestBatteries; i++)
+		fixtures[i] = new BatteryFixture(numberedBattery(i));
+
+	HostRunThreadCalls();
+
+	for (UInt32 i = 0; i < kAggregateTestBatteries; i++)
+	{
+		current		+= fixtures[i]->psNumber(kIOPMPSCurrentCapacityKey);
+		max			+= fixtures[i]->psNumber(kIOPMPSMaxCapacityKey);
+		amperage	+= fixtures[i]->psNumber(kIOPMPSAmperageKey);
+
+		// Only the first publishes
+		if (i)
+			CHECK(fixtures[i]->battery->getProperty(kAggregateBatteryStateKey) == NULL);
+	}
+
+	BatteryFixture &first = *fixtures[0];
+
+	CHECK_EQ(13000, current);
+	CHECK_EQ(-7000, amperage);
+	CHECK_EQ(kAggregateTestBatteries, aggregateNumber(first, "BatteryCount"));
+	CHECK_EQ(kAggregateTestBatteries, aggregateNumber(first, "BatteriesInstalled"));
+	CHECK_EQ(current, aggregateNumber(first, kIOPMPSCurrentCapacityKey));
+	CHECK_EQ(max, aggregateNumber(first, kIOPMPSMaxCapacityKey));
+	CHECK_EQ(amperage, aggregateNumber(first, kIOPMPSAmperageKey));
+
+	// Everything left over the net rate, not any one battery's estimate
+	CHECK_EQ(current * 60 / -amperage, aggregateNumber(first, kIOPMPSTimeRemainingKey));
+
+	// A battery taken out leaves the others' sum
+	SInt64 last = fixtures[kAggregateTestBatteries - 1]->psNumber(kIOPMPSCurrentCapacityKey);
+
+	delete fixtures[kAggregateTestBatteries - 1];
+
+	CHECK_EQ(kAggregateTestBatteries - 1, aggregateNumber(first, "BatteryCount"));
+	CHECK_EQ(current - last, aggregateNumber(first, kIOPMPSCurrentCapacityKey));
+
+	for (UInt32 i = 0; i < kAggregateTestBatteries - 1; i++)
+		delete fixtures[i];
+}
+
+TEST(AggregateBatteriesSharePollTicks)
+{
+	FakeACPIDevice				*devices[kAggregateTestBatteries];
+	BatteryFixture				*fixtures[kAggregateTestBatteries];
+	std::vector<uint64_t>		polls[kAggregateTestBatteries];
+	uint64_t					start;
+
+	// Started out of step with one another
+	for (UInt32 i = 0; i < kAggregateTestBatteries; i++)
+	{
+		devices[i]	= numberedBattery(i);
+		fixtures[i]	= new BatteryFixture(devices[i]);
+		HostRunThreadCalls();
+
+		devices[i]->setHook("_BST", recordPoll, &polls[i]);
+		HostClockAdvance(kAggregateStaggerMS);
+	}
+
+	start = HostClockMS();
+
+	while (HostClockMS() - start < kAggregateRunMS)
+	{
+		HostClockAdvance(HostNextTimerMS());
+		HostRunThreadCalls();
+	}
+
+	// Once settled, every battery is read at the same ticks
+	std::vector<uint64_t> settled[kAggregateTestBatteries];
+
+	for (UInt32 i = 0; i < kAggregateTestBatteries; i++)
+	{
+		for (size_t poll = 0; poll < polls[i].size(); poll++)
+		{
+			if (polls[i][poll] >= start + kAggregateSettleMS)
+				settled[i].push_back(polls[i][poll]);
+		}
+	}
+
+	CHECK(settled[0].size() >= 2);
+
+	for (UInt32 i = 1; i < kAggregateTestBatteries; i++)
+		CHECK(settled[i] == settled[0]);
+
+	for (UInt32 i = 0; i < kAggregateTestBatteries; i++)
+		delete fixtures[i];
+}
+
+BENCH(AggregateBatteryScaling)
+{
+	static const UInt32		counts[] = { 1, 2, 8, kAggregateBenchMax };
+	static BatteryFixture	*fixtures[kAggregateBenchMax];
+	OSArray					*status[2];
+	char					metric[64];
+
+	status[0] = CreateBSTPackage(BATTERY_DISCHARGING, 1000, 3900, 11500);
+	status[1] = CreateBSTPackage(BATTERY_DISCHARGING, 1100, 3890, 11500);
+
+	for (UInt32 c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		UInt32		count = counts[c];
+		uint64_t	start;
+		double		perUpdate;
+
+		for (UInt32 i = 0; i < count; i++)
+			fixtures[i] = new BatteryFixture(numberedBattery(i % kAggregateTestBatteries));
+
+		HostRunThreadCalls();
+
+		// Each _BST folds one battery into the totals and republishes them
+		start = BenchNowNS();
+
+		for (UInt32 update = 0; update < kAggregateBenchUpdates; update++)
+			fixtures[update % count]->battery->setBatteryBST(status[(update / count) & 1]);
+
+		perUpdate = (double) (BenchNowNS() - start) / kAggregateBenchUpdates;
+
+		snprintf(metric, sizeof(metric), "%u batteries, per _BST", (unsigned int) count);
+		BenchReport("AggregateBatteryScaling", metric, perUpdate, "ns");
+
+		CHECK_EQ(count, aggregateNumber(*fixtures[0], "BatteryCount"));
+
+		for (UInt32 i = 0; i < count; i++)
+			delete fixtures[i];
+	}
+
+	status[0]->release();
+	status[1]->release();
+}
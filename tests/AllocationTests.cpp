@@ -0,0 +1,67 @@
+/*
+ * Allocations on the steady-state poll path: once everything a poll
+ * publishes exists, polling again only updates it in place.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+enum
+{
+	kSteadyPackages	= 8,
+	kSteadyPolls	= 200
+};
+
+// Runs whatever the battery has armed next: a poll, an interpolation
+// step or a notification refresh
+static void runNextTimer(void)
+{
+	uint64_t next = HostNextTimerMS();
+
+	if (next != ~0ULL)
+		HostClockAdvance(next);
+
+	HostRunThreadCalls();
+}
+
+TEST(SteadyPollsAllocateNothing)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	BatteryFixture	fixture(device);
+	OSArray			*status[kSteadyPackages];
+	SInt64			objects;
+	SInt64			mallocs;
+
+	// Readings that differ in every field the driver publishes from _BST,
+	// made up front so the test's own packages aren't counted
+	for (UInt32 i = 0; i < kSteadyPackages; i++)
+		status[i] = CreateBSTPackage(BATTERY_DISCHARGING, 1000 + 10 * i, 4000 - 5 * i, 11500 + 3 * i);
+
+	HostRunThreadCalls();
+
+	// Let every published object come into being once
+	for (UInt32 i = 0; i < kSteadyPackages; i++)
+	{
+		device->setObject("_BST", status[i]);
+		runNextTimer();
+	}
+
+	objects = HostCreatedObjects();
+	mallocs = HostMallocs();
+
+	for (UInt32 i = 0; i < kSteadyPolls; i++)
+	{
+		device->setObject("_BST", status[i % kSteadyPackages]);
+		runNextTimer();
+	}
+
+	CHECK_EQ(objects, HostCreatedObjects());
+	CHECK_EQ(mallocs, HostMallocs());
+
+	// The polls did publish
+	CHECK(fixture.psNumber(kIOPMPSCurrentCapacityKey) > 0);
+
+	for (UInt32 i = 0; i < kSteadyPackages; i++)
+		status[i]->release();
+}
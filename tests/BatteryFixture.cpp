@@ -0,0 +1,75 @@
+#include "BatteryFixture.h"
+
+BatteryFixture::BatteryFixture(IOACPIPlatformDevice *inDevice, const char *rateEstimator,
+							   OSDictionary *properties)
+{
+	device = inDevice;
+	if (!device) {
+		device = new IOACPIPlatformDevice;
+		device->init();
+	}
+
+	manager = new AppleSmartBatteryManager;
+	manager->init(NULL);
+
+	if (rateEstimator)
+		manager->setProperty(kRateEstimatorKey, rateEstimator);
+	for (unsigned int i = 0; properties && (i < properties->getCount()); i++)
+		manager->setProperty(properties->getKey(i), properties->getObjectAt(i));
+
+	manager->attach(device);
+	started = manager->start(device);
+
+	battery = OSDynamicCast(AppleSmartBattery, manager->getClient());
+}
+
+BatteryFixture::~BatteryFixture()
+{
+	stop();
+	device->release();
+}
+
+void BatteryFixture::stop(void)
+{
+	if (!manager)
+		return;
+
+	manager->stop(device);
+	manager->detach(device);
+	manager->release();
+
+	manager = NULL;
+	battery = NULL;
+}
+
+OSObject *BatteryFixture::psProperty(const char *key)
+{
+	const OSSymbol	*symbol = OSSymbol::withCString(key);
+	OSObject		*value = battery->getPSProperty(symbol);
+
+	symbol->release();
+
+	return value;
+}
+
+SInt64 BatteryFixture::psNumber(const char *key)
+{
+	OSNumber *number = OSDynamicCast(OSNumber, psProperty(key));
+
+	return number ? (SInt32) number->unsigned32BitValue() : -1;
+}
+
+OSArray *CreateBSTPackage(UInt32 state, UInt32 rate, UInt32 capacity, UInt32 voltage)
+{
+	OSArray		*package = OSArray::withCapacity(4);
+	UInt32		values[] = { state, rate, capacity, voltage };
+
+	for (UInt32 i = 0; i < 4; i++)
+	{
+		OSNumber *number = OSNumber::withNumber(values[i], 32);
+		package->setObject(number);
+		number->release();
+	}
+
+	return package;
+}
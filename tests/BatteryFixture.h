@@ -0,0 +1,38 @@
+/*
+ * A manager and its battery started on an ACPI device, the way the kernel
+ * matches them, and torn down again through the manager.
+ */
+
+#ifndef __BatteryFixture__
+#define __BatteryFixture__
+
+#include "AppleSmartBatteryManager.h"
+#include "AppleSmartBattery.h"
+
+class BatteryFixture
+{
+public:
+	// Takes over the caller's reference on device; a bare device (no
+	// methods at all) when NULL. rateEstimator and properties are set on
+	// the manager before it starts, as Info.plist would.
+	explicit BatteryFixture(IOACPIPlatformDevice *device = NULL, const char *rateEstimator = NULL,
+							OSDictionary *properties = NULL);
+	~BatteryFixture();
+
+	// Stops and releases the manager (and with it the battery) now
+	void	stop(void);
+
+	// The battery's power source dictionary, as published on updateStatus()
+	OSObject	*psProperty(const char *key);
+	SInt64		psNumber(const char *key);
+
+	IOACPIPlatformDevice		*device;
+	AppleSmartBatteryManager	*manager;
+	AppleSmartBattery			*battery;
+	bool						started;
+};
+
+// An _BST package: state, rate, remaining capacity, voltage
+OSArray	*CreateBSTPackage(UInt32 state, UInt32 rate, UInt32 capacity, UInt32 voltage);
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * DecodeACPIPackage() and ConvertACPICapacities() against a small schema
+ * that has one field of every kind.
+ */
+
+#include "TestHarness.h"
+#include "AppleSmartBattery.h"
+#include "FakeACPIDevice.h"
+
+typedef struct TestPackage
+{
+	UInt32			capacity;
+	UInt32			flags;
+	OSSymbol		*name;
+	ACPIBytes		data;
+} TestPackage;
+
+static const ACPIPackageField testFields[] =
+{
+	ACPI_INTEGER(0,	TestPackage, capacity,	kACPIUnitCapacity,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(1,	TestPackage, flags,		kACPIUnitNone,		7,					NULL),
+	ACPI_STRING (2,	TestPackage, name,									NULL),
+	ACPI_BUFFER (3,	TestPackage, data)
+};
+
+static void addNumber(OSArray *package, UInt32 value)
+{
+	OSNumber *number = OSNumber::withNumber(value, 32);
+	package->setObject(number);
+	number->release();
+}
+
+static void addString(OSArray *package, const char *value)
+{
+	OSString *string = OSString::withCString(value);
+	package->setObject(string);
+	string->release();
+}
+
+static void addData(OSArray *package, const void *bytes, unsigned int length)
+{
+	OSData *data = OSData::withBytes(bytes, length);
+	package->setObject(data);
+	data->release();
+}
+
+static bool symbolIs(const OSSymbol *symbol, const char *value)
+{
+	return symbol && !strcmp(symbol->getCStringNoCopy(), value);
+}
+
+TEST(DecodeFullPackage)
+{
+	OSArray		*package = OSArray::withCapacity(4);
+	TestPackage	decoded;
+
+	addNumber(package, 5000);
+	addNumber(package, 3);
+	addString(package, "Model");
+	addData(package, "\x01\x02\x03", 3);
+
+	bzero(&decoded, sizeof(decoded));
+	CHECK_EQ(kIOReturnSuccess, DecodeACPIPackage(package, testFields, ACPI_FIELD_COUNT(testFields), &decoded));
+
+	CHECK_EQ(5000, decoded.capacity);
+	CHECK_EQ(3, decoded.flags);
+	CHECK(symbolIs(decoded.name, "Model"));
+	CHECK_EQ(3, decoded.data.length);
+	CHECK(decoded.data.bytes && !memcmp(decoded.data.bytes, "\x01\x02\x03", 3));
+
+	decoded.name->release();
+	package->release();
+}
+
+TEST(DecodeShortPackageUsesSentinels)
+{
+	OSArray		*package = OSArray::withCapacity(2);
+	TestPackage	decoded;
+
+	addNumber(package, 5000);
+
+	bzero(&decoded, sizeof(decoded));
+	CHECK_EQ(kIOReturnUnderrun, DecodeACPIPackage(package, testFields, ACPI_FIELD_COUNT(testFields), &decoded));
+
+	CHECK_EQ(5000, decoded.capacity);
+	CHECK_EQ(7, decoded.flags);
+	CHECK(symbolIs(decoded.name, "Unknown"));
+	CHECK(!decoded.data.bytes);
+	CHECK_EQ(0, decoded.data.length);
+
+	decoded.name->release();
+	package->release();
+}
+
+TEST(DecodeWrongTypesUseSentinels)
+{
+	OSArray		*package = OSArray::withCapacity(4);
+	TestPackage	decoded;
+
+	addString(package, "not a number");
+	addData(package, "\x00", 1);
+	addNumber(package, 42);
+	addNumber(package, 43);
+
+	bzero(&decoded, sizeof(decoded));
+	CHECK_EQ(kIOReturnSuccess, DecodeACPIPackage(package, testFields, ACPI_FIELD_COUNT(testFields), &decoded));
+
+	CHECK_EQ(ACPI_UNKNOWN, decoded.capacity);
+	CHECK_EQ(7, decoded.flags);
+	CHECK(symbolIs(decoded.name, "Unknown"));
+	CHECK(!decoded.data.bytes);
+
+	decoded.name->release();
+	package->release();
+}
+
+TEST(DecodeReusesMatchingCandidateSymbol)
+{
+	OSArray			*package = OSArray::withCapacity(4);
+	const OSSymbol	*candidate = OSSymbol::withCString("Model");
+	int				references = candidate->getRetainCount();
+	TestPackage		decoded;
+
+	addNumber(package, 1);
+	addNumber(package, 2);
+	addString(package, "Model");
+
+	bzero(&decoded, sizeof(decoded));
+	decoded.name = (OSSymbol *) candidate;
+	DecodeACPIPackage(package, testFields, ACPI_FIELD_COUNT(testFields), &decoded);
+
+	CHECK(decoded.name == candidate);
+	CHECK_EQ(references + 1, candidate->getRetainCount());
+
+	decoded.name->release();
+	candidate->release();
+	package->release();
+}
+
+TEST(DecodeStringFromBuffer)
+{
+	OSArray		*package = OSArray::withCapacity(4);
+	OSArray		*terminated = OSArray::withCapacity(4);
+	TestPackage	decoded;
+
+	// Firmware often returns strings as unterminated buffers, or with
+	// padding after a NUL
+	addNumber(package, 1);
+	addNumber(package, 2);
+	addData(package, "ABC", 3);
+
+	addNumber(terminated, 1);
+	addNumber(terminated, 2);
+	addData(terminated, "AB\0CD", 5);
+
+	bzero(&decoded, sizeof(decoded));
+	DecodeACPIPackage(package, testFields, ACPI_FIELD_COUNT(testFields), &decoded);
+	CHECK(symbolIs(decoded.name, "ABC"));
+	decoded.name->release();
+
+	bzero(&decoded, sizeof(decoded));
+	DecodeACPIPackage(terminated, testFields, ACPI_FIELD_COUNT(testFields), &decoded);
+	CHECK(symbolIs(decoded.name, "AB"));
+	decoded.name->release();
+
+	package->release();
+	terminated->release();
+}
+
+TEST(ConvertCapacitiesSkipsSentinelsAndOtherUnits)
+{
+	TestPackage decoded;
+
+	bzero(&decoded, sizeof(decoded));
+	decoded.capacity	= 50000;
+	decoded.flags		= 50000;
+
+	ConvertACPICapacities(testFields, ACPI_FIELD_COUNT(testFields), &decoded, 10000);
+	CHECK_EQ(5, decoded.capacity);
+	CHECK_EQ(50000, decoded.flags);
+
+	decoded.capacity = ACPI_UNKNOWN;
+	ConvertACPICapacities(testFields, ACPI_FIELD_COUNT(testFields), &decoded, 10000);
+	CHECK_EQ(ACPI_UNKNOWN, decoded.capacity);
+
+	// No usable voltage: left as reported
+	decoded.capacity = 50000;
+	ConvertACPICapacities(testFields, ACPI_FIELD_COUNT(testFields), &decoded, 0);
+	ConvertACPICapacities(testFields, ACPI_FIELD_COUNT(testFields), &decoded, ACPI_UNKNOWN);
+	CHECK_EQ(50000, decoded.capacity);
+}
+
+/*
+ * Decode cost for packages shaped like _BIX and BBIX. The schemas mirror the
+ * driver's (without the published keys); the per-field reference does what
+ * decoding did before the typed view, a cast per field and a fresh symbol
+ * per string.
+ */
+
+static const ACPIPackageField benchBIXFields[] =
+{
+	ACPI_INTEGER(BIX_REVISION,				ACPIBatteryInfo, revision,			kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_POWER_UNIT,			ACPIBatteryInfo, powerUnit,			kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_DESIGN_CAPACITY,		ACPIBatteryInfo, designCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_LAST_FULL_CAPACITY,	ACPIBatteryInfo, lastFullCapacity,	kACPIUnitCapacity,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_TECHNOLOGY,			ACPIBatteryInfo, technology,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_DESIGN_VOLTAGE,		ACPIBatteryInfo, designVoltage,		kACPIUnitMilliVolts,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_CAPACITY_WARNING,		ACPIBatteryInfo, capacityWarning,	kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_LOW_WARNING,			ACPIBatteryInfo, capacityLow,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_CYCLE_COUNT,			ACPIBatteryInfo, cycleCount,		kACPIUnitNone,			ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_ACCURACY,				ACPIBatteryInfo, accuracy,			kACPIUnitPercent,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_MAX_SAMPLE_TIME,		ACPIBatteryInfo, maxSampleTime,		kACPIUnitMilliSeconds,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_MIN_SAMPLE_TIME,		ACPIBatteryInfo, minSampleTime,		kACPIUnitMilliSeconds,	ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BIX_MAX_AVG_INTERVAL,		ACPIBatteryInfo, maxAverageInterval, kACPIUnitMilliSeconds,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_MIN_AVG_INTERVAL,		ACPIBatteryInfo, minAverageInterval, kACPIUnitMilliSeconds,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_GRANULARITY_1,			ACPIBatteryInfo, granularity1,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BIX_GRANULARITY_2,			ACPIBatteryInfo, granularity2,		kACPIUnitCapacity,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_STRING (BIX_MODEL_NUMBER,			ACPIBatteryInfo, model,											NULL),
+	ACPI_STRING (BIX_SERIAL_NUMBER,			ACPIBatteryInfo, serial,										NULL),
+	ACPI_STRING (BIX_BATTERY_TYPE,			ACPIBatteryInfo, type,											NULL),
+	ACPI_STRING (BIX_OEM,					ACPIBatteryInfo, oem,											NULL)
+};
+
+static const ACPIPackageField benchBBIXFields[] =
+{
+	ACPI_INTEGER(BBIX_MANUF_ACCESS,			ACPIBatteryExtraInfo, manufacturerAccess,		kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_BATTERYMODE,			ACPIBatteryExtraInfo, batteryMode,				kACPIUnitNone,			ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_ATRATETIMETOFULL,		ACPIBatteryExtraInfo, atRateTimeToFull,			kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_ATRATETIMETOEMPTY,	ACPIBatteryExtraInfo, atRateTimeToEmpty,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_TEMPERATURE,			ACPIBatteryExtraInfo, temperature,				kACPIUnitTenthKelvin,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_VOLTAGE,				ACPIBatteryExtraInfo, voltage,					kACPIUnitMilliVolts,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_CURRENT,				ACPIBatteryExtraInfo, current,					kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_AVG_CURRENT,			ACPIBatteryExtraInfo, averageCurrent,			kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_REL_STATE_CHARGE,		ACPIBatteryExtraInfo, relativeStateOfCharge,	kACPIUnitPercent,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_ABS_STATE_CHARGE,		ACPIBatteryExtraInfo, absoluteStateOfCharge,	kACPIUnitPercent,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_REMAIN_CAPACITY,		ACPIBatteryExtraInfo, remainingCapacity,		kACPIUnitMilliAmps,		ACPI_NO_SENTINEL,	NULL),
+	ACPI_INTEGER(BBIX_RUNTIME_TO_EMPTY,		ACPIBatteryExtraInfo, runTimeToEmpty,			kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_AVG_TIME_TO_EMPTY,	ACPIBatteryExtraInfo, averageTimeToEmpty,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_AVG_TIME_TO_FULL,		ACPIBatteryExtraInfo, averageTimeToFull,		kACPIUnitMinutes,		ACPI_UNKNOWN,		NULL),
+	ACPI_INTEGER(BBIX_MANUF_DATE,			ACPIBatteryExtraInfo, manufactureDate,			kACPIUnitPackedDate,	ACPI_NO_SENTINEL,	NULL),
+	ACPI_BUFFER (BBIX_MANUF_DATA,			ACPIBatteryExtraInfo, manufacturerData)
+};
+
+enum
+{
+	kDecodeBenchRounds	= 200000
+};
+
+static OSArray *createBBIXPackage(void)
+{
+	OSArray *package = OSArray::withCapacity(16);
+
+	for (UInt32 i = 0; i < BBIX_MANUF_DATA; i++)
+		addNumber(package, 100 + i);
+
+	addData(package, "\x10\x20\x30\x40\x50\x60\x70\x80", 8);
+
+	return package;
+}
+
+static void releaseSymbols(const ACPIPackageField *fields, UInt32 fieldCount, void *decoded)
+{
+	for (UInt32 i = 0; i < fieldCount; i++)
+	{
+		OSSymbol **symbol = (OSSymbol **) ((UInt8 *) decoded + fields[i].offset);
+
+		if (kACPIFieldString == fields[i].type && *symbol) {
+			(*symbol)->release();
+			*symbol = NULL;
+		}
+	}
+}
+
+// One cast per field and a new symbol per string, as before the typed view
+static void decodePerField(OSArray *package, const ACPIPackageField *fields, UInt32 fieldCount, void *decoded)
+{
+	char	buffer[kACPIStringMax + 1];
+
+	for (UInt32 i = 0; i < fieldCount; i++)
+	{
+		const ACPIPackageField	*field = &fields[i];
+		OSObject				*element = package->getObject(field->index);
+		void					*member = (UInt8 *) decoded + field->offset;
+
+		if (kACPIFieldInteger == field->type)
+		{
+			OSNumber *number = OSDynamicCast(OSNumber, element);
+			*(UInt32 *) member = number ? number->unsigned32BitValue() : field->sentinel;
+		}
+		else if (kACPIFieldString == field->type)
+		{
+			OSString	*string = OSDynamicCast(OSString, element);
+			OSData		*data = OSDynamicCast(OSData, element);
+
+			if (string)
+				snprintf(buffer, sizeof(buffer), "%s", string->getCStringNoCopy());
+			else if (data)
+				snprintf(buffer, sizeof(buffer), "%.*s", (int) data->getLength(), (const char *) data->getBytesNoCopy());
+			else
+				snprintf(buffer, sizeof(buffer), "Unknown");
+
+			*(const OSSymbol **) member = OSSymbol::withCString(buffer);
+		}
+		else
+		{
+			OSData		*data = OSDynamicCast(OSData, element);
+			ACPIBytes	*bytes = (ACPIBytes *) member;
+
+			bytes->bytes	= data ? data->getBytesNoCopy() : NULL;
+			bytes->length	= data ? data->getLength() : 0;
+		}
+	}
+}
+
+static double nsPerDecode(OSArray *package, const ACPIPackageField *fields, UInt32 fieldCount,
+						  void *decoded, size_t size, bool typedView, bool keepSymbols)
+{
+	uint64_t start;
+
+	bzero(decoded, size);
+	start = BenchNowNS();
+
+	for (UInt32 i = 0; i < kDecodeBenchRounds; i++)
+	{
+		// Keeping the symbols across rounds is the steady state: the
+		// driver hands the previous read's symbols back as candidates
+		if (!keepSymbols || !typedView)
+			releaseSymbols(fields, fieldCount, decoded);
+
+		if (typedView)
+			DecodeACPIPackage(package, fields, fieldCount, decoded);
+		else
+			decodePerField(package, fields, fieldCount, decoded);
+	}
+
+	start = BenchNowNS() - start;
+	releaseSymbols(fields, fieldCount, decoded);
+
+	return (double) start / kDecodeBenchRounds;
+}
+
+BENCH(DecodeBatteryPackages)
+{
+	OSArray					*bix = CreateBIXPackage(1, 5400, 5200, 11100, 42, "SN0001");
+	OSArray					*bbix = createBBIXPackage();
+	ACPIBatteryInfo			info;
+	ACPIBatteryExtraInfo	extra;
+
+	BenchReport("DecodeBatteryPackages", "_BIX, typed view, unchanged strings",
+				nsPerDecode(bix, benchBIXFields, ACPI_FIELD_COUNT(benchBIXFields), &info, sizeof(info), true, true), "ns");
+	BenchReport("DecodeBatteryPackages", "_BIX, typed view, new strings",
+				nsPerDecode(bix, benchBIXFields, ACPI_FIELD_COUNT(benchBIXFields), &info, sizeof(info), true, false), "ns");
+	BenchReport("DecodeBatteryPackages", "_BIX, cast per field",
+				nsPerDecode(bix, benchBIXFields, ACPI_FIELD_COUNT(benchBIXFields), &info, sizeof(info), false, false), "ns");
+	BenchReport("DecodeBatteryPackages", "BBIX, typed view",
+				nsPerDecode(bbix, benchBBIXFields, ACPI_FIELD_COUNT(benchBBIXFields), &extra, sizeof(extra), true, true), "ns");
+	BenchReport("DecodeBatteryPackages", "BBIX, cast per field",
+				nsPerDecode(bbix, benchBBIXFields, ACPI_FIELD_COUNT(benchBBIXFields), &extra, sizeof(extra), false, false), "ns");
+
+	bix->release();
+	bbix->release();
+}
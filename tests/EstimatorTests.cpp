@@ -0,0 +1,239 @@
+/*
+ * The average rate estimators, fed _BST packages directly at chosen times.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+static void applyBST(BatteryFixture &fixture, UInt32 state, UInt32 rate, UInt32 capacity)
+{
+	OSArray *package = CreateBSTPackage(state, rate, capacity, 12000);
+
+	fixture.battery->setBatteryBST(package);
+	package->release();
+}
+
+// A battery whose polls never read _BST, so only the readings fed here
+// reach the estimator
+static FakeACPIDevice *quietBattery(void)
+{
+	FakeACPIDevice *device = FakeACPIDevice::withBattery(false);
+
+	device->failEvery("_BST", 1);
+	return device;
+}
+
+TEST(EstimatorDefaultsToEWMA)
+{
+	BatteryFixture fixture;
+
+	CHECK(fixture.started);
+	CHECK(fixture.battery);
+
+	OSString *name = OSDynamicCast(OSString, fixture.battery->getProperty(kRateEstimatorKey));
+	CHECK(name && name->isEqualTo("EWMA"));
+}
+
+TEST(EstimatorEWMA)
+{
+	BatteryFixture fixture(quietBattery(), "EWMA");
+
+	applyBST(fixture, BATTERY_DISCHARGING, 1000, 5000);
+	CHECK_EQ(-1000, fixture.psNumber(kIOPMPSAmperageKey));
+
+	// One time constant later the new reading has half the weight
+	HostClockAdvance(60000);
+	applyBST(fixture, BATTERY_DISCHARGING, 2000, 5000);
+	CHECK_EQ(-1500, fixture.psNumber(kIOPMPSAmperageKey));
+	CHECK_EQ(-2000, fixture.psNumber("InstantAmperage"));
+}
+
+TEST(EstimatorEWMAWeighsByElapsedTime)
+{
+	BatteryFixture fixture(quietBattery(), "EWMA");
+
+	applyBST(fixture, BATTERY_DISCHARGING, 1000, 5000);
+
+	// 10 s of a 60 s time constant: 1000 + 1000 * 10 / 70
+	HostClockAdvance(10000);
+	applyBST(fixture, BATTERY_DISCHARGING, 2000, 5000);
+	CHECK_EQ(-1143, fixture.psNumber(kIOPMPSAmperageKey));
+}
+
+TEST(EstimatorPairwise)
+{
+	BatteryFixture fixture(quietBattery(), "Pairwise");
+
+	applyBST(fixture, BATTERY_DISCHARGING, 1000, 5000);
+
+	HostClockAdvance(10000);
+	applyBST(fixture, BATTERY_DISCHARGING, 2000, 5000);
+	CHECK_EQ(-1500, fixture.psNumber(kIOPMPSAmperageKey));
+}
+
+TEST(EstimatorKalman)
+{
+	BatteryFixture fixture(quietBattery(), "Kalman");
+
+	applyBST(fixture, BATTERY_DISCHARGING, 1000, 5000);
+
+	// Prior variance doubles over one time constant, so the reading gets
+	// two thirds of the weight; capacity didn't move, so no dC/dt
+	HostClockAdvance(60000);
+	applyBST(fixture, BATTERY_DISCHARGING, 2000, 5000);
+	CHECK_EQ(-1667, fixture.psNumber(kIOPMPSAmperageKey));
+}
+
+TEST(EstimatorResetsOnStateChange)
+{
+	BatteryFixture fixture(quietBattery(), "EWMA");
+
+	applyBST(fixture, BATTERY_DISCHARGING, 1000, 5000);
+	HostClockAdvance(60000);
+
+	// Charging starts a new average from the first reading
+	applyBST(fixture, BATTERY_CHARGING, 3000, 5000);
+	CHECK_EQ(3000, fixture.psNumber(kIOPMPSAmperageKey));
+	CHECK(kOSBooleanTrue == fixture.psProperty(kIOPMPSIsChargingKey));
+}
+
+/*
+ * Trace replay: a known current profile read through a noisy _BST every
+ * 30 s, replayed through each estimator. Error is against the noise-free
+ * current; CPU is the thread time setBatteryBST() takes per reading, so
+ * differences between estimators are the estimators' own cost.
+ */
+
+enum
+{
+	kReplayPeriodMS		= 30000,
+	kReplayReadings		= 240,			// two hours
+	kReplayWarmup		= 4,
+	kReplayRounds		= 20
+};
+
+enum
+{
+	kTraceSteady = 0,
+	kTraceStep,
+	kTraceBursty,
+	kReplayTraceCount
+};
+
+static const char *replayTraceNames[kReplayTraceCount] =
+{
+	"steady 1500 mA",
+	"step 800 to 3000 mA",
+	"bursty 600/2400 mA"
+};
+
+static const char *estimatorNames[] = { "Pairwise", "EWMA", "Kalman" };
+
+static UInt32 trueCurrent(int trace, UInt32 reading)
+{
+	switch (trace)
+	{
+		case kTraceStep:	return (reading < kReplayReadings / 2) ? 800 : 3000;
+		case kTraceBursty:	return ((reading / 4) & 1) ? 2400 : 600;
+		default:			return 1500;
+	}
+}
+
+// Up to +-300 mA of reading noise, the same sequence every replay
+static SInt32 readingNoise(UInt32 reading)
+{
+	return (SInt32) ((reading * 2654435761U) >> 22) % 601 - 300;
+}
+
+static uint64_t threadCPUNS(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+struct ReplayResult
+{
+	double		meanError;			// mA
+	double		rmsError;			// mA
+	double		rawMeanError;		// mA, the _BST reading itself
+	double		cpuNS;				// per reading
+};
+
+static void replay(int trace, const char *estimator, ReplayResult *result)
+{
+	double		sumError = 0, sumSquares = 0, sumRaw = 0;
+	uint64_t	cpu = 0;
+	UInt32		scored = 0;
+
+	for (UInt32 round = 0; round < kReplayRounds; round++)
+	{
+		BatteryFixture	fixture(quietBattery(), estimator);
+		double			capacity = 5000;
+
+		for (UInt32 i = 0; i < kReplayReadings; i++)
+		{
+			UInt32		current = trueCurrent(trace, i);
+			UInt32		reading = (UInt32) ((SInt32) current + readingNoise(i));
+			OSArray		*package;
+			uint64_t	start;
+
+			capacity -= (double) current * kReplayPeriodMS / 3600000.0;
+			package = CreateBSTPackage(BATTERY_DISCHARGING, reading, (UInt32) capacity, 12000);
+
+			HostClockAdvance(kReplayPeriodMS);
+
+			start = threadCPUNS();
+			fixture.battery->setBatteryBST(package);
+			cpu += threadCPUNS() - start;
+
+			package->release();
+
+			if (round || (i < kReplayWarmup))
+				continue;
+
+			double error = fabs((double) -fixture.psNumber(kIOPMPSAmperageKey) - current);
+
+			sumError	+= error;
+			sumSquares	+= error * error;
+			sumRaw		+= abs(readingNoise(i));
+			scored++;
+		}
+	}
+
+	result->meanError		= sumError / scored;
+	result->rmsError		= sqrt(sumSquares / scored);
+	result->rawMeanError	= sumRaw / scored;
+	result->cpuNS			= (double) cpu / (kReplayRounds * kReplayReadings);
+}
+
+BENCH(EstimatorTraceReplay)
+{
+	char metric[80];
+
+	for (int trace = 0; trace < kReplayTraceCount; trace++)
+	{
+		ReplayResult result;
+
+		for (UInt32 e = 0; e < sizeof(estimatorNames) / sizeof(estimatorNames[0]); e++)
+		{
+			replay(trace, estimatorNames[e], &result);
+
+			snprintf(metric, sizeof(metric), "%s, %s, mean error", replayTraceNames[trace], estimatorNames[e]);
+			BenchReport("EstimatorTraceReplay", metric, result.meanError, "mA");
+			snprintf(metric, sizeof(metric), "%s, %s, RMS error", replayTraceNames[trace], estimatorNames[e]);
+			BenchReport("EstimatorTraceReplay", metric, result.rmsError, "mA");
+			snprintf(metric, sizeof(metric), "%s, %s, CPU", replayTraceNames[trace], estimatorNames[e]);
+			BenchReport("EstimatorTraceReplay", metric, result.cpuNS, "ns/reading");
+		}
+
+		snprintf(metric, sizeof(metric), "%s, raw _BST, mean error", replayTraceNames[trace]);
+		BenchReport("EstimatorTraceReplay", metric, result.rawMeanError, "mA");
+	}
+}
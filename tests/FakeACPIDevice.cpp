@@ -0,0 +1,349 @@
+#include "FakeACPIDevice.h"
+#include "BatteryFixture.h"
+
+OSDefineMetaClassAndStructors(FakeACPIDevice, IOACPIPlatformDevice)
+
+FakeACPIDevice *FakeACPIDevice::device(void)
+{
+	FakeACPIDevice *me = new FakeACPIDevice;
+
+	if (me && !me->init()) {
+		me->release();
+		return NULL;
+	}
+
+	me->jitterSeed = 1;
+
+	return me;
+}
+
+FakeACPIDevice *FakeACPIDevice::withBattery(bool extended)
+{
+	FakeACPIDevice	*me = device();
+	OSArray			*info;
+	OSArray			*status;
+
+	if (!me)
+		return NULL;
+
+	if (extended)
+		info = CreateBIXPackage(1, 5400, 5200, 11100, 42, "SN0001");
+	else
+		info = CreateBIFPackage(1, 5400, 5200, 11100, "SN0001");
+
+	status = CreateBSTPackage(BATTERY_DISCHARGING, 1000, 4000, 11500);
+
+	me->setInteger("_STA", 0x1F);
+	me->setObject(extended ? "_BIX" : "_BIF", info);
+	me->setObject("_BST", status);
+	me->setInteger("_BTP", 0);
+
+	info->release();
+	status->release();
+
+	return me;
+}
+
+void FakeACPIDevice::free(void)
+{
+	std::map<std::string, Method>::iterator it;
+
+	for (it = methods.begin(); it != methods.end(); ++it)
+	{
+		if (it->second.value)
+			it->second.value->release();
+		if (it->second.lastParameter)
+			it->second.lastParameter->release();
+	}
+
+	methods.clear();
+
+	IOACPIPlatformDevice::free();
+}
+
+FakeACPIDevice::Method *FakeACPIDevice::method(const char *name, bool create)
+{
+	std::map<std::string, Method>::iterator it = methods.find(name);
+
+	if (it != methods.end())
+		return &it->second;
+
+	if (!create)
+		return NULL;
+
+	Method fresh;
+
+	bzero(&fresh, sizeof(fresh));
+	fresh.failStatus = kIOReturnTimeout;
+
+	return &(methods[name] = fresh);
+}
+
+void FakeACPIDevice::setInteger(const char *name, UInt32 value)
+{
+	OSNumber *number = OSNumber::withNumber(value, 32);
+
+	setObject(name, number);
+	number->release();
+}
+
+void FakeACPIDevice::setObject(const char *name, OSObject *value)
+{
+	Method *m = method(name, true);
+
+	if (value)
+		value->retain();
+	if (m->value)
+		m->value->release();
+
+	m->value = value;
+}
+
+void FakeACPIDevice::removeMethod(const char *name)
+{
+	setObject(name, NULL);
+}
+
+void FakeACPIDevice::setLatency(const char *name, UInt32 ms, UInt32 jitterMS)
+{
+	Method *m = method(name, true);
+
+	m->latencyMS	= ms;
+	m->jitterMS		= jitterMS;
+}
+
+void FakeACPIDevice::failNext(const char *name, UInt32 count, IOReturn status)
+{
+	Method *m = method(name, true);
+
+	m->failCount	= count;
+	m->failStatus	= status;
+}
+
+void FakeACPIDevice::failEvery(const char *name, UInt32 period, IOReturn status)
+{
+	Method *m = method(name, true);
+
+	m->failPeriod	= period;
+	m->failStatus	= status;
+}
+
+void FakeACPIDevice::setHook(const char *name, FakeACPIHook hook, void *context)
+{
+	Method *m = method(name, true);
+
+	m->hook			= hook;
+	m->hookContext	= context;
+}
+
+UInt32 FakeACPIDevice::evaluations(const char *name)
+{
+	Method *m = method(name, false);
+
+	return m ? m->evaluations : 0;
+}
+
+UInt32 FakeACPIDevice::gatedEvaluations(const char *name)
+{
+	Method *m = method(name, false);
+
+	return m ? m->gatedEvaluations : 0;
+}
+
+void FakeACPIDevice::resetEvaluations(void)
+{
+	std::map<std::string, Method>::iterator it;
+
+	for (it = methods.begin(); it != methods.end(); ++it)
+	{
+		it->second.evaluations		= 0;
+		it->second.gatedEvaluations	= 0;
+	}
+}
+
+void FakeACPIDevice::emulateTripPoint(IOService *target)
+{
+	tripTarget	= target;
+	tripPoint	= 0;
+	tripFired	= 0;
+}
+
+void FakeACPIDevice::setBatteryStatus(UInt32 state, UInt32 rate, UInt32 capacity)
+{
+	Method		*m = method("_BST", false);
+	OSArray		*package = (m && m->value) ? OSDynamicCast(OSArray, m->value) : NULL;
+	OSNumber	*number = package ? OSDynamicCast(OSNumber, package->getObject(2)) : NULL;
+	UInt32		previous = number ? number->unsigned32BitValue() : capacity;
+
+	package = CreateBSTPackage(state, rate, capacity, 11500);
+	setObject("_BST", package);
+	package->release();
+
+	if (!tripTarget || !tripPoint)
+		return;
+
+	if (((previous > tripPoint) && (capacity <= tripPoint))
+		|| ((previous < tripPoint) && (capacity >= tripPoint)))
+	{
+		tripPoint = 0;
+		tripFired++;
+		tripTarget->message(kIOACPIMessageDeviceNotification, this, (void *) 0x80);
+	}
+}
+
+OSObject *FakeACPIDevice::lastParameter(const char *name)
+{
+	Method *m = method(name, false);
+
+	return m ? m->lastParameter : NULL;
+}
+
+IOReturn FakeACPIDevice::evaluateObject(const char *objectName, OSObject **result,
+										OSObject *params[], IOItemCount paramCount,
+										IOOptionBits options)
+{
+	Method			*m = method(objectName, false);
+	FakeACPIHook	hook;
+	UInt32			latency;
+	bool			fail;
+
+	if (result)
+		*result = NULL;
+
+	if (!m || !m->value)
+		return kIOReturnNotFound;
+
+	m->evaluations++;
+
+	if (getWorkLoop()->inGate())
+		m->gatedEvaluations++;
+
+	if (m->lastParameter) {
+		m->lastParameter->release();
+		m->lastParameter = NULL;
+	}
+
+	if (paramCount && params && params[0]) {
+		m->lastParameter = params[0];
+		m->lastParameter->retain();
+	}
+
+	latency = m->latencyMS;
+	if (m->jitterMS) {
+		jitterSeed = jitterSeed * 1103515245 + 12345;
+		latency += (jitterSeed >> 8) % (m->jitterMS + 1);
+	}
+
+	if (latency)
+		HostClockAdvance(latency);
+
+	// The hook may rescript this very method
+	hook = m->hook;
+	m->hook = NULL;
+	if (hook)
+		hook(this, objectName, m->hookContext);
+
+	m = method(objectName, false);
+	if (!m->value)
+		return kIOReturnNotFound;
+
+	fail = false;
+	if (m->failCount) {
+		m->failCount--;
+		fail = true;
+	}
+	else if (m->failPeriod && !(m->evaluations % m->failPeriod)) {
+		fail = true;
+	}
+
+	if (fail)
+		return m->failStatus;
+
+	// What the EC arms
+	if (tripTarget && !strcmp(objectName, "_BTP")) {
+		OSNumber *trip = (paramCount && params) ? OSDynamicCast(OSNumber, params[0]) : NULL;
+
+		tripPoint = trip ? trip->unsigned32BitValue() : 0;
+	}
+
+	if (result) {
+		m->value->retain();
+		*result = m->value;
+	}
+
+	return kIOReturnSuccess;
+}
+
+IOReturn FakeACPIDevice::validateObject(const char *objectName)
+{
+	Method *m = method(objectName, false);
+
+	return (m && m->value) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+static void appendNumber(OSArray *package, UInt32 value)
+{
+	OSNumber *number = OSNumber::withNumber(value, 32);
+
+	package->setObject(number);
+	number->release();
+}
+
+static void appendString(OSArray *package, const char *value)
+{
+	OSString *string = OSString::withCString(value);
+
+	package->setObject(string);
+	string->release();
+}
+
+OSArray *CreateBIXPackage(UInt32 powerUnit, UInt32 designCapacity, UInt32 lastFullCapacity,
+						  UInt32 designVoltage, UInt32 cycleCount, const char *serial)
+{
+	OSArray *package = OSArray::withCapacity(20);
+
+	appendNumber(package, 0);					// Revision
+	appendNumber(package, powerUnit);
+	appendNumber(package, designCapacity);
+	appendNumber(package, lastFullCapacity);
+	appendNumber(package, 1);					// Rechargeable
+	appendNumber(package, designVoltage);
+	appendNumber(package, designCapacity / 10);	// Warning
+	appendNumber(package, designCapacity / 20);	// Low
+	appendNumber(package, cycleCount);
+	appendNumber(package, 1000);				// Accuracy, 1%
+	appendNumber(package, ACPI_UNKNOWN);		// Max sampling time
+	appendNumber(package, ACPI_UNKNOWN);		// Min sampling time
+	appendNumber(package, 60000);				// Max averaging interval
+	appendNumber(package, 1000);				// Min averaging interval
+	appendNumber(package, 10);					// Granularity 1
+	appendNumber(package, 10);					// Granularity 2
+	appendString(package, "TestModel");
+	appendString(package, serial);
+	appendString(package, "LION");
+	appendString(package, "TestOEM");
+
+	return package;
+}
+
+OSArray *CreateBIFPackage(UInt32 powerUnit, UInt32 designCapacity, UInt32 lastFullCapacity,
+						  UInt32 designVoltage, const char *serial)
+{
+	OSArray *package = OSArray::withCapacity(13);
+
+	appendNumber(package, powerUnit);
+	appendNumber(package, designCapacity);
+	appendNumber(package, lastFullCapacity);
+	appendNumber(package, 1);					// Rechargeable
+	appendNumber(package, designVoltage);
+	appendNumber(package, designCapacity / 10);	// Warning
+	appendNumber(package, designCapacity / 20);	// Low
+	appendNumber(package, 10);					// Granularity 1
+	appendNumber(package, 10);					// Granularity 2
+	appendString(package, "TestModel");
+	appendString(package, serial);
+	appendString(package, "LION");
+	appendString(package, "TestOEM");
+
+	return package;
+}
@@ -0,0 +1,116 @@
+/*
+ * An ACPI battery device whose methods are scripted by the test. Everything
+ * the driver evaluates goes through AppleSmartBatteryManager's
+ * evaluateBatteryObject()/evaluateBatteryInteger(), which land here.
+ *
+ * Evaluation "takes" its scripted latency by moving the host clock forward
+ * from inside evaluateObject(), so timers armed on the work loop come due
+ * while the method is still being evaluated, as they would on a slow EC.
+ */
+
+#ifndef __FakeACPIDevice__
+#define __FakeACPIDevice__
+
+#include <map>
+#include <string>
+
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+
+class FakeACPIDevice;
+
+// Runs inside an evaluation, after its latency and before it returns
+typedef void (*FakeACPIHook)(FakeACPIDevice *device, const char *method, void *context);
+
+class FakeACPIDevice : public IOACPIPlatformDevice
+{
+	OSDeclareDefaultStructors(FakeACPIDevice)
+
+public:
+	// An empty namespace; script methods before the manager starts
+	static FakeACPIDevice	*device(void);
+
+	// A battery present in the bay, with _BIX (or _BIF), _BST and _BTP
+	static FakeACPIDevice	*withBattery(bool extended = true);
+
+	virtual void	free(void);
+
+	// The method returns value from now on. setObject() retains it.
+	void	setInteger(const char *method, UInt32 value);
+	void	setObject(const char *method, OSObject *value);
+
+	// The method disappears from the namespace
+	void	removeMethod(const char *method);
+
+	// Every evaluation takes ms, plus up to jitterMS more
+	void	setLatency(const char *method, UInt32 ms, UInt32 jitterMS = 0);
+
+	// The next count evaluations fail with status
+	void	failNext(const char *method, UInt32 count, IOReturn status = kIOReturnTimeout);
+
+	// One in every period evaluations fails, deterministically
+	void	failEvery(const char *method, UInt32 period, IOReturn status = kIOReturnTimeout);
+
+	// hook runs once, during the next evaluation of method
+	void	setHook(const char *method, FakeACPIHook hook, void *context = NULL);
+
+	UInt32		evaluations(const char *method);
+	void		resetEvaluations(void);
+
+	// First parameter of the last evaluation, or NULL
+	OSObject	*lastParameter(const char *method);
+
+	// Evaluations made while a work loop gate was held
+	UInt32		gatedEvaluations(const char *method);
+
+	// Emulates the EC's trip point: the value last written with _BTP fires
+	// once, when setBatteryStatus() moves the capacity onto or past it,
+	// sending Notify(0x80) to target (not retained). It is not armed again
+	// until the driver writes _BTP again.
+	void		emulateTripPoint(IOService *target);
+
+	// Scripts _BST, and fires the trip point if the capacity crossed it
+	void		setBatteryStatus(UInt32 state, UInt32 rate, UInt32 capacity);
+
+	// The armed trip point, 0 for none, and how often it has fired
+	UInt32		programmedTripPoint(void) { return tripPoint; }
+	UInt32		tripNotifications(void) { return tripFired; }
+
+	virtual IOReturn	evaluateObject(const char *objectName, OSObject **result = 0,
+									   OSObject *params[] = 0, IOItemCount paramCount = 0,
+									   IOOptionBits options = 0);
+
+	virtual IOReturn	validateObject(const char *objectName);
+
+private:
+	struct Method
+	{
+		OSObject		*value;
+		UInt32			latencyMS;
+		UInt32			jitterMS;
+		UInt32			failCount;
+		IOReturn		failStatus;
+		UInt32			failPeriod;
+		FakeACPIHook	hook;
+		void			*hookContext;
+		UInt32			evaluations;
+		UInt32			gatedEvaluations;
+		OSObject		*lastParameter;
+	};
+
+	Method	*method(const char *name, bool create);
+
+	std::map<std::string, Method>	methods;
+	UInt32							jitterSeed;
+	IOService						*tripTarget;
+	UInt32							tripPoint;
+	UInt32							tripFired;
+};
+
+// Packages as a DSDT would return them. Capacities are in the power unit's
+// scale (mAh or mWh); strings are the model, serial, type and OEM.
+OSArray	*CreateBIXPackage(UInt32 powerUnit, UInt32 designCapacity, UInt32 lastFullCapacity,
+						  UInt32 designVoltage, UInt32 cycleCount, const char *serial);
+OSArray	*CreateBIFPackage(UInt32 powerUnit, UInt32 designCapacity, UInt32 lastFullCapacity,
+						  UInt32 designVoltage, const char *serial);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Object accounting: "DriverMemoryFootprint" counts what the driver holds,
+ * not what it allocated within a single call.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+static SInt64 liveObjects(BatteryFixture &fixture, const char *site)
+{
+	OSDictionary	*footprint = OSDynamicCast(OSDictionary, fixture.battery->getProperty("DriverMemoryFootprint"));
+	OSDictionary	*siteDict;
+	OSNumber		*live;
+
+	if (!footprint)
+		return -1;
+
+	siteDict = site ? OSDynamicCast(OSDictionary, footprint->getObject(site)) : NULL;
+	live = OSDynamicCast(OSNumber, site ? (siteDict ? siteDict->getObject("Live") : NULL)
+									   : footprint->getObject("LiveObjects"));
+
+	return live ? (SInt32) live->unsigned32BitValue() : -1;
+}
+
+static void poll(BatteryFixture &fixture, FakeACPIDevice *device, UInt32 capacity)
+{
+	OSArray *package = CreateBSTPackage(BATTERY_DISCHARGING, 1000 + capacity % 7, capacity, 11500);
+
+	device->setObject("_BST", package);
+	package->release();
+
+	fixture.manager->message(kIOACPIMessageDeviceNotification, device, (void *) 0x90);
+	HostRunThreadCalls();
+}
+
+TEST(FootprintCountsHeldObjects)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	// Published numbers, the constructed serial and its numeric form, held
+	// by the power source dictionary
+	CHECK(liveObjects(fixture, "PowerSourceNumbers") > 10);
+	CHECK_EQ(2, liveObjects(fixture, "SerialNumber"));
+	CHECK_EQ(1, liveObjects(fixture, "ManufacturerData"));
+
+	// The legacy info alternates between two dictionaries; let both exist
+	poll(fixture, device, 3995);
+
+	SInt64 numbers	= liveObjects(fixture, "PowerSourceNumbers");
+	SInt64 total	= liveObjects(fixture, NULL);
+
+	// Steady state: each poll replaces what it publishes
+	for (UInt32 capacity = 3990; capacity > 3900; capacity -= 10)
+		poll(fixture, device, capacity);
+
+	CHECK_EQ(numbers, liveObjects(fixture, "PowerSourceNumbers"));
+	CHECK_EQ(total, liveObjects(fixture, NULL));
+
+	// A re-read of the static information replaces the serial objects
+	fixture.manager->message(kIOACPIMessageDeviceNotification, device, (void *) BATTERY_INFO_CHANGED);
+	HostRunThreadCalls();
+	CHECK_EQ(2, liveObjects(fixture, "SerialNumber"));
+	CHECK_EQ(total, liveObjects(fixture, NULL));
+}
+
+TEST(FootprintDropsRemovedBattery)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	OSDictionary *footprint = OSDynamicCast(OSDictionary, fixture.battery->getProperty("DriverMemoryFootprint"));
+
+	device->setInteger("_STA", 0);
+	fixture.manager->message(kIOACPIMessageDeviceNotification, device, (void *) BATTERY_INFO_CHANGED);
+	HostRunThreadCalls();
+
+	CHECK_EQ(0, liveObjects(fixture, "SerialNumber"));
+	CHECK_EQ(0, liveObjects(fixture, "ManufacturerData"));
+	CHECK_EQ(0, liveObjects(fixture, "ManufactureDate"));
+
+	// Updated in place, not rebuilt
+	CHECK(footprint == fixture.battery->getProperty("DriverMemoryFootprint"));
+}
+
+/*
+ * Soak: a long run of timer polls at the override's one second period,
+ * each reading a different _BST. Neither the objects alive in the host nor
+ * the driver's own count may climb.
+ */
+
+enum
+{
+	kSoakPackages	= 16,
+	kSoakWarmup		= 64
+};
+
+struct SoakResult
+{
+	UInt32	polls;
+	SInt32	hostObjects[2];			// after warmup, at the end
+	SInt64	driverObjects[2];
+	SInt32	peakHostObjects;
+};
+
+static void soak(UInt32 polls, SoakResult *result)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	OSDictionary	*properties = OSDictionary::withCapacity(1);
+	OSNumber		*period = OSNumber::withNumber(1, 32);
+	OSArray			*status[kSoakPackages];
+
+	properties->setObject(kBatteryPollingDebugKey, period);
+	period->release();
+
+	for (UInt32 i = 0; i < kSoakPackages; i++)
+		status[i] = CreateBSTPackage(BATTERY_DISCHARGING, 1000 + 7 * i, 4000 - 3 * i, 11500 + i);
+
+	BatteryFixture fixture(device, NULL, properties);
+	properties->release();
+
+	HostRunThreadCalls();
+
+	for (UInt32 i = 0; i < kSoakWarmup + polls; i++)
+	{
+		if (kSoakWarmup == i)
+		{
+			device->resetEvaluations();
+			result->hostObjects[0]		= HostLiveObjects();
+			result->driverObjects[0]	= liveObjects(fixture, NULL);
+			result->peakHostObjects		= result->hostObjects[0];
+		}
+
+		device->setObject("_BST", status[i % kSoakPackages]);
+		HostClockAdvance(1000);
+		HostRunThreadCalls();
+
+		if (HostLiveObjects() > result->peakHostObjects)
+			result->peakHostObjects = HostLiveObjects();
+	}
+
+	result->polls				= device->evaluations("_BST");
+	result->hostObjects[1]		= HostLiveObjects();
+	result->driverObjects[1]	= liveObjects(fixture, NULL);
+
+	for (UInt32 i = 0; i < kSoakPackages; i++)
+		status[i]->release();
+}
+
+static void checkFlat(const SoakResult &result, UInt32 polls)
+{
+	CHECK(result.polls >= polls);
+	CHECK_EQ(result.hostObjects[0], result.hostObjects[1]);
+	CHECK_EQ(result.driverObjects[0], result.driverObjects[1]);
+
+	// Nothing builds up and is then let go between two samples
+	CHECK(result.peakHostObjects <= result.hostObjects[0] + 4);
+}
+
+TEST(FootprintFlatOverSoak)
+{
+	SoakResult result;
+
+	soak(20000, &result);
+	checkFlat(result, 20000);
+}
+
+BENCH(FootprintMillionPolls)
+{
+	SoakResult	result;
+	uint64_t	start = BenchNowNS();
+
+	soak(1000000, &result);
+
+	BenchReport("FootprintMillionPolls", "polls", result.polls, "");
+	BenchReport("FootprintMillionPolls", "time per poll", (double) (BenchNowNS() - start) / result.polls, "ns");
+	BenchReport("FootprintMillionPolls", "host objects, start", result.hostObjects[0], "");
+	BenchReport("FootprintMillionPolls", "host objects, end", result.hostObjects[1], "");
+	BenchReport("FootprintMillionPolls", "DriverMemoryFootprint, start", (double) result.driverObjects[0], "");
+	BenchReport("FootprintMillionPolls", "DriverMemoryFootprint, end", (double) result.driverObjects[1], "");
+
+	checkFlat(result, 1000000);
+}
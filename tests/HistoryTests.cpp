@@ -0,0 +1,260 @@
+/*
+ * The varint sample history codec: EncodeHistorySample() into a block and
+ * NextHistorySample() back out.
+ */
+
+#include "TestHarness.h"
+#include "AppleSmartBattery.h"
+
+static BatteryHistorySample makeSample(uint64_t timestamp, uint32_t status, uint32_t rate, uint32_t capacity,
+									   uint32_t voltage, uint32_t temperature, int32_t current)
+{
+	BatteryHistorySample sample;
+
+	sample.timestamp	= timestamp;
+	sample.status		= status;
+	sample.rate			= rate;
+	sample.capacity		= capacity;
+	sample.voltage		= voltage;
+	sample.temperature	= temperature;
+	sample.current		= current;
+
+	return sample;
+}
+
+// Encodes samples into block the way the driver appends them
+static void fillBlock(BatteryHistoryBlock *block, const BatteryHistorySample *samples, UInt32 count)
+{
+	SInt64 interval = 0;
+
+	bzero(block, sizeof(*block));
+	block->key		= samples[0];
+	block->count	= 1;
+
+	for (UInt32 i = 1; i < count; i++)
+	{
+		UInt32 length = EncodeHistorySample(&samples[i - 1], interval, &samples[i], &block->data[block->used]);
+
+		CHECK(length <= kHistoryMaxEncodedSample);
+
+		block->used	+= length;
+		block->count++;
+		interval = (SInt64) (samples[i].timestamp - samples[i - 1].timestamp);
+	}
+}
+
+static bool sameSample(const BatteryHistorySample *a, const BatteryHistorySample *b)
+{
+	return (a->timestamp == b->timestamp) && (a->status == b->status) && (a->rate == b->rate)
+		&& (a->capacity == b->capacity) && (a->voltage == b->voltage)
+		&& (a->temperature == b->temperature) && (a->current == b->current);
+}
+
+TEST(HistoryRoundTrip)
+{
+	BatteryHistorySample	samples[] =
+	{
+		makeSample(1000000,	1, 1500, 5000, 12000, 2981, -1500),
+		makeSample(1030000,	1, 1480, 4987, 11990, 2983, -1480),
+		makeSample(1060000,	1, 1520, 4975, 11985, 2983, -1520),
+		makeSample(1061000,	2, 2000, 4975, 12400, 2990,  2000),		// plugged in, irregular interval
+		makeSample(1091000,	2, 1990, 4991, 12410, 2991,  1990)
+	};
+	UInt32					count = sizeof(samples) / sizeof(samples[0]);
+	BatteryHistoryBlock		block;
+	BatteryHistoryCursor	cursor;
+
+	fillBlock(&block, samples, count);
+
+	// A steady 30 s poll costs about one byte per field
+	CHECK(block.used < count * 7 * 2);
+
+	InitHistoryCursor(&cursor, &block);
+	CHECK(sameSample(&samples[0], &cursor.sample));
+
+	for (UInt32 i = 1; i < count; i++)
+	{
+		CHECK(NextHistorySample(&cursor));
+		CHECK(sameSample(&samples[i], &cursor.sample));
+	}
+
+	CHECK(!NextHistorySample(&cursor));
+}
+
+TEST(HistoryExtremeValues)
+{
+	BatteryHistorySample	samples[] =
+	{
+		makeSample(0,						0,			0,			0,			0,			0,			0),
+		makeSample(0xFFFFFFFFFFFFULL,		0xFFFFFFFF,	0xFFFFFFFF,	0xFFFFFFFF,	0xFFFFFFFF,	0xFFFFFFFF,	-2147483647 - 1),
+		makeSample(0xFFFFFFFFFFFFULL + 1,	0,			0,			0,			0,			0,			2147483647)
+	};
+	BatteryHistoryBlock		block;
+	BatteryHistoryCursor	cursor;
+
+	fillBlock(&block, samples, 3);
+
+	InitHistoryCursor(&cursor, &block);
+	CHECK(NextHistorySample(&cursor));
+	CHECK(sameSample(&samples[1], &cursor.sample));
+	CHECK(NextHistorySample(&cursor));
+	CHECK(sameSample(&samples[2], &cursor.sample));
+}
+
+TEST(HistoryTruncatedBlock)
+{
+	BatteryHistorySample	samples[] =
+	{
+		makeSample(1000, 1, 1500, 5000, 12000, 2981, -1500),
+		makeSample(31000, 1, 1480, 4987, 11990, 2983, -1480),
+		makeSample(61000, 1, 100000, 4975, 11985, 2983, -100000)
+	};
+	BatteryHistoryBlock		block;
+	BatteryHistoryCursor	cursor;
+
+	fillBlock(&block, samples, 3);
+	block.used--;
+
+	InitHistoryCursor(&cursor, &block);
+	CHECK(NextHistorySample(&cursor));
+	CHECK(sameSample(&samples[1], &cursor.sample));
+
+	// The last sample is cut short and must not be returned
+	CHECK(!NextHistorySample(&cursor));
+	CHECK_EQ(1, cursor.index);
+}
+
+/*
+ * Codec cost over long synthetic traces: encode and decode time per sample
+ * and bytes per sample, blocks filled the way recordHistorySample() fills
+ * them.
+ */
+
+enum
+{
+	kTraceSamples	= 100000,
+	kTraceCount		= 4
+};
+
+static const char *traceNames[kTraceCount] =
+{
+	"steady discharge, 30 s",
+	"charging, 30 s",
+	"noisy rate and voltage",
+	"irregular intervals"
+};
+
+static BatteryHistorySample traceSample(int trace, UInt32 i)
+{
+	UInt32	noise = (i * 2654435761U) >> 20;		// 12 bits
+	UInt32	capacity = 5000 - (i / 20) % 4000;
+
+	switch (trace)
+	{
+		case 1:
+			return makeSample(1000000 + 30000ULL * i, 2, 2000, 1000 + (i / 10) % 4000,
+							  12000 + (i / 100) % 600, 2990, 2000);
+		case 2:
+			return makeSample(1000000 + 30000ULL * i, 1, 500 + noise, capacity,
+							  10000 + noise, 2950 + noise % 60, -(SInt32) (500 + noise));
+		case 3:
+			return makeSample(1000000 + 30000ULL * i + (noise % 5000), 1, 1500, capacity,
+							  11800 - (i / 50) % 800, 2981, -1500);
+		default:
+			return makeSample(1000000 + 30000ULL * i, 1, 1500, capacity,
+							  11800 - (i / 50) % 800, 2981, -1500);
+	}
+}
+
+// Appends to blocks[*current] as the driver does; returns bytes encoded
+static UInt32 appendTrace(BatteryHistoryBlock *blocks, UInt32 *current, const BatteryHistorySample *previous,
+						  SInt64 *interval, const BatteryHistorySample *sample)
+{
+	BatteryHistoryBlock	*block = &blocks[*current];
+	UInt8				encoded[kHistoryMaxEncodedSample];
+	UInt32				length = 0;
+
+	if (block->count)
+		length = EncodeHistorySample(previous, *interval, sample, encoded);
+
+	if (!block->count || (length > sizeof(block->data) - block->used))
+	{
+		if (block->count)
+			block = &blocks[++(*current)];
+
+		block->count	= 1;
+		block->used		= 0;
+		block->key		= *sample;
+		*interval		= 0;
+
+		return sizeof(BatteryHistorySample);
+	}
+
+	bcopy(encoded, &block->data[block->used], length);
+	block->used += length;
+	block->count++;
+	*interval = (SInt64) (sample->timestamp - previous->timestamp);
+
+	return length;
+}
+
+BENCH(HistoryCodec)
+{
+	BatteryHistorySample	*samples = new BatteryHistorySample[kTraceSamples];
+	BatteryHistoryBlock		*blocks = new BatteryHistoryBlock[kTraceSamples];
+	char					metric[80];
+
+	for (int trace = 0; trace < kTraceCount; trace++)
+	{
+		UInt32					current = 0;
+		UInt64					bytes = 0;
+		UInt32					decoded = 0;
+		SInt64					interval = 0;
+		bool					same = true;
+		uint64_t				start;
+		double					encodeNS, decodeNS;
+
+		for (UInt32 i = 0; i < kTraceSamples; i++)
+			samples[i] = traceSample(trace, i);
+
+		bzero(blocks, sizeof(BatteryHistoryBlock) * kTraceSamples);
+
+		start = BenchNowNS();
+		for (UInt32 i = 0; i < kTraceSamples; i++)
+			bytes += appendTrace(blocks, &current, i ? &samples[i - 1] : NULL, &interval, &samples[i]);
+		encodeNS = (double) (BenchNowNS() - start) / kTraceSamples;
+
+		start = BenchNowNS();
+		for (UInt32 b = 0; b <= current; b++)
+		{
+			BatteryHistoryCursor cursor;
+
+			InitHistoryCursor(&cursor, &blocks[b]);
+
+			do {
+				same = same && sameSample(&samples[decoded], &cursor.sample);
+				decoded++;
+			} while (NextHistorySample(&cursor));
+		}
+		decodeNS = (double) (BenchNowNS() - start) / kTraceSamples;
+
+		CHECK_EQ(kTraceSamples, decoded);
+		CHECK(same);
+
+		snprintf(metric, sizeof(metric), "%s, encode", traceNames[trace]);
+		BenchReport("HistoryCodec", metric, encodeNS, "ns/sample");
+		snprintf(metric, sizeof(metric), "%s, decode", traceNames[trace]);
+		BenchReport("HistoryCodec", metric, decodeNS, "ns/sample");
+		snprintf(metric, sizeof(metric), "%s, encoded", traceNames[trace]);
+		BenchReport("HistoryCodec", metric, (double) bytes / kTraceSamples, "bytes/sample");
+		snprintf(metric, sizeof(metric), "%s, in blocks", traceNames[trace]);
+		BenchReport("HistoryCodec", metric, (double) (current + 1) * sizeof(BatteryHistoryBlock) / kTraceSamples, "bytes/sample");
+		snprintf(metric, sizeof(metric), "%s, held by %u blocks", traceNames[trace], (unsigned int) kHistoryBlocks);
+		BenchReport("HistoryCodec", metric, (double) kTraceSamples * kHistoryBlocks / (current + 1), "samples");
+	}
+
+	BenchReport("HistoryCodec", "unencoded", sizeof(BatteryHistorySample), "bytes/sample");
+
+	delete [] samples;
+	delete [] blocks;
+}
@@ -0,0 +1,33 @@
+/*
+ * The manager and battery brought up and torn down on a device that
+ * implements no ACPI methods at all.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+
+TEST(ManagerStartsOnEmptyNamespace)
+{
+	BatteryFixture fixture;
+
+	CHECK(fixture.started);
+	CHECK(fixture.battery != NULL);
+
+	// Nothing answered _STA; no battery is reported
+	CHECK(fixture.psProperty(kIOPMPSBatteryInstalledKey) != kOSBooleanTrue);
+}
+
+TEST(ManagerStopsWithTimersArmed)
+{
+	BatteryFixture fixture;
+
+	// The first poll arms the poll timer once it completes; stopping must
+	// not fire it
+	HostRunThreadCalls();
+	CHECK(HostNextTimerMS() != ~0ULL);
+
+	fixture.stop();
+	CHECK(fixture.battery == NULL);
+
+	HostClockAdvance(60 * 1000);
+}
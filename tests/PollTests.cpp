@@ -0,0 +1,761 @@
+/*
+ * The poll state machine against a scripted ACPI device: what each path
+ * evaluates, what it publishes, and how cancellation, deadlines, sleep and
+ * removal cut a poll short.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+static void sendNotify(BatteryFixture &fixture, UInt32 code)
+{
+	fixture.manager->message(kIOACPIMessageDeviceNotification, fixture.device, (void *)(uintptr_t) code);
+}
+
+static void setStatus(FakeACPIDevice *device, UInt32 state, UInt32 rate, UInt32 capacity)
+{
+	OSArray *package = CreateBSTPackage(state, rate, capacity, 11500);
+
+	device->setObject("_BST", package);
+	package->release();
+}
+
+static bool pollingReasonIs(BatteryFixture &fixture, const char *reason)
+{
+	OSSymbol *value = OSDynamicCast(OSSymbol, fixture.battery->getProperty("PollingReason"));
+
+	return value && value->isEqualTo(reason);
+}
+
+// Starts on a battery with _BIX and runs the initial full poll
+static FakeACPIDevice *startedDevice(void)
+{
+	return FakeACPIDevice::withBattery(true);
+}
+
+TEST(PollInitialReadsEverything)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	CHECK(fixture.started);
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, device->evaluations("_BIX"));
+	CHECK_EQ(0, device->evaluations("_BIF"));
+	CHECK_EQ(1, device->evaluations("_BST"));
+	CHECK(device->evaluations("_STA") >= 1);
+
+	CHECK_EQ(5400, fixture.psNumber(kIOPMPSDesignCapacityKey));
+	CHECK_EQ(5200, fixture.psNumber(kIOPMPSMaxCapacityKey));
+	CHECK_EQ(4000, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+	CHECK_EQ(11500, fixture.psNumber(kIOPMPSVoltageKey));
+	CHECK_EQ(42, fixture.psNumber(kIOPMPSCycleCountKey));
+	CHECK_EQ(-1000, fixture.psNumber(kIOPMPSAmperageKey));
+	CHECK(fixture.psProperty(kIOPMPSBatteryInstalledKey) == kOSBooleanTrue);
+
+	CHECK(OSDynamicCast(OSArray, fixture.manager->getProperty("Battery Extended Information")));
+	CHECK(OSDynamicCast(OSArray, fixture.manager->getProperty("Battery Status")));
+}
+
+TEST(PollBIFWattsAreConverted)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(false);
+	OSArray			*info = CreateBIFPackage(WATTS, 59940, 57720, 11100, "SN0002");
+
+	device->setObject("_BIF", info);
+	info->release();
+
+	BatteryFixture fixture(device);
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, device->evaluations("_BIF"));
+	CHECK_EQ(0, device->evaluations("_BIX"));
+
+	// Capacities are divided by the design voltage, as the driver always has
+	CHECK_EQ(59940 / 11100, fixture.psNumber(kIOPMPSDesignCapacityKey));
+	CHECK_EQ(57720 / 11100, fixture.psNumber(kIOPMPSMaxCapacityKey));
+	CHECK(OSDynamicCast(OSArray, fixture.manager->getProperty("Battery Information")));
+}
+
+TEST(PollAlarmSkipsCachedStaticInfo)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+	device->resetEvaluations();
+
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3900);
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+
+	// One _STA from message(), one from the poll
+	CHECK_EQ(2, device->evaluations("_STA"));
+	CHECK_EQ(0, device->evaluations("_BIX"));
+	CHECK_EQ(1, device->evaluations("_BST"));
+	CHECK_EQ(3900, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+}
+
+TEST(PollStatusNotificationsCoalesce)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+	device->resetEvaluations();
+
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3800);
+
+	for (int i = 0; i < 3; i++)
+		sendNotify(fixture, BATTERY_STATUS_CHANGED);
+
+	// Nothing until the coalescing window closes
+	CHECK_EQ(0, HostPendingThreadCalls());
+
+	HostClockAdvance(250);
+	CHECK_EQ(1, HostPendingThreadCalls());
+	HostRunThreadCalls();
+
+	CHECK_EQ(0, device->evaluations("_STA"));
+	CHECK_EQ(1, device->evaluations("_BST"));
+	CHECK_EQ(3800, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+}
+
+TEST(PollStageDeadlineBacksOff)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	// Past the deadline a method gets before its latency is known
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3700);
+	device->setLatency("_BST", 11000);
+
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+
+	CHECK(pollingReasonIs(fixture, "Backoff"));
+	CHECK_EQ(4000, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+
+	// The retry reads normally again
+	device->setLatency("_BST", 0);
+	HostClockAdvance(HostNextTimerMS());
+	HostRunThreadCalls();
+
+	CHECK_EQ(3700, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+	CHECK(!pollingReasonIs(fixture, "Backoff"));
+}
+
+TEST(PollFailedStatusBacksOff)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	device->failNext("_BST", 1);
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+
+	CHECK(pollingReasonIs(fixture, "Backoff"));
+}
+
+TEST(PollSleepCancelsInFlight)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3600);
+	sendNotify(fixture, 0x90);
+
+	// Power management waits for the poll to stop
+	CHECK(fixture.manager->setPowerState(0, fixture.manager) != kIOPMAckImplied);
+	CHECK_EQ(0, fixture.manager->hostPowerAcknowledgements);
+
+	device->resetEvaluations();
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(0, device->evaluations("_BST"));
+	CHECK_EQ(4000, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+
+	// Wake reads presence and status before acknowledging
+	CHECK(fixture.manager->setPowerState(1, fixture.manager) != kIOPMAckImplied);
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+
+	HostRunThreadCalls();
+
+	CHECK_EQ(2, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(1, device->evaluations("_BST"));
+	CHECK_EQ(0, device->evaluations("_BIX"));
+	CHECK_EQ(3600, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+}
+
+static SInt64 batteryNumber(BatteryFixture &fixture, const char *key)
+{
+	OSNumber *number = OSDynamicCast(OSNumber, fixture.battery->getProperty(key));
+
+	return number ? (SInt64) number->unsigned64BitValue() : -1;
+}
+
+enum
+{
+	kSlowStageMS	= 500
+};
+
+// Sleep arrives kSlowStageMS before the stage the hook is on returns
+static void sleepMidStage(FakeACPIDevice *device, const char *method, void *context)
+{
+	BatteryFixture *fixture = (BatteryFixture *) context;
+
+	CHECK(fixture->manager->setPowerState(0, fixture->manager) != kIOPMAckImplied);
+	HostClockAdvance(kSlowStageMS);
+}
+
+TEST(PollSleepMidPollAcksAfterTheStage)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	// A full read with every stage slow; sleep comes halfway through _BIX
+	device->setLatency("_STA", kSlowStageMS);
+	device->setLatency("_BIX", kSlowStageMS);
+	device->setLatency("_BST", kSlowStageMS);
+	device->setHook("_BIX", sleepMidStage, &fixture);
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3500);
+
+	device->resetEvaluations();
+	sendNotify(fixture, BATTERY_INFO_CHANGED);
+	HostRunThreadCalls();
+
+	// Acknowledged as soon as _BIX returned; _BST was never started
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(1, device->evaluations("_BIX"));
+	CHECK_EQ(0, device->evaluations("_BST"));
+	CHECK_EQ(kSlowStageMS, batteryNumber(fixture, "SleepAckLatency_msec"));
+	CHECK_EQ(4000, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+}
+
+TEST(PollWakeAcksBeforeAFullReadWould)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+	uint64_t		start;
+
+	HostRunThreadCalls();
+
+	// Static information is the slow part of a full read
+	device->setLatency("_STA", 200);
+	device->setLatency("_BIX", 800);
+	device->setLatency("_BST", 200);
+
+	start = HostClockMS();
+	sendNotify(fixture, BATTERY_INFO_CHANGED);
+	HostRunThreadCalls();
+
+	uint64_t fullRead = HostClockMS() - start;
+
+	CHECK(fullRead >= 1200);
+
+	// Nothing in flight; sleep is acknowledged at once and publishes nothing
+	CHECK(fixture.manager->setPowerState(0, fixture.manager) == kIOPMAckImplied);
+	CHECK_EQ(0, batteryNumber(fixture, "SleepAckLatency_msec"));
+
+	device->resetEvaluations();
+	CHECK(fixture.manager->setPowerState(1, fixture.manager) != kIOPMAckImplied);
+	HostRunThreadCalls();
+
+	// _STA and _BST only, and the time power management waited is published
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(0, device->evaluations("_BIX"));
+	CHECK_EQ(400, batteryNumber(fixture, "SleepAckLatency_msec"));
+	CHECK(batteryNumber(fixture, "SleepAckLatency_msec") < (SInt64) fullRead);
+}
+
+struct SleepRequest
+{
+	BatteryFixture	*fixture;
+	IOReturn		maxWait;
+};
+
+static void sleepDuringStage(FakeACPIDevice *device, const char *method, void *context)
+{
+	SleepRequest *request = (SleepRequest *) context;
+
+	request->maxWait = request->fixture->manager->setPowerState(0, request->fixture->manager);
+}
+
+TEST(PollSleepWakeWaitFollowsStageDeadlines)
+{
+	FakeACPIDevice	*device = startedDevice();
+	OSDictionary	*properties = OSDictionary::withCapacity(1);
+	OSNumber		*period = OSNumber::withNumber(1, 32);
+	SleepRequest	request;
+
+	properties->setObject(kBatteryPollingDebugKey, period);
+	period->release();
+
+	BatteryFixture fixture(device, NULL, properties);
+	properties->release();
+
+	// Enough fast evaluations for the deadlines to come down to the minimum
+	for (int i = 0; i < 2 * kDeadlineMinSamples; i++)
+	{
+		HostRunThreadCalls();
+		HostClockAdvance(1000);
+	}
+
+	CHECK_EQ(kDeadlineMinMS, fixture.manager->methodDeadline("_STA"));
+	CHECK_EQ(kDeadlineMinMS, fixture.manager->methodDeadline("_BST"));
+
+	// Sleep 100 ms into _BST waits out the rest of its deadline, not the
+	// whole poll's
+	request.fixture	= &fixture;
+	request.maxWait	= kIOPMAckImplied;
+	device->setLatency("_BST", 100);
+	device->setHook("_BST", sleepDuringStage, &request);
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ((kDeadlineMinMS - 100 + kDeadlineMinMS) * 1000, request.maxWait);
+
+	// Wake waits for _STA and _BST, whose deadline that slow one raised
+	UInt32 wakeRead = fixture.manager->methodDeadline("_STA") + fixture.manager->methodDeadline("_BST");
+
+	CHECK(wakeRead < 1000);
+	device->setLatency("_BST", 0);
+	CHECK_EQ((wakeRead + kDeadlineMinMS) * 1000, fixture.manager->setPowerState(1, fixture.manager));
+	HostRunThreadCalls();
+
+	CHECK_EQ(2, fixture.manager->hostPowerAcknowledgements);
+}
+
+static void removeBattery(FakeACPIDevice *device, const char *method, void *context)
+{
+	BatteryFixture *fixture = (BatteryFixture *) context;
+
+	device->setInteger("_STA", 0);
+	sendNotify(*fixture, BATTERY_INFO_CHANGED);
+}
+
+TEST(PollRemovalMidPoll)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3500);
+	device->setHook("_BST", removeBattery, &fixture);
+
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+
+	CHECK(fixture.psProperty(kIOPMPSBatteryInstalledKey) == kOSBooleanFalse);
+	CHECK(fixture.psNumber(kIOPMPSCurrentCapacityKey) != 3500);
+}
+
+TEST(PollWakeQueuedBehindPollAcksAfterIt)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	// Nothing in flight; sleep goes ahead at once
+	CHECK(fixture.manager->setPowerState(0, fixture.manager) == kIOPMAckImplied);
+
+	sendNotify(fixture, 0x90);
+	CHECK(fixture.manager->setPowerState(1, fixture.manager) != kIOPMAckImplied);
+
+	// A later status-only request (kBatteryStatusPath, private to the
+	// driver) doesn't displace the wake read
+	fixture.battery->pollBatteryState(4);
+
+	// The poll that was in flight completes; the wake read is still to come
+	HostRunThreadCalls(1);
+	CHECK_EQ(0, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(1, HostPendingThreadCalls());
+	CHECK(!fixture.psProperty("EstimatesStaleUntil"));
+
+	HostRunThreadCalls();
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK(fixture.psProperty("EstimatesStaleUntil"));
+}
+
+TEST(PollFullReadDisplacesQueuedWake)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	CHECK(fixture.manager->setPowerState(0, fixture.manager) == kIOPMAckImplied);
+	sendNotify(fixture, 0x90);
+	CHECK(fixture.manager->setPowerState(1, fixture.manager) != kIOPMAckImplied);
+
+	// Static information changed: the queued read becomes a full one
+	fixture.battery->handleBatteryInfoChanged();
+
+	HostRunThreadCalls(1);
+	CHECK_EQ(0, fixture.manager->hostPowerAcknowledgements);
+
+	device->resetEvaluations();
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(1, device->evaluations("_BIX"));
+}
+
+TEST(PollTripPointWrittenOffTheWorkLoop)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	// 4000 of 5200 mAh discharging: the next trip is the 76% boundary
+	OSNumber *param = OSDynamicCast(OSNumber, device->lastParameter("_BTP"));
+
+	CHECK_EQ(1, device->evaluations("_BTP"));
+	CHECK_EQ(0, device->gatedEvaluations("_BTP"));
+	CHECK(param && (3952 == param->unsigned32BitValue()));
+
+	OSNumber *trip = OSDynamicCast(OSNumber, fixture.battery->getProperty("BatteryTripPoint"));
+	CHECK(trip && (3952 == trip->unsigned32BitValue()));
+	CHECK(pollingReasonIs(fixture, "TripPoint"));
+
+	// Unchanged capacity, nothing to write
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+	CHECK_EQ(1, device->evaluations("_BTP"));
+
+	// A boundary crossed moves it
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3950);
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+
+	param = OSDynamicCast(OSNumber, device->lastParameter("_BTP"));
+	CHECK_EQ(2, device->evaluations("_BTP"));
+	CHECK_EQ(0, device->gatedEvaluations("_BTP"));
+	CHECK(param && (3900 == param->unsigned32BitValue()));
+}
+
+// What every evaluation cost the work loop when it ran inside the gate
+static IOReturn evaluateInGate(OSObject *target, void *method, void *, void *, void *)
+{
+	return ((FakeACPIDevice *) target)->evaluateObject((const char *) method);
+}
+
+TEST(PollSlowMethodsLeaveTheGateOpen)
+{
+	static const char	*slow[] = { "_STA", "_BIX", "_BST", "_BTP" };
+	FakeACPIDevice		*device = startedDevice();
+
+	for (unsigned int i = 0; i < sizeof(slow) / sizeof(slow[0]); i++)
+		device->setLatency(slow[i], 400);
+
+	BatteryFixture	fixture(device);
+	IOWorkLoop		*loop = fixture.manager->getWorkLoop();
+
+	loop->hostResetHold();
+
+	// Every kind of poll: initial, status, static information, and a sleep
+	// and wake
+	HostRunThreadCalls();
+
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3900);
+	sendNotify(fixture, BATTERY_STATUS_CHANGED);
+	HostClockAdvance(250);
+	HostRunThreadCalls();
+
+	sendNotify(fixture, BATTERY_INFO_CHANGED);
+	HostRunThreadCalls();
+
+	fixture.manager->setPowerState(0, fixture.manager);
+	fixture.manager->setPowerState(1, fixture.manager);
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, fixture.manager->hostPowerAcknowledgements);
+	CHECK_EQ(3900, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+
+	for (unsigned int i = 0; i < sizeof(slow) / sizeof(slow[0]); i++)
+	{
+		CHECK(device->evaluations(slow[i]) > 0);
+		CHECK_EQ(0, device->gatedEvaluations(slow[i]));
+	}
+
+	// 400 ms of EC time per method, none of it with the gate held
+	CHECK(loop->hostLongestHoldMS() < 400);
+
+	// The same method evaluated in the gate, as polls used to
+	loop->hostResetHold();
+	loop->runAction(evaluateInGate, device, (void *) "_BST");
+
+	CHECK_EQ(1, device->gatedEvaluations("_BST"));
+	CHECK(loop->hostLongestHoldMS() >= 400);
+}
+
+TEST(PollTripPointFiresAndRearms)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+
+	device->emulateTripPoint(fixture.manager);
+	HostRunThreadCalls();
+
+	CHECK_EQ(3952, device->programmedTripPoint());
+
+	// Short of the trip point the EC stays quiet
+	device->setBatteryStatus(BATTERY_DISCHARGING, 1000, 3990);
+	HostRunThreadCalls();
+	CHECK_EQ(0, device->tripNotifications());
+	CHECK_EQ(1, device->evaluations("_BST"));
+
+	// Crossing it fires once; the poll it causes arms the next boundary
+	device->setBatteryStatus(BATTERY_DISCHARGING, 1000, 3950);
+	CHECK_EQ(1, device->tripNotifications());
+	CHECK_EQ(0, device->programmedTripPoint());
+	HostClockAdvance(250);			// the notify coalescing window
+	HostRunThreadCalls();
+
+	CHECK_EQ(2, device->evaluations("_BST"));
+	CHECK_EQ(3950, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+	CHECK_EQ(3900, device->programmedTripPoint());
+	CHECK_EQ(0, device->gatedEvaluations("_BTP"));
+
+	OSNumber *trip = OSDynamicCast(OSNumber, fixture.battery->getProperty("BatteryTripPoint"));
+	CHECK(trip && (3900 == trip->unsigned32BitValue()));
+
+	// And that one fires too, so notification keeps replacing polling
+	device->setBatteryStatus(BATTERY_DISCHARGING, 1000, 3899);
+	CHECK_EQ(2, device->tripNotifications());
+	HostClockAdvance(250);
+	HostRunThreadCalls();
+
+	CHECK_EQ(3, device->evaluations("_BST"));
+	CHECK_EQ(3899, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+	CHECK_EQ(3848, device->programmedTripPoint());
+	CHECK_EQ(3, device->evaluations("_BTP"));
+	CHECK(pollingReasonIs(fixture, "TripPoint"));
+}
+
+TEST(PollTripPointFailureFallsBackToTimer)
+{
+	FakeACPIDevice *device = startedDevice();
+
+	device->failNext("_BTP", 1);
+
+	BatteryFixture fixture(device);
+	HostRunThreadCalls();
+
+	CHECK_EQ(1, device->evaluations("_BTP"));
+	CHECK(!fixture.battery->getProperty("BatteryTripPoint"));
+	CHECK(!pollingReasonIs(fixture, "TripPoint"));
+
+	// Not tried again
+	setStatus(device, BATTERY_DISCHARGING, 1000, 3800);
+	sendNotify(fixture, 0x90);
+	HostRunThreadCalls();
+	CHECK_EQ(1, device->evaluations("_BTP"));
+}
+
+TEST(PollStopReleasesEverything)
+{
+	// Interned symbols and statics are created by the first battery
+	{
+		BatteryFixture warmup(startedDevice());
+		HostRunThreadCalls();
+	}
+
+	SInt32 objects = HostLiveObjects();
+
+	{
+		FakeACPIDevice	*device = startedDevice();
+		BatteryFixture	fixture(device);
+
+		HostRunThreadCalls();
+
+		// Stopped with a poll queued and every timer armed
+		sendNotify(fixture, BATTERY_STATUS_CHANGED);
+		sendNotify(fixture, 0x90);
+		fixture.stop();
+
+		HostRunThreadCalls();
+	}
+
+	CHECK_EQ(objects, HostLiveObjects());
+}
+
+TEST(PollLatencySnapshotOutlivesManager)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	*fixture = new BatteryFixture(device);
+	OSDictionary	*latency;
+	OSData			*record;
+
+	device->setLatency("_BST", 40);
+	HostRunThreadCalls();
+	HostClockAdvance(kLatencyPublishMS);
+	HostRunThreadCalls();
+
+	latency = OSDynamicCast(OSDictionary, fixture->manager->getProperty("ACPIMethodLatency"));
+	CHECK(latency != NULL);
+	record = latency ? OSDynamicCast(OSData, latency->getObject("_BST")) : NULL;
+	CHECK(record != NULL);
+	if (!record) {
+		delete fixture;
+		return;
+	}
+
+	record->retain();
+	delete fixture;
+
+	// Whoever still holds the record reads its own copy
+	const ACPIMethodLatency *bytes = (const ACPIMethodLatency *) record->getBytesNoCopy();
+
+	CHECK_EQ(sizeof(ACPIMethodLatency), record->getLength());
+	CHECK_EQ(kLatencyHistogramVersion, bytes->version);
+	CHECK_EQ(1, bytes->calls);
+	CHECK(bytes->maxMicroseconds >= 40000);
+
+	record->release();
+}
+
+static const ACPIMethodLatency *publishedLatency(BatteryFixture &fixture, const char *method)
+{
+	OSDictionary	*latency = OSDynamicCast(OSDictionary, fixture.manager->getProperty("ACPIMethodLatency"));
+	OSData			*record = latency ? OSDynamicCast(OSData, latency->getObject(method)) : NULL;
+
+	if (!record || (sizeof(ACPIMethodLatency) != record->getLength()))
+		return NULL;
+
+	return (const ACPIMethodLatency *) record->getBytesNoCopy();
+}
+
+TEST(PollLatencyPublishedOffThePollPath)
+{
+	FakeACPIDevice			*device = startedDevice();
+	BatteryFixture			fixture(device);
+	const ACPIMethodLatency	*record;
+	UInt32					calls;
+	UInt32					bucketed = 0;
+
+	device->setLatency("_BST", 3);
+	HostRunThreadCalls();
+
+	// The poll itself leaves the published records alone
+	record = publishedLatency(fixture, "_BST");
+	CHECK(record != NULL);
+	if (!record)
+		return;
+	CHECK_EQ(0, record->calls);
+
+	// The timer armed by the poll's first sample publishes them; the
+	// scripted latency has already moved the clock on by 3 ms
+	HostClockAdvance(kLatencyPublishMS - 10);
+	HostRunThreadCalls();
+	CHECK_EQ(0, record->calls);
+
+	HostClockAdvance(10);
+	HostRunThreadCalls();
+
+	calls = device->evaluations("_BST");
+	CHECK(calls >= 1);
+	CHECK_EQ(calls, record->calls);
+	CHECK_EQ(0, record->errors);
+	CHECK(record->maxMicroseconds >= 3000);
+	CHECK(record->totalMicroseconds >= 3000ULL * calls);
+
+	for (int i = 0; i < kLatencyBucketCount; i++)
+		bucketed += record->buckets[i];
+	CHECK_EQ(calls, bucketed);
+}
+
+static SInt64 aggregateNumber(BatteryFixture &fixture, const char *key)
+{
+	OSDictionary	*aggregate = OSDynamicCast(OSDictionary, fixture.battery->getProperty(kAggregateBatteryStateKey));
+	OSNumber		*number = aggregate ? OSDynamicCast(OSNumber, aggregate->getObject(key)) : NULL;
+
+	return number ? (SInt64) number->unsigned64BitValue() : -1;
+}
+
+TEST(PollInterpolationIsNotAPoll)
+{
+	FakeACPIDevice	*device = startedDevice();
+	BatteryFixture	fixture(device);
+	OSNumber		*published;
+	UInt32			publishedBefore;
+	SInt64			capacity;
+
+	HostRunThreadCalls();
+
+	published = OSDynamicCast(OSNumber, fixture.battery->getProperty("StatusUpdatesPublished"));
+	CHECK(published != NULL);
+	if (!published)
+		return;
+
+	publishedBefore	= published->unsigned32BitValue();
+	capacity		= fixture.psNumber(kIOPMPSCurrentCapacityKey);
+	device->resetEvaluations();
+
+	// Well inside the poll interval, after a few interpolation ticks
+	HostClockAdvance(30000);
+
+	CHECK_EQ(0, device->evaluations("_BST"));
+	CHECK(fixture.psNumber(kIOPMPSCurrentCapacityKey) < capacity);
+	CHECK_EQ(publishedBefore, published->unsigned32BitValue());
+
+	// The combined power source moves with it
+	CHECK_EQ(fixture.psNumber(kIOPMPSCurrentCapacityKey), aggregateNumber(fixture, kIOPMPSCurrentCapacityKey));
+}
+
+TEST(PollAggregateListLockCreatedOnce)
+{
+	SInt32 perManager;
+
+	// The first manager to start creates the lock
+	{
+		BatteryFixture warmup(startedDevice());
+		HostRunThreadCalls();
+
+		perManager = HostLiveLocks();
+	}
+
+	SInt32 locks = HostLiveLocks();
+
+	perManager -= locks;
+
+	{
+		BatteryFixture	first(startedDevice());
+		BatteryFixture	second(startedDevice());
+
+		HostRunThreadCalls();
+
+		// Only each manager's own
+		CHECK_EQ(locks + 2 * perManager, HostLiveLocks());
+		CHECK_EQ(2, aggregateNumber(first, "BatteryCount"));
+		CHECK(second.battery->getProperty(kAggregateBatteryStateKey) == NULL);
+
+		// The second battery takes over publishing, without the first's share
+		AppleSmartBattery *firstBattery = first.battery;
+
+		firstBattery->retain();
+		first.stop();
+		HostRunThreadCalls();
+
+		CHECK(firstBattery->getProperty(kAggregateBatteryStateKey) == NULL);
+		CHECK_EQ(1, aggregateNumber(second, "BatteryCount"));
+		firstBattery->release();
+	}
+
+	// Nor freed with the last battery
+	CHECK_EQ(locks, HostLiveLocks());
+}
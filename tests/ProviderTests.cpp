@@ -0,0 +1,62 @@
+/*
+ * The scripted ACPI device, seen through the manager's evaluation helpers.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+TEST(ProviderServesScriptedBattery)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(false);
+	BatteryFixture	fixture(device);
+
+	HostRunThreadCalls();
+
+	CHECK(fixture.psProperty(kIOPMPSBatteryInstalledKey) == kOSBooleanTrue);
+	CHECK_EQ(4000, fixture.psNumber(kIOPMPSCurrentCapacityKey));
+	CHECK_EQ(5200, fixture.psNumber(kIOPMPSMaxCapacityKey));
+	CHECK(device->evaluations("_BIF") >= 1);
+	CHECK(device->evaluations("_BST") >= 1);
+}
+
+TEST(ProviderLatencyMovesTheClock)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(false);
+	BatteryFixture	fixture(device);
+	uint64_t		start;
+
+	HostRunThreadCalls();
+
+	device->setLatency("_BST", 300);
+	device->resetEvaluations();
+	start = HostClockMS();
+
+	fixture.manager->message(kIOACPIMessageDeviceNotification, device, (void *) 0x80);
+	HostClockAdvance(250);		// the notification coalescing window
+	HostRunThreadCalls();
+
+	CHECK(device->evaluations("_BST") >= 1);
+	CHECK(HostClockMS() - start >= 300 * device->evaluations("_BST"));
+}
+
+TEST(ProviderFailureKeepsLastReading)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(false);
+	BatteryFixture	fixture(device);
+	OSArray			*status;
+
+	HostRunThreadCalls();
+
+	status = CreateBSTPackage(BATTERY_DISCHARGING, 1000, 3000, 11500);
+	device->setObject("_BST", status);
+	status->release();
+
+	// A read that fails publishes nothing from it
+	device->failNext("_BST", 1);
+	fixture.manager->message(kIOACPIMessageDeviceNotification, device, (void *) 0x80);
+	HostClockAdvance(250);		// the notification coalescing window
+	HostRunThreadCalls();
+
+	CHECK(fixture.psNumber(kIOPMPSCurrentCapacityKey) != 3000);
+}
@@ -0,0 +1,221 @@
+/*
+ * Hung and flapping ECs over many polls: how far apart the retries are, that
+ * they never pile up behind one another, and the BBIX circuit breaker.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+enum
+{
+	kHungMS				= 11000,	// past any stage deadline
+	kBackoffBaseMS		= 2000,		// as in AppleSmartBattery.cpp
+	kBackoffMaxMS		= 300000,
+	kExtraCircuitOpenMS	= 600000,
+	kHungPolls			= 12,
+	kFlappingPolls		= 40,
+	kSpreadBatteries	= 8
+};
+
+static void sendNotify(BatteryFixture &fixture, UInt32 code)
+{
+	fixture.manager->message(kIOACPIMessageDeviceNotification, fixture.device, (void *)(uintptr_t) code);
+}
+
+static bool pollingReasonIs(BatteryFixture &fixture, const char *reason)
+{
+	OSSymbol *value = OSDynamicCast(OSSymbol, fixture.battery->getProperty("PollingReason"));
+
+	return value && value->isEqualTo(reason);
+}
+
+static UInt32 nextPollInterval(BatteryFixture &fixture)
+{
+	OSNumber *number = OSDynamicCast(OSNumber, fixture.battery->getProperty("NextPollInterval_msec"));
+
+	return number ? number->unsigned32BitValue() : 0;
+}
+
+// Runs the clock to the next poll and the poll itself; returns how long it
+// was in coming
+static uint64_t runNextPoll(void)
+{
+	uint64_t start = HostClockMS();
+
+	while (!HostPendingThreadCalls())
+		HostClockAdvance(HostNextTimerMS());
+
+	start = HostClockMS() - start;
+	HostRunThreadCalls();
+
+	return start;
+}
+
+// The first failure, from a status notification
+static void failFirstPoll(BatteryFixture &fixture)
+{
+	sendNotify(fixture, BATTERY_STATUS_CHANGED);
+	HostClockAdvance(250);
+	HostRunThreadCalls();
+}
+
+TEST(RetryHungECBacksOff)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	BatteryFixture	fixture(device);
+	UInt32			capped[kHungPolls];
+	UInt32			cappedCount = 0;
+	bool			spread = false;
+
+	HostRunThreadCalls();
+
+	device->setLatency("_BST", kHungMS);
+	failFirstPoll(fixture);
+
+	for (UInt32 failures = 1; failures <= kHungPolls; failures++)
+	{
+		UInt64	bound = (UInt64) kBackoffBaseMS << (failures - 1);
+		UInt32	interval = nextPollInterval(fixture);
+		UInt32	evaluations = device->evaluations("_BST");
+
+		if (bound > kBackoffMaxMS)
+			bound = kBackoffMaxMS;
+
+		// Doubling, with the upper half randomized
+		CHECK(pollingReasonIs(fixture, "Backoff"));
+		CHECK((interval >= bound / 2) && (interval <= bound));
+
+		if (bound == kBackoffMaxMS)
+		{
+			for (UInt32 i = 0; i < cappedCount; i++)
+				spread = spread || (capped[i] != interval);
+			capped[cappedCount++] = interval;
+		}
+
+		// One retry, when it was scheduled, and nothing queued behind it
+		CHECK_EQ(0, HostPendingThreadCalls());
+		CHECK_EQ(interval, runNextPoll());
+		CHECK_EQ(evaluations + 1, device->evaluations("_BST"));
+	}
+
+	CHECK(cappedCount >= 2);
+	CHECK(spread);
+
+	// Once the EC answers again, polling goes back to normal
+	device->setLatency("_BST", 0);
+	runNextPoll();
+
+	CHECK(!pollingReasonIs(fixture, "Backoff"));
+	CHECK(nextPollInterval(fixture) > kBackoffBaseMS);
+}
+
+TEST(RetryHungBatteriesDontRetryTogether)
+{
+	FakeACPIDevice	*devices[kSpreadBatteries];
+	BatteryFixture	*fixtures[kSpreadBatteries];
+	bool			spread = false;
+
+	for (UInt32 i = 0; i < kSpreadBatteries; i++)
+	{
+		devices[i]	= FakeACPIDevice::withBattery(true);
+		fixtures[i]	= new BatteryFixture(devices[i]);
+	}
+
+	HostRunThreadCalls();
+
+	// Hung at the same moment
+	for (UInt32 i = 0; i < kSpreadBatteries; i++)
+	{
+		devices[i]->setLatency("_BST", kHungMS);
+		sendNotify(*fixtures[i], BATTERY_STATUS_CHANGED);
+	}
+
+	HostClockAdvance(250);
+	HostRunThreadCalls();
+
+	for (UInt32 i = 0; i < kSpreadBatteries; i++)
+	{
+		CHECK(pollingReasonIs(*fixtures[i], "Backoff"));
+		spread = spread || (nextPollInterval(*fixtures[i]) != nextPollInterval(*fixtures[0]));
+	}
+
+	CHECK(spread);
+
+	for (UInt32 i = 0; i < kSpreadBatteries; i++)
+		delete fixtures[i];
+}
+
+TEST(RetryFlappingECDoesNotEscalate)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	BatteryFixture	fixture(device);
+	UInt32			backoffs = 0;
+
+	HostRunThreadCalls();
+
+	// Every other _BST times out
+	device->failEvery("_BST", 2);
+	device->resetEvaluations();
+
+	for (UInt32 poll = 0; poll < kFlappingPolls; poll++)
+	{
+		UInt32 evaluations = device->evaluations("_BST");
+
+		runNextPoll();
+
+		CHECK_EQ(evaluations + 1, device->evaluations("_BST"));
+		CHECK_EQ(0, HostPendingThreadCalls());
+
+		// A success in between resets the backoff each time
+		if (pollingReasonIs(fixture, "Backoff")) {
+			backoffs++;
+			CHECK(nextPollInterval(fixture) <= kBackoffBaseMS);
+		}
+	}
+
+	CHECK_EQ(kFlappingPolls / 2, backoffs);
+	CHECK_EQ(kFlappingPolls, device->evaluations("_BST"));
+}
+
+TEST(RetryExtraCircuitBreaker)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	OSArray			*extra = OSArray::withCapacity(1);
+
+	device->setObject("BBIX", extra);
+	device->failEvery("BBIX", 1);
+	extra->release();
+
+	BatteryFixture fixture(device);
+	HostRunThreadCalls();
+
+	// The initial poll, then two more
+	CHECK_EQ(1, device->evaluations("BBIX"));
+	runNextPoll();
+	runNextPoll();
+
+	CHECK_EQ(3, device->evaluations("BBIX"));
+	CHECK(fixture.battery->getProperty("ExtraInfoCircuitOpen") == kOSBooleanTrue);
+
+	// Left out while open, then tried once when it expires; the required
+	// methods carry on in between without backoff
+	uint64_t	opened = HostClockMS();
+	UInt32		status = device->evaluations("_BST");
+
+	while ((3 == device->evaluations("BBIX")) && (HostClockMS() - opened < 2 * kExtraCircuitOpenMS))
+	{
+		runNextPoll();
+		CHECK(!pollingReasonIs(fixture, "Backoff"));
+	}
+
+	CHECK(device->evaluations("_BST") > status + 1);
+	CHECK(HostClockMS() - opened >= kExtraCircuitOpenMS);
+	CHECK_EQ(4, device->evaluations("BBIX"));
+
+	// Which fails, and re-opens it straight away
+	CHECK(fixture.battery->getProperty("ExtraInfoCircuitOpen") == kOSBooleanTrue);
+
+	runNextPoll();
+	CHECK_EQ(4, device->evaluations("BBIX"));
+}
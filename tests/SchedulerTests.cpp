@@ -0,0 +1,136 @@
+/*
+ * The poll scheduler over a simulated hour: how many ACPI methods the EC
+ * is asked to evaluate under each polling policy.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+
+struct PollScenario
+{
+	const char	*name;
+	UInt32		state;
+	UInt32		rate;			// mA
+	UInt32		capacity;		// mAh at the start of the hour
+};
+
+static const PollScenario pollScenarios[] =
+{
+	{ "AC, fully charged",			0,						0,		5200 },
+	{ "Charging",					BATTERY_CHARGING,		2000,	2600 },
+	{ "Discharging",				BATTERY_DISCHARGING,	1000,	4000 },
+	{ "Discharging past warning",	BATTERY_DISCHARGING,	1000,	900 }
+};
+
+enum
+{
+	kPolicyAdaptive,			// the scheduler, with _BTP trip points
+	kPolicyAdaptiveNoTrip,		// the scheduler on firmware without _BTP
+	kPolicyFixed,				// every 30 s, as before the scheduler
+	kPolicyCount
+};
+
+static const char *policyNames[kPolicyCount] =
+{
+	"adaptive",
+	"adaptive, no _BTP",
+	"fixed 30 s"
+};
+
+static const char *ecMethods[] = { "_STA", "_BIX", "_BIF", "BBIX", "_BST", "_BTP" };
+
+static void setStatus(FakeACPIDevice *device, const PollScenario &scenario, UInt32 capacity)
+{
+	OSArray *package = CreateBSTPackage(scenario.state, scenario.rate, capacity, 11500);
+
+	device->setObject("_BST", package);
+	package->release();
+}
+
+static UInt32 transactionsPerHour(const PollScenario &scenario, int policy)
+{
+	FakeACPIDevice	*device = FakeACPIDevice::withBattery(true);
+	OSDictionary	*properties = NULL;
+	UInt32			capacity = scenario.capacity;
+	UInt32			transactions = 0;
+
+	if (kPolicyFixed == policy)
+	{
+		OSNumber *seconds = OSNumber::withNumber(30, 32);
+
+		properties = OSDictionary::withCapacity(1);
+		properties->setObject(kBatteryPollingDebugKey, seconds);
+		seconds->release();
+	}
+
+	if (kPolicyAdaptive != policy)
+		device->removeMethod("_BTP");
+
+	setStatus(device, scenario, capacity);
+
+	BatteryFixture fixture(device, NULL, properties);
+
+	if (properties)
+		properties->release();
+
+	HostRunThreadCalls();
+	device->resetEvaluations();
+
+	for (UInt32 second = 1; second <= 3600; second++)
+	{
+		UInt32 moved = (scenario.rate * second) / 3600;
+		UInt32 now = scenario.capacity;
+
+		if (BATTERY_DISCHARGING == scenario.state)
+			now = (moved < scenario.capacity) ? scenario.capacity - moved : 0;
+		else if (BATTERY_CHARGING == scenario.state)
+			now = scenario.capacity + moved;
+
+		if (now != capacity) {
+			capacity = now;
+			setStatus(device, scenario, capacity);
+		}
+
+		HostClockAdvance(1000);
+		HostRunThreadCalls();
+	}
+
+	for (UInt32 i = 0; i < sizeof(ecMethods) / sizeof(ecMethods[0]); i++)
+		transactions += device->evaluations(ecMethods[i]);
+
+	return transactions;
+}
+
+TEST(SchedulerBacksOffOnAC)
+{
+	UInt32 fixed	= transactionsPerHour(pollScenarios[0], kPolicyFixed);
+	UInt32 adaptive	= transactionsPerHour(pollScenarios[0], kPolicyAdaptive);
+
+	// 120 polls an hour against the 5 minute stable interval
+	CHECK(fixed >= 120);
+	CHECK(adaptive * 5 <= fixed);
+}
+
+TEST(SchedulerPollsMoreNearThresholds)
+{
+	UInt32 discharging		= transactionsPerHour(pollScenarios[2], kPolicyAdaptiveNoTrip);
+	UInt32 pastWarning		= transactionsPerHour(pollScenarios[3], kPolicyAdaptiveNoTrip);
+
+	CHECK(pastWarning > discharging);
+}
+
+BENCH(SchedulerTransactionsPerHour)
+{
+	char metric[64];
+
+	for (UInt32 i = 0; i < sizeof(pollScenarios) / sizeof(pollScenarios[0]); i++)
+	{
+		for (int policy = 0; policy < kPolicyCount; policy++)
+		{
+			snprintf(metric, sizeof(metric), "%s, %s", pollScenarios[i].name, policyNames[policy]);
+			BenchReport("SchedulerTransactionsPerHour", metric,
+						transactionsPerHour(pollScenarios[i], policy), "evaluations/h");
+		}
+	}
+}
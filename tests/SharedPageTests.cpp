@@ -0,0 +1,299 @@
+/*
+ * The shared page's sample ring, BatterySharedPageAppend() and
+ * BatterySharedPageReadSamples(), and the user space reader on its file
+ * stand-in.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "TestHarness.h"
+#include "AppleSmartBatteryReader.h"
+
+// A sample's fields all follow from its sequence number in the ring
+
+static void makeSample(BatterySample *sample, uint64_t sequence)
+{
+	sample->timestamp		= 1000 * sequence;
+	sample->flags			= (uint32_t) sequence & 0xFF;
+	sample->currentCapacity	= (uint32_t) sequence;
+	sample->amperage		= -(int32_t) sequence;
+	sample->voltage			= (uint32_t) sequence + 1;
+	sample->temperature		= (uint32_t) sequence + 2;
+	sample->reserved		= 0;
+}
+
+static bool sampleIsWhole(const BatterySample *sample)
+{
+	BatterySample expected;
+
+	makeSample(&expected, sample->timestamp / 1000);
+
+	return !memcmp(&expected, sample, sizeof(expected));
+}
+
+static BatterySharedPage *createPage(void)
+{
+	BatterySharedPage *page = (BatterySharedPage *) calloc(1, sizeof(BatterySharedPage));
+
+	page->magic		= kBatterySharedPageMagic;
+	page->version	= kBatterySnapshotVersion;
+	page->size		= sizeof(BatterySharedPage);
+	page->ringSize	= kBatterySharedRingSize;
+
+	return page;
+}
+
+static void appendSamples(BatterySharedPage *page, uint64_t count)
+{
+	BatterySample sample;
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		makeSample(&sample, page->ringHead);
+		BatterySharedPageAppend(page, &sample);
+	}
+}
+
+// The samples hold consecutive sequence numbers ending at last
+static bool samplesEndAt(const BatterySample *samples, uint32_t count, uint64_t last)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (!sampleIsWhole(&samples[i]) || (samples[i].timestamp != 1000 * (last - count + 1 + i)))
+			return false;
+	}
+
+	return true;
+}
+
+TEST(SharedRingBeforeWrap)
+{
+	BatterySharedPage	*page = createPage();
+	BatterySample		samples[kBatterySharedRingSize];
+
+	CHECK_EQ(0, BatterySharedPageReadSamples(page, samples, kBatterySharedRingSize));
+
+	appendSamples(page, 10);
+
+	CHECK_EQ(10, BatterySharedPageReadSamples(page, samples, kBatterySharedRingSize));
+	CHECK(samplesEndAt(samples, 10, 9));
+
+	// The newest come back when fewer are asked for
+	CHECK_EQ(4, BatterySharedPageReadSamples(page, samples, 4));
+	CHECK(samplesEndAt(samples, 4, 9));
+
+	free(page);
+}
+
+TEST(SharedRingWrapsAround)
+{
+	BatterySharedPage	*page = createPage();
+	BatterySample		samples[kBatterySharedRingSize];
+	uint64_t			written = 3 * kBatterySharedRingSize + 5;
+
+	appendSamples(page, written);
+
+	// The slot the writer would fill next holds the oldest sample, which a
+	// reader can never be sure of, so a full read stops one short
+	CHECK_EQ(kBatterySharedRingSize - 1, BatterySharedPageReadSamples(page, samples, kBatterySharedRingSize));
+	CHECK(samplesEndAt(samples, kBatterySharedRingSize - 1, written - 1));
+
+	// Asking for more than the ring holds is the same as asking for it all
+	CHECK_EQ(kBatterySharedRingSize - 1, BatterySharedPageReadSamples(page, samples, 1000));
+
+	CHECK_EQ(16, BatterySharedPageReadSamples(page, samples, 16));
+	CHECK(samplesEndAt(samples, 16, written - 1));
+
+	// Exactly one lap
+	free(page);
+	page = createPage();
+	appendSamples(page, kBatterySharedRingSize);
+
+	CHECK_EQ(kBatterySharedRingSize - 1, BatterySharedPageReadSamples(page, samples, kBatterySharedRingSize));
+	CHECK(samplesEndAt(samples, kBatterySharedRingSize - 1, kBatterySharedRingSize - 1));
+
+	free(page);
+}
+
+struct RingRun
+{
+	BatterySharedPage	*page;
+	volatile bool		stop;
+	uint64_t			reads;
+	uint64_t			bad;
+	uint64_t			empty;
+};
+
+static void *appendRing(void *argument)
+{
+	RingRun *run = (RingRun *) argument;
+
+	while (!__atomic_load_n(&run->stop, __ATOMIC_ACQUIRE))
+		appendSamples(run->page, 1);
+
+	return NULL;
+}
+
+TEST(SharedRingDropsOverwrittenSamples)
+{
+	RingRun			run;
+	pthread_t		writer;
+	BatterySample	samples[kBatterySharedRingSize];
+	uint64_t		deadline;
+
+	memset(&run, 0, sizeof(run));
+	run.page = createPage();
+
+	pthread_create(&writer, NULL, appendRing, &run);
+	deadline = BenchNowNS() + 200000000ULL;
+
+	// Whatever the writer overwrote mid-copy is dropped; what is left is a
+	// run of whole, consecutive samples
+	while (BenchNowNS() < deadline)
+	{
+		uint32_t count = BatterySharedPageReadSamples(run.page, samples, kBatterySharedRingSize);
+
+		run.reads++;
+
+		if (!count) {
+			run.empty++;
+			continue;
+		}
+
+		if (!samplesEndAt(samples, count, samples[count - 1].timestamp / 1000))
+			run.bad++;
+	}
+
+	__atomic_store_n(&run.stop, true, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+
+	CHECK(run.reads > 0);
+	CHECK(run.page->ringHead > kBatterySharedRingSize);
+	CHECK_EQ(0, run.bad);
+	CHECK(run.empty < run.reads);
+
+	free(run.page);
+}
+
+// The reader library against its file stand-in
+
+static void tempPath(char *path, size_t size)
+{
+	static unsigned int serial;
+
+	snprintf(path, size, "/tmp/battery-shared-page.%d.%u", (int) getpid(), serial++);
+}
+
+TEST(SharedFileReaderSeesWriter)
+{
+	char				path[64];
+	BatterySharedPage	*page;
+	BatteryReader		reader;
+	BatterySnapshot		snapshot;
+	BatterySample		samples[kBatterySharedRingSize];
+
+	tempPath(path, sizeof(path));
+	page = BatterySharedFileCreate(path);
+	CHECK(page != NULL);
+	if (!page)
+		return;
+
+	CHECK_EQ(0, BatteryReaderOpenFile(&reader, path));
+
+	// Published after the reader mapped the file
+	bzero(&snapshot, sizeof(snapshot));
+	snapshot.generation			= 7;
+	snapshot.currentCapacity	= 4000;
+	snapshot.maxCapacity		= 5200;
+	snapshot.flags				= kBatterySnapshotPresent;
+	BatterySnapshotWrite(&page->snapshot, &snapshot);
+	appendSamples(page, kBatterySharedRingSize + 3);
+
+	bzero(&snapshot, sizeof(snapshot));
+	CHECK_EQ(0, BatteryReaderCopySnapshot(&reader, &snapshot));
+	CHECK_EQ(7, snapshot.generation);
+	CHECK_EQ(4000, snapshot.currentCapacity);
+	CHECK_EQ(5200, snapshot.maxCapacity);
+
+	CHECK_EQ(kBatterySharedRingSize + 3, BatteryReaderSamplesWritten(&reader));
+	CHECK_EQ(kBatterySharedRingSize - 1, BatteryReaderCopySamples(&reader, samples, kBatterySharedRingSize));
+	CHECK(samplesEndAt(samples, kBatterySharedRingSize - 1, kBatterySharedRingSize + 2));
+
+	// Only the driver keeps a _BST history
+	uint64_t	first, next;
+	uint32_t	count;
+
+	errno = 0;
+	CHECK_EQ(-1, BatteryReaderCopyHistory(&reader, 0, NULL, 0, &first, &count, &next));
+	CHECK_EQ(ENOTSUP, errno);
+
+	BatteryReaderClose(&reader);
+	CHECK(reader.page == NULL);
+
+	BatterySharedFileClose(page);
+	unlink(path);
+}
+
+TEST(SharedFileReaderFromEnvironment)
+{
+	char				path[64];
+	BatterySharedPage	*page;
+	BatteryReader		reader;
+	const char			*saved = getenv(kBatterySharedPageEnvironment);
+
+	tempPath(path, sizeof(path));
+	page = BatterySharedFileCreate(path);
+	CHECK(page != NULL);
+
+	setenv(kBatterySharedPageEnvironment, path, 1);
+	CHECK_EQ(0, BatteryReaderOpen(&reader));
+	BatteryReaderClose(&reader);
+
+	if (saved)
+		setenv(kBatterySharedPageEnvironment, saved, 1);
+	else
+		unsetenv(kBatterySharedPageEnvironment);
+
+	BatterySharedFileClose(page);
+	unlink(path);
+}
+
+TEST(SharedFileReaderRejectsOtherLayouts)
+{
+	char				path[64];
+	BatterySharedPage	*page;
+	BatteryReader		reader;
+
+	tempPath(path, sizeof(path));
+
+	// Missing
+	errno = 0;
+	CHECK_EQ(-1, BatteryReaderOpenFile(&reader, path));
+	CHECK_EQ(ENOENT, errno);
+
+	// Another version of the layout
+	page = BatterySharedFileCreate(path);
+	CHECK(page != NULL);
+	if (!page)
+		return;
+
+	page->version = kBatterySnapshotVersion + 1;
+
+	errno = 0;
+	CHECK_EQ(-1, BatteryReaderOpenFile(&reader, path));
+	CHECK_EQ(EPROTO, errno);
+	CHECK(reader.page == NULL);
+
+	// Not yet initialised
+	page->version	= kBatterySnapshotVersion;
+	page->magic		= 0;
+
+	CHECK_EQ(-1, BatteryReaderOpenFile(&reader, path));
+
+	BatterySharedFileClose(page);
+	unlink(path);
+}
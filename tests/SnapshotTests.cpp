@@ -0,0 +1,199 @@
+/*
+ * BatterySnapshotWrite() and BatterySnapshotRead() across threads: one
+ * writer, any number of readers, and no reader ever sees half of one
+ * publication and half of another.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "TestHarness.h"
+#include "AppleSmartBatterySnapshot.h"
+
+// Every field of a published snapshot is derived from its generation, so a
+// reader can tell a torn copy from a whole one
+
+static void fillSnapshot(BatterySnapshot *snapshot, uint32_t generation)
+{
+	snapshot->timestamp				= 1000ULL * generation;
+	snapshot->generation			= generation;
+	snapshot->flags					= generation & 0xFF;
+	snapshot->currentCapacity		= generation;
+	snapshot->maxCapacity			= generation + 1;
+	snapshot->designCapacity		= generation + 2;
+	snapshot->amperage				= -(int32_t) generation;
+	snapshot->voltage				= generation + 3;
+	snapshot->timeRemaining			= generation + 4;
+	snapshot->averageTimeToEmpty	= generation + 5;
+	snapshot->averageTimeToFull		= generation + 6;
+	snapshot->temperature			= generation + 7;
+	snapshot->cycleCount			= generation + 8;
+}
+
+static bool snapshotIsWhole(const BatterySnapshot *snapshot)
+{
+	BatterySnapshot expected;
+
+	fillSnapshot(&expected, snapshot->generation);
+
+	return !memcmp(&expected, snapshot, sizeof(expected));
+}
+
+struct LatchRun
+{
+	BatterySnapshotLatch	latch;
+	volatile bool			stop;
+	volatile uint32_t		started;		// readers running
+	uint32_t				readers;
+	uint32_t				writes;			// 0: until stop
+	uint64_t				written;
+};
+
+struct LatchReader
+{
+	LatchRun	*run;
+	pthread_t	thread;
+	uint64_t	reads;
+	uint64_t	torn;
+	uint64_t	backwards;
+};
+
+static void *writeLatch(void *argument)
+{
+	LatchRun		*run = (LatchRun *) argument;
+	BatterySnapshot	snapshot;
+	uint32_t		generation = 1;
+
+	// Publish only once every reader is in its loop
+	while (__atomic_load_n(&run->started, __ATOMIC_ACQUIRE) < run->readers)
+		sched_yield();
+
+	while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)
+		   && (!run->writes || (generation <= run->writes)))
+	{
+		fillSnapshot(&snapshot, generation++);
+		BatterySnapshotWrite(&run->latch, &snapshot);
+	}
+
+	run->written = generation - 1;
+	__atomic_store_n(&run->stop, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void *readLatch(void *argument)
+{
+	LatchReader		*reader = (LatchReader *) argument;
+	BatterySnapshot	snapshot;
+	uint32_t		last = 0;
+
+	__atomic_add_fetch(&reader->run->started, 1, __ATOMIC_RELEASE);
+
+	while (!__atomic_load_n(&reader->run->stop, __ATOMIC_ACQUIRE))
+	{
+		BatterySnapshotRead(&reader->run->latch, &snapshot);
+		reader->reads++;
+
+		if (!snapshotIsWhole(&snapshot))
+			reader->torn++;
+		if (snapshot.generation < last)
+			reader->backwards++;
+
+		last = snapshot.generation;
+	}
+
+	return NULL;
+}
+
+// Runs one writer against readerCount readers, either for a number of
+// writes or, with writes == 0, for durationMS. Totals go to the reader
+// slot past the last.
+static void runLatch(LatchRun *run, LatchReader *readers, uint32_t readerCount,
+					 uint32_t writes, uint32_t durationMS)
+{
+	LatchReader	*total = &readers[readerCount];
+	pthread_t	writer;
+
+	memset(run, 0, sizeof(*run));
+	memset(readers, 0, sizeof(*readers) * (readerCount + 1));
+	run->readers	= readerCount;
+	run->writes		= writes;
+
+	fillSnapshot(&run->latch.slot[0], 0);
+	fillSnapshot(&run->latch.slot[1], 0);
+
+	for (uint32_t i = 0; i < readerCount; i++)
+	{
+		readers[i].run = run;
+		pthread_create(&readers[i].thread, NULL, readLatch, &readers[i]);
+	}
+
+	pthread_create(&writer, NULL, writeLatch, run);
+
+	if (!writes) {
+		usleep(durationMS * 1000);
+		__atomic_store_n(&run->stop, true, __ATOMIC_RELEASE);
+	}
+
+	pthread_join(writer, NULL);
+
+	for (uint32_t i = 0; i < readerCount; i++)
+	{
+		pthread_join(readers[i].thread, NULL);
+		total->reads		+= readers[i].reads;
+		total->torn			+= readers[i].torn;
+		total->backwards	+= readers[i].backwards;
+	}
+}
+
+enum
+{
+	kLatchTestReaders	= 4,
+	kLatchTestWrites	= 200000,
+	kLatchBenchMS		= 250,
+	kLatchBenchMax		= 64
+};
+
+TEST(SnapshotReadersNeverSeeATornCopy)
+{
+	LatchRun	run;
+	LatchReader	readers[kLatchTestReaders + 1];
+
+	runLatch(&run, readers, kLatchTestReaders, kLatchTestWrites, 0);
+
+	CHECK_EQ(kLatchTestWrites, run.written);
+	CHECK(readers[kLatchTestReaders].reads > 0);
+	CHECK_EQ(0, readers[kLatchTestReaders].torn);
+	CHECK_EQ(0, readers[kLatchTestReaders].backwards);
+
+	// The last publication is the one left readable
+	BatterySnapshot snapshot;
+
+	BatterySnapshotRead(&run.latch, &snapshot);
+	CHECK_EQ(kLatchTestWrites, snapshot.generation);
+	CHECK(snapshotIsWhole(&snapshot));
+}
+
+BENCH(SnapshotReaderScaling)
+{
+	static LatchRun		run;
+	static LatchReader	readers[kLatchBenchMax + 1];
+	char				metric[64];
+
+	for (uint32_t count = 1; count <= kLatchBenchMax; count *= 2)
+	{
+		LatchReader *total = &readers[count];
+
+		runLatch(&run, readers, count, 0, kLatchBenchMS);
+
+		snprintf(metric, sizeof(metric), "%u readers, reads", (unsigned int) count);
+		BenchReport("SnapshotReaderScaling", metric, total->reads * 1000.0 / kLatchBenchMS, "/s");
+		snprintf(metric, sizeof(metric), "%u readers, writes", (unsigned int) count);
+		BenchReport("SnapshotReaderScaling", metric, run.written * 1000.0 / kLatchBenchMS, "/s");
+
+		CHECK_EQ(0, total->torn);
+		CHECK_EQ(0, total->backwards);
+	}
+}
@@ -0,0 +1,73 @@
+/*
+ * Minimal self-registering test framework for the host build of the driver.
+ *
+ *   TEST(name) { CHECK(cond); CHECK_EQ(expected, actual); }
+ *   BENCH(name) { BenchReport(name, "metric", value, "unit"); }
+ *
+ * A failed check is reported and the test carries on; TestMain.cpp runs
+ * every registered test and exits non-zero if any check failed. Benchmarks
+ * only run with --bench, see "make -C tests bench".
+ */
+
+#ifndef __TestHarness__
+#define __TestHarness__
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct TestCase
+{
+	const char	*name;
+	void		(*function)(void);
+	TestCase	*next;
+};
+
+void	RegisterTest(TestCase *test);
+void	RegisterBench(TestCase *bench);
+void	TestFailed(const char *file, int line, const char *expression);
+void	TestFailedEqual(const char *file, int line, const char *expected, const char *actual,
+						long long expectedValue, long long actualValue);
+
+// Monotonic wall time, for what a benchmark measures on the real clock
+uint64_t	BenchNowNS(void);
+
+// One line of a benchmark's results
+void	BenchReport(const char *bench, const char *metric, double value, const char *unit);
+
+struct TestRegistrar
+{
+	TestRegistrar(TestCase *test)	{ RegisterTest(test); }
+};
+
+struct BenchRegistrar
+{
+	BenchRegistrar(TestCase *bench)	{ RegisterBench(bench); }
+};
+
+#define TEST(name) \
+	static void test_##name(void); \
+	static TestCase testCase_##name = { #name, test_##name, 0 }; \
+	static TestRegistrar testRegistrar_##name(&testCase_##name); \
+	static void test_##name(void)
+
+#define BENCH(name) \
+	static void bench_##name(void); \
+	static TestCase benchCase_##name = { #name, bench_##name, 0 }; \
+	static BenchRegistrar benchRegistrar_##name(&benchCase_##name); \
+	static void bench_##name(void)
+
+#define CHECK(expression) \
+	do { \
+		if (!(expression)) \
+			TestFailed(__FILE__, __LINE__, #expression); \
+	} while (0)
+
+#define CHECK_EQ(expected, actual) \
+	do { \
+		long long _expected = (long long) (expected); \
+		long long _actual = (long long) (actual); \
+		if (_expected != _actual) \
+			TestFailedEqual(__FILE__, __LINE__, #expected, #actual, _expected, _actual); \
+	} while (0)
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Runs every TEST() linked into the binary, or only those whose names
+ * contain the first argument. With --bench first, runs the BENCH()es
+ * instead.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "TestHarness.h"
+
+static TestCase	*testList = 0;
+static TestCase	**testListTail = &testList;
+static TestCase	*benchList = 0;
+static TestCase	**benchListTail = &benchList;
+static int		checkFailures = 0;
+
+void RegisterTest(TestCase *test)
+{
+	*testListTail = test;
+	testListTail = &test->next;
+}
+
+void RegisterBench(TestCase *bench)
+{
+	*benchListTail = bench;
+	benchListTail = &bench->next;
+}
+
+uint64_t BenchNowNS(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void BenchReport(const char *bench, const char *metric, double value, const char *unit)
+{
+	printf("%-28s %-44s %14.1f %s\n", bench, metric, value, unit);
+	fflush(stdout);
+}
+
+void TestFailed(const char *file, int line, const char *expression)
+{
+	fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+	checkFailures++;
+}
+
+void TestFailedEqual(const char *file, int line, const char *expected, const char *actual,
+					 long long expectedValue, long long actualValue)
+{
+	fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: expected %lld, got %lld\n",
+			file, line, expected, actual, expectedValue, actualValue);
+	checkFailures++;
+}
+
+int main(int argc, char **argv)
+{
+	bool		bench = (argc > 1) && !strcmp(argv[1], "--bench");
+	const char	*filter = (argc > (bench ? 2 : 1)) ? argv[bench ? 2 : 1] : 0;
+	int			run = 0;
+	int			failed = 0;
+
+	for (TestCase *test = bench ? benchList : testList; test; test = test->next)
+	{
+		int before = checkFailures;
+
+		if (filter && !strstr(test->name, filter))
+			continue;
+
+		test->function();
+		run++;
+
+		if (checkFailures != before) {
+			fprintf(stderr, "FAIL %s\n", test->name);
+			failed++;
+		}
+	}
+
+	printf("%d of %d %s passed\n", run - failed, run, bench ? "benchmarks" : "tests");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * AppleSmartBatteryUserClient opened on a started battery, the way
+ * IOServiceOpen() would.
+ */
+
+#include "TestHarness.h"
+#include "BatteryFixture.h"
+#include "FakeACPIDevice.h"
+#include "AppleSmartBatteryUserClient.h"
+
+static AppleSmartBatteryUserClient *openClient(AppleSmartBattery *battery)
+{
+	AppleSmartBatteryUserClient *client = new AppleSmartBatteryUserClient;
+
+	if (!client->initWithTask(current_task(), NULL, 0, NULL)
+		|| !client->attach(battery) || !client->start(battery))
+	{
+		client->release();
+		return NULL;
+	}
+
+	return client;
+}
+
+// As IOConnectCallMethod() arrives: no dispatch, the client supplies it
+static IOReturn callMethod(AppleSmartBatteryUserClient *client, uint32_t selector,
+						   IOExternalMethodArguments *arguments)
+{
+	arguments->selector = selector;
+
+	return client->externalMethod(selector, arguments, NULL, NULL, NULL);
+}
+
+static void closeClient(AppleSmartBatteryUserClient *client, AppleSmartBattery *battery)
+{
+	client->clientClose();
+	client->detach(battery);
+	client->release();
+}
+
+TEST(UserClientMapsTheSharedPage)
+{
+	BatteryFixture				fixture(FakeACPIDevice::withBattery(true));
+	AppleSmartBatteryUserClient	*client;
+	IOMemoryDescriptor			*memory = NULL;
+	IOOptionBits				options = 0;
+	BatterySnapshot				snapshot;
+
+	HostRunThreadCalls();
+
+	client = openClient(fixture.battery);
+	CHECK(client != NULL);
+	if (!client)
+		return;
+
+	CHECK_EQ(kIOReturnBadArgument, client->clientMemoryForType(kBatterySharedMemoryType + 1, &options, &memory));
+
+	CHECK_EQ(kIOReturnSuccess, client->clientMemoryForType(kBatterySharedMemoryType, &options, &memory));
+	CHECK(memory != NULL);
+	CHECK(options & kIOMapReadOnly);
+	if (!memory) {
+		closeClient(client, fixture.battery);
+		return;
+	}
+
+	// What the mapping shows is what the battery just published
+	const BatterySharedPage *page = (const BatterySharedPage *) ((IOBufferMemoryDescriptor *) memory)->getBytesNoCopy();
+
+	CHECK(memory->getLength() >= sizeof(BatterySharedPage));
+	CHECK_EQ(kBatterySharedPageMagic, page->magic);
+	CHECK_EQ(kBatterySharedRingSize, page->ringSize);
+
+	BatterySnapshotRead(&page->snapshot, &snapshot);
+	CHECK(snapshot.flags & kBatterySnapshotPresent);
+	CHECK_EQ(fixture.psNumber(kIOPMPSCurrentCapacityKey), snapshot.currentCapacity);
+	CHECK(page->ringHead > 0);
+
+	memory->release();
+	closeClient(client, fixture.battery);
+}
+
+TEST(UserClientChecksMethodArguments)
+{
+	BatteryFixture				fixture(FakeACPIDevice::withBattery(true));
+	AppleSmartBatteryUserClient	*client;
+	IOExternalMethodArguments	arguments;
+	BatteryHistorySample		samples[4];
+	uint64_t					input[2] = { 0, 0 };
+	uint64_t					output[3];
+
+	HostRunThreadCalls();
+
+	client = openClient(fixture.battery);
+	CHECK(client != NULL);
+	if (!client)
+		return;
+
+	bzero(&arguments, sizeof(arguments));
+	arguments.scalarInput			= input;
+	arguments.scalarInputCount		= 1;
+	arguments.scalarOutput			= output;
+	arguments.scalarOutputCount		= 3;
+	arguments.structureOutput		= samples;
+	arguments.structureOutputSize	= sizeof(samples);
+
+	CHECK_EQ(kIOReturnBadArgument, callMethod(client, kBatteryUserClientMethodCount, &arguments));
+
+	arguments.scalarInputCount = 2;
+	CHECK_EQ(kIOReturnBadArgument, callMethod(client, kBatteryUserClientCopyHistory, &arguments));
+
+	arguments.scalarInputCount = 1;
+	CHECK_EQ(kIOReturnSuccess, callMethod(client, kBatteryUserClientCopyHistory, &arguments));
+	CHECK(output[1] >= 1);
+
+	closeClient(client, fixture.battery);
+}
+
+TEST(UserClientRefusesCallsOnceClosed)
+{
+	BatteryFixture				*fixture = new BatteryFixture(FakeACPIDevice::withBattery(true));
+	AppleSmartBattery			*battery;
+	AppleSmartBatteryUserClient	*client;
+	IOExternalMethodArguments	arguments;
+	IOMemoryDescriptor			*memory = NULL;
+	IOOptionBits				options = 0;
+	uint64_t					input = 0;
+	uint64_t					output[3];
+
+	HostRunThreadCalls();
+
+	battery	= fixture->battery;
+	client	= openClient(battery);
+	CHECK(client != NULL);
+	if (!client) {
+		delete fixture;
+		return;
+	}
+
+	bzero(&arguments, sizeof(arguments));
+	arguments.scalarInput		= &input;
+	arguments.scalarInputCount	= 1;
+	arguments.scalarOutput		= output;
+	arguments.scalarOutputCount	= 3;
+
+	// A call racing the close still has the battery it started with; the
+	// client holds it until it is freed
+	CHECK_EQ(kIOReturnSuccess, client->clientClose());
+	CHECK(client->isInactive());
+
+	// The manager and battery stop under it
+	client->detach(battery);
+	fixture->stop();
+
+	CHECK_EQ(kIOReturnNotReady, callMethod(client, kBatteryUserClientCopyHistory, &arguments));
+	CHECK_EQ(kIOReturnNotReady, client->clientMemoryForType(kBatterySharedMemoryType, &options, &memory));
+	CHECK(memory == NULL);
+
+	client->release();
+	delete fixture;
+}
+
+/*
+ * History export: polls at the one second override period, each with its
+ * own remaining capacity, so every exported sample says which poll it was.
+ */
+
+enum
+{
+	kHistoryFirstCapacity	= 3000
+};
+
+static BatteryFixture *historyFixture(FakeACPIDevice **device)
+{
+	OSDictionary	*properties = OSDictionary::withCapacity(1);
+	OSNumber		*period = OSNumber::withNumber(1, 32);
+	BatteryFixture	*fixture;
+
+	*device = FakeACPIDevice::withBattery(true);
+
+	properties->setObject(kBatteryPollingDebugKey, period);
+	period->release();
+
+	fixture = new BatteryFixture(*device, NULL, properties);
+	properties->release();
+
+	HostRunThreadCalls();
+
+	return fixture;
+}
+
+// Poll number n reads capacity kHistoryFirstCapacity + n; with noisy set,
+// rate and voltage jump around so the samples don't delta-encode down to a
+// byte a field and the history blocks fill sooner
+static void pollHistory(FakeACPIDevice *device, UInt32 from, UInt32 count, bool noisy)
+{
+	for (UInt32 n = from; n < from + count; n++)
+	{
+		UInt32	rate = noisy ? 500 + ((n * 7919) % 3000) : 1000;
+		UInt32	voltage = noisy ? 10000 + ((n * 104729) % 3000) : 11500;
+		OSArray	*status = CreateBSTPackage(BATTERY_DISCHARGING, rate, kHistoryFirstCapacity + n, voltage);
+
+		device->setObject("_BST", status);
+		status->release();
+
+		HostClockAdvance(1000);
+		HostRunThreadCalls();
+	}
+}
+
+// The samples are polls first..first+count-1, in order
+static bool historyIsPolls(const BatteryHistorySample *samples, UInt32 count, UInt32 first)
+{
+	for (UInt32 i = 0; i < count; i++)
+	{
+		if ((samples[i].capacity != kHistoryFirstCapacity + first + i)
+			|| (i && (samples[i].timestamp <= samples[i - 1].timestamp)))
+			return false;
+	}
+
+	return true;
+}
+
+// Sequence number of the sample poll n left, found from the capacity
+static bool findPoll(AppleSmartBattery *battery, UInt32 n, UInt64 *sequence)
+{
+	BatteryHistorySample	samples[64];
+	BatteryHistoryRequest	request;
+
+	bzero(&request, sizeof(request));
+	request.buffer		= samples;
+	request.maxCount	= 64;
+
+	do {
+		if ((kIOReturnSuccess != battery->copySampleHistory(&request)) || !request.count)
+			return false;
+
+		for (UInt32 i = 0; i < request.count; i++)
+		{
+			if (samples[i].capacity == kHistoryFirstCapacity + n) {
+				*sequence = request.first + i;
+				return true;
+			}
+		}
+
+		request.cursor = request.first + request.count;
+	} while (true);
+}
+
+TEST(HistoryCursorResumes)
+{
+	FakeACPIDevice			*device;
+	BatteryFixture			*fixture = historyFixture(&device);
+	BatteryHistorySample	samples[100];
+	BatteryHistoryRequest	request;
+	UInt64					start;
+
+	pollHistory(device, 0, 50, false);
+	CHECK(findPoll(fixture->battery, 0, &start));
+
+	// More than one 16 sample batch in a single call
+	bzero(&request, sizeof(request));
+	request.cursor		= start;
+	request.buffer		= samples;
+	request.maxCount	= 40;
+
+	CHECK_EQ(kIOReturnSuccess, fixture->battery->copySampleHistory(&request));
+	CHECK_EQ(start, request.first);
+	CHECK_EQ(40, request.count);
+	CHECK(historyIsPolls(samples, 40, 0));
+
+	// The next call carries on where that one stopped, and sees the polls
+	// taken since
+	pollHistory(device, 50, 30, false);
+
+	request.cursor		= request.first + request.count;
+	request.maxCount	= 100;
+
+	CHECK_EQ(kIOReturnSuccess, fixture->battery->copySampleHistory(&request));
+	CHECK_EQ(start + 40, request.first);
+	CHECK_EQ(40, request.count);
+	CHECK(historyIsPolls(samples, 40, 40));
+
+	// Nothing new: an empty copy at the head
+	request.cursor = request.first + request.count;
+
+	CHECK_EQ(kIOReturnSuccess, fixture->battery->copySampleHistory(&request));
+	CHECK_EQ(0, request.count);
+	CHECK_EQ(request.cursor, request.first);
+
+	delete fixture;
+}
+
+TEST(HistoryGapAfterOverwrite)
+{
+	FakeACPIDevice			*device;
+	BatteryFixture			*fixture = historyFixture(&device);
+	BatteryHistorySample	samples[64];
+	BatteryHistoryRequest	request;
+	UInt64					start;
+	UInt64					oldest;
+
+	pollHistory(device, 0, 10, true);
+	CHECK(findPoll(fixture->battery, 0, &start));
+
+	// Enough to go round every block
+	pollHistory(device, 10, 10000, true);
+
+	bzero(&request, sizeof(request));
+	request.cursor		= start;
+	request.buffer		= samples;
+	request.maxCount	= 64;
+
+	CHECK_EQ(kIOReturnSuccess, fixture->battery->copySampleHistory(&request));
+
+	// The copy starts at the oldest sample still held; the gap up to it
+	// is what was lost
+	oldest = request.first;
+	CHECK(oldest > start);
+	CHECK_EQ(64, request.count);
+	CHECK(historyIsPolls(samples, 64, (UInt32) (oldest - start)));
+
+	// Asking from anywhere in the gap gives the same answer
+	request.cursor = start + (oldest - start) / 2;
+	CHECK_EQ(kIOReturnSuccess, fixture->battery->copySampleHistory(&request));
+	CHECK_EQ(oldest, request.first);
+
+	delete fixture;
+}
+
+TEST(UserClientCopiesHistoryThroughDescriptor)
+{
+	FakeACPIDevice				*device;
+	BatteryFixture				*fixture = historyFixture(&device);
+	AppleSmartBatteryUserClient	*client;
+	IOBufferMemoryDescriptor	*descriptor;
+	IOExternalMethodArguments	arguments;
+	uint64_t					input;
+	uint64_t					output[3];
+	UInt64						start;
+
+	pollHistory(device, 0, 50, false);
+	CHECK(findPoll(fixture->battery, 0, &start));
+
+	client = openClient(fixture->battery);
+	CHECK(client != NULL);
+	if (!client) {
+		delete fixture;
+		return;
+	}
+
+	// Room for more than is there: the size reported back is what was copied
+	descriptor = IOBufferMemoryDescriptor::withOptions(kIODirectionIn, 100 * sizeof(BatteryHistorySample));
+
+	input = start;
+	bzero(&arguments, sizeof(arguments));
+	arguments.scalarInput				= &input;
+	arguments.scalarInputCount			= 1;
+	arguments.scalarOutput				= output;
+	arguments.scalarOutputCount			= 3;
+	arguments.structureOutputDescriptor	= descriptor;
+
+	CHECK_EQ(kIOReturnSuccess, callMethod(client, kBatteryUserClientCopyHistory, &arguments));
+	CHECK_EQ(start, output[0]);
+	CHECK_EQ(50, output[1]);
+	CHECK_EQ(start + 50, output[2]);
+	CHECK_EQ(50 * sizeof(BatteryHistorySample), arguments.structureOutputDescriptorSize);
+	CHECK(historyIsPolls((const BatteryHistorySample *) descriptor->getBytesNoCopy(), 50, 0));
+	CHECK_EQ(0, descriptor->hostPrepared);
+
+	descriptor->release();
+	closeClient(client, fixture->battery);
+	delete fixture;
+}
@@ -0,0 +1,1582 @@
+/*
+ * Host implementations of the kernel interfaces declared in HostKernel.h.
+ * See that file for what is modelled and how the tests drive it.
+ */
+
+#include "HostKernel.h"
+
+#include <algorithm>
+
+const vm_size_t page_size = 4096;
+
+static volatile SInt32	hostLiveObjects = 0;
+static volatile SInt64	hostCreatedObjects = 0;
+static volatile SInt64	hostMallocs = 0;
+static volatile SInt32	hostLiveLocks = 0;
+static uint64_t			hostUptime = 1000ULL * kSecondScale;
+static bool				hostClientPrivileged = true;
+
+/******************************************************************************
+ * Logging, allocation, locks
+ ******************************************************************************/
+
+void IOLog(const char *format, ...)
+{
+	static int enabled = -1;
+	va_list args;
+
+	if (enabled < 0)
+		enabled = getenv("HOST_IOLOG") ? 1 : 0;
+
+	if (!enabled)
+		return;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+void *IOMalloc(vm_size_t size)
+{
+	OSAddAtomic64(1, &hostMallocs);
+
+	return malloc(size);
+}
+
+void IOFree(void *address, vm_size_t size)
+{
+	::free(address);
+}
+
+struct IOLock
+{
+	pthread_mutex_t	mutex;
+};
+
+IOLock *IOLockAlloc(void)
+{
+	IOLock *lock = (IOLock *) malloc(sizeof(IOLock));
+
+	if (!lock)
+		return NULL;
+
+	pthread_mutex_init(&lock->mutex, NULL);
+	OSIncrementAtomic(&hostLiveLocks);
+
+	return lock;
+}
+
+void IOLockFree(IOLock *lock)
+{
+	pthread_mutex_destroy(&lock->mutex);
+	::free(lock);
+	OSDecrementAtomic(&hostLiveLocks);
+}
+
+void IOLockLock(IOLock *lock)
+{
+	pthread_mutex_lock(&lock->mutex);
+}
+
+void IOLockUnlock(IOLock *lock)
+{
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+/******************************************************************************
+ * Time
+ ******************************************************************************/
+
+void clock_get_uptime(uint64_t *result)
+{
+	*result = hostUptime;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result)
+{
+	*result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result)
+{
+	*result = nanoseconds;
+}
+
+/******************************************************************************
+ * Thread calls
+ ******************************************************************************/
+
+struct thread_call
+{
+	thread_call_func_t	func;
+	thread_call_param_t	param0;
+	thread_call_param_t	param1;
+	bool				pending;
+	bool				running;
+	bool				freed;
+};
+
+static std::vector<thread_call *>	hostThreadCallQueue;
+
+static bool dequeueThreadCall(thread_call_t call)
+{
+	std::vector<thread_call *>::iterator it = std::find(hostThreadCallQueue.begin(), hostThreadCallQueue.end(), call);
+
+	if (it == hostThreadCallQueue.end())
+		return false;
+
+	hostThreadCallQueue.erase(it);
+	call->pending = false;
+
+	return true;
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+	thread_call_t call = new thread_call();
+
+	call->func		= func;
+	call->param0	= param0;
+
+	return call;
+}
+
+bool thread_call_enter(thread_call_t call)
+{
+	return thread_call_enter1(call, NULL);
+}
+
+bool thread_call_enter1(thread_call_t call, thread_call_param_t param1)
+{
+	call->param1 = param1;
+
+	if (call->pending)
+		return true;
+
+	call->pending = true;
+	hostThreadCallQueue.push_back(call);
+
+	return false;
+}
+
+bool thread_call_cancel(thread_call_t call)
+{
+	return dequeueThreadCall(call);
+}
+
+// Nothing runs concurrently here, so there is never an invocation to wait for
+bool thread_call_cancel_wait(thread_call_t call)
+{
+	return dequeueThreadCall(call);
+}
+
+bool thread_call_free(thread_call_t call)
+{
+	if (call->pending)
+		return false;
+
+	if (call->running)
+		call->freed = true;
+	else
+		delete call;
+
+	return true;
+}
+
+unsigned int HostRunThreadCalls(unsigned int limit)
+{
+	unsigned int count = 0;
+
+	while (!hostThreadCallQueue.empty() && (count < limit))
+	{
+		thread_call_t call = hostThreadCallQueue.front();
+
+		hostThreadCallQueue.erase(hostThreadCallQueue.begin());
+
+		call->pending = false;
+		call->running = true;
+		call->func(call->param0, call->param1);
+		call->running = false;
+
+		if (call->freed)
+			delete call;
+
+		count++;
+	}
+
+	return count;
+}
+
+unsigned int HostPendingThreadCalls(void)
+{
+	return (unsigned int) hostThreadCallQueue.size();
+}
+
+/******************************************************************************
+ * OSObject
+ ******************************************************************************/
+
+void *OSObject::operator new(size_t size)
+{
+	void *mem = calloc(1, size);
+
+	if (mem) {
+		OSIncrementAtomic(&hostLiveObjects);
+		OSAddAtomic64(1, &hostCreatedObjects);
+	}
+
+	return mem;
+}
+
+void OSObject::operator delete(void *mem, size_t size)
+{
+	if (!mem)
+		return;
+
+	OSDecrementAtomic(&hostLiveObjects);
+	::free(mem);
+}
+
+OSObject::OSObject() : retainCount(1)
+{
+}
+
+OSObject::~OSObject()
+{
+}
+
+void OSObject::retain(void) const
+{
+	OSIncrementAtomic(&retainCount);
+}
+
+void OSObject::release(void) const
+{
+	if (1 == OSDecrementAtomic(&retainCount))
+		const_cast<OSObject *>(this)->free();
+}
+
+int OSObject::getRetainCount(void) const
+{
+	return retainCount;
+}
+
+bool OSObject::init(void)
+{
+	return true;
+}
+
+void OSObject::free(void)
+{
+	delete this;
+}
+
+bool OSObject::isEqualTo(const OSObject *object) const
+{
+	return this == object;
+}
+
+SInt32 HostLiveObjects(void)
+{
+	return hostLiveObjects;
+}
+
+SInt64 HostCreatedObjects(void)
+{
+	return hostCreatedObjects;
+}
+
+SInt64 HostMallocs(void)
+{
+	return hostMallocs;
+}
+
+SInt32 HostLiveLocks(void)
+{
+	return hostLiveLocks;
+}
+
+/******************************************************************************
+ * OSBoolean, OSString, OSSymbol
+ ******************************************************************************/
+
+OSBoolean * const kOSBooleanTrue	= new OSBoolean(true);
+OSBoolean * const kOSBooleanFalse	= new OSBoolean(false);
+
+OSBoolean *OSBoolean::withBoolean(bool value)
+{
+	return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+OSString *OSString::withCString(const char *cString)
+{
+	OSString *me;
+
+	if (!cString)
+		return NULL;
+
+	me = new OSString;
+	me->string = cString;
+
+	return me;
+}
+
+bool OSString::isEqualTo(const char *cString) const
+{
+	return cString && (string == cString);
+}
+
+bool OSString::isEqualTo(const OSObject *object) const
+{
+	const OSString *other = OSDynamicCast(OSString, object);
+
+	return other && (string == other->string);
+}
+
+// Never destroyed, so static symbols may outlive the pool's translation unit
+static std::vector<OSSymbol *>	*symbolPool(void)
+{
+	static std::vector<OSSymbol *> *pool = new std::vector<OSSymbol *>;
+
+	return pool;
+}
+
+static pthread_mutex_t	symbolPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+const OSSymbol *OSSymbol::withCString(const char *cString)
+{
+	std::vector<OSSymbol *>	*pool = symbolPool();
+	OSSymbol				*symbol = NULL;
+
+	if (!cString)
+		return NULL;
+
+	pthread_mutex_lock(&symbolPoolLock);
+
+	for (size_t i = 0; i < pool->size(); i++)
+	{
+		if ((*pool)[i]->string == cString) {
+			symbol = (*pool)[i];
+			symbol->retain();
+			break;
+		}
+	}
+
+	if (!symbol)
+	{
+		symbol = new OSSymbol;
+		symbol->string = cString;
+		pool->push_back(symbol);
+	}
+
+	pthread_mutex_unlock(&symbolPoolLock);
+
+	return symbol;
+}
+
+void OSSymbol::retain(void) const
+{
+	OSObject::retain();
+}
+
+void OSSymbol::release(void) const
+{
+	std::vector<OSSymbol *> *pool = symbolPool();
+
+	// Leaves the pool with its last reference, so a lookup can't revive it
+	pthread_mutex_lock(&symbolPoolLock);
+
+	if (1 == getRetainCount())
+		pool->erase(std::find(pool->begin(), pool->end(), this));
+
+	pthread_mutex_unlock(&symbolPoolLock);
+
+	OSObject::release();
+}
+
+/******************************************************************************
+ * OSNumber, OSData
+ ******************************************************************************/
+
+static unsigned long long numberMask(unsigned int numberOfBits)
+{
+	return (numberOfBits >= 64) ? ~0ULL : ((1ULL << numberOfBits) - 1);
+}
+
+OSNumber *OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+	OSNumber *me;
+
+	if (!numberOfBits || (numberOfBits > 64))
+		return NULL;
+
+	me = new OSNumber;
+	me->size	= numberOfBits;
+	me->value	= value & numberMask(numberOfBits);
+
+	return me;
+}
+
+void OSNumber::setValue(unsigned long long newValue)
+{
+	value = newValue & numberMask(size);
+}
+
+bool OSNumber::isEqualTo(unsigned long long otherValue, unsigned int numberOfBits) const
+{
+	return value == otherValue;
+}
+
+bool OSNumber::isEqualTo(const OSObject *object) const
+{
+	const OSNumber *other = OSDynamicCast(OSNumber, object);
+
+	return other && (value == other->value);
+}
+
+OSData *OSData::withCapacity(unsigned int capacity)
+{
+	OSData *me = new OSData;
+
+	me->data.reserve(capacity);
+
+	return me;
+}
+
+OSData *OSData::withBytes(const void *bytes, unsigned int numBytes)
+{
+	OSData *me = new OSData;
+
+	if (numBytes)
+		me->data.assign((const UInt8 *) bytes, (const UInt8 *) bytes + numBytes);
+
+	return me;
+}
+
+OSData *OSData::withBytesNoCopy(void *bytes, unsigned int numBytes)
+{
+	OSData *me = new OSData;
+
+	me->external		= bytes;
+	me->externalLength	= numBytes;
+
+	return me;
+}
+
+const void *OSData::getBytesNoCopy(void) const
+{
+	if (external)
+		return externalLength ? external : NULL;
+
+	return data.empty() ? NULL : &data[0];
+}
+
+const void *OSData::getBytesNoCopy(unsigned int start, unsigned int numBytes) const
+{
+	const UInt8 *bytes = (const UInt8 *) getBytesNoCopy();
+
+	if (!bytes || ((UInt64) start + numBytes > getLength()))
+		return NULL;
+
+	return bytes + start;
+}
+
+unsigned int OSData::getLength(void) const
+{
+	return external ? externalLength : (unsigned int) data.size();
+}
+
+bool OSData::appendBytes(const void *bytes, unsigned int numBytes)
+{
+	// The kernel refuses to grow a buffer it doesn't own as well
+	if (external)
+		return false;
+
+	if (numBytes)
+		data.insert(data.end(), (const UInt8 *) bytes, (const UInt8 *) bytes + numBytes);
+
+	return true;
+}
+
+bool OSData::isEqualTo(const void *bytes, unsigned int numBytes) const
+{
+	if (numBytes != getLength())
+		return false;
+
+	return !numBytes || !memcmp(getBytesNoCopy(), bytes, numBytes);
+}
+
+bool OSData::isEqualTo(const OSObject *object) const
+{
+	const OSData *other = OSDynamicCast(OSData, object);
+
+	return other && isEqualTo(other->getBytesNoCopy(), other->getLength());
+}
+
+/******************************************************************************
+ * OSArray
+ ******************************************************************************/
+
+OSArray *OSArray::withCapacity(unsigned int capacity)
+{
+	OSArray *me = new OSArray;
+
+	me->capacity = capacity;
+	me->objects.reserve(capacity);
+
+	return me;
+}
+
+void OSArray::free(void)
+{
+	flushCollection();
+	OSCollection::free();
+}
+
+unsigned int OSArray::getCapacity(void) const
+{
+	return std::max(capacity, getCount());
+}
+
+OSObject *OSArray::getObject(unsigned int index) const
+{
+	return (index < objects.size()) ? (OSObject *) objects[index] : NULL;
+}
+
+bool OSArray::setObject(const OSObject *object)
+{
+	return setObject(getCount(), object);
+}
+
+bool OSArray::setObject(unsigned int index, const OSObject *object)
+{
+	if (!object || (index > objects.size()))
+		return false;
+
+	object->retain();
+	objects.insert(objects.begin() + index, object);
+
+	return true;
+}
+
+bool OSArray::replaceObject(unsigned int index, const OSObject *object)
+{
+	const OSObject *old;
+
+	if (!object || (index >= objects.size()))
+		return false;
+
+	object->retain();
+	old = objects[index];
+	objects[index] = object;
+	old->release();
+
+	return true;
+}
+
+void OSArray::removeObject(unsigned int index)
+{
+	const OSObject *old;
+
+	if (index >= objects.size())
+		return;
+
+	old = objects[index];
+	objects.erase(objects.begin() + index);
+	old->release();
+}
+
+void OSArray::flushCollection(void)
+{
+	std::vector<const OSObject *> old;
+
+	old.swap(objects);
+
+	for (size_t i = 0; i < old.size(); i++)
+		old[i]->release();
+}
+
+bool OSArray::isEqualTo(const OSObject *object) const
+{
+	const OSArray *other = OSDynamicCast(OSArray, object);
+
+	if (!other || (other->getCount() != getCount()))
+		return false;
+
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (!objects[i]->isEqualTo(other->objects[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/******************************************************************************
+ * OSDictionary
+ ******************************************************************************/
+
+OSDictionary *OSDictionary::withCapacity(unsigned int capacity)
+{
+	OSDictionary *me = new OSDictionary;
+
+	me->entries.reserve(capacity);
+
+	return me;
+}
+
+void OSDictionary::free(void)
+{
+	flushCollection();
+	OSCollection::free();
+}
+
+OSObject *OSDictionary::getObject(const char *key) const
+{
+	if (!key)
+		return NULL;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].first->isEqualTo(key))
+			return (OSObject *) entries[i].second;
+	}
+
+	return NULL;
+}
+
+OSObject *OSDictionary::getObject(const OSString *key) const
+{
+	return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+OSObject *OSDictionary::getObject(const OSSymbol *key) const
+{
+	return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+bool OSDictionary::setObject(const char *key, const OSObject *object)
+{
+	const OSSymbol	*symbol;
+	bool			result;
+
+	if (!key || !object)
+		return false;
+
+	symbol = OSSymbol::withCString(key);
+	result = setObject(symbol, object);
+	symbol->release();
+
+	return result;
+}
+
+bool OSDictionary::setObject(const OSString *key, const OSObject *object)
+{
+	return key ? setObject(key->getCStringNoCopy(), object) : false;
+}
+
+bool OSDictionary::setObject(const OSSymbol *key, const OSObject *object)
+{
+	if (!key || !object)
+		return false;
+
+	object->retain();
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].first == key)
+		{
+			const OSObject *old = entries[i].second;
+
+			entries[i].second = object;
+			old->release();
+
+			return true;
+		}
+	}
+
+	key->retain();
+	entries.push_back(std::make_pair(key, object));
+
+	return true;
+}
+
+void OSDictionary::removeObject(const char *key)
+{
+	if (!key)
+		return;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].first->isEqualTo(key))
+		{
+			std::pair<const OSSymbol *, const OSObject *> old = entries[i];
+
+			entries.erase(entries.begin() + i);
+			old.second->release();
+			old.first->release();
+
+			return;
+		}
+	}
+}
+
+void OSDictionary::removeObject(const OSString *key)
+{
+	if (key)
+		removeObject(key->getCStringNoCopy());
+}
+
+void OSDictionary::removeObject(const OSSymbol *key)
+{
+	if (key)
+		removeObject(key->getCStringNoCopy());
+}
+
+void OSDictionary::flushCollection(void)
+{
+	std::vector<std::pair<const OSSymbol *, const OSObject *> > old;
+
+	old.swap(entries);
+
+	for (size_t i = 0; i < old.size(); i++)
+	{
+		old[i].second->release();
+		old[i].first->release();
+	}
+}
+
+bool OSDictionary::isEqualTo(const OSObject *object) const
+{
+	const OSDictionary *other = OSDynamicCast(OSDictionary, object);
+
+	if (!other || (other->getCount() != getCount()))
+		return false;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		OSObject *theirs = other->getObject(entries[i].first);
+
+		if (!theirs || !entries[i].second->isEqualTo(theirs))
+			return false;
+	}
+
+	return true;
+}
+
+/******************************************************************************
+ * IORegistryEntry
+ ******************************************************************************/
+
+bool IORegistryEntry::init(OSDictionary *dictionary)
+{
+	if (!OSObject::init())
+		return false;
+
+	propertyTable = OSDictionary::withCapacity(16);
+
+	for (unsigned int i = 0; dictionary && (i < dictionary->getCount()); i++)
+		propertyTable->setObject(dictionary->getKey(i), dictionary->getObjectAt(i));
+
+	return true;
+}
+
+void IORegistryEntry::free(void)
+{
+	if (propertyTable) {
+		propertyTable->release();
+		propertyTable = NULL;
+	}
+
+	OSObject::free();
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol *aKey, OSObject *anObject)
+{
+	return propertyTable ? propertyTable->setObject(aKey, anObject) : false;
+}
+
+bool IORegistryEntry::setProperty(const OSString *aKey, OSObject *anObject)
+{
+	return propertyTable ? propertyTable->setObject(aKey, anObject) : false;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, OSObject *anObject)
+{
+	return propertyTable ? propertyTable->setObject(aKey, anObject) : false;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, const char *aString)
+{
+	OSString	*string = OSString::withCString(aString);
+	bool		result;
+
+	if (!string)
+		return false;
+
+	result = setProperty(aKey, string);
+	string->release();
+
+	return result;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, bool aBoolean)
+{
+	return setProperty(aKey, aBoolean ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits)
+{
+	OSNumber	*number = OSNumber::withNumber(aValue, aNumberOfBits);
+	bool		result;
+
+	if (!number)
+		return false;
+
+	result = setProperty(aKey, number);
+	number->release();
+
+	return result;
+}
+
+OSObject *IORegistryEntry::getProperty(const OSSymbol *aKey) const
+{
+	return propertyTable ? propertyTable->getObject(aKey) : NULL;
+}
+
+OSObject *IORegistryEntry::getProperty(const OSString *aKey) const
+{
+	return propertyTable ? propertyTable->getObject(aKey) : NULL;
+}
+
+OSObject *IORegistryEntry::getProperty(const char *aKey) const
+{
+	return propertyTable ? propertyTable->getObject(aKey) : NULL;
+}
+
+void IORegistryEntry::removeProperty(const OSSymbol *aKey)
+{
+	if (propertyTable)
+		propertyTable->removeObject(aKey);
+}
+
+void IORegistryEntry::removeProperty(const OSString *aKey)
+{
+	if (propertyTable)
+		propertyTable->removeObject(aKey);
+}
+
+void IORegistryEntry::removeProperty(const char *aKey)
+{
+	if (propertyTable)
+		propertyTable->removeObject(aKey);
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject *properties)
+{
+	return kIOReturnUnsupported;
+}
+
+/******************************************************************************
+ * IOService
+ ******************************************************************************/
+
+static IOPlatformExpert	hostPlatform;
+
+bool IOService::init(OSDictionary *dictionary)
+{
+	return IORegistryEntry::init(dictionary);
+}
+
+void IOService::free(void)
+{
+	IORegistryEntry::free();
+}
+
+bool IOService::start(IOService *provider)
+{
+	return true;
+}
+
+void IOService::stop(IOService *provider)
+{
+}
+
+IOWorkLoop *IOService::getWorkLoop(void) const
+{
+	return providerEntry ? providerEntry->getWorkLoop() : HostWorkLoop();
+}
+
+bool IOService::attach(IOService *provider)
+{
+	if (!provider || providerEntry)
+		return false;
+
+	retain();
+	providerEntry = provider;
+	provider->clients.push_back(this);
+
+	return true;
+}
+
+void IOService::detach(IOService *provider)
+{
+	std::vector<IOService *>::iterator it;
+
+	if (!provider || (provider != providerEntry))
+		return;
+
+	it = std::find(provider->clients.begin(), provider->clients.end(), this);
+	if (it != provider->clients.end())
+		provider->clients.erase(it);
+
+	providerEntry = NULL;
+	release();
+}
+
+IOService *IOService::getClient(void) const
+{
+	return clients.empty() ? NULL : clients.front();
+}
+
+IOReturn IOService::acknowledgeSetPowerState(void)
+{
+	hostPowerAcknowledgements++;
+
+	return kIOReturnSuccess;
+}
+
+IOReturn IOService::messageClients(UInt32 type, void *argument, vm_size_t argSize)
+{
+	hostMessagesSent++;
+
+	for (size_t i = 0; i < clients.size(); i++)
+		clients[i]->message(type, this, argument);
+
+	return kIOReturnSuccess;
+}
+
+IOPlatformExpert *IOService::getPlatform(void)
+{
+	return &hostPlatform;
+}
+
+/******************************************************************************
+ * IOWorkLoop and event sources
+ ******************************************************************************/
+
+static std::vector<IOWorkLoop *>	hostWorkLoops;
+
+IOWorkLoop *IOWorkLoop::workLoop(void)
+{
+	IOWorkLoop *me = new IOWorkLoop;
+
+	if (!me->init()) {
+		me->release();
+		return NULL;
+	}
+
+	return me;
+}
+
+bool IOWorkLoop::init(void)
+{
+	pthread_mutexattr_t attr;
+
+	if (!OSObject::init())
+		return false;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&gate, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	hostWorkLoops.push_back(this);
+
+	return true;
+}
+
+void IOWorkLoop::free(void)
+{
+	std::vector<IOWorkLoop *>::iterator it = std::find(hostWorkLoops.begin(), hostWorkLoops.end(), this);
+
+	if (it != hostWorkLoops.end())
+		hostWorkLoops.erase(it);
+
+	while (!eventSources.empty())
+		removeEventSource(eventSources.back());
+
+	pthread_mutex_destroy(&gate);
+
+	OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource *newEvent)
+{
+	if (!newEvent || newEvent->getWorkLoop())
+		return kIOReturnBadArgument;
+
+	newEvent->retain();
+	newEvent->setWorkLoop(this);
+	eventSources.push_back(newEvent);
+
+	return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource *toRemove)
+{
+	std::vector<IOEventSource *>::iterator it = std::find(eventSources.begin(), eventSources.end(), toRemove);
+
+	if (it == eventSources.end())
+		return kIOReturnBadArgument;
+
+	eventSources.erase(it);
+	toRemove->setWorkLoop(NULL);
+	toRemove->release();
+
+	return kIOReturnSuccess;
+}
+
+void IOWorkLoop::disableAllEventSources(void)
+{
+	for (size_t i = 0; i < eventSources.size(); i++)
+		eventSources[i]->disable();
+}
+
+IOReturn IOWorkLoop::runAction(Action action, OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+	IOReturn result;
+
+	closeGate();
+	result = action(target, arg0, arg1, arg2, arg3);
+	openGate();
+
+	return result;
+}
+
+void IOWorkLoop::closeGate(void)
+{
+	pthread_mutex_lock(&gate);
+	if (!OSIncrementAtomic(&gateDepth))
+		gateClosedAt = hostUptime;
+}
+
+void IOWorkLoop::openGate(void)
+{
+	if (1 == OSDecrementAtomic(&gateDepth) && ((hostUptime - gateClosedAt) > longestHold))
+		longestHold = hostUptime - gateClosedAt;
+	pthread_mutex_unlock(&gate);
+}
+
+bool IOWorkLoop::inGate(void) const
+{
+	return gateDepth > 0;
+}
+
+IOTimerEventSource *IOWorkLoop::hostTimerAt(unsigned int index) const
+{
+	return OSDynamicCast(IOTimerEventSource, eventSources[index]);
+}
+
+bool IOEventSource::init(OSObject *inOwner)
+{
+	if (!OSObject::init())
+		return false;
+
+	owner	= inOwner;
+	enabled	= true;
+
+	return true;
+}
+
+IOTimerEventSource *IOTimerEventSource::timerEventSource(OSObject *owner, Action action)
+{
+	IOTimerEventSource *me = new IOTimerEventSource;
+
+	if (!me->init(owner)) {
+		me->release();
+		return NULL;
+	}
+
+	me->action = action;
+
+	return me;
+}
+
+void IOTimerEventSource::free(void)
+{
+	IOEventSource::free();
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+	deadline	= hostUptime + (uint64_t) ms * kMillisecondScale;
+	armed		= true;
+
+	return kIOReturnSuccess;
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+	deadline	= hostUptime + (uint64_t) us * kMicrosecondScale;
+	armed		= true;
+
+	return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout(void)
+{
+	armed = false;
+}
+
+void IOTimerEventSource::hostFire(void)
+{
+	IOWorkLoop *loop = workLoop;
+
+	if (!armed || !enabled || !loop || !action)
+		return;
+
+	armed = false;
+
+	retain();
+	loop->closeGate();
+	action(owner, this);
+	loop->openGate();
+	release();
+}
+
+IOCommandGate *IOCommandGate::commandGate(OSObject *owner, Action action)
+{
+	IOCommandGate *me = new IOCommandGate;
+
+	if (!me->init(owner)) {
+		me->release();
+		return NULL;
+	}
+
+	return me;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+	IOWorkLoop	*loop = workLoop;
+	IOReturn	result;
+
+	if (!action)
+		return kIOReturnBadArgument;
+
+	if (loop)
+		loop->closeGate();
+
+	result = action(owner, arg0, arg1, arg2, arg3);
+
+	if (loop)
+		loop->openGate();
+
+	return result;
+}
+
+static IOTimerEventSource *nextTimer(void)
+{
+	IOTimerEventSource *next = NULL;
+
+	for (size_t i = 0; i < hostWorkLoops.size(); i++)
+	{
+		IOWorkLoop *loop = hostWorkLoops[i];
+
+		for (unsigned int j = 0; j < loop->hostEventSourceCount(); j++)
+		{
+			IOTimerEventSource *timer = loop->hostTimerAt(j);
+
+			if (!timer || !timer->hostArmed() || !timer->isEnabled())
+				continue;
+
+			if (!next || (timer->hostDeadline() < next->hostDeadline()))
+				next = timer;
+		}
+	}
+
+	return next;
+}
+
+void HostClockAdvance(uint64_t ms)
+{
+	uint64_t target = hostUptime + ms * kMillisecondScale;
+
+	for (;;)
+	{
+		IOTimerEventSource *timer = nextTimer();
+
+		if (!timer || (timer->hostDeadline() > target))
+			break;
+
+		if (timer->hostDeadline() > hostUptime)
+			hostUptime = timer->hostDeadline();
+
+		timer->hostFire();
+	}
+
+	// A timer fired from a nested advance may already have moved past it
+	if (hostUptime < target)
+		hostUptime = target;
+}
+
+uint64_t HostClockMS(void)
+{
+	return hostUptime / kMillisecondScale;
+}
+
+uint64_t HostNextTimerMS(void)
+{
+	IOTimerEventSource *timer = nextTimer();
+
+	if (!timer)
+		return ~0ULL;
+
+	if (timer->hostDeadline() <= hostUptime)
+		return 0;
+
+	return (timer->hostDeadline() - hostUptime + kMillisecondScale - 1) / kMillisecondScale;
+}
+
+IOWorkLoop *HostWorkLoop(void)
+{
+	static IOWorkLoop *loop = IOWorkLoop::workLoop();
+
+	return loop;
+}
+
+/******************************************************************************
+ * Memory descriptors, user clients
+ ******************************************************************************/
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void *bytes, IOByteCount withLength)
+{
+	if (offset >= length)
+		return 0;
+
+	if (withLength > length - offset)
+		withLength = length - offset;
+
+	memcpy((UInt8 *) buffer + offset, bytes, withLength);
+
+	return withLength;
+}
+
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection)
+{
+	hostPrepared++;
+	return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection)
+{
+	hostPrepared--;
+	return kIOReturnSuccess;
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::withOptions(IOOptionBits options, vm_size_t capacity, vm_size_t alignment)
+{
+	IOBufferMemoryDescriptor *me = new IOBufferMemoryDescriptor;
+
+	me->buffer = calloc(1, capacity);
+	me->length = capacity;
+
+	if (!me->buffer) {
+		me->release();
+		return NULL;
+	}
+
+	return me;
+}
+
+void IOBufferMemoryDescriptor::free(void)
+{
+	::free(buffer);
+	IOMemoryDescriptor::free();
+}
+
+task_t current_task(void)
+{
+	return (task_t) &hostClientPrivileged;
+}
+
+bool IOUserClient::initWithTask(task_t owningTask, void *securityID, UInt32 type, OSDictionary *properties)
+{
+	return IOService::init(properties);
+}
+
+IOReturn IOUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+									  IOExternalMethodDispatch *dispatch, OSObject *target, void *reference)
+{
+	uint32_t inputSize, outputSize;
+
+	if (!dispatch || !dispatch->function)
+		return kIOReturnUnsupported;
+
+	inputSize	= arguments->structureInputDescriptor
+				  ? (uint32_t) arguments->structureInputDescriptor->getLength() : arguments->structureInputSize;
+	outputSize	= arguments->structureOutputDescriptor
+				  ? (uint32_t) arguments->structureOutputDescriptor->getLength() : arguments->structureOutputSize;
+
+	if ((dispatch->checkScalarInputCount != kIOUCVariableStructureSize)
+		&& (dispatch->checkScalarInputCount != arguments->scalarInputCount))
+		return kIOReturnBadArgument;
+
+	if ((dispatch->checkStructureInputSize != kIOUCVariableStructureSize)
+		&& (dispatch->checkStructureInputSize != inputSize))
+		return kIOReturnBadArgument;
+
+	if ((dispatch->checkScalarOutputCount != kIOUCVariableStructureSize)
+		&& (dispatch->checkScalarOutputCount != arguments->scalarOutputCount))
+		return kIOReturnBadArgument;
+
+	if ((dispatch->checkStructureOutputSize != kIOUCVariableStructureSize)
+		&& (dispatch->checkStructureOutputSize != outputSize))
+		return kIOReturnBadArgument;
+
+	return dispatch->function(target, reference, arguments);
+}
+
+IOReturn IOUserClient::clientHasPrivilege(void *securityToken, const char *privilegeName)
+{
+	return hostClientPrivileged ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
+
+void HostSetClientPrivileged(bool privileged)
+{
+	hostClientPrivileged = privileged;
+}
+
+/******************************************************************************
+ * IOACPIPlatformDevice
+ ******************************************************************************/
+
+void IOACPIPlatformDevice::free(void)
+{
+	if (workLoop) {
+		workLoop->release();
+		workLoop = NULL;
+	}
+
+	IOService::free();
+}
+
+IOWorkLoop *IOACPIPlatformDevice::getWorkLoop(void) const
+{
+	if (!workLoop)
+		workLoop = IOWorkLoop::workLoop();
+
+	return workLoop;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateObject(const char *objectName, OSObject **result,
+											  OSObject *params[], IOItemCount paramCount,
+											  IOOptionBits options)
+{
+	if (result)
+		*result = NULL;
+
+	return kIOReturnNotFound;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const char *objectName, UInt32 *resultInt32,
+											   OSObject *params[], IOItemCount paramCount,
+											   IOOptionBits options)
+{
+	OSObject	*result = NULL;
+	OSNumber	*number;
+	IOReturn	status;
+
+	status = evaluateObject(objectName, &result, params, paramCount, options);
+
+	if (kIOReturnSuccess == status)
+	{
+		number = OSDynamicCast(OSNumber, result);
+
+		if (number)
+			*resultInt32 = number->unsigned32BitValue();
+		else
+			status = kIOReturnBadArgument;
+	}
+
+	if (result)
+		result->release();
+
+	return status;
+}
+
+IOReturn IOACPIPlatformDevice::validateObject(const char *objectName)
+{
+	return kIOReturnNotFound;
+}
+
+/******************************************************************************
+ * IOPMPowerSource
+ ******************************************************************************/
+
+bool IOPMPowerSource::init(void)
+{
+	if (!IOService::init())
+		return false;
+
+	properties = OSDictionary::withCapacity(10);
+	if (!properties)
+		return false;
+
+	settingsChangedSinceUpdate = false;
+
+	externalConnectedKey		= OSSymbol::withCString(kIOPMPSExternalConnectedKey);
+	externalChargeCapableKey	= OSSymbol::withCString(kIOPMPSExternalChargeCapableKey);
+	batteryInstalledKey			= OSSymbol::withCString(kIOPMPSBatteryInstalledKey);
+	chargingKey					= OSSymbol::withCString(kIOPMPSIsChargingKey);
+	warnLevelKey				= OSSymbol::withCString(kIOPMPSAtWarnLevelKey);
+	criticalLevelKey			= OSSymbol::withCString(kIOPMPSAtCriticalLevelKey);
+	currentCapacityKey			= OSSymbol::withCString(kIOPMPSCurrentCapacityKey);
+	maxCapacityKey				= OSSymbol::withCString(kIOPMPSMaxCapacityKey);
+	timeRemainingKey			= OSSymbol::withCString(kIOPMPSTimeRemainingKey);
+	amperageKey					= OSSymbol::withCString(kIOPMPSAmperageKey);
+	voltageKey					= OSSymbol::withCString(kIOPMPSVoltageKey);
+	cycleCountKey				= OSSymbol::withCString(kIOPMPSCycleCountKey);
+	adapterInfoKey				= OSSymbol::withCString(kIOPMPSAdapterInfoKey);
+	locationKey					= OSSymbol::withCString(kIOPMPSLocationKey);
+	errorConditionKey			= OSSymbol::withCString(kIOPMPSErrorConditionKey);
+	manufacturerKey				= OSSymbol::withCString(kIOPMPSManufacturerKey);
+	modelKey					= OSSymbol::withCString(kIOPMPSModelKey);
+	serialKey					= OSSymbol::withCString(kIOPMPSSerialKey);
+	batteryInfoKey				= OSSymbol::withCString(kIOPMPSLegacyBatteryInfoKey);
+
+	return true;
+}
+
+void IOPMPowerSource::free(void)
+{
+	const OSSymbol **keys[] = {
+		&externalConnectedKey, &externalChargeCapableKey, &batteryInstalledKey, &chargingKey,
+		&warnLevelKey, &criticalLevelKey, &currentCapacityKey, &maxCapacityKey, &timeRemainingKey,
+		&amperageKey, &voltageKey, &cycleCountKey, &adapterInfoKey, &locationKey, &errorConditionKey,
+		&manufacturerKey, &modelKey, &serialKey, &batteryInfoKey
+	};
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		if (*keys[i]) {
+			(*keys[i])->release();
+			*keys[i] = NULL;
+		}
+	}
+
+	if (properties) {
+		properties->release();
+		properties = NULL;
+	}
+
+	IOService::free();
+}
+
+// As xnu: copy every power source property into the registry, then tell
+// the clients. Keys dropped from properties stay in the registry.
+void IOPMPowerSource::updateStatus(void)
+{
+	if (!settingsChangedSinceUpdate)
+		return;
+
+	for (unsigned int i = 0; i < properties->getCount(); i++)
+		setProperty(properties->getKey(i), properties->getObjectAt(i));
+
+	settingsChangedSinceUpdate = false;
+	hostStatusUpdates++;
+
+	messageClients(kIOPMMessageBatteryStatusHasChanged);
+}
+
+void IOPMPowerSource::setPSProperty(const OSSymbol *key, OSObject *value)
+{
+	OSObject *lastValue;
+
+	if (!key || !value)
+		return;
+
+	lastValue = properties->getObject(key);
+
+	if (!lastValue || !lastValue->isEqualTo(value))
+		settingsChangedSinceUpdate = true;
+
+	properties->setObject(key, value);
+}
+
+OSObject *IOPMPowerSource::getPSProperty(const OSSymbol *key)
+{
+	return key ? properties->getObject(key) : NULL;
+}
+
+void IOPMPowerSource::setPSBool(const OSSymbol *key, bool value)
+{
+	setPSProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IOPMPowerSource::getPSBool(const OSSymbol *key)
+{
+	return kOSBooleanTrue == properties->getObject(key);
+}
+
+void IOPMPowerSource::setPSInt(const OSSymbol *key, unsigned long long value)
+{
+	OSNumber *number = OSNumber::withNumber(value, 32);
+
+	if (number) {
+		setPSProperty(key, number);
+		number->release();
+	}
+}
+
+unsigned int IOPMPowerSource::getPSInt(const OSSymbol *key)
+{
+	OSNumber *number = OSDynamicCast(OSNumber, properties->getObject(key));
+
+	return number ? number->unsigned32BitValue() : 0;
+}
+
+void IOPMPowerSource::setExternalConnected(bool value)		{ setPSBool(externalConnectedKey, value); }
+bool IOPMPowerSource::externalConnected(void)				{ return getPSBool(externalConnectedKey); }
+void IOPMPowerSource::setExternalChargeCapable(bool value)	{ setPSBool(externalChargeCapableKey, value); }
+bool IOPMPowerSource::externalChargeCapable(void)			{ return getPSBool(externalChargeCapableKey); }
+void IOPMPowerSource::setBatteryInstalled(bool value)		{ setPSBool(batteryInstalledKey, value); }
+bool IOPMPowerSource::batteryInstalled(void)				{ return getPSBool(batteryInstalledKey); }
+void IOPMPowerSource::setIsCharging(bool value)				{ setPSBool(chargingKey, value); }
+bool IOPMPowerSource::isCharging(void)						{ return getPSBool(chargingKey); }
+void IOPMPowerSource::setAtWarnLevel(bool value)			{ setPSBool(warnLevelKey, value); }
+bool IOPMPowerSource::atWarnLevel(void)						{ return getPSBool(warnLevelKey); }
+void IOPMPowerSource::setAtCriticalLevel(bool value)		{ setPSBool(criticalLevelKey, value); }
+bool IOPMPowerSource::atCriticalLevel(void)					{ return getPSBool(criticalLevelKey); }
+
+void IOPMPowerSource::setCurrentCapacity(unsigned int value)	{ setPSInt(currentCapacityKey, value); }
+unsigned int IOPMPowerSource::currentCapacity(void)				{ return getPSInt(currentCapacityKey); }
+void IOPMPowerSource::setMaxCapacity(unsigned int value)		{ setPSInt(maxCapacityKey, value); }
+unsigned int IOPMPowerSource::maxCapacity(void)					{ return getPSInt(maxCapacityKey); }
+void IOPMPowerSource::setTimeRemaining(int value)				{ setPSInt(timeRemainingKey, (unsigned int) value); }
+int IOPMPowerSource::timeRemaining(void)						{ return (int) getPSInt(timeRemainingKey); }
+void IOPMPowerSource::setAmperage(int value)					{ setPSInt(amperageKey, (unsigned int) value); }
+int IOPMPowerSource::amperage(void)								{ return (int) getPSInt(amperageKey); }
+void IOPMPowerSource::setVoltage(unsigned int value)			{ setPSInt(voltageKey, value); }
+unsigned int IOPMPowerSource::voltage(void)						{ return getPSInt(voltageKey); }
+void IOPMPowerSource::setCycleCount(unsigned int value)			{ setPSInt(cycleCountKey, value); }
+unsigned int IOPMPowerSource::cycleCount(void)					{ return getPSInt(cycleCountKey); }
+void IOPMPowerSource::setAdapterInfo(int value)					{ setPSInt(adapterInfoKey, (unsigned int) value); }
+int IOPMPowerSource::adapterInfo(void)							{ return (int) getPSInt(adapterInfoKey); }
+void IOPMPowerSource::setLocation(int value)					{ setPSInt(locationKey, (unsigned int) value); }
+int IOPMPowerSource::location(void)								{ return (int) getPSInt(locationKey); }
+
+void IOPMPowerSource::setErrorCondition(OSSymbol *value)	{ setPSProperty(errorConditionKey, value); }
+OSSymbol *IOPMPowerSource::errorCondition(void)				{ return OSDynamicCast(OSSymbol, properties->getObject(errorConditionKey)); }
+void IOPMPowerSource::setManufacturer(OSSymbol *value)		{ setPSProperty(manufacturerKey, value); }
+OSSymbol *IOPMPowerSource::manufacturer(void)				{ return OSDynamicCast(OSSymbol, properties->getObject(manufacturerKey)); }
+void IOPMPowerSource::setModel(OSSymbol *value)				{ setPSProperty(modelKey, value); }
+OSSymbol *IOPMPowerSource::model(void)						{ return OSDynamicCast(OSSymbol, properties->getObject(modelKey)); }
+void IOPMPowerSource::setSerial(OSSymbol *value)			{ setPSProperty(serialKey, value); }
+OSSymbol *IOPMPowerSource::serial(void)						{ return OSDynamicCast(OSSymbol, properties->getObject(serialKey)); }
+
+void IOPMPowerSource::setLegacyIOBatteryInfo(OSDictionary *dictionary)
+{
+	setPSProperty(batteryInfoKey, dictionary);
+}
@@ -0,0 +1,881 @@
+/*
+ * Host (user space) stand-ins for the parts of libkern, IOKit and the Mach
+ * kernel the battery driver uses, so that AppleSmartBattery.cpp and
+ * AppleSmartBatteryManager.cpp can be built and exercised by the tests in
+ * tests/. The headers under tests/host/include mirror the SDK paths the
+ * driver includes and all resolve to this file.
+ *
+ * Behaviour follows the kernel wherever the driver relies on it:
+ * zero-filled object allocation, retain counts with free() on the last
+ * release, interned symbols, change-detecting setPSProperty(). Everything
+ * asynchronous is driven by the test instead, one step at a time:
+ *
+ *   HostClockAdvance()      moves uptime forward, firing due timers in order
+ *   HostRunThreadCalls()    runs queued thread calls on the calling thread
+ *
+ * The work loop gate is a recursive lock, so a thread call that calls back
+ * into the work loop (or a timer fired from inside a thread call, see
+ * HostClockAdvance()) behaves as it would against another thread.
+ */
+
+#ifndef __HostKernel__
+#define __HostKernel__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+/******************************************************************************
+ * Types and return codes
+ ******************************************************************************/
+
+typedef uint8_t		UInt8;
+typedef uint16_t	UInt16;
+typedef uint32_t	UInt32;
+typedef uint64_t	UInt64;
+typedef int8_t		SInt8;
+typedef int16_t		SInt16;
+typedef int32_t		SInt32;
+typedef int64_t		SInt64;
+typedef bool		Boolean;
+
+typedef int			IOReturn;
+typedef UInt32		IOOptionBits;
+typedef UInt32		IOItemCount;
+typedef size_t		IOByteCount;
+typedef size_t		vm_size_t;
+typedef void		*task_t;
+
+#define kIOReturnSuccess		0
+#define kIOReturnError			((IOReturn) 0xe00002bc)
+#define kIOReturnNoMemory		((IOReturn) 0xe00002bd)
+#define kIOReturnNoResources	((IOReturn) 0xe00002be)
+#define kIOReturnNotPrivileged	((IOReturn) 0xe00002c1)
+#define kIOReturnBadArgument	((IOReturn) 0xe00002c2)
+#define kIOReturnUnsupported	((IOReturn) 0xe00002c7)
+#define kIOReturnBusy			((IOReturn) 0xe00002d5)
+#define kIOReturnTimeout		((IOReturn) 0xe00002d6)
+#define kIOReturnNotReady		((IOReturn) 0xe00002d8)
+#define kIOReturnUnderrun		((IOReturn) 0xe00002e8)
+#define kIOReturnNotFound		((IOReturn) 0xe00002f0)
+
+extern const vm_size_t page_size;
+
+/******************************************************************************
+ * Logging, allocation, locks, atomics
+ ******************************************************************************/
+
+// Printed to stderr only when HOST_IOLOG is set in the environment
+void	IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void	*IOMalloc(vm_size_t size);
+void	IOFree(void *address, vm_size_t size);
+
+typedef struct IOLock IOLock;
+
+IOLock	*IOLockAlloc(void);
+void	IOLockFree(IOLock *lock);
+void	IOLockLock(IOLock *lock);
+void	IOLockUnlock(IOLock *lock);
+
+#define OSMemoryBarrier()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address)
+{
+	return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32 *address)
+{
+	return OSAddAtomic(1, address);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32 *address)
+{
+	return OSAddAtomic(-1, address);
+}
+
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64 *address)
+{
+	return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline Boolean OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address)
+{
+	return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline Boolean OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *address)
+{
+	return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * Time. Absolute time is in nanoseconds and only moves when the test says so.
+ ******************************************************************************/
+
+enum
+{
+	kNanosecondScale	= 1,
+	kMicrosecondScale	= 1000,
+	kMillisecondScale	= 1000 * 1000,
+	kSecondScale		= 1000 * 1000 * 1000
+};
+
+void	clock_get_uptime(uint64_t *result);
+void	absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+void	nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result);
+
+/******************************************************************************
+ * Thread calls. Entered calls queue up until HostRunThreadCalls().
+ ******************************************************************************/
+
+typedef void	*thread_call_param_t;
+typedef void	(*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+typedef struct thread_call	*thread_call_t;
+
+thread_call_t	thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+bool	thread_call_enter(thread_call_t call);
+bool	thread_call_enter1(thread_call_t call, thread_call_param_t param1);
+bool	thread_call_cancel(thread_call_t call);
+bool	thread_call_cancel_wait(thread_call_t call);
+bool	thread_call_free(thread_call_t call);
+
+/******************************************************************************
+ * libkern containers
+ ******************************************************************************/
+
+typedef std::type_info OSMetaClass;
+
+#define OSTypeID(type)			(&typeid(type))
+#define OSTypeIDInst(object)	(&typeid(*(object)))
+
+class OSObject;
+
+template <class T, class P> static inline T *HostDynamicCast(P *object)
+{
+	if (!object)
+		return NULL;
+
+	return dynamic_cast<T *>(const_cast<OSObject *>(static_cast<const OSObject *>(object)));
+}
+
+#define OSDynamicCast(type, object)		HostDynamicCast<type>(object)
+
+// Plain function pointer for a member function, as the kernel's
+// OSMemberFunctionCast; relies on GCC's bound member function extension
+// (build with -Wno-pmf-conversions)
+#define OSMemberFunctionCast(cptrtype, self, func)	((cptrtype) ((self)->*(func)))
+
+#define OSDeclareDefaultStructors(className) \
+	public: \
+		className(); \
+	protected: \
+		virtual ~className(); \
+	private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+	className::className() { } \
+	className::~className() { }
+
+class OSObject
+{
+public:
+	// Zero filled, as kalloc'd objects are
+	static void	*operator new(size_t size);
+	static void	operator delete(void *mem, size_t size);
+
+	OSObject();
+
+	virtual void	retain(void) const;
+	virtual void	release(void) const;
+	int				getRetainCount(void) const;
+
+	virtual bool	init(void);
+	virtual void	free(void);
+
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+protected:
+	virtual ~OSObject();
+
+private:
+	mutable volatile SInt32	retainCount;
+};
+
+class OSBoolean : public OSObject
+{
+public:
+	static OSBoolean	*withBoolean(bool value);
+
+	explicit OSBoolean(bool value) : value(value) { }
+
+	virtual void	retain(void) const { }
+	virtual void	release(void) const { }
+
+	bool	isTrue(void) const	{ return value; }
+	bool	isFalse(void) const	{ return !value; }
+	bool	getValue(void) const { return value; }
+
+private:
+	bool	value;
+};
+
+extern OSBoolean * const kOSBooleanTrue;
+extern OSBoolean * const kOSBooleanFalse;
+
+class OSString : public OSObject
+{
+public:
+	static OSString	*withCString(const char *cString);
+
+	const char	*getCStringNoCopy(void) const	{ return string.c_str(); }
+	unsigned int	getLength(void) const		{ return (unsigned int) string.length(); }
+
+	bool	isEqualTo(const char *cString) const;
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+protected:
+	std::string	string;
+};
+
+// Interned: equal strings give the same object while any reference is held
+class OSSymbol : public OSString
+{
+public:
+	static const OSSymbol	*withCString(const char *cString);
+	static const OSSymbol	*withCStringNoCopy(const char *cString)	{ return withCString(cString); }
+	static const OSSymbol	*withString(const OSString *aString)		{ return withCString(aString->getCStringNoCopy()); }
+
+	virtual void	retain(void) const;
+	virtual void	release(void) const;
+};
+
+class OSNumber : public OSObject
+{
+public:
+	static OSNumber	*withNumber(unsigned long long value, unsigned int numberOfBits);
+
+	void	setValue(unsigned long long value);
+
+	unsigned int		unsigned32BitValue(void) const	{ return (unsigned int) value; }
+	unsigned long long	unsigned64BitValue(void) const	{ return value; }
+	unsigned int		numberOfBits(void) const		{ return size; }
+
+	bool	isEqualTo(unsigned long long value, unsigned int numberOfBits) const;
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+private:
+	unsigned long long	value;
+	unsigned int		size;
+};
+
+class OSData : public OSObject
+{
+public:
+	static OSData	*withCapacity(unsigned int capacity);
+	static OSData	*withBytes(const void *bytes, unsigned int numBytes);
+	static OSData	*withBytesNoCopy(void *bytes, unsigned int numBytes);
+
+	const void	*getBytesNoCopy(void) const;
+	const void	*getBytesNoCopy(unsigned int start, unsigned int numBytes) const;
+	unsigned int	getLength(void) const;
+
+	bool	appendBytes(const void *bytes, unsigned int numBytes);
+
+	bool	isEqualTo(const void *bytes, unsigned int numBytes) const;
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+private:
+	std::vector<UInt8>	data;
+	const void			*external;		// withBytesNoCopy()
+	unsigned int		externalLength;
+};
+
+class OSCollection : public OSObject
+{
+public:
+	virtual unsigned int	getCount(void) const = 0;
+	virtual void			flushCollection(void) = 0;
+};
+
+class OSArray : public OSCollection
+{
+public:
+	static OSArray	*withCapacity(unsigned int capacity);
+
+	virtual void	free(void);
+
+	virtual unsigned int	getCount(void) const		{ return (unsigned int) objects.size(); }
+	unsigned int	getCapacity(void) const;
+	OSObject		*getObject(unsigned int index) const;
+
+	bool	setObject(const OSObject *object);
+	bool	setObject(unsigned int index, const OSObject *object);
+	bool	replaceObject(unsigned int index, const OSObject *object);
+	void	removeObject(unsigned int index);
+	virtual void	flushCollection(void);
+
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+private:
+	std::vector<const OSObject *>	objects;
+	unsigned int					capacity;
+};
+
+class OSDictionary : public OSCollection
+{
+public:
+	static OSDictionary	*withCapacity(unsigned int capacity);
+
+	virtual void	free(void);
+
+	virtual unsigned int	getCount(void) const		{ return (unsigned int) entries.size(); }
+
+	OSObject	*getObject(const char *key) const;
+	OSObject	*getObject(const OSString *key) const;
+	OSObject	*getObject(const OSSymbol *key) const;
+
+	bool	setObject(const char *key, const OSObject *object);
+	bool	setObject(const OSString *key, const OSObject *object);
+	bool	setObject(const OSSymbol *key, const OSObject *object);
+
+	void	removeObject(const char *key);
+	void	removeObject(const OSString *key);
+	void	removeObject(const OSSymbol *key);
+
+	virtual void	flushCollection(void);
+
+	virtual bool	isEqualTo(const OSObject *object) const;
+
+	// Host only, in insertion order (the kernel uses OSCollectionIterator)
+	const OSSymbol	*getKey(unsigned int index) const	{ return entries[index].first; }
+	OSObject		*getObjectAt(unsigned int index) const	{ return (OSObject *) entries[index].second; }
+
+private:
+	std::vector<std::pair<const OSSymbol *, const OSObject *> >	entries;
+};
+
+/******************************************************************************
+ * IOKit
+ ******************************************************************************/
+
+class IOService;
+class IOWorkLoop;
+class IOEventSource;
+class IOTimerEventSource;
+class IOCommandGate;
+
+class IORegistryEntry : public OSObject
+{
+public:
+	virtual bool	init(OSDictionary *dictionary = 0);
+	virtual void	free(void);
+
+	bool	setProperty(const OSSymbol *aKey, OSObject *anObject);
+	bool	setProperty(const OSString *aKey, OSObject *anObject);
+	bool	setProperty(const char *aKey, OSObject *anObject);
+	bool	setProperty(const char *aKey, const char *aString);
+	bool	setProperty(const char *aKey, bool aBoolean);
+	bool	setProperty(const char *aKey, unsigned long long aValue, unsigned int aNumberOfBits);
+
+	OSObject	*getProperty(const OSSymbol *aKey) const;
+	OSObject	*getProperty(const OSString *aKey) const;
+	OSObject	*getProperty(const char *aKey) const;
+
+	void	removeProperty(const OSSymbol *aKey);
+	void	removeProperty(const OSString *aKey);
+	void	removeProperty(const char *aKey);
+
+	virtual IOReturn	setProperties(OSObject *properties);
+
+private:
+	OSDictionary	*propertyTable;
+};
+
+typedef unsigned long IOPMPowerFlags;
+
+typedef struct IOPMPowerState
+{
+	unsigned long	version;
+	IOPMPowerFlags	capabilityFlags;
+	IOPMPowerFlags	outputPowerCharacter;
+	IOPMPowerFlags	inputPowerRequirement;
+	unsigned long	staticPower;
+	unsigned long	unbudgetedPower;
+	unsigned long	powerToAttain;
+	unsigned long	timeToAttain;
+	unsigned long	settleUpTime;
+	unsigned long	timeToLower;
+	unsigned long	settleDownTime;
+	unsigned long	powerDomainBudget;
+} IOPMPowerState;
+
+enum
+{
+	kIOPMPowerStateVersion1		= 1,
+	kIOPMPowerOn				= 0x00000002,
+	kIOPMAckImplied				= 0,
+	IOPMAckImplied				= 0
+};
+
+class IOPlatformExpert
+{
+public:
+	int		numBatteriesSupported(void)		{ return 1; }
+};
+
+class IOService : public IORegistryEntry
+{
+public:
+	virtual bool	init(OSDictionary *dictionary = 0);
+	virtual void	free(void);
+
+	virtual IOService	*probe(IOService *provider, SInt32 *score)	{ return this; }
+	virtual bool	start(IOService *provider);
+	virtual void	stop(IOService *provider);
+
+	// The provider's work loop; a service without one gets HostWorkLoop()
+	virtual IOWorkLoop	*getWorkLoop(void) const;
+
+	// One provider per service here. Attaching retains the client.
+	bool	attach(IOService *provider);
+	void	detach(IOService *provider);
+	IOService	*getProvider(void) const	{ return providerEntry; }
+	IOService	*getClient(void) const;
+
+	void	registerService(IOOptionBits options = 0)	{ }
+	bool	terminate(IOOptionBits options = 0)			{ inactive = true; return true; }
+	bool	isInactive(void) const						{ return inactive; }
+
+	void	PMinit(void)		{ }
+	void	PMstop(void)		{ }
+	IOReturn	registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates)	{ return kIOReturnSuccess; }
+	IOReturn	joinPMtree(IOService *driver)	{ return kIOReturnSuccess; }
+
+	// Counted in hostPowerAcknowledgements
+	IOReturn	acknowledgeSetPowerState(void);
+
+	virtual IOReturn	setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice)	{ return IOPMAckImplied; }
+	virtual IOReturn	message(UInt32 type, IOService *provider, void *argument = 0)		{ return kIOReturnUnsupported; }
+	virtual IOReturn	messageClients(UInt32 type, void *argument = 0, vm_size_t argSize = 0);
+
+	static IOPlatformExpert	*getPlatform(void);
+
+	UInt32		hostPowerAcknowledgements;
+	UInt32		hostMessagesSent;
+
+private:
+	IOService	*providerEntry;
+	std::vector<IOService *>	clients;
+	bool		inactive;
+};
+
+class IOEventSource : public OSObject
+{
+public:
+	typedef void (*Action)(OSObject *owner, ...);
+
+	virtual bool	init(OSObject *owner);
+
+	void	enable(void)				{ enabled = true; }
+	void	disable(void)				{ enabled = false; }
+	bool	isEnabled(void) const		{ return enabled; }
+
+	IOWorkLoop	*getWorkLoop(void) const	{ return workLoop; }
+	void		setWorkLoop(IOWorkLoop *inWorkLoop)	{ workLoop = inWorkLoop; }
+
+protected:
+	OSObject	*owner;
+	IOWorkLoop	*workLoop;
+	bool		enabled;
+};
+
+class IOWorkLoop : public OSObject
+{
+public:
+	typedef IOReturn (*Action)(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+
+	static IOWorkLoop	*workLoop(void);
+
+	virtual bool	init(void);
+	virtual void	free(void);
+
+	// The work loop holds a reference on each source it has
+	IOReturn	addEventSource(IOEventSource *newEvent);
+	IOReturn	removeEventSource(IOEventSource *toRemove);
+	void		disableAllEventSources(void);
+
+	IOReturn	runAction(Action action, OSObject *target, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+
+	void	closeGate(void);
+	void	openGate(void);
+	bool	inGate(void) const;
+
+	// Host only
+	unsigned int		hostEventSourceCount(void) const	{ return (unsigned int) eventSources.size(); }
+	IOTimerEventSource	*hostTimerAt(unsigned int index) const;
+
+	// Longest the gate has been held, in host clock time, since the last reset
+	uint64_t			hostLongestHoldMS(void) const		{ return longestHold / kMillisecondScale; }
+	void				hostResetHold(void)					{ longestHold = 0; }
+
+private:
+	pthread_mutex_t				gate;
+	volatile SInt32				gateDepth;
+	uint64_t					gateClosedAt;
+	uint64_t					longestHold;
+	std::vector<IOEventSource *>	eventSources;
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+public:
+	typedef void (*Action)(OSObject *owner, IOTimerEventSource *sender);
+
+	static IOTimerEventSource	*timerEventSource(OSObject *owner, Action action = 0);
+
+	virtual void	free(void);
+
+	IOReturn	setTimeoutMS(UInt32 ms);
+	IOReturn	setTimeoutUS(UInt32 us);
+	void		cancelTimeout(void);
+
+	// Host only
+	bool		hostArmed(void) const		{ return armed; }
+	uint64_t	hostDeadline(void) const	{ return deadline; }
+	void		hostFire(void);
+
+private:
+	Action		action;
+	uint64_t	deadline;
+	bool		armed;
+};
+
+class IOCommandGate : public IOEventSource
+{
+public:
+	typedef IOReturn (*Action)(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+
+	static IOCommandGate	*commandGate(OSObject *owner, Action action = 0);
+
+	IOReturn	runAction(Action action, void *arg0 = 0, void *arg1 = 0, void *arg2 = 0, void *arg3 = 0);
+};
+
+typedef UInt32 IODirection;
+
+enum
+{
+	kIODirectionNone			= 0x0,
+	kIODirectionIn				= 0x1,
+	kIODirectionOut				= 0x2,
+	kIODirectionOutIn			= kIODirectionIn | kIODirectionOut,
+	kIOMemoryKernelUserShared	= 0x00010000,
+	kIOMapReadOnly				= 0x00001000
+};
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+	IOByteCount	writeBytes(IOByteCount offset, const void *bytes, IOByteCount withLength);
+	IOByteCount	getLength(void) const	{ return length; }
+
+	// Counted, so tests can see every prepare() is completed
+	IOReturn	prepare(IODirection forDirection = kIODirectionNone);
+	IOReturn	complete(IODirection forDirection = kIODirectionNone);
+
+	SInt32		hostPrepared;
+
+protected:
+	void		*buffer;
+	IOByteCount	length;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+	static IOBufferMemoryDescriptor	*withOptions(IOOptionBits options, vm_size_t capacity, vm_size_t alignment = 1);
+
+	virtual void	free(void);
+
+	void	*getBytesNoCopy(void)	{ return buffer; }
+};
+
+#define kIOClientPrivilegeAdministrator		"root"
+
+task_t	current_task(void);
+
+struct IOExternalMethodArguments;
+
+typedef IOReturn (*IOExternalMethodAction)(OSObject *target, void *reference,
+										   IOExternalMethodArguments *arguments);
+
+struct IOExternalMethodDispatch
+{
+	IOExternalMethodAction	function;
+	uint32_t				checkScalarInputCount;
+	uint32_t				checkStructureInputSize;
+	uint32_t				checkScalarOutputCount;
+	uint32_t				checkStructureOutputSize;
+};
+
+enum
+{
+	kIOUCVariableStructureSize	= 0xffffffff
+};
+
+struct IOExternalMethodArguments
+{
+	uint32_t			version;
+	uint32_t			selector;
+
+	const uint64_t		*scalarInput;
+	uint32_t			scalarInputCount;
+
+	const void			*structureInput;
+	uint32_t			structureInputSize;
+	IOMemoryDescriptor	*structureInputDescriptor;
+
+	uint64_t			*scalarOutput;
+	uint32_t			scalarOutputCount;
+
+	void				*structureOutput;
+	uint32_t			structureOutputSize;
+	IOMemoryDescriptor	*structureOutputDescriptor;
+	uint32_t			structureOutputDescriptorSize;
+};
+
+class IOUserClient : public IOService
+{
+public:
+	virtual bool	initWithTask(task_t owningTask, void *securityID, UInt32 type, OSDictionary *properties);
+
+	virtual IOReturn	clientClose(void)		{ return kIOReturnUnsupported; }
+	virtual IOReturn	clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory)
+											{ return kIOReturnUnsupported; }
+
+	// Checks the argument counts and sizes against dispatch, as the kernel
+	// does, then calls it
+	virtual IOReturn	externalMethod(uint32_t selector, IOExternalMethodArguments *arguments,
+									   IOExternalMethodDispatch *dispatch = 0, OSObject *target = 0,
+									   void *reference = 0);
+
+	// Grants or refuses according to HostSetClientPrivileged()
+	static IOReturn	clientHasPrivilege(void *securityToken, const char *privilegeName);
+};
+
+/******************************************************************************
+ * ACPI
+ ******************************************************************************/
+
+#define kIOACPIMessageDeviceNotification	0xe0008000
+
+// A device with an empty ACPI namespace: nothing validates or evaluates.
+// Tests script methods by subclassing. Each device has a work loop of its
+// own, which everything attached below it shares.
+class IOACPIPlatformDevice : public IOService
+{
+public:
+	virtual void	free(void);
+
+	virtual IOWorkLoop	*getWorkLoop(void) const;
+
+	virtual IOReturn	evaluateObject(const char *objectName, OSObject **result = 0,
+									   OSObject *params[] = 0, IOItemCount paramCount = 0,
+									   IOOptionBits options = 0);
+
+	// Evaluates the object and converts an integer result, as the kernel does
+	virtual IOReturn	evaluateInteger(const char *objectName, UInt32 *resultInt32,
+										OSObject *params[] = 0, IOItemCount paramCount = 0,
+										IOOptionBits options = 0);
+
+	virtual IOReturn	validateObject(const char *objectName);
+
+private:
+	mutable IOWorkLoop	*workLoop;
+};
+
+/******************************************************************************
+ * Power sources
+ ******************************************************************************/
+
+#define kIOPMPSExternalConnectedKey			"ExternalConnected"
+#define kIOPMPSExternalChargeCapableKey		"ExternalChargeCapable"
+#define kIOPMPSBatteryInstalledKey			"BatteryInstalled"
+#define kIOPMPSIsChargingKey				"IsCharging"
+#define kIOPMPSAtWarnLevelKey				"AtWarnLevel"
+#define kIOPMPSAtCriticalLevelKey			"AtCriticalLevel"
+#define kIOPMPSCurrentCapacityKey			"CurrentCapacity"
+#define kIOPMPSMaxCapacityKey				"MaxCapacity"
+#define kIOPMPSDesignCapacityKey			"DesignCapacity"
+#define kIOPMPSTimeRemainingKey				"TimeRemaining"
+#define kIOPMPSAmperageKey					"Amperage"
+#define kIOPMPSVoltageKey					"Voltage"
+#define kIOPMPSCycleCountKey				"CycleCount"
+#define kIOPMPSMaxErrKey					"MaxErr"
+#define kIOPMPSAdapterInfoKey				"AdapterInfo"
+#define kIOPMPSLocationKey					"Location"
+#define kIOPMPSErrorConditionKey			"ErrorCondition"
+#define kIOPMPSManufacturerKey				"Manufacturer"
+#define kIOPMPSManufactureDateKey			"ManufactureDate"
+#define kIOPMPSModelKey						"Model"
+#define kIOPMPSSerialKey					"Serial"
+#define kIOPMDeviceNameKey					"DeviceName"
+#define kIOPMPSLegacyBatteryInfoKey			"LegacyBatteryInfo"
+#define kIOPMPSBatteryHealthKey				"BatteryHealth"
+#define kIOPMPSBatteryTemperatureKey		"Temperature"
+#define kIOPMPSBatteryChargeStatusKey		"ChargeStatus"
+#define kIOPMPSInvalidWakeSecondsKey		"BatteryInvalidWakeSeconds"
+#define kIOPMPSPostChargeWaitSecondsKey		"PostChargeWaitSeconds"
+#define kIOPMPSPostDishargeWaitSecondsKey	"PostDischargeWaitSeconds"
+#define kIOPMFullyChargedKey				"FullyCharged"
+
+#define kIOBatteryInfoKey					"IOBatteryInfo"
+#define kIOBatteryCurrentChargeKey			"Current"
+#define kIOBatteryCapacityKey				"Capacity"
+#define kIOBatteryFlagsKey					"Flags"
+#define kIOBatteryVoltageKey				"Voltage"
+#define kIOBatteryAmperageKey				"Amperage"
+#define kIOBatteryCycleCountKey				"Cycle Count"
+
+enum
+{
+	kIOPMACInstalled		= (1 << 0),
+	kIOPMBatteryCharging	= (1 << 1),
+	kIOPMBatteryInstalled	= (1 << 2)
+};
+
+#define kIOPMMessageBatteryStatusHasChanged	0xe0034100
+
+class IOPMPowerSource : public IOService
+{
+public:
+	virtual bool	init(void);
+	virtual void	free(void);
+
+	// Pushes the power source dictionary into the registry and messages
+	// clients, if anything changed since the last update
+	virtual void	updateStatus(void);
+
+	void		setPSProperty(const OSSymbol *key, OSObject *value);
+	OSObject	*getPSProperty(const OSSymbol *key);
+
+	void	setExternalConnected(bool value);
+	bool	externalConnected(void);
+	void	setExternalChargeCapable(bool value);
+	bool	externalChargeCapable(void);
+	void	setBatteryInstalled(bool value);
+	bool	batteryInstalled(void);
+	void	setIsCharging(bool value);
+	bool	isCharging(void);
+	void	setAtWarnLevel(bool value);
+	bool	atWarnLevel(void);
+	void	setAtCriticalLevel(bool value);
+	bool	atCriticalLevel(void);
+
+	void	setCurrentCapacity(unsigned int value);
+	unsigned int	currentCapacity(void);
+	void	setMaxCapacity(unsigned int value);
+	unsigned int	maxCapacity(void);
+	void	setTimeRemaining(int value);
+	int		timeRemaining(void);
+	void	setAmperage(int value);
+	int		amperage(void);
+	void	setVoltage(unsigned int value);
+	unsigned int	voltage(void);
+	void	setCycleCount(unsigned int value);
+	unsigned int	cycleCount(void);
+	void	setAdapterInfo(int value);
+	int		adapterInfo(void);
+	void	setLocation(int value);
+	int		location(void);
+
+	void	setErrorCondition(OSSymbol *value);
+	OSSymbol	*errorCondition(void);
+	void	setManufacturer(OSSymbol *value);
+	OSSymbol	*manufacturer(void);
+	void	setModel(OSSymbol *value);
+	OSSymbol	*model(void);
+	void	setSerial(OSSymbol *value);
+	OSSymbol	*serial(void);
+	void	setLegacyIOBatteryInfo(OSDictionary *dictionary);
+
+	UInt32	hostStatusUpdates;
+
+protected:
+	OSDictionary	*properties;
+	bool			settingsChangedSinceUpdate;
+
+	const OSSymbol	*externalConnectedKey;
+	const OSSymbol	*externalChargeCapableKey;
+	const OSSymbol	*batteryInstalledKey;
+	const OSSymbol	*chargingKey;
+	const OSSymbol	*warnLevelKey;
+	const OSSymbol	*criticalLevelKey;
+	const OSSymbol	*currentCapacityKey;
+	const OSSymbol	*maxCapacityKey;
+	const OSSymbol	*timeRemainingKey;
+	const OSSymbol	*amperageKey;
+	const OSSymbol	*voltageKey;
+	const OSSymbol	*cycleCountKey;
+	const OSSymbol	*adapterInfoKey;
+	const OSSymbol	*locationKey;
+	const OSSymbol	*errorConditionKey;
+	const OSSymbol	*manufacturerKey;
+	const OSSymbol	*modelKey;
+	const OSSymbol	*serialKey;
+	const OSSymbol	*batteryInfoKey;
+
+private:
+	void		setPSBool(const OSSymbol *key, bool value);
+	bool		getPSBool(const OSSymbol *key);
+	void		setPSInt(const OSSymbol *key, unsigned long long value);
+	unsigned int	getPSInt(const OSSymbol *key);
+};
+
+/******************************************************************************
+ * Test control
+ ******************************************************************************/
+
+// Current uptime in ms
+uint64_t	HostClockMS(void);
+
+// Moves uptime forward by ms. Each timer that falls due on the way fires at
+// its own deadline, earliest first, under its work loop's gate. Safe to call
+// from a thread call (a scripted ACPI evaluation that takes time).
+void		HostClockAdvance(uint64_t ms);
+
+// Runs queued thread calls on this thread, including any queued while
+// running, until none are left or limit calls have run. Returns the count.
+unsigned int	HostRunThreadCalls(unsigned int limit = 1000);
+unsigned int	HostPendingThreadCalls(void);
+
+// Ms until the earliest armed timer on an enabled source, or ~0ULL
+uint64_t	HostNextTimerMS(void);
+
+// The work loop of services that have no provider
+IOWorkLoop	*HostWorkLoop(void);
+
+// Every OSObject currently allocated (symbols and booleans included)
+SInt32		HostLiveObjects(void);
+
+// OSObjects and IOMalloc() blocks allocated so far, freed or not
+SInt64		HostCreatedObjects(void);
+SInt64		HostMallocs(void);
+
+// IOLocks currently allocated
+SInt32		HostLiveLocks(void);
+
+void		HostSetClientPrivileged(bool privileged);
+
+#endif